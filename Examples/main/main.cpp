@@ -6,14 +6,15 @@
 #include <array>
 #include <atomic>
 #include "textWriter.h"
+#include "stressTest.h"
 using namespace Whisper;
 
 #define STREAM_AUDIO 1
 
-static HRESULT loadWhisperModel( const wchar_t* path, iModel** pp )
+static HRESULT loadWhisperModel( const wchar_t* path, iModel** pp, bool hybrid = false )
 {
 	using namespace Whisper;
-	constexpr eModelImplementation impl = eModelImplementation::GPU;
+	const eModelImplementation impl = hybrid ? eModelImplementation::Hybrid : eModelImplementation::GPU;
 	// constexpr eModelImplementation impl = eModelImplementation::Reference;
 	constexpr uint32_t flags = 0;
 	return Whisper::loadModel( path, impl, flags, nullptr, pp );
@@ -192,7 +193,7 @@ int wmain( int argc, wchar_t* argv[] )
 		return 2;
 	}
 
-	if( Whisper::findLanguageKeyA( params.language.c_str() ) == UINT_MAX )
+	if( params.language != "auto" && Whisper::findLanguageKeyA( params.language.c_str() ) == UINT_MAX )
 	{
 		fprintf( stderr, "error: unknown language '%s'\n", params.language.c_str() );
 		whisper_print_usage( argc, argv, params );
@@ -200,13 +201,34 @@ int wmain( int argc, wchar_t* argv[] )
 	}
 
 	ComLight::CComPtr<iModel> model;
-	HRESULT hr = loadWhisperModel( params.model.c_str(), &model );
+	HRESULT hr = loadWhisperModel( params.model.c_str(), &model, params.hybrid );
 	if( FAILED( hr ) )
 	{
 		printError( "failed to load the model", hr );
 		return 4;
 	}
 
+	if( params.stress_contexts > 0 )
+	{
+		ComLight::CComPtr<iMediaFoundation> mf;
+		hr = initMediaFoundation( &mf );
+		if( FAILED( hr ) )
+		{
+			printError( "failed to initialize Media Foundation runtime", hr );
+			return 5;
+		}
+		for( const std::wstring& fname : params.fname_inp )
+		{
+			hr = stressTest( model, mf, fname, params );
+			if( FAILED( hr ) )
+			{
+				printError( "Stress test failed", hr );
+				return 10;
+			}
+		}
+		return 0;
+	}
+
 	ComLight::CComPtr<iContext> context;
 	hr = model->createContext( &context );
 	if( FAILED( hr ) )
@@ -215,6 +237,19 @@ int wmain( int argc, wchar_t* argv[] )
 		return 5;
 	}
 
+	ComLight::CComPtr<iModel> draftModel;
+	if( !params.draft_model.empty() )
+	{
+		hr = loadWhisperModel( params.draft_model.c_str(), &draftModel );
+		if( SUCCEEDED( hr ) )
+			hr = context->setDraftModel( draftModel, 4 );
+		if( FAILED( hr ) )
+		{
+			printError( "failed to load the draft model", hr );
+			return 4;
+		}
+	}
+
 	ComLight::CComPtr<iMediaFoundation> mf;
 	hr = initMediaFoundation( &mf );
 	if( FAILED( hr ) )
@@ -223,6 +258,13 @@ int wmain( int argc, wchar_t* argv[] )
 		return 5;
 	}
 
+	if( !params.timeline.empty() )
+	{
+		hr = context->timelineStart( 0x40000 );
+		if( FAILED( hr ) )
+			printError( "failed to start the timeline recorder", hr );
+	}
+
 	for( const std::wstring& fname : params.fname_inp )
 	{
 		// print some info about the processing
@@ -277,7 +319,7 @@ int wmain( int argc, wchar_t* argv[] )
 			wparams.encoder_begin_callback_user_data = &is_aborted;
 		}
 
-		if( STREAM_AUDIO && !wparams.flag( eFullParamsFlags::TokenTimestamps ) )
+		if( STREAM_AUDIO && !wparams.flag( eFullParamsFlags::TokenTimestamps ) && params.n_processors <= 1 )
 		{
 			ComLight::CComPtr<iAudioReader> reader;
 			CHECK( mf->openAudioFile( fname.c_str(), params.diarize, &reader ) );
@@ -288,9 +330,13 @@ int wmain( int argc, wchar_t* argv[] )
 		{
 			// Token-level timestamps feature is not currently implemented when streaming the audio
 			// When these timestamps are requested, fall back to buffered mode.
+			// Parallel transcription needs the complete audio too, it splits the audio into chunks.
 			ComLight::CComPtr<iAudioBuffer> buffer;
 			CHECK( mf->loadAudioFile( fname.c_str(), params.diarize, &buffer ) );
-			hr = context->runFull( wparams, buffer );
+			if( params.n_processors > 1 )
+				hr = context->runFullParallel( wparams, buffer, params.n_processors );
+			else
+				hr = context->runFull( wparams, buffer );
 		}
 
 		if( FAILED( hr ) )
@@ -323,6 +369,12 @@ int wmain( int argc, wchar_t* argv[] )
 	}
 
 	context->timingsPrint();
+	if( !params.timeline.empty() )
+	{
+		hr = context->timelineSave( params.timeline.c_str() );
+		if( FAILED( hr ) )
+			printError( "Unable to save the timeline", hr );
+	}
 	context = nullptr;
 	return 0;
 }
\ No newline at end of file
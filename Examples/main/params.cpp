@@ -45,8 +45,12 @@ void whisper_print_usage( int argc, wchar_t** argv, const whisper_params& params
 	fprintf( stderr, "  -ps,      --print-special [%-7s] print special tokens\n", cstr( params.print_special ) );
 	fprintf( stderr, "  -nc,      --no-colors     [%-7s] do not print colors\n", cstr( !params.print_colors ) );
 	fprintf( stderr, "  -nt,      --no-timestamps [%-7s] do not print timestamps\n", cstr( params.no_timestamps ) );
-	fprintf( stderr, "  -l LANG,  --language LANG [%-7s] spoken language\n", params.language.c_str() );
+	fprintf( stderr, "  -hy,      --hybrid        [%-7s] decode on the CPU with the hybrid model\n", cstr( params.hybrid ) );
+	fprintf( stderr, "  -ss N,    --stress N      [%-7d] benchmark 1 to N contexts transcribing concurrently\n", params.stress_contexts );
+	fprintf( stderr, "  -l LANG,  --language LANG [%-7s] spoken language, 'auto' to detect\n", params.language.c_str() );
 	fprintf( stderr, "  -m FNAME, --model FNAME   [%-7S] model path\n", params.model.c_str() );
+	fprintf( stderr, "  -md FNAME, --model-draft FNAME [%-7S] smaller model for speculative decoding\n", params.draft_model.c_str() );
+	fprintf( stderr, "  -tl FNAME, --timeline FNAME [%-7S] save the timeline of the profiler events into JSON file\n", params.timeline.c_str() );
 	fprintf( stderr, "  -f FNAME, --file FNAME    [%-7s] path of the input audio file\n", "" );
 	fprintf( stderr, "\n" );
 }
@@ -87,8 +91,12 @@ bool whisper_params::parse( int argc, wchar_t* argv[] )
 		else if( arg == L"-ps" || arg == L"--print-special" ) { print_special = true; }
 		else if( arg == L"-nc" || arg == L"--no-colors" ) { print_colors = false; }
 		else if( arg == L"-nt" || arg == L"--no-timestamps" ) { no_timestamps = true; }
+		else if( arg == L"-hy" || arg == L"--hybrid" ) { hybrid = true; }
+		else if( arg == L"-ss" || arg == L"--stress" ) { stress_contexts = std::stoul( argv[ ++i ] ); }
 		else if( arg == L"-l" || arg == L"--language" ) { language = utf8( argv[ ++i ] ); }
 		else if( arg == L"-m" || arg == L"--model" ) { model = argv[ ++i ]; }
+		else if( arg == L"-md" || arg == L"--model-draft" ) { draft_model = argv[ ++i ]; }
+		else if( arg == L"-tl" || arg == L"--timeline" ) { timeline = argv[ ++i ]; }
 		else if( arg == L"-f" || arg == L"--file" ) { fname_inp.push_back( argv[ ++i ] ); }
 		else
 		{
@@ -12,6 +12,7 @@ struct whisper_params
 	uint32_t duration_ms = 0;
 	uint32_t max_context = UINT_MAX;
 	uint32_t max_len = 0;
+	uint32_t stress_contexts = 0;
 
 	float word_thold = 0.01f;
 
@@ -25,9 +26,12 @@ struct whisper_params
 	bool print_special = false;
 	bool print_colors = true;
 	bool no_timestamps = false;
+	bool hybrid = false;
 
 	std::string language = "en";
 	std::wstring model = L"models/ggml-base.en.bin";
+	std::wstring draft_model;
+	std::wstring timeline;
 	std::vector<std::wstring> fname_inp;
 
 	whisper_params();
@@ -0,0 +1,84 @@
+#include "stressTest.h"
+#include "../../ComLightLib/comLightClient.h"
+#include "miscUtils.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+using namespace Whisper;
+
+namespace
+{
+	// Whisper models consume 16 kHz mono audio
+	constexpr double sampleRate = 16000;
+
+	struct Job
+	{
+		ComLight::CComPtr<iContext> context;
+		HRESULT status = S_OK;
+	};
+
+	// Run the first count jobs on their own threads, and measure the wall clock time
+	HRESULT runConcurrently( Job* jobs, uint32_t count, const sFullParams& wparams, const iAudioBuffer* buffer, double& seconds )
+	{
+		using namespace std::chrono;
+		const auto started = steady_clock::now();
+
+		std::vector<std::thread> threads;
+		threads.reserve( count );
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			Job* j = &jobs[ i ];
+			threads.emplace_back( [ j, &wparams, buffer ]()
+				{
+					j->status = j->context->runFull( wparams, buffer );
+				} );
+		}
+		for( std::thread& t : threads )
+			t.join();
+
+		seconds = duration_cast<duration<double>>( steady_clock::now() - started ).count();
+		for( uint32_t i = 0; i < count; i++ )
+			if( FAILED( jobs[ i ].status ) )
+				return jobs[ i ].status;
+		return S_OK;
+	}
+}
+
+HRESULT stressTest( iModel* model, iMediaFoundation* mf, const std::wstring& fname, const whisper_params& params )
+{
+	// All contexts transcribe the same audio, decoding the file once
+	ComLight::CComPtr<iAudioBuffer> buffer;
+	CHECK( mf->loadAudioFile( fname.c_str(), false, &buffer ) );
+	const double audioSeconds = (double)buffer->countSamples() / sampleRate;
+
+	// The contexts are created in advance, before the concurrent runs
+	std::vector<Job> jobs( params.stress_contexts );
+	for( Job& j : jobs )
+		CHECK( model->createContext( &j.context ) );
+
+	sFullParams wparams;
+	CHECK( jobs[ 0 ].context->fullDefaultParams( eSamplingStrategy::Greedy, &wparams ) );
+	wparams.resetFlag( eFullParamsFlags::PrintRealtime | eFullParamsFlags::PrintProgress | eFullParamsFlags::PrintTimestamps );
+	wparams.setFlag( eFullParamsFlags::NoContext );
+	wparams.language = Whisper::makeLanguageKey( params.language.c_str() );
+	wparams.offset_ms = params.offset_t_ms;
+	wparams.duration_ms = params.duration_ms;
+
+	printf( "%S: %.1f seconds of audio\n", fname.c_str(), audioSeconds );
+	printf( "contexts\tthreads\tseconds\tRTF\n" );
+	for( uint32_t count = 1; count <= params.stress_contexts; count++ )
+	{
+		// The contexts share the CPU cores
+		wparams.cpuThreads = (int)std::max( params.n_threads / count, 1u );
+
+		double seconds;
+		CHECK( runConcurrently( jobs.data(), count, wparams, buffer, seconds ) );
+		// Aggregate real-time factor, above 1.0 when the contexts together transcribe faster than real time
+		const double rtf = audioSeconds * count / seconds;
+		printf( "%u\t%d\t%.3f\t%.2f\n", count, wparams.cpuThreads, seconds, rtf );
+	}
+
+	// The DeviceWait block shows the time the first context spent waiting for the GPU work of the other ones
+	jobs[ 0 ].context->timingsPrint();
+	return S_OK;
+}
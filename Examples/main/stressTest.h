@@ -0,0 +1,8 @@
+#pragma once
+#include "../../Whisper/API/iContext.cl.h"
+#include "../../Whisper/API/iMediaFoundation.cl.h"
+#include "params.h"
+
+// Transcribe the audio file with 1, 2, .. params.stress_contexts contexts of the same model, running on concurrent threads.
+// Prints the aggregate real-time factor for each count of contexts, the sum of audio durations divided by the wall clock time.
+HRESULT stressTest( Whisper::iModel* model, Whisper::iMediaFoundation* mf, const std::wstring& fname, const whisper_params& params );
@@ -0,0 +1,127 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <atlstr.h>
+#include <charconv>
+#include <thread>
+#include "Whisper/API/whisperWindows.h"
+using namespace Whisper;
+
+namespace
+{
+	struct CommandLineArgs
+	{
+		int threads = (int)std::thread::hardware_concurrency();
+		uint32_t minMilliseconds = 200;
+		CStringA filter;
+		CString json;
+		bool tune = false;
+
+		bool parse( int argc, wchar_t* argv[] );
+	};
+
+	bool printUsage()
+	{
+		fprintf( stderr, "Usage: benchmarkKernels.exe [-t THREADS] [-ms MILLISECONDS] [-f KERNEL] [-json FILE] [-tune]\n" );
+		fprintf( stderr, "  -t      threads for the matrix multiplications, default is the count of logical CPU cores\n" );
+		fprintf( stderr, "  -ms     minimum time to measure each case, default 200\n" );
+		fprintf( stderr, "  -f      only run the kernels with names containing the string: mulMat, norm, softMax, addRepeatGeluRow, floatsUpcast, fft\n" );
+		fprintf( stderr, "  -json   save the results into that JSON file\n" );
+		fprintf( stderr, "  -tune   run the autotuner of the matrix multiplications for THREADS before the benchmark, and save the results into the cache\n" );
+		return false;
+	}
+
+	bool parseNumber( const wchar_t* arg, uint32_t& rdi )
+	{
+		CStringA tmp;
+		tmp.Format( "%S", arg );
+		tmp.Trim();
+		auto res = std::from_chars( tmp.GetString(), tmp.GetString() + tmp.GetLength(), rdi );
+		if( res.ec != (std::errc)0 )
+		{
+			fprintf( stderr, "Unable to parse string into number\n" );
+			return false;
+		}
+		return true;
+	}
+
+	bool CommandLineArgs::parse( int argc, wchar_t* argv[] )
+	{
+		CString sw;
+		for( int i = 1; i < argc; i++ )
+		{
+			sw = argv[ i ];
+			if( 0 == sw.CompareNoCase( L"-tune" ) )
+			{
+				tune = true;
+				continue;
+			}
+			if( i + 1 >= argc )
+				return printUsage();
+			const wchar_t* const val = argv[ ++i ];
+
+			if( 0 == sw.CompareNoCase( L"-t" ) )
+			{
+				uint32_t v;
+				if( !parseNumber( val, v ) )
+					return false;
+				threads = (int)v;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-ms" ) )
+			{
+				if( !parseNumber( val, minMilliseconds ) )
+					return false;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-f" ) )
+			{
+				filter = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-json" ) )
+			{
+				json = val;
+				continue;
+			}
+			return printUsage();
+		}
+		return true;
+	}
+
+	void __stdcall logSink( void* context, eLogLevel lvl, const char* message )
+	{
+		FILE* const stream = ( lvl == eLogLevel::Info ) ? stdout : stderr;
+		fprintf( stream, "%s\n", message );
+	}
+}
+
+int wmain( int argc, wchar_t* argv[] )
+{
+	CommandLineArgs cla;
+	if( !cla.parse( argc, argv ) )
+		return 1;
+
+	sLoggerSetup logSetup;
+	logSetup.sink = &logSink;
+	logSetup.level = eLogLevel::Info;
+	setupLogger( logSetup );
+
+	if( cla.tune )
+	{
+		HRESULT hr = tuneCpuMatMul( cla.threads );
+		if( FAILED( hr ) )
+			return hr;
+	}
+
+	sCpuBenchmarkParams params;
+	params.threads = cla.threads;
+	params.minMilliseconds = cla.minMilliseconds;
+	params.filter = cla.filter.IsEmpty() ? nullptr : cla.filter.GetString();
+	params.jsonPath = cla.json.IsEmpty() ? nullptr : cla.json.GetString();
+
+	HRESULT hr = benchmarkCpuKernels( params );
+	if( SUCCEEDED( hr ) )
+		return 0;
+	return hr;
+}
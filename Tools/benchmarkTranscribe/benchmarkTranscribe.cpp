@@ -0,0 +1,746 @@
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <shlwapi.h>
+#include <stdio.h>
+#include <atlbase.h>
+#include <atlstr.h>
+#include <atlfile.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "Whisper/API/whisperWindows.h"
+#include "Whisper/API/sFullParams.h"
+#include "ComLightLib/hresult.h"
+#pragma comment( lib, "shlwapi.lib" )
+using namespace Whisper;
+
+namespace
+{
+	struct CommandLineArgs
+	{
+		CString model;
+		CString corpus = L"SampleClips";
+		eModelImplementation impl = eModelImplementation::GPU;
+		eSamplingStrategy strategy = eSamplingStrategy::Greedy;
+		bool streamed = false;
+		CStringA language;
+		int threads = (int)std::min( std::thread::hardware_concurrency(), 4u );
+		uint32_t warmup = 1;
+		uint32_t repeat = 3;
+		CString json;
+		CString baseline;
+		uint32_t thresholdPercent = 5;
+
+		bool parse( int argc, wchar_t* argv[] );
+	};
+
+	bool printUsage()
+	{
+		fprintf( stderr, "Usage: benchmarkTranscribe.exe -m MODEL [-c DIRECTORY] [-impl gpu|hybrid] [-mode full|streamed] [-s greedy|beam] [-l LANGUAGE] [-t THREADS]\n" );
+		fprintf( stderr, "  [-warmup COUNT] [-repeat COUNT] [-json FILE] [-baseline FILE] [-threshold PERCENT]\n" );
+		fprintf( stderr, "  -m          path to the GGML model file\n" );
+		fprintf( stderr, "  -c          directory with the audio clips, default is SampleClips\n" );
+		fprintf( stderr, "  -impl       model implementation, default gpu\n" );
+		fprintf( stderr, "  -mode       full loads the complete audio and calls runFull, streamed calls runStreamed; default full\n" );
+		fprintf( stderr, "  -s          sampling strategy, default greedy\n" );
+		fprintf( stderr, "  -l          spoken language, default is the one from the default parameters of the model\n" );
+		fprintf( stderr, "  -t          count of CPU threads, default min( 4, logical CPU cores )\n" );
+		fprintf( stderr, "  -warmup     runs of every clip excluded from the measures, default 1\n" );
+		fprintf( stderr, "  -repeat     measured runs of every clip, the tool reports medians; default 3\n" );
+		fprintf( stderr, "  -json       save the results into that JSON file\n" );
+		fprintf( stderr, "  -baseline   compare the results with that JSON file, saved by this tool\n" );
+		fprintf( stderr, "  -threshold  fail when encode, decode or total time is slower than the baseline by more than that, default 5\n" );
+		return false;
+	}
+
+	bool parseNumber( const wchar_t* arg, uint32_t& rdi )
+	{
+		CStringA tmp;
+		tmp.Format( "%S", arg );
+		tmp.Trim();
+		auto res = std::from_chars( tmp.GetString(), tmp.GetString() + tmp.GetLength(), rdi );
+		if( res.ec != (std::errc)0 )
+		{
+			fprintf( stderr, "Unable to parse string into number\n" );
+			return false;
+		}
+		return true;
+	}
+
+	bool CommandLineArgs::parse( int argc, wchar_t* argv[] )
+	{
+		CString sw;
+		for( int i = 1; i < argc; i++ )
+		{
+			sw = argv[ i ];
+			if( i + 1 >= argc )
+				return printUsage();
+			const wchar_t* const val = argv[ ++i ];
+
+			if( 0 == sw.CompareNoCase( L"-m" ) )
+			{
+				model = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-c" ) )
+			{
+				corpus = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-impl" ) )
+			{
+				if( 0 == _wcsicmp( val, L"gpu" ) )
+					impl = eModelImplementation::GPU;
+				else if( 0 == _wcsicmp( val, L"hybrid" ) )
+					impl = eModelImplementation::Hybrid;
+				else
+					return printUsage();
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-mode" ) )
+			{
+				if( 0 == _wcsicmp( val, L"full" ) )
+					streamed = false;
+				else if( 0 == _wcsicmp( val, L"streamed" ) )
+					streamed = true;
+				else
+					return printUsage();
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-s" ) )
+			{
+				if( 0 == _wcsicmp( val, L"greedy" ) )
+					strategy = eSamplingStrategy::Greedy;
+				else if( 0 == _wcsicmp( val, L"beam" ) )
+					strategy = eSamplingStrategy::BeamSearch;
+				else
+					return printUsage();
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-l" ) )
+			{
+				language = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-t" ) )
+			{
+				uint32_t v;
+				if( !parseNumber( val, v ) )
+					return false;
+				threads = (int)std::max( v, 1u );
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-warmup" ) )
+			{
+				if( !parseNumber( val, warmup ) )
+					return false;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-repeat" ) )
+			{
+				if( !parseNumber( val, repeat ) )
+					return false;
+				repeat = std::max( repeat, 1u );
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-json" ) )
+			{
+				json = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-baseline" ) )
+			{
+				baseline = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-threshold" ) )
+			{
+				if( !parseNumber( val, thresholdPercent ) )
+					return false;
+				continue;
+			}
+			return printUsage();
+		}
+		if( model.IsEmpty() )
+			return printUsage();
+		return true;
+	}
+
+	void __stdcall logSink( void* context, eLogLevel lvl, const char* message )
+	{
+		fprintf( stderr, "%s\n", message );
+	}
+
+	void printError( const char* what, HRESULT hr )
+	{
+		fprintf( stderr, "%s: error 0x%08X\n", what, hr );
+	}
+
+	constexpr double ticksToSeconds = 1E-7;
+
+	double elapsedSeconds( std::chrono::steady_clock::time_point started )
+	{
+		using namespace std::chrono;
+		return duration_cast<duration<double>>( steady_clock::now() - started ).count();
+	}
+
+	// Measures of a single run, in seconds
+	struct RunMeasures
+	{
+		double wall = 0;
+		double spectrogram = 0;
+		double encode = 0;
+		double decode = 0;
+		double sample = 0;
+		uint32_t decodes = 0;
+		uint32_t tokens = 0;
+	};
+
+	struct ClipResult
+	{
+		CStringA name;
+		double audio = 0;
+		// Medians of the measured runs, every field is a median on its own
+		RunMeasures median;
+		// Word error rate, or a negative number when the clip has no reference transcript
+		double wer = -1;
+		CStringA text;
+
+		// Real-time factor: seconds of processing per second of audio, lower is faster
+		double rtf() const
+		{
+			return ( audio > 0 ) ? median.wall / audio : 0;
+		}
+		double tokensPerSecond() const
+		{
+			return ( median.decode > 0 ) ? median.tokens / median.decode : 0;
+		}
+	};
+
+	template<class E>
+	E medianOf( std::vector<RunMeasures>& runs, E RunMeasures::* field )
+	{
+		std::sort( runs.begin(), runs.end(), [ field ]( const RunMeasures& a, const RunMeasures& b ) { return a.*field < b.*field; } );
+		return runs[ runs.size() / 2 ].*field;
+	}
+
+	RunMeasures computeMedians( std::vector<RunMeasures>& runs )
+	{
+		RunMeasures res;
+		res.wall = medianOf( runs, &RunMeasures::wall );
+		res.spectrogram = medianOf( runs, &RunMeasures::spectrogram );
+		res.encode = medianOf( runs, &RunMeasures::encode );
+		res.decode = medianOf( runs, &RunMeasures::decode );
+		res.sample = medianOf( runs, &RunMeasures::sample );
+		res.decodes = medianOf( runs, &RunMeasures::decodes );
+		res.tokens = medianOf( runs, &RunMeasures::tokens );
+		return res;
+	}
+
+	bool isAudioFile( const wchar_t* name )
+	{
+		const wchar_t* ext = wcsrchr( name, L'.' );
+		if( nullptr == ext )
+			return false;
+		static const wchar_t* const extensions[] = { L".wav", L".wma", L".mp3", L".flac", L".m4a" };
+		for( const wchar_t* e : extensions )
+			if( 0 == _wcsicmp( ext, e ) )
+				return true;
+		return false;
+	}
+
+	HRESULT listClips( const CString& dir, std::vector<CString>& names )
+	{
+		names.clear();
+		WIN32_FIND_DATAW fd;
+		HANDLE h = FindFirstFileW( dir + L"\\*", &fd );
+		if( INVALID_HANDLE_VALUE == h )
+			return HRESULT_FROM_WIN32( GetLastError() );
+		do
+		{
+			if( 0 == ( fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) && isAudioFile( fd.cFileName ) )
+				names.emplace_back( fd.cFileName );
+		}
+		while( FindNextFileW( h, &fd ) );
+		FindClose( h );
+		std::sort( names.begin(), names.end(), []( const CString& a, const CString& b ) { return a.CompareNoCase( b ) < 0; } );
+		return S_OK;
+	}
+
+	HRESULT readTextFile( LPCTSTR path, CStringA& rdi )
+	{
+		CAtlFile file;
+		HRESULT hr = file.Create( path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING );
+		if( FAILED( hr ) )
+			return hr;
+		ULONGLONG len;
+		hr = file.GetSize( len );
+		if( FAILED( hr ) )
+			return hr;
+		if( len > 0x1000000 )
+			return E_INVALIDARG;
+		char* buffer = rdi.GetBufferSetLength( (int)len );
+		hr = file.Read( buffer, (DWORD)len );
+		rdi.ReleaseBuffer( (int)len );
+		if( FAILED( hr ) )
+			return hr;
+		// Skip UTF-8 BOM
+		if( rdi.GetLength() >= 3 && 0 == memcmp( rdi.GetString(), "\xEF\xBB\xBF", 3 ) )
+			rdi.Delete( 0, 3 );
+		return S_OK;
+	}
+
+	// Split the text into lowercase words, ignoring punctuation. Bytes above 0x7F, UTF-8 encoded non-ASCII characters, are kept in the words.
+	std::vector<CStringA> splitWords( const CStringA& text )
+	{
+		std::vector<CStringA> words;
+		CStringA word;
+		for( int i = 0; i < text.GetLength(); i++ )
+		{
+			const uint8_t c = (uint8_t)text[ i ];
+			if( isalnum( c ) || c == '\'' || c >= 0x80 )
+			{
+				word.AppendChar( (char)tolower( c ) );
+				continue;
+			}
+			if( !word.IsEmpty() )
+			{
+				words.push_back( word );
+				word.Empty();
+			}
+		}
+		if( !word.IsEmpty() )
+			words.push_back( word );
+		return words;
+	}
+
+	// Word error rate: the word-level edit distance between the transcript and the reference, divided by the count of words in the reference
+	double wordErrorRate( const CStringA& reference, const CStringA& hypothesis )
+	{
+		const std::vector<CStringA> ref = splitWords( reference );
+		const std::vector<CStringA> hyp = splitWords( hypothesis );
+		if( ref.empty() )
+			return hyp.empty() ? 0.0 : 1.0;
+
+		std::vector<uint32_t> prev( hyp.size() + 1 ), curr( hyp.size() + 1 );
+		for( size_t j = 0; j <= hyp.size(); j++ )
+			prev[ j ] = (uint32_t)j;
+		for( size_t i = 1; i <= ref.size(); i++ )
+		{
+			curr[ 0 ] = (uint32_t)i;
+			for( size_t j = 1; j <= hyp.size(); j++ )
+			{
+				const uint32_t substitution = prev[ j - 1 ] + ( ref[ i - 1 ] == hyp[ j - 1 ] ? 0 : 1 );
+				curr[ j ] = std::min( { substitution, prev[ j ] + 1, curr[ j - 1 ] + 1 } );
+			}
+			std::swap( prev, curr );
+		}
+		return (double)prev[ hyp.size() ] / (double)ref.size();
+	}
+
+	class Benchmark
+	{
+		const CommandLineArgs& args;
+		CComPtr<iMediaFoundation> mf;
+		CComPtr<iModel> model;
+		CComPtr<iContext> context;
+		sFullParams wparams;
+
+		HRESULT runOnce( const CString& path, const iAudioBuffer* buffer, RunMeasures& rdi, CStringA* text );
+		HRESULT collectResults( RunMeasures& rdi, CStringA* text );
+
+	public:
+		double loadSeconds = 0;
+
+		Benchmark( const CommandLineArgs& cla ) : args( cla ) { }
+
+		HRESULT initialize();
+		HRESULT runClip( const CString& path, ClipResult& rdi );
+	};
+
+	HRESULT Benchmark::initialize()
+	{
+		HRESULT hr = initMediaFoundation( &mf );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to initialize Media Foundation runtime", hr );
+			return hr;
+		}
+
+		const auto started = std::chrono::steady_clock::now();
+		hr = loadModel( args.model, args.impl, 0, nullptr, &model );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to load the model", hr );
+			return hr;
+		}
+		hr = model->createContext( &context );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to create the context", hr );
+			return hr;
+		}
+		loadSeconds = elapsedSeconds( started );
+
+		hr = context->fullDefaultParams( args.strategy, &wparams );
+		if( FAILED( hr ) )
+			return hr;
+		wparams.resetFlag( eFullParamsFlags::PrintRealtime | eFullParamsFlags::PrintProgress | eFullParamsFlags::PrintTimestamps );
+		// The repeated runs of the same clip must not see the text of the previous ones
+		wparams.setFlag( eFullParamsFlags::NoContext );
+		wparams.cpuThreads = args.threads;
+		if( !args.language.IsEmpty() )
+			wparams.language = makeLanguageKey( args.language );
+		return S_OK;
+	}
+
+	HRESULT Benchmark::collectResults( RunMeasures& rdi, CStringA* text )
+	{
+		sStageTimings timings;
+		CHECK( context->timingsGet( timings ) );
+		rdi.spectrogram = timings.spectrogram * ticksToSeconds;
+		rdi.encode = timings.encode * ticksToSeconds;
+		rdi.decode = timings.decode * ticksToSeconds;
+		rdi.sample = timings.sample * ticksToSeconds;
+		rdi.decodes = timings.countDecodes;
+
+		CComPtr<iTranscribeResult> result;
+		CHECK( context->getResults( eResultFlags::Tokens, &result ) );
+		sTranscribeLength length;
+		CHECK( result->getSize( length ) );
+
+		const sToken* const tokens = result->getTokens();
+		rdi.tokens = 0;
+		for( uint32_t i = 0; i < length.countTokens; i++ )
+			if( !( tokens[ i ].flags & eTokenFlags::Special ) )
+				rdi.tokens++;
+
+		if( nullptr != text )
+		{
+			const sSegment* const segments = result->getSegments();
+			text->Empty();
+			for( uint32_t i = 0; i < length.countSegments; i++ )
+				*text += segments[ i ].text;
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::runOnce( const CString& path, const iAudioBuffer* buffer, RunMeasures& rdi, CStringA* text )
+	{
+		CHECK( context->timingsReset() );
+		const auto started = std::chrono::steady_clock::now();
+		if( nullptr != buffer )
+		{
+			CHECK( context->runFull( wparams, buffer ) );
+		}
+		else
+		{
+			// Opening the file is a part of the measure, the streaming mode decodes the audio while transcribing
+			CComPtr<iAudioReader> reader;
+			CHECK( mf->openAudioFile( path, false, &reader ) );
+			sProgressSink progressSink{ nullptr, nullptr };
+			CHECK( context->runStreamed( wparams, progressSink, reader ) );
+		}
+		rdi.wall = elapsedSeconds( started );
+		return collectResults( rdi, text );
+	}
+
+	HRESULT Benchmark::runClip( const CString& path, ClipResult& rdi )
+	{
+		// In the full mode, the audio is decoded once, before the measures
+		CComPtr<iAudioBuffer> buffer;
+		if( !args.streamed )
+		{
+			CHECK( mf->loadAudioFile( path, false, &buffer ) );
+			rdi.audio = (double)buffer->countSamples() / 16000.0;
+		}
+		else
+		{
+			CComPtr<iAudioReader> reader;
+			CHECK( mf->openAudioFile( path, false, &reader ) );
+			int64_t duration;
+			CHECK( reader->getDuration( duration ) );
+			rdi.audio = duration * ticksToSeconds;
+		}
+
+		RunMeasures tmp;
+		for( uint32_t i = 0; i < args.warmup; i++ )
+			CHECK( runOnce( path, buffer, tmp, nullptr ) );
+
+		std::vector<RunMeasures> runs( args.repeat );
+		for( uint32_t i = 0; i < args.repeat; i++ )
+		{
+			// Keep the text of the last run, they should be identical anyway
+			CStringA* text = ( i + 1 == args.repeat ) ? &rdi.text : nullptr;
+			CHECK( runOnce( path, buffer, runs[ i ], text ) );
+		}
+		rdi.median = computeMedians( runs );
+		return S_OK;
+	}
+
+	size_t peakWorkingSet()
+	{
+		PROCESS_MEMORY_COUNTERS pmc;
+		pmc.cb = sizeof( pmc );
+		if( !GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) )
+			return 0;
+		return pmc.PeakWorkingSetSize;
+	}
+
+	void printResults( const std::vector<ClipResult>& clips, const ClipResult& total )
+	{
+		printf( "clip\taudio\twall\tRTF\tmel\tencode\tdecode\tsample\tdecodes\ttokens\ttokens/s\tWER\n" );
+		auto printRow = []( const ClipResult& c )
+		{
+			printf( "%s\t%.2f\t%.3f\t%.2f\t%.3f\t%.3f\t%.3f\t%.3f\t%u\t%u\t%.1f\t",
+				c.name.GetString(), c.audio, c.median.wall, c.rtf(), c.median.spectrogram, c.median.encode, c.median.decode, c.median.sample,
+				c.median.decodes, c.median.tokens, c.tokensPerSecond() );
+			if( c.wer >= 0 )
+				printf( "%.1f%%\n", c.wer * 100 );
+			else
+				printf( "n/a\n" );
+		};
+		for( const ClipResult& c : clips )
+			printRow( c );
+		printRow( total );
+	}
+
+	void appendNumber( CStringA& json, const char* key, double val )
+	{
+		json.AppendFormat( ", \"%s\": %.6g", key, val );
+	}
+
+	void appendClip( CStringA& json, const ClipResult& c )
+	{
+		json.AppendFormat( "{ \"name\": \"%s\"", c.name.GetString() );
+		appendNumber( json, "audio", c.audio );
+		appendNumber( json, "wall", c.median.wall );
+		appendNumber( json, "rtf", c.rtf() );
+		appendNumber( json, "spectrogram", c.median.spectrogram );
+		appendNumber( json, "encode", c.median.encode );
+		appendNumber( json, "decode", c.median.decode );
+		appendNumber( json, "sample", c.median.sample );
+		appendNumber( json, "decodes", c.median.decodes );
+		appendNumber( json, "tokens", c.median.tokens );
+		appendNumber( json, "tokensPerSecond", c.tokensPerSecond() );
+		if( c.wer >= 0 )
+			appendNumber( json, "wer", c.wer );
+		json += " }";
+	}
+
+	// Every clip is on its own line of the file, the baseline comparison relies on that
+	HRESULT saveJson( const CString& path, const CommandLineArgs& args, double loadSeconds, size_t peakRss,
+		const std::vector<ClipResult>& clips, const ClipResult& total )
+	{
+		CStringA json;
+		json.Format( "{\n\"model\": \"%S\",\n", PathFindFileNameW( args.model ) );
+		json.AppendFormat( "\"mode\": \"%s\",\n", args.streamed ? "streamed" : "full" );
+		json.AppendFormat( "\"implementation\": \"%s\",\n", ( args.impl == eModelImplementation::Hybrid ) ? "hybrid" : "gpu" );
+		json.AppendFormat( "\"threads\": %d,\n", args.threads );
+		json.AppendFormat( "\"repeat\": %u,\n", args.repeat );
+		json.AppendFormat( "\"loadSeconds\": %.6g,\n", loadSeconds );
+		json.AppendFormat( "\"peakWorkingSet\": %zu,\n", peakRss );
+		json += "\"total\": ";
+		appendClip( json, total );
+		json += ",\n\"clips\": [\n";
+		for( size_t i = 0; i < clips.size(); i++ )
+		{
+			appendClip( json, clips[ i ] );
+			json += ( i + 1 < clips.size() ) ? ",\n" : "\n";
+		}
+		json += "]\n}\n";
+
+		CAtlFile file;
+		CHECK( file.Create( path, GENERIC_WRITE, 0, CREATE_ALWAYS ) );
+		CHECK( file.Write( json.GetString(), (DWORD)json.GetLength() ) );
+		return S_OK;
+	}
+
+	bool jsonNumber( const CStringA& line, const char* key, double& rdi )
+	{
+		CStringA pattern;
+		pattern.Format( "\"%s\": ", key );
+		const int i = line.Find( pattern );
+		if( i < 0 )
+			return false;
+		rdi = atof( line.GetString() + i + pattern.GetLength() );
+		return true;
+	}
+
+	bool jsonName( const CStringA& line, CStringA& rdi )
+	{
+		const char* pattern = "{ \"name\": \"";
+		const int i = line.Find( pattern );
+		if( i < 0 )
+			return false;
+		const int begin = i + (int)strlen( pattern );
+		const int end = line.Find( '"', begin );
+		if( end < 0 )
+			return false;
+		rdi = line.Mid( begin, end - begin );
+		return true;
+	}
+
+	// Compare the results with the baseline JSON saved by this tool, return S_FALSE when any measure regressed by more than the threshold
+	HRESULT compareBaseline( const CString& path, uint32_t thresholdPercent, const std::vector<ClipResult>& clips, const ClipResult& total )
+	{
+		CStringA content;
+		HRESULT hr = readTextFile( path, content );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to read the baseline", hr );
+			return hr;
+		}
+
+		const double limit = 1.0 + thresholdPercent * 0.01;
+		bool regressed = false;
+		uint32_t compared = 0;
+		printf( "\nclip\tmeasure\tbaseline\tcurrent\tchange\n" );
+
+		int pos = 0;
+		CStringA line = content.Tokenize( "\r\n", pos );
+		while( !line.IsEmpty() )
+		{
+			CStringA name;
+			if( jsonName( line, name ) )
+			{
+				const ClipResult* c = nullptr;
+				if( name == total.name )
+					c = &total;
+				else
+				{
+					for( const ClipResult& r : clips )
+						if( r.name == name )
+							c = &r;
+				}
+
+				if( nullptr != c )
+				{
+					compared++;
+					const std::pair<const char*, double> measures[] =
+					{
+						{ "wall", c->median.wall },
+						{ "encode", c->median.encode },
+						{ "decode", c->median.decode },
+					};
+					for( const auto& m : measures )
+					{
+						double base;
+						if( !jsonNumber( line, m.first, base ) || base <= 0 )
+							continue;
+						const double ratio = m.second / base;
+						const bool bad = ratio > limit;
+						regressed |= bad;
+						printf( "%s\t%s\t%.3f\t%.3f\t%+.1f%%%s\n", name.GetString(), m.first, base, m.second, ( ratio - 1 ) * 100, bad ? "\tREGRESSION" : "" );
+					}
+				}
+			}
+			line = content.Tokenize( "\r\n", pos );
+		}
+
+		if( 0 == compared )
+		{
+			fprintf( stderr, "The baseline has none of these clips\n" );
+			return E_INVALIDARG;
+		}
+		return regressed ? S_FALSE : S_OK;
+	}
+}
+
+int wmain( int argc, wchar_t* argv[] )
+{
+	CommandLineArgs cla;
+	if( !cla.parse( argc, argv ) )
+		return 1;
+
+	sLoggerSetup logSetup;
+	logSetup.sink = &logSink;
+	logSetup.level = eLogLevel::Warning;
+	setupLogger( logSetup );
+
+	std::vector<CString> names;
+	HRESULT hr = listClips( cla.corpus, names );
+	if( FAILED( hr ) || names.empty() )
+	{
+		fprintf( stderr, "No audio files in the directory \"%S\"\n", cla.corpus.GetString() );
+		return 1;
+	}
+
+	Benchmark bench{ cla };
+	hr = bench.initialize();
+	if( FAILED( hr ) )
+		return hr;
+	printf( "Loaded the model in %.3f seconds\n", bench.loadSeconds );
+
+	std::vector<ClipResult> clips( names.size() );
+	ClipResult total;
+	total.name = "total";
+	double werErrors = 0;
+	double werWords = 0;
+	for( size_t i = 0; i < names.size(); i++ )
+	{
+		ClipResult& c = clips[ i ];
+		c.name = names[ i ];
+		const CString path = cla.corpus + L"\\" + names[ i ];
+		hr = bench.runClip( path, c );
+		if( FAILED( hr ) )
+		{
+			fprintf( stderr, "Unable to transcribe \"%S\": error 0x%08X\n", path.GetString(), hr );
+			return hr;
+		}
+
+		// The reference transcript is optional, "jfk.wav" clip uses "jfk.reference.txt" file
+		const CString refPath = path.Left( path.ReverseFind( L'.' ) ) + L".reference.txt";
+		CStringA reference;
+		if( SUCCEEDED( readTextFile( refPath, reference ) ) )
+		{
+			c.wer = wordErrorRate( reference, c.text );
+			// The total WER is weighted by the count of words in the references
+			const double words = (double)splitWords( reference ).size();
+			werErrors += c.wer * words;
+			werWords += words;
+		}
+
+		total.audio += c.audio;
+		total.median.wall += c.median.wall;
+		total.median.spectrogram += c.median.spectrogram;
+		total.median.encode += c.median.encode;
+		total.median.decode += c.median.decode;
+		total.median.sample += c.median.sample;
+		total.median.decodes += c.median.decodes;
+		total.median.tokens += c.median.tokens;
+	}
+	if( werWords > 0 )
+		total.wer = werErrors / werWords;
+
+	const size_t peakRss = peakWorkingSet();
+	printResults( clips, total );
+	printf( "Peak working set %.1f MB\n", peakRss / ( 1024.0 * 1024.0 ) );
+
+	if( !cla.json.IsEmpty() )
+	{
+		hr = saveJson( cla.json, cla, bench.loadSeconds, peakRss, clips, total );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to save the JSON", hr );
+			return hr;
+		}
+	}
+
+	if( !cla.baseline.IsEmpty() )
+	{
+		hr = compareBaseline( cla.baseline, cla.thresholdPercent, clips, total );
+		if( FAILED( hr ) )
+			return hr;
+		if( S_FALSE == hr )
+		{
+			fprintf( stderr, "Performance regressed by more than %u%% compared to the baseline\n", cla.thresholdPercent );
+			return 2;
+		}
+	}
+	return 0;
+}
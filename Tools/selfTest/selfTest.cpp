@@ -0,0 +1,376 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <atlbase.h>
+#include <atlstr.h>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include "Whisper/API/whisperWindows.h"
+#include "ComLightLib/hresult.h"
+using namespace Whisper;
+
+namespace
+{
+	struct CommandLineArgs
+	{
+		CStringA filter;
+		CString model;
+		CString audio = L"SampleClips\\columbia.wma";
+
+		bool parse( int argc, wchar_t* argv[] );
+	};
+
+	bool printUsage()
+	{
+		fprintf( stderr, "Usage: selfTest.exe [-m MODEL] [-a AUDIO] [-f TEST] [-v]\n" );
+		fprintf( stderr, "  -m      path to the GGML model file, for the tests which need a model: tokenize, decodeScheduler\n" );
+		fprintf( stderr, "  -a      audio file with English speech for decodeScheduler test, default is SampleClips\\columbia.wma\n" );
+		fprintf( stderr, "  -f      only run the tests with names containing the string: mulMatBf16, mulMatJit, tuningCache, tokenize, decodeScheduler\n" );
+		fprintf( stderr, "  -v      print the passed tests too, not just the failures\n" );
+		return false;
+	}
+
+	eLogLevel s_logLevel = eLogLevel::Info;
+
+	bool CommandLineArgs::parse( int argc, wchar_t* argv[] )
+	{
+		CString sw;
+		for( int i = 1; i < argc; i++ )
+		{
+			sw = argv[ i ];
+			if( 0 == sw.CompareNoCase( L"-v" ) )
+			{
+				s_logLevel = eLogLevel::Debug;
+				continue;
+			}
+			if( i + 1 >= argc )
+				return printUsage();
+			const wchar_t* const val = argv[ ++i ];
+
+			if( 0 == sw.CompareNoCase( L"-m" ) )
+			{
+				model = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-a" ) )
+			{
+				audio = val;
+				continue;
+			}
+			if( 0 == sw.CompareNoCase( L"-f" ) )
+			{
+				filter = val;
+				continue;
+			}
+			return printUsage();
+		}
+		return true;
+	}
+
+	void __stdcall logSink( void* context, eLogLevel lvl, const char* message )
+	{
+		FILE* const stream = ( lvl == eLogLevel::Error ) ? stderr : stdout;
+		fprintf( stream, "%s\n", message );
+	}
+
+	void printError( const char* what, HRESULT hr )
+	{
+		fprintf( stderr, "%s: error 0x%08X\n", what, hr );
+	}
+
+	// Tests of the public API which need a model; the kernels are tested by testCpuKernels function of the DLL
+	class ModelTests
+	{
+		const CommandLineArgs& args;
+		CComPtr<iModel> model;
+		size_t countPassed = 0, countFailed = 0;
+
+		bool enabled( const char* name ) const
+		{
+			if( args.filter.IsEmpty() )
+				return true;
+			CStringA n = name, f = args.filter;
+			n.MakeLower();
+			f.MakeLower();
+			return n.Find( f ) >= 0;
+		}
+
+		void check( bool passed, const char* what )
+		{
+			if( passed )
+			{
+				countPassed++;
+				if( s_logLevel >= eLogLevel::Debug )
+					printf( "%s: passed\n", what );
+			}
+			else
+			{
+				countFailed++;
+				fprintf( stderr, "%s: FAILED\n", what );
+			}
+		}
+
+		HRESULT tokenize( const char* text, std::vector<int>& tokens );
+		HRESULT testTokenize();
+		HRESULT testDecodeScheduler();
+
+	public:
+		ModelTests( const CommandLineArgs& cla ) : args( cla ) { }
+
+		HRESULT run();
+	};
+
+	HRESULT ModelTests::run()
+	{
+		// The decode scheduler only exists in the GPU models created with that flag, the rest of the tests don't depend on it
+		HRESULT hr = loadModel( args.model, eModelImplementation::GPU, (uint32_t)eGpuModelFlags::BatchedDecoder, nullptr, &model );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to load the model", hr );
+			return hr;
+		}
+
+		CHECK( testTokenize() );
+		CHECK( testDecodeScheduler() );
+
+		if( 0 != countFailed )
+		{
+			fprintf( stderr, "Model: %zu tests failed, %zu passed\n", countFailed, countPassed );
+			return E_FAIL;
+		}
+		printf( "Model: all %zu tests passed\n", countPassed );
+		return S_OK;
+	}
+
+	HRESULT ModelTests::tokenize( const char* text, std::vector<int>& tokens )
+	{
+		tokens.clear();
+		return model->tokenize( text, []( int len, const whisper_token* buffer, void* pv ) -> HRESULT
+			{
+				std::vector<int>& vec = *(std::vector<int>*)pv;
+				vec.assign( buffer, buffer + len );
+				return S_OK;
+			}, &tokens );
+	}
+
+	// Texts for the round trip: words, punctuation, contractions, numbers, runs of whitespace, non-ASCII letters, emoji, and invalid UTF-8
+	static const char* const s_roundTripTexts[] =
+	{
+		"Hello world",
+		" And so, my fellow Americans: ask not what your country can do for you, ask what you can do for your country.",
+		"I'm sure they'll say it's fine, don't you think? We've been here, you'd know",
+		"In 1969, 600000000 people watched; pi is 3.14159",
+		"two  spaces,\ttab\nnew line   trailing   ",
+		"na\xC3\xAFve caf\xC3\xA9, \xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xE3\x81\x93\xE3\x82\x93\xE3\x81\xAB\xE3\x81\xA1\xE3\x81\xAF",
+		"\xF0\x9F\x91\x8D\xF0\x9F\x8F\xBD ok!!! ...",
+		"broken \xC3\x28 bytes \xFF\xFE",
+	};
+
+	HRESULT ModelTests::testTokenize()
+	{
+		if( !enabled( "tokenize" ) )
+			return S_OK;
+
+		SpecialTokens special;
+		CHECK( model->getSpecialTokens( special ) );
+		std::vector<int> tokens;
+
+		CHECK( tokenize( "", tokens ) );
+		check( tokens.empty(), "tokenize: the empty string has no tokens" );
+
+		// Concatenated strings of the tokens must reproduce the text exactly, and the tokens must be text tokens
+		CStringA what, decoded;
+		for( const char* text : s_roundTripTexts )
+		{
+			CHECK( tokenize( text, tokens ) );
+			decoded.Empty();
+			bool notText = false;
+			for( int t : tokens )
+			{
+				notText |= ( t < 0 || t >= special.TranscriptionEnd );
+				const char* s = model->stringFromToken( t );
+				if( nullptr != s )
+					decoded += s;
+			}
+			what.Format( "tokenize: round trip of \"%s\", %zu tokens", text, tokens.size() );
+			check( !notText && decoded == text && tokens.size() <= strlen( text ), what );
+		}
+
+		// A word which is a token on its own must be encoded as that single token.
+		// Tested with every text token which is a single word: optional space, then ASCII letters.
+		size_t countWords = 0, countWrong = 0;
+		for( int i = 0; i < special.TranscriptionEnd; i++ )
+		{
+			const char* s = model->stringFromToken( i );
+			if( nullptr == s || 0 == *s )
+				continue;
+			const char* letters = ( *s == ' ' ) ? s + 1 : s;
+			if( 0 == *letters )
+				continue;
+			bool word = true;
+			for( const char* c = letters; 0 != *c && word; c++ )
+				word = ( *c >= 'a' && *c <= 'z' ) || ( *c >= 'A' && *c <= 'Z' );
+			if( !word )
+				continue;
+
+			countWords++;
+			CHECK( tokenize( s, tokens ) );
+			// The vocabulary has a few duplicate strings, the encoder picks the first of them
+			if( tokens.size() == 1 && 0 == strcmp( model->stringFromToken( tokens[ 0 ] ), s ) )
+				continue;
+			if( countWrong++ < 10 )
+				fprintf( stderr, "tokenize: \"%s\" is token %i, encoded into %zu tokens\n", s, i, tokens.size() );
+		}
+		what.Format( "tokenize: %zu words which are tokens on their own, %zu encoded differently", countWords, countWrong );
+		check( countWords > 0 && 0 == countWrong, what );
+		return S_OK;
+	}
+
+	// Transcribes the audio on a new thread
+	struct TranscribeJob
+	{
+		CComPtr<iContext> context;
+		sFullParams params;
+		const iAudioBuffer* buffer = nullptr;
+		volatile HRESULT status = E_PENDING;
+
+		static DWORD __stdcall threadProc( void* pv )
+		{
+			TranscribeJob& job = *(TranscribeJob*)pv;
+			job.status = job.context->runFull( job.params, job.buffer );
+			return 0;
+		}
+	};
+
+	// IDs of the text tokens in the results of the context
+	HRESULT collectTextTokens( iContext* context, int eot, std::vector<int>& rdi )
+	{
+		rdi.clear();
+		CComPtr<iTranscribeResult> result;
+		CHECK( context->getResults( eResultFlags::Tokens, &result ) );
+		sTranscribeLength length;
+		CHECK( result->getSize( length ) );
+		const sToken* const tokens = result->getTokens();
+		for( uint32_t i = 0; i < length.countTokens; i++ )
+			if( tokens[ i ].id < eot )
+				rdi.push_back( tokens[ i ].id );
+		return S_OK;
+	}
+
+	// Two contexts with the complete vocabulary, batched by the scheduler, and a concurrent one with a restricted vocabulary.
+	// The restricted one doesn't join the scheduler, it must not stall the batches of the other two, nor get the tokens computed by them.
+	HRESULT ModelTests::testDecodeScheduler()
+	{
+		if( !enabled( "decodeScheduler" ) )
+			return S_OK;
+
+		CComPtr<iMediaFoundation> mf;
+		CHECK( initMediaFoundation( &mf ) );
+		CComPtr<iAudioBuffer> buffer;
+		HRESULT hr = mf->loadAudioFile( args.audio, false, &buffer );
+		if( FAILED( hr ) )
+		{
+			printError( "Unable to load the audio for decodeScheduler test", hr );
+			return hr;
+		}
+
+		SpecialTokens special;
+		CHECK( model->getSpecialTokens( special ) );
+		std::vector<int> allowed;
+		CHECK( tokenize( "the, and. a of to we you I it is that in this what can do for your country", allowed ) );
+
+		std::array<TranscribeJob, 3> jobs;
+		for( TranscribeJob& job : jobs )
+		{
+			CHECK( model->createContext( &job.context ) );
+			CHECK( job.context->fullDefaultParams( eSamplingStrategy::Greedy, &job.params ) );
+			job.params.resetFlag( eFullParamsFlags::PrintRealtime | eFullParamsFlags::PrintProgress | eFullParamsFlags::PrintTimestamps );
+			job.params.setFlag( eFullParamsFlags::NoContext );
+			// A single window of the audio
+			job.params.duration_ms = 30000;
+			job.buffer = buffer;
+		}
+		jobs[ 2 ].params.allowed_tokens = allowed.data();
+		jobs[ 2 ].params.allowed_n_tokens = (int)allowed.size();
+
+		std::array<HANDLE, 3> threads;
+		size_t countThreads = 0;
+		for( TranscribeJob& job : jobs )
+		{
+			HANDLE h = CreateThread( nullptr, 0, &TranscribeJob::threadProc, &job, 0, nullptr );
+			if( nullptr == h )
+			{
+				hr = HRESULT_FROM_WIN32( GetLastError() );
+				break;
+			}
+			threads[ countThreads++ ] = h;
+		}
+
+		// Far longer than a window of audio takes on any GPU which runs the model
+		constexpr DWORD timeoutMs = 5 * 60 * 1000;
+		const DWORD wait = WaitForMultipleObjects( (DWORD)countThreads, threads.data(), TRUE, timeoutMs );
+		if( WAIT_TIMEOUT == wait )
+		{
+			check( false, "decodeScheduler: the contexts have stalled" );
+			// The threads are stuck in the DLL, the only way out is terminating the process
+			fflush( stdout );
+			fflush( stderr );
+			TerminateProcess( GetCurrentProcess(), (UINT)HRESULT_FROM_WIN32( ERROR_TIMEOUT ) );
+		}
+		for( size_t i = 0; i < countThreads; i++ )
+			CloseHandle( threads[ i ] );
+		CHECK( hr );
+
+		CStringA what;
+		for( size_t i = 0; i < jobs.size(); i++ )
+		{
+			what.Format( "decodeScheduler: context %zu completed, status 0x%08X", i, (uint32_t)jobs[ i ].status );
+			check( SUCCEEDED( jobs[ i ].status ), what );
+		}
+
+		std::vector<int> tokens;
+		for( size_t i = 0; i < 2; i++ )
+		{
+			CHECK( collectTextTokens( jobs[ i ].context, special.TranscriptionEnd, tokens ) );
+			what.Format( "decodeScheduler: context %zu with the complete vocabulary, %zu text tokens", i, tokens.size() );
+			check( !tokens.empty(), what );
+		}
+
+		CHECK( collectTextTokens( jobs[ 2 ].context, special.TranscriptionEnd, tokens ) );
+		size_t countOutside = 0;
+		for( int t : tokens )
+			if( std::find( allowed.begin(), allowed.end(), t ) == allowed.end() )
+				countOutside++;
+		what.Format( "decodeScheduler: context with the restricted vocabulary, %zu text tokens, %zu of them outside of the vocabulary", tokens.size(), countOutside );
+		check( 0 == countOutside, what );
+		return S_OK;
+	}
+}
+
+int wmain( int argc, wchar_t* argv[] )
+{
+	CommandLineArgs cla;
+	if( !cla.parse( argc, argv ) )
+		return 1;
+
+	sLoggerSetup logSetup;
+	logSetup.sink = &logSink;
+	logSetup.level = s_logLevel;
+	setupLogger( logSetup );
+
+	HRESULT hr = testCpuKernels( cla.filter.IsEmpty() ? nullptr : cla.filter.GetString() );
+	if( !cla.model.IsEmpty() )
+	{
+		ModelTests tests{ cla };
+		const HRESULT hrModel = tests.run();
+		if( SUCCEEDED( hr ) )
+			hr = hrModel;
+	}
+	else
+		printf( "The tests which need a model were skipped, use -m argument to run them\n" );
+
+	if( SUCCEEDED( hr ) )
+		return 0;
+	return hr;
+}
@@ -9,5 +9,15 @@ namespace Whisper
 		Wave64 = 2,
 		NoReshapedMatMul = 4,
 		UseReshapedMatMul = 8,
+		// Batch decode steps of the contexts which run concurrently on different threads, GPU model only
+		BatchedDecoder = 0x10,
+		// Hybrid model only: benchmark the tile shapes of the CPU matrix multiplications on the first load, the results are cached on disk
+		TuneMulMat = 0x20,
+		// Hybrid model only: generate the micro-kernels of the CPU matrix multiplications at runtime, for the exact lengths of the dot products in the decoder weights
+		JitMulMat = 0x40,
+		// Hybrid model only: store the attention caches of the decoder in INT8 precision instead of FP16
+		KvCacheInt8 = 0x80,
+		// Hybrid model only: convert the decoder weights from FP16 to BF16 on CPUs with AVX512_BF16 support, faster but less precise
+		Bf16Weights = 0x100,
 	};
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "sLanguageList.h"
 #include "sLoadModelCallbacks.h"
 #include "eGpuModelFlags.h"
+#include "sCpuBenchmarkParams.h"
+#include "sStageTimings.h"
 
 namespace Whisper
 {
@@ -19,6 +21,9 @@ namespace Whisper
 	using whisper_token = int;
 	struct sProgressSink;
 
+	// Receives the tokens produced by iModel.tokenize method
+	using pfnDecodedTokens = HRESULT( __stdcall* )( int len, const whisper_token* buffer, void* pv );
+
 	__interface __declspec( novtable, uuid( "b9956374-3b18-4943-90f2-2ab18a404537" ) ) iContext : public IUnknown
 	{
 		// Run the entire model: PCM -> log mel spectrogram -> encoder -> decoder -> text
@@ -38,6 +43,27 @@ namespace Whisper
 		// Performance information
 		HRESULT __stdcall timingsPrint();
 		HRESULT __stdcall timingsReset();
+
+		// Split the audio at pauses in the speech into up to countContexts chunks, and transcribe these chunks concurrently on separate contexts which share the model.
+		// The segments are merged into this context, getResults method returns them the same way as after runFull.
+		// Every chunk except the first one starts 5 seconds before its split point, the decoder transcribes that overlap again to have the preceding text, and the merge drops these duplicate segments. The text of the last chunk becomes the prompt of the next run.
+		// The GPU work of the contexts is serialized on the shared D3D device, only the CPU work runs concurrently.
+		// This makes the method useful with the Hybrid model, which decodes on the CPU; the GPU model gains little from it.
+		HRESULT __stdcall runFullParallel( const sFullParams& params, const iAudioBuffer* buffer, uint32_t countContexts );
+
+		// Use a smaller model of the same family to speed up the greedy decoding; pass nullptr to disable.
+		// The draft model proposes countTokens tokens, this context verifies all of them with a single call to the decoder, and keeps the longest matching prefix.
+		HRESULT __stdcall setDraftModel( iModel* draft, uint32_t countTokens );
+
+		// Start recording the timeline of the profiler events: CPU blocks, operations of the hybrid decoder, callbacks, and audio I/O.
+		// The recorder keeps up to countEvents of the most recent events; pass 0 to stop recording. Call this method while the context is idle.
+		HRESULT __stdcall timelineStart( uint32_t countEvents );
+		// Save the recorded timeline into JSON file in Chrome trace event format, for chrome://tracing or https://ui.perfetto.dev
+		HRESULT __stdcall timelineSave( const wchar_t* path );
+
+		// Get the time spent in the stages of the transcription since the last timingsReset call.
+		// Unlike timingsPrint, this method doesn't log anything, it's for the benchmarks which compare the numbers across builds.
+		HRESULT __stdcall timingsGet( sStageTimings& rdi );
 	};
 
 	__interface __declspec( novtable, uuid( "abefb4c9-e8d8-46a3-8747-5afbadef1adb" ) ) iModel : public IUnknown
@@ -50,6 +76,10 @@ namespace Whisper
 
 		// Token Id -> String
 		const char* __stdcall stringFromToken( whisper_token token );
+
+		// Encode UTF-8 text into tokens with the byte-level BPE, for example to use as sFullParams.prompt_tokens
+		// The callback is called once, with all tokens of the text.
+		HRESULT __stdcall tokenize( const char* text, pfnDecodedTokens pfn, void* pv );
 	};
 
 	HRESULT __stdcall setupLogger( const sLoggerSetup& setup );
@@ -59,6 +89,17 @@ namespace Whisper
 	uint32_t __stdcall findLanguageKeyA( const char* lang );
 
 	HRESULT __stdcall getSupportedLanguages( sLanguageList& rdi );
+
+	// Measure performance of the CPU kernels at the shapes used by all sizes of Whisper models, print the results to the log, and optionally save them to a JSON file
+	HRESULT __stdcall benchmarkCpuKernels( const sCpuBenchmarkParams& params );
+
+	// Benchmark the tile shapes of the CPU matrix multiplications for the decoder weights of all sizes of Whisper models, and save the fastest ones into the cache on disk.
+	// Hybrid models use the cached results when the count of CPU threads of the context is the same.
+	HRESULT __stdcall tuneCpuMatMul( int threads );
+
+	// Compare the CPU kernels with scalar reference implementations, print the failures to the log.
+	// The optional filter only runs the tests with names containing that string. Returns E_FAIL when any of them failed.
+	HRESULT __stdcall testCpuKernels( const char* filter );
 }
 
 #include "sFullParams.h"
\ No newline at end of file
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+namespace Whisper
+{
+	// Parameters for benchmarkCpuKernels function
+	struct sCpuBenchmarkParams
+	{
+		// Count of threads for the matrix multiplications and for the roofline estimates; other kernels run on a single thread, like they do in the model.
+		int threads;
+		// Minimum time to spend measuring each case, in milliseconds. Each case runs at least 5 times regardless.
+		uint32_t minMilliseconds;
+		// Optional filter for the kernel names, case-insensitive substring. Pass nullptr to run all of them.
+		const char* filter;
+		// Optional path of the JSON file with the results. Pass nullptr to only print them to the log.
+		const wchar_t* jsonPath;
+	};
+}
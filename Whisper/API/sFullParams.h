@@ -27,6 +27,9 @@ namespace Whisper
 		PrintProgress = 0x10,
 		PrintRealtime = 0x20,
 		PrintTimestamps = 0x40,
+		// Hybrid model only: encode the next window of audio on the GPU, while the CPU decodes the current one.
+		// The next window is only known in advance with SingleSegment flag, the flag is ignored without it.
+		PipelineEncode = 0x80,
 
 		// Experimental
 		TokenTimestamps = 0x100,
@@ -51,6 +54,7 @@ namespace Whisper
 		int offset_ms;          // start offset in ms
 		int duration_ms;        // audio duration to process in ms
 		eFullParamsFlags flags;
+		// Language key, see makeLanguageKey() function. Zero or "auto" key detect the language from the first 30 seconds of the audio.
 		uint32_t language;
 
 		// [EXPERIMENTAL] token-level timestamps
@@ -85,6 +89,12 @@ namespace Whisper
 		pfnEncoderBegin encoder_begin_callback;
 		void* encoder_begin_callback_user_data;
 
+		// Optional restricted vocabulary: the decoder only computes logits of these tokens, and samples the text from them.
+		// The end of text and timestamp tokens are always allowed. Pass nullptr or 0 for the complete vocabulary.
+		// These fields are at the end of the structure, to keep the offsets of the older ones.
+		const whisper_token* allowed_tokens;
+		int allowed_n_tokens;
+
 		// Couple utility methods, they workaround the lack of bit fields in C++
 		inline bool flag( eFullParamsFlags f ) const
 		{
@@ -105,6 +115,12 @@ namespace Whisper
 				f &= ~(uint32_t)bit;
 			flags = (eFullParamsFlags)f;
 		}
+		// True when the language needs to be detected from the audio
+		inline bool autoLanguage() const
+		{
+			// 0x6F747561 = makeLanguageKey( "auto" )
+			return 0 == language || 0x6F747561 == language;
+		}
 	};
 
 	struct sSegmentTime
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+namespace Whisper
+{
+	// Time spent in the stages of the transcription since the last timingsReset call, in 100-nanosecond ticks.
+	// When a stage runs on several threads at once, the times of these threads are added together.
+	struct sStageTimings
+	{
+		// Complete runFull, runStreamed, runCapture or runFullParallel calls
+		uint64_t run;
+		// Mel spectrogram of the audio
+		uint64_t spectrogram;
+		// Encoder, including the wait for the GPU
+		uint64_t encode;
+		// Decoder, including the wait for the GPU
+		uint64_t decode;
+		// Sampling of the tokens from the output of the decoder
+		uint64_t sample;
+		// Count of the runs
+		uint32_t countRuns;
+		// Count of decoder invocations; the greedy sampling decodes once per token, the beam search decodes all beams with one call
+		uint32_t countDecodes;
+	};
+}
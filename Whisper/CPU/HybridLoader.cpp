@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "HybridLoader.h"
+#include "simdUtils.h"
 using namespace CpuCompute;
 using namespace ComLight;
 
@@ -51,8 +52,9 @@ static void populateDecodeTensorsMap( CAtlMap<CStringA, Tensor*>& map, int layer
 	}
 }
 
-HybridLoader::HybridLoader( DecoderTensors& m, int countLayers ) :
-	destination( m )
+HybridLoader::HybridLoader( DecoderTensors& m, int countLayers, bool bf16Weights ) :
+	destination( m ),
+	convertBf16( bf16Weights )
 {
 	populateDecodeTensorsMap( map, countLayers, destination );
 	pending.reserve( map.GetCount() );
@@ -92,6 +94,10 @@ HRESULT HybridLoader::setupTensor( const CStringA& name, int n_dims, int ftype,
 	if( totalElts * cbElement > UINT_MAX )
 		return DISP_E_OVERFLOW;
 
+	// Only the weight matrices of the layers are consumed by mulMat. The token embedding is also used by addRows(), which needs FP16.
+	if( convertBf16 && ftype != 0 && n_dims == 2 && 0 == strncmp( name, "decoder.blocks.", 15 ) )
+		pt.bf16Elements = totalElts;
+
 	size_t payloadBytes = cbElement * totalElts;
 	pt.payloadBytes = payloadBytes;
 	CHECK( stream->seek( payloadBytes, eSeekOrigin::Current ) );
@@ -114,6 +120,7 @@ HRESULT HybridLoader::completeLoad( ComLight::iReadStream* stream, iLoaderProgre
 	CHECK( buffer.allocate( bufferBytes ) );
 
 	uint8_t* rdi = buffer.pointer();
+	size_t countBf16 = 0;
 
 	for( const auto& pt : pending )
 	{
@@ -126,6 +133,13 @@ HRESULT HybridLoader::completeLoad( ComLight::iReadStream* stream, iLoaderProgre
 		CHECK( progressSink.gotBytes( (int64_t)pt.payloadBytes ) );
 
 		pt.destPointer->setDataPointer( rdi );
+		if( 0 != pt.bf16Elements )
+		{
+			// Same element size, can convert in place
+			halfsToBf16( (uint16_t*)rdi, (const uint16_t*)rdi, pt.bf16Elements );
+			pt.destPointer->setType( eDataType::BF16 );
+			countBf16++;
+		}
 
 		const size_t cb = ( pt.payloadBytes + 31 ) & ( ~( (size_t)31 ) );
 		rdi += cb;
@@ -136,5 +150,7 @@ HRESULT HybridLoader::completeLoad( ComLight::iReadStream* stream, iLoaderProgre
 
 	constexpr double mulMb = 1.0 / ( 1 << 20 );
 	logDebug( u8"Loaded %zu decoder tensors, %g MB RAM", pending.size(), mulMb * (double)(int64_t)bufferBytes );
+	if( 0 != countBf16 )
+		logDebug( u8"Converted %zu weight matrices to BF16", countBf16 );
 	return S_OK;
 }
\ No newline at end of file
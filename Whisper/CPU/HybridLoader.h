@@ -16,6 +16,8 @@ namespace CpuCompute
 		DecoderTensors& destination;
 		CAtlMap<CStringA, Tensor*> map;
 		size_t bufferBytes = 0;
+		// True to convert FP16 weight matrices of the layers into BF16 after loading
+		const bool convertBf16;
 
 		struct alignas( 32 ) PendingTensor
 		{
@@ -23,12 +25,14 @@ namespace CpuCompute
 			int64_t streamOffset = 0;
 			size_t bufferOffset = 0;
 			size_t payloadBytes = 0;
+			// Count of elements to convert from FP16 to BF16 after loading, or 0 to keep the original type
+			size_t bf16Elements = 0;
 		};
 		std::vector<PendingTensor> pending;
 
 	public:
 
-		HybridLoader( DecoderTensors& m, int countLayers );
+		HybridLoader( DecoderTensors& m, int countLayers, bool bf16Weights = false );
 
 		HRESULT setupTensor( const CStringA& name, int n_dims, int ftype, const std::array<int, 4>& ne, ComLight::iReadStream* stream, int64_t& postponedBytes );
 
@@ -5,32 +5,74 @@
 
 namespace CpuCompute
 {
+	// Keys and values of a single layer of the attention cache, in head-major layout: [ head ][ token ][ headDim ]
+	// Rows of each head are dense, the attention reads them sequentially without any permute() / reshape3d() views
+	struct AttentionCache
+	{
+		// Either uint16_t FP16 values, or int8_t quantized values
+		const void* keys;
+		const void* values;
+		// For INT8 caches, the scales of individual rows, [ head ][ token ], or of complete heads when perHeadScales is true; nullptr for FP16 caches
+		const float* keyScales;
+		const float* valueScales;
+		// Distance between heads, in elements of keys / values
+		size_t headStride;
+		// Distance between heads in the scale vectors
+		size_t scalesHeadStride;
+		uint32_t n_head, headDim;
+		// Count of tokens in the cache
+		uint32_t length;
+		bool perHeadScales;
+
+		bool isInt8() const { return nullptr != keyScales; }
+	};
+
 	class KvTensors
 	{
-		uint16_t* keys = nullptr;
-		uint16_t* values = nullptr;
-		uint32_t size = 0;
+		void* keys = nullptr;
+		void* values = nullptr;
+		float* keyScales = nullptr;
+		float* valueScales = nullptr;
+		uint32_t n_layer = 0, n_ctx = 0, n_head = 0, headDim = 0;
+		bool int8 = false;
+		// INT8 caches written by storeHead() have a single scale per head, the ones written by store() have a scale per row
+		bool perHeadScales = false;
+		// Temporary buffer for FP16 -> INT8 conversions
+		std::vector<float> tempRow;
 
 		CpuCompute::LargeBuffer memory;
 
+		size_t headStride() const { return (size_t)n_ctx * headDim; }
+		size_t layerStride() const { return headStride() * n_head; }
+		size_t scalesHeadStride() const { return perHeadScales ? 1 : n_ctx; }
+
+		void storeRow( uint32_t layer, uint32_t head, uint32_t token, const float* k, const float* v );
+		void storeRow( uint32_t layer, uint32_t head, uint32_t token, const uint16_t* k, const uint16_t* v );
+
 	public:
-		// Create these two large tensors, FP16 precision
-		HRESULT create( const Whisper::sModelParams& mp );
+		// Allocate the cache for n_layer layers, each layer holds up to n_ctx tokens of n_state = n_head * headDim elements
+		// With useInt8 and scalePerHead both true, the cache is written with storeHead() method, otherwise with store()
+		HRESULT create( uint32_t layers, uint32_t ctx, uint32_t state, uint32_t heads, bool useInt8, bool scalePerHead = false );
 
-		// A slice of model.memory_cross_k tensor
-		Tensor keysView( uint32_t len, uint32_t off ) const
+		// Create the self-attention cache of the decoder, memory_k / memory_v tensors in the reference version
+		HRESULT create( const Whisper::sModelParams& mp, bool useInt8 )
 		{
-			if( len + off <= size )
-				return Tensor::fromData( keys + off, eDataType::FP16, len );
-			throw E_BOUNDS;
+			return create( mp.n_text_layer, mp.n_text_ctx, mp.n_text_state, mp.n_text_head, useInt8 );
 		}
 
-		// A slice of model.memory_cross_v tensor
-		Tensor valuesView( uint32_t len, uint32_t off ) const
-		{
-			if( len + off <= size )
-				return Tensor::fromData( values + off, eDataType::FP16, len );
-			throw E_BOUNDS;
-		}
+		// Write keys and values of the layer for tokens [ position .. position + N ]
+		// The source tensors are [ n_state, N ], either FP32 or FP16, with dense rows
+		void store( uint32_t layer, uint32_t position, const Tensor& k, const Tensor& v );
+
+		// Count of the attention heads in all layers
+		uint32_t countHeads() const { return n_layer * n_head; }
+
+		// Write keys and values of tokens [ 0 .. length ] for a single head, the index is layer * n_head + head.
+		// The sources are FP16 [ n_state, length, n_layer ] tensors with keys and values of all layers, such as the cross-attention buffers made by the encoder.
+		// Different heads can be written on different threads concurrently.
+		void storeHead( uint32_t index, const uint16_t* k, const uint16_t* v, uint32_t length );
+
+		// Get the keys and values of the layer for tokens [ 0 .. length ]
+		AttentionCache view( uint32_t layer, uint32_t length ) const;
 	};
-}
\ No newline at end of file
+}
@@ -1,19 +1,180 @@
 #include "stdafx.h"
 #include "KvTensors.h"
+#include "simdUtils.h"
 using namespace CpuCompute;
 
-// Create these two large tensors, FP16 precision
-HRESULT KvTensors::create( const Whisper::sModelParams& mp )
+HRESULT KvTensors::create( uint32_t layers, uint32_t ctx, uint32_t state, uint32_t heads, bool useInt8, bool scalePerHead )
 {
-	const uint32_t n_mem = mp.n_text_layer * mp.n_text_ctx;
-	const uint32_t n_elements = mp.n_text_state * n_mem;
+	if( 0 == heads || 0 != state % heads || 0 != ( state / heads ) % 8 )
+		return E_INVALIDARG;
 
-	const size_t cb = sizeof( uint16_t ) * (size_t)n_elements * 2;
-	CHECK( memory.allocate( cb ) );
+	n_layer = layers;
+	n_ctx = ctx;
+	n_head = heads;
+	headDim = state / heads;
+	int8 = useInt8;
+	perHeadScales = useInt8 && scalePerHead;
 
-	uint16_t* pointer = (uint16_t*)memory.pointer();
+	const size_t n_elements = layerStride() * n_layer;
+	const size_t n_rows = (size_t)n_layer * n_head * scalesHeadStride();
+	const size_t cbElements = useInt8 ? sizeof( int8_t ) : sizeof( uint16_t );
+
+	// Keys, values, and for INT8 caches the two vectors with scales
+	const size_t cbValues = ( ( n_elements * cbElements ) + 31 ) & ~(size_t)31;
+	const size_t cbScales = useInt8 ? n_rows * sizeof( float ) : 0;
+	CHECK( memory.allocate( cbValues * 2 + cbScales * 2 ) );
+
+	uint8_t* pointer = (uint8_t*)memory.pointer();
 	keys = pointer;
-	values = pointer + n_elements;
-	size = n_elements;
+	values = pointer + cbValues;
+	if( useInt8 )
+	{
+		keyScales = (float*)( pointer + cbValues * 2 );
+		valueScales = keyScales + n_rows;
+		if( !perHeadScales )
+			tempRow.resize( (size_t)headDim * 2 );
+	}
+	else
+	{
+		keyScales = nullptr;
+		valueScales = nullptr;
+	}
 	return S_OK;
-}
\ No newline at end of file
+}
+
+void KvTensors::storeRow( uint32_t layer, uint32_t head, uint32_t token, const float* k, const float* v )
+{
+	const size_t idxRow = ( (size_t)layer * n_head + head ) * n_ctx + token;
+	const size_t off = idxRow * headDim;
+	if( int8 )
+	{
+		keyScales[ idxRow ] = quantizeRowInt8( (int8_t*)keys + off, k, headDim );
+		valueScales[ idxRow ] = quantizeRowInt8( (int8_t*)values + off, v, headDim );
+	}
+	else
+	{
+		floatsDowncast( (uint16_t*)keys + off, k, headDim );
+		floatsDowncast( (uint16_t*)values + off, v, headDim );
+	}
+}
+
+void KvTensors::storeRow( uint32_t layer, uint32_t head, uint32_t token, const uint16_t* k, const uint16_t* v )
+{
+	if( int8 )
+	{
+		float* const k32 = tempRow.data();
+		float* const v32 = k32 + headDim;
+		floatsUpcast( k32, k, headDim );
+		floatsUpcast( v32, v, headDim );
+		storeRow( layer, head, token, k32, v32 );
+	}
+	else
+	{
+		const size_t off = ( ( (size_t)layer * n_head + head ) * n_ctx + token ) * headDim;
+		memcpy( (uint16_t*)keys + off, k, headDim * sizeof( uint16_t ) );
+		memcpy( (uint16_t*)values + off, v, headDim * sizeof( uint16_t ) );
+	}
+}
+
+void KvTensors::store( uint32_t layer, uint32_t position, const Tensor& k, const Tensor& v )
+{
+	const uint32_t n_state = n_head * headDim;
+	if( k.type() != v.type() || !isSameShape( k, v ) )
+		throw E_INVALIDARG;
+	if( k.ne[ 0 ] != n_state || k.nb[ 0 ] != 1 || v.nb[ 0 ] != 1 || k.ne[ 2 ] != 1 || k.ne[ 3 ] != 1 )
+		throw E_INVALIDARG;
+	const uint32_t N = k.ne[ 1 ];
+	if( layer >= n_layer || position + N > n_ctx )
+		throw E_BOUNDS;
+	if( perHeadScales )
+		throw E_NOTIMPL;
+
+	// Transpose [ token ][ head ][ headDim ] source into [ head ][ token ][ headDim ] destination, one row at a time
+	switch( k.type() )
+	{
+	case eDataType::FP32:
+		for( uint32_t i = 0; i < N; i++ )
+		{
+			const float* rsiKey = k.fp32() + (size_t)i * k.nb[ 1 ];
+			const float* rsiValue = v.fp32() + (size_t)i * v.nb[ 1 ];
+			for( uint32_t h = 0; h < n_head; h++ )
+				storeRow( layer, h, position + i, rsiKey + h * headDim, rsiValue + h * headDim );
+		}
+		return;
+	case eDataType::FP16:
+		for( uint32_t i = 0; i < N; i++ )
+		{
+			const uint16_t* rsiKey = k.fp16() + (size_t)i * k.nb[ 1 ];
+			const uint16_t* rsiValue = v.fp16() + (size_t)i * v.nb[ 1 ];
+			for( uint32_t h = 0; h < n_head; h++ )
+				storeRow( layer, h, position + i, rsiKey + h * headDim, rsiValue + h * headDim );
+		}
+		return;
+	}
+	throw E_NOTIMPL;
+}
+
+void KvTensors::storeHead( uint32_t index, const uint16_t* k, const uint16_t* v, uint32_t length )
+{
+	if( index >= countHeads() )
+		throw E_BOUNDS;
+	if( length > n_ctx )
+		throw E_BOUNDS;
+
+	// Transpose [ layer ][ token ][ head ][ headDim ] source into [ layer ][ head ][ token ][ headDim ] destination
+	const size_t n_state = (size_t)n_head * headDim;
+	const size_t layer = index / n_head;
+	const size_t head = index % n_head;
+	const size_t offSource = layer * length * n_state + head * headDim;
+	k += offSource;
+	v += offSource;
+	const size_t off = index * headStride();
+
+	if( int8 )
+	{
+		if( !perHeadScales )
+			throw E_NOTIMPL;
+		keyScales[ index ] = quantizeRowsInt8( (int8_t*)keys + off, k, n_state, headDim, length );
+		valueScales[ index ] = quantizeRowsInt8( (int8_t*)values + off, v, n_state, headDim, length );
+		return;
+	}
+
+	uint16_t* rdiKeys = (uint16_t*)keys + off;
+	uint16_t* rdiValues = (uint16_t*)values + off;
+	for( uint32_t i = 0; i < length; i++, k += n_state, v += n_state, rdiKeys += headDim, rdiValues += headDim )
+	{
+		memcpy( rdiKeys, k, headDim * sizeof( uint16_t ) );
+		memcpy( rdiValues, v, headDim * sizeof( uint16_t ) );
+	}
+}
+
+AttentionCache KvTensors::view( uint32_t layer, uint32_t length ) const
+{
+	if( layer >= n_layer || length > n_ctx )
+		throw E_BOUNDS;
+
+	AttentionCache res;
+	const size_t off = layerStride() * layer;
+	if( int8 )
+	{
+		res.keys = (const int8_t*)keys + off;
+		res.values = (const int8_t*)values + off;
+		const size_t offScales = (size_t)layer * n_head * scalesHeadStride();
+		res.keyScales = keyScales + offScales;
+		res.valueScales = valueScales + offScales;
+	}
+	else
+	{
+		res.keys = (const uint16_t*)keys + off;
+		res.values = (const uint16_t*)values + off;
+		res.keyScales = nullptr;
+		res.valueScales = nullptr;
+	}
+	res.headStride = headStride();
+	res.scalesHeadStride = scalesHeadStride();
+	res.n_head = n_head;
+	res.headDim = headDim;
+	res.length = length;
+	res.perHeadScales = perHeadScales;
+	return res;
+}
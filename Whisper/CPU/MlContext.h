@@ -1,6 +1,9 @@
 #pragma once
 #include "Tensor.h"
 #include "ParallelForRunner.h"
+#include "mulMat.h"
+#include "KvTensors.h"
+#include "../Utils/ProfileCollection.h"
 
 namespace CpuCompute
 {
@@ -8,6 +11,14 @@ namespace CpuCompute
 	{
 		ParallelForRunner pfor;
 		iMemoryAllocator* allocator = nullptr;
+		Whisper::ProfileCollection* profiler = nullptr;
+		// ID of the tag for the next operation, see ProfileCollection::cpuOpTagId
+		uint16_t nextTag = 0;
+
+		// Measure time of an operation, with the count of floating point operations and bytes of memory touched by it.
+		// Returns an empty RAII object when the context has no profiler, or the profiler doesn't measure the operations.
+		Whisper::ProfileCollection::OpRaii profileOp( Whisper::eCpuOp op, const std::array<uint32_t, 3>& shape, uint64_t flops, uint64_t bytes );
+		Whisper::ProfileCollection::OpRaii profileMulMat( const Tensor& result, const Tensor& a, const Tensor& b, const MulMatEpilogue* epilogue );
 
 	public:
 		MlContext( int threads );
@@ -26,6 +37,18 @@ namespace CpuCompute
 			return ret;
 		}
 
+		void setProfiler( Whisper::ProfileCollection* pc )
+		{
+			profiler = pc;
+		}
+
+		// Set tag string for the next operation, the profiler reports the operations separately for each tag.
+		// Same as GpuProfiler::setNextTag, the string should be readonly, the profiler only keeps the pointer.
+		void setNextTag( const char* name )
+		{
+			nextTag = ( nullptr != profiler && profiler->profileCpuOps() ) ? profiler->cpuOpTagId( name ) : 0;
+		}
+
 		Tensor createTensor( eDataType type, const std::array<uint32_t, 4>& size );
 		Tensor createTensor( eDataType type, std::initializer_list<uint32_t> size );
 
@@ -41,9 +64,21 @@ namespace CpuCompute
 			fmaRepeat( cur, wb.w, wb.b );
 		}
 
+		// Fused equivalent of norm() followed by fmaRepeat(), for 1D weight and bias vectors
+		Tensor normFma( const Tensor& arg, const Tensor& w, const Tensor& b );
+
+		inline Tensor normFma( const Tensor& arg, const TensorPair& wb )
+		{
+			return normFma( arg, wb.w, wb.b );
+		}
+
 		// Multiply two matrices
 		Tensor mulMat( const Tensor& a, const Tensor& b );
 
+		// Multiply two matrices, and apply the epilogue to the output tiles while they're in registers
+		// This saves a complete pass over the output for addRepeat, addRepeatScale, scale, addRepeatGelu, and addInPlace
+		Tensor mulMat( const Tensor& a, const Tensor& b, const MulMatEpilogue& epilogue );
+
 		// cur = add( repeat( b, cur ), cur ); cur = scale(cur, scaling)
 		void addRepeatScale( Tensor& cur, const Tensor& b, float scaling );
 
@@ -60,6 +95,16 @@ namespace CpuCompute
 
 		void softMax( Tensor& cur, float inputScale = 1.0f );
 
+		// Fused multi-head attention, softmax( Q * K ) * V computed with the streaming softmax, without materializing the KQ matrix.
+		// Q is FP32 matrix [ n_state, N ] with the heads merged in the first dimension, the output is FP32 matrix of the same shape.
+		// Keys and values come from the head-major attention cache, the scaling must be already applied to Q and K.
+		// When causal is true, query #i only attends to the first ( n_past + i + 1 ) keys.
+		Tensor attention( const Tensor& q, const AttentionCache& kv, bool causal, uint32_t n_past = 0 );
+
+		// Write keys and values of all layers into the head-major cache, the heads are split across threads.
+		// The sources are FP16 tensors with `length` tokens of every layer, in [ layer ][ token ][ n_state ] layout.
+		void storeHeads( KvTensors& cache, const Tensor& keys, const Tensor& values, uint32_t length );
+
 		Tensor copy( const Tensor& a, eDataType type, std::initializer_list<uint32_t> size );
 
 		HRESULT copyImpl( Tensor& result, const Tensor& source );
@@ -3,11 +3,35 @@
 #include "simdUtils.h"
 #include "mulMat.h"
 using namespace CpuCompute;
+using Whisper::eCpuOp;
+using Whisper::ProfileCollection;
 
 MlContext::MlContext( int threads ) : pfor( threads )
 {
 }
 
+ProfileCollection::OpRaii MlContext::profileOp( eCpuOp op, const std::array<uint32_t, 3>& shape, uint64_t flops, uint64_t bytes )
+{
+	const uint16_t tag = nextTag;
+	nextTag = 0;
+	ProfileCollection* const pc = ( nullptr != profiler && profiler->profileCpuOps() ) ? profiler : nullptr;
+	return ProfileCollection::OpRaii{ pc, op, tag, shape, flops, bytes };
+}
+
+namespace
+{
+	inline uint64_t tensorBytes( const Tensor& t )
+	{
+		return (uint64_t)t.countElements() * elementSize( t.type() );
+	}
+
+	// Shape of the tensor for the profiler, the last 2 dimensions are merged
+	inline std::array<uint32_t, 3> profilerShape( const Tensor& t )
+	{
+		return { t.ne[ 0 ], t.ne[ 1 ], t.ne[ 2 ] * t.ne[ 3 ] };
+	}
+}
+
 Tensor MlContext::createTensor( eDataType type, const std::array<uint32_t, 4>& size )
 {
 	Tensor res;
@@ -48,6 +72,8 @@ Tensor MlContext::addRows( const Tensor& d_te, const Tensor& d_pe, const int* to
 		throw E_BOUNDS;
 
 	Tensor res = createTensor( eDataType::FP32, { d_te.ne[ 0 ], (uint32_t)n_tokens } );
+	// Reads FP16 row of the token embedding, and FP32 row of the positional one, writes FP32 row
+	auto prof = profileOp( eCpuOp::addRows, profilerShape( res ), 0, tensorBytes( res ) * 5 / 2 );
 
 	const size_t inner = (size_t)d_te.ne[ 0 ];
 	const size_t outer = (size_t)n_tokens;
@@ -145,6 +171,7 @@ Tensor MlContext::norm( const Tensor& arg )
 	if( arg.type() != eDataType::FP32 || arg.nb[ 0 ] != 1 )
 		throw E_INVALIDARG;
 	Tensor res = createTensor( eDataType::FP32, arg.ne );
+	auto prof = profileOp( eCpuOp::norm, profilerShape( arg ), 0, tensorBytes( arg ) * 2 );
 
 	NormContext context;
 	context.source = arg.fp32();
@@ -157,6 +184,58 @@ Tensor MlContext::norm( const Tensor& arg )
 	return res;
 }
 
+namespace
+{
+	struct NormFmaContext : public iComputeRange
+	{
+		const float* source;
+		float* result;
+		const float* w;
+		const float* b;
+		size_t inner;
+		DispatchHelper3 threads;
+		std::array<uint32_t, 3> nbInput;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			std::array<uint32_t, 3> idx = threads.unpack( i );
+			float* rdi = result + i * inner;
+			for( ; i < end; i++, rdi += inner, threads.next( idx ) )
+			{
+				const float* rsi = sourceRow( source, idx, nbInput[ 0 ], nbInput[ 1 ], nbInput[ 2 ] );
+				normFma( rdi, rsi, inner, w, b );
+			}
+			return S_OK;
+		}
+	};
+}
+
+Tensor MlContext::normFma( const Tensor& arg, const Tensor& w, const Tensor& b )
+{
+	if( arg.type() != eDataType::FP32 || arg.nb[ 0 ] != 1 )
+		throw E_INVALIDARG;
+	if( !( w.type() == eDataType::FP32 && b.type() == eDataType::FP32 && w.isContinuous() && b.isContinuous() ) )
+		throw E_INVALIDARG;
+	// The fused version only supports the case found in the model, 1D vectors of the same length as the rows of the argument
+	if( !( w.ne[ 0 ] == arg.ne[ 0 ] && isSameShape( w, b ) && w.countElements() == w.ne[ 0 ] ) )
+		throw E_NOTIMPL;
+
+	Tensor res = createTensor( eDataType::FP32, arg.ne );
+	auto prof = profileOp( eCpuOp::normFma, profilerShape( arg ), 0, tensorBytes( arg ) * 2 + tensorBytes( w ) + tensorBytes( b ) );
+
+	NormFmaContext context;
+	context.source = arg.fp32();
+	context.result = res.fp32();
+	context.w = w.fp32();
+	context.b = b.fp32();
+	context.inner = arg.ne[ 0 ];
+	context.threads = DispatchHelper3( arg.ne[ 1 ], arg.ne[ 2 ], arg.ne[ 3 ] );
+	context.nbInput = { arg.nb[ 1 ], arg.nb[ 2 ], arg.nb[ 3 ] };
+
+	check( pfor.parallelFor( context, context.threads.groupsCount() ) );
+	return res;
+}
+
 void MlContext::fmaRepeat( Tensor& cur, const Tensor& w, const Tensor& b )
 {
 	if( !( cur.isContinuous() && w.isContinuous() && b.isContinuous() ) )
@@ -167,6 +246,7 @@ void MlContext::fmaRepeat( Tensor& cur, const Tensor& w, const Tensor& b )
 
 	if( !isSameShape( w, b ) )
 		throw E_INVALIDARG;
+	auto prof = profileOp( eCpuOp::fmaRepeat, profilerShape( cur ), 0, tensorBytes( cur ) * 2 + tensorBytes( w ) + tensorBytes( b ) );
 
 	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
 	std::array<uint32_t, 3> idx = { 0, 0, 0 };
@@ -189,6 +269,16 @@ void MlContext::fmaRepeat( Tensor& cur, const Tensor& w, const Tensor& b )
 	}
 }
 
+ProfileCollection::OpRaii MlContext::profileMulMat( const Tensor& result, const Tensor& a, const Tensor& b, const MulMatEpilogue* epilogue )
+{
+	// 2 FLOPs, multiply and add, per element of the shared dimension
+	const uint64_t flops = 2 * (uint64_t)result.countElements() * a.ne[ 0 ];
+	uint64_t bytes = tensorBytes( a ) + tensorBytes( b ) + tensorBytes( result );
+	if( nullptr != epilogue && nullptr != epilogue->residual )
+		bytes += tensorBytes( *epilogue->residual );
+	return profileOp( eCpuOp::mulMat, { a.ne[ 1 ], b.ne[ 1 ], a.ne[ 0 ] }, flops, bytes );
+}
+
 Tensor MlContext::mulMat( const Tensor& a, const Tensor& b )
 {
 	if( !DirectCompute::canMulMat( a, b ) )
@@ -196,11 +286,25 @@ Tensor MlContext::mulMat( const Tensor& a, const Tensor& b )
 
 	std::array<uint32_t, 4> ne{ a.ne[ 1 ], b.ne[ 1 ], a.ne[ 2 ], b.ne[ 3 ] };
 	Tensor result = createTensor( eDataType::FP32, ne );
+	auto prof = profileMulMat( result, a, b, nullptr );
 
 	check( CpuCompute::mulMat( result, a, b, pfor ) );
 	return result;
 }
 
+Tensor MlContext::mulMat( const Tensor& a, const Tensor& b, const MulMatEpilogue& epilogue )
+{
+	if( !DirectCompute::canMulMat( a, b ) )
+		throw E_INVALIDARG;
+
+	std::array<uint32_t, 4> ne{ a.ne[ 1 ], b.ne[ 1 ], a.ne[ 2 ], b.ne[ 3 ] };
+	Tensor result = createTensor( eDataType::FP32, ne );
+	auto prof = profileMulMat( result, a, b, &epilogue );
+
+	check( CpuCompute::mulMat( result, a, b, pfor, &epilogue ) );
+	return result;
+}
+
 // cur = add( repeat( b, cur ), cur ); cur = scale(cur, scaling)
 void MlContext::addRepeatScale( Tensor& cur, const Tensor& b, float scaling )
 {
@@ -208,6 +312,7 @@ void MlContext::addRepeatScale( Tensor& cur, const Tensor& b, float scaling )
 		throw E_INVALIDARG;
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
+	auto prof = profileOp( eCpuOp::addRepeatScale, profilerShape( cur ), 0, tensorBytes( cur ) * 2 + tensorBytes( b ) );
 
 	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
 	std::array<uint32_t, 3> idx = { 0, 0, 0 };
@@ -236,6 +341,7 @@ void MlContext::addRepeat( Tensor& cur, const Tensor& b )
 		throw E_INVALIDARG;
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
+	auto prof = profileOp( eCpuOp::addRepeat, profilerShape( cur ), 0, tensorBytes( cur ) * 2 + tensorBytes( b ) );
 
 	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
 	std::array<uint32_t, 3> idx = { 0, 0, 0 };
@@ -264,6 +370,7 @@ void MlContext::scale( Tensor& cur, float scaling )
 		throw E_INVALIDARG;
 
 	const size_t len = cur.countElements();
+	auto prof = profileOp( eCpuOp::scale, profilerShape( cur ), 0, tensorBytes( cur ) * 2 );
 	const __m256 scale = _mm256_set1_ps( scaling );
 	scaleRow( cur.fp32(), len, scale );
 }
@@ -273,6 +380,7 @@ void MlContext::diagMaskInf( Tensor& cur, uint32_t n_past )
 	if( !( cur.isContinuous() && cur.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
 
+	auto prof = profileOp( eCpuOp::diagMaskInf, profilerShape( cur ), 0, tensorBytes( cur ) );
 	const size_t n = cur.countRows();
 	const size_t nc = cur.ne[ 0 ];
 	const size_t nr = cur.ne[ 1 ];
@@ -324,9 +432,126 @@ void MlContext::softMax( Tensor& cur, float inputScale )
 	context.stride = cur.nb[ 1 ];
 
 	const size_t n = cur.countRows();
+	auto prof = profileOp( eCpuOp::softMax, profilerShape( cur ), 0, tensorBytes( cur ) * 2 );
 	pfor.parallelFor( context, n );
 }
 
+Tensor MlContext::attention( const Tensor& q, const AttentionCache& kv, bool causal, uint32_t n_past )
+{
+	if( q.type() != eDataType::FP32 || !q.isContinuous() )
+		throw E_INVALIDARG;
+	const uint32_t n_state = q.ne[ 0 ];
+	if( n_state != kv.n_head * kv.headDim || 0 == kv.length )
+		throw E_INVALIDARG;
+	if( causal && n_past + q.ne[ 1 ] > kv.length )
+		throw E_BOUNDS;
+
+	struct AttentionContext : public iComputeRange
+	{
+		float* result;
+		const float* q;
+		const AttentionCache* kv;
+		const DirectCompute::LookupTablesData* lookup;
+		size_t n_state, n_past;
+		bool causal;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			ALIGNED_SPAN( scores, attentionBlockLength );
+			const size_t n_head = kv->n_head;
+			const size_t headDim = kv->headDim;
+			const size_t scalesStride = kv->scalesHeadStride;
+			for( ; i < end; i++ )
+			{
+				const size_t head = i % n_head;
+				const size_t token = i / n_head;
+				const size_t offset = token * n_state + head * headDim;
+				// With causal mask, the query #token only attends to the keys [ 0 .. n_past + token ]
+				const size_t count = causal ? std::min( n_past + token + 1, (size_t)kv->length ) : kv->length;
+				// Keys and values of the head are dense matrices [ headDim, length ]
+				const size_t off = head * kv->headStride;
+				if( kv->perHeadScales )
+				{
+					attentionHeadInt8( result + offset, scores, q + offset,
+						(const int8_t*)kv->keys + off, kv->keyScales[ head ],
+						(const int8_t*)kv->values + off, kv->valueScales[ head ],
+						headDim, headDim, count, *lookup );
+				}
+				else if( kv->isInt8() )
+				{
+					attentionRowInt8( result + offset, scores, q + offset,
+						(const int8_t*)kv->keys + off, kv->keyScales + head * scalesStride,
+						(const int8_t*)kv->values + off, kv->valueScales + head * scalesStride,
+						headDim, headDim, count, *lookup );
+				}
+				else
+				{
+					attentionRow( result + offset, scores, q + offset,
+						(const uint16_t*)kv->keys + off, (const uint16_t*)kv->values + off, headDim, headDim, count, *lookup );
+				}
+			}
+			return S_OK;
+		}
+	};
+
+	Tensor res = createTensor( eDataType::FP32, { n_state, q.ne[ 1 ] } );
+
+	AttentionContext context;
+	context.result = res.fp32();
+	context.q = q.fp32();
+	context.kv = &kv;
+	context.lookup = &getLookupTables();
+	context.n_state = n_state;
+	context.n_past = n_past;
+	context.causal = causal;
+
+	// Count of the ( query, key ) pairs; each one costs 2 FLOPs per element for the dot product, and 2 more for the weighted sum of the values
+	const uint64_t N = q.ne[ 1 ];
+	const uint64_t pairs = causal ? N * n_past + N * ( N + 1 ) / 2 : N * kv.length;
+	const uint64_t flops = pairs * n_state * 4;
+	// Keys and values are loaded once per query, but all queries of the batch share the cache lines; the estimate counts them once
+	const uint64_t keys = causal ? n_past + N : kv.length;
+	const uint64_t bytes = keys * n_state * ( kv.isInt8() ? 2 : 4 ) + tensorBytes( q ) * 2;
+	auto prof = profileOp( eCpuOp::attention, { n_state, q.ne[ 1 ], (uint32_t)keys }, flops, bytes );
+
+	const size_t n = (size_t)q.ne[ 1 ] * kv.n_head;
+	check( pfor.parallelFor( context, n ) );
+	return res;
+}
+
+void MlContext::storeHeads( KvTensors& cache, const Tensor& keys, const Tensor& values, uint32_t length )
+{
+	if( keys.type() != eDataType::FP16 || values.type() != eDataType::FP16 || !keys.isContinuous() || !values.isContinuous() )
+		throw E_INVALIDARG;
+	if( !isSameShape( keys, values ) )
+		throw E_INVALIDARG;
+
+	struct StoreContext : public iComputeRange
+	{
+		KvTensors* cache;
+		const uint16_t* keys;
+		const uint16_t* values;
+		uint32_t length;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			for( ; i < end; i++ )
+				cache->storeHead( (uint32_t)i, keys, values, length );
+			return S_OK;
+		}
+	};
+
+	StoreContext context;
+	context.cache = &cache;
+	context.keys = keys.fp16();
+	context.values = values.fp16();
+	context.length = length;
+
+	const uint64_t bytes = tensorBytes( keys ) * 2 + tensorBytes( values ) * 2;
+	auto prof = profileOp( eCpuOp::copy, profilerShape( keys ), 0, bytes );
+	check( pfor.parallelFor( context, cache.countHeads() ) );
+}
+
 namespace
 {
 	template<class R, class S>
@@ -407,6 +632,7 @@ HRESULT MlContext::copyImpl( Tensor& result, const Tensor& source )
 {
 	if( !( result.isContinuous() && ( result.countElements() == source.countElements() ) ) )
 		return E_INVALIDARG;
+	auto prof = profileOp( eCpuOp::copy, profilerShape( result ), 0, tensorBytes( result ) + tensorBytes( source ) );
 
 	const eDataType typeResult = result.type();
 	const eDataType typeSource = source.type();
@@ -554,6 +780,7 @@ void MlContext::addInPlace( Tensor& a, const Tensor& b )
 		throw E_NOTIMPL;
 
 	const size_t length = a.countElements();
+	auto prof = profileOp( eCpuOp::addInPlace, profilerShape( a ), 0, tensorBytes( a ) * 3 );
 	addRowInPlace( a.fp32(), b.fp32(), length );
 }
 
@@ -564,6 +791,7 @@ Tensor MlContext::add( const Tensor& a, const Tensor& b )
 
 	Tensor res = createTensor( eDataType::FP32, a.ne );
 	const size_t length = a.countElements();
+	auto prof = profileOp( eCpuOp::add, profilerShape( a ), 0, tensorBytes( a ) * 3 );
 	addRow( res.fp32(), a.fp32(), b.fp32(), length );
 	return res;
 }
@@ -574,6 +802,7 @@ void MlContext::addRepeatGelu( Tensor& cur, const Tensor& b )
 		throw E_INVALIDARG;
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
+	auto prof = profileOp( eCpuOp::addRepeatGelu, profilerShape( cur ), 0, tensorBytes( cur ) * 2 + tensorBytes( b ) );
 
 	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
 	std::array<uint32_t, 3> idx = { 0, 0, 0 };
@@ -125,6 +125,8 @@ HRESULT ParallelForRunner::parallelFor( iComputeRange& compute, size_t length, s
 
 	size_t nth = length / minBatch;
 	nth = std::min( nth, (size_t)(uint32_t)maxThreads );
+	// When the length is smaller than the batch, the calling thread does all the work
+	nth = std::max( nth, (size_t)1 );
 
 	computeRange = &compute;
 	countItems = length;
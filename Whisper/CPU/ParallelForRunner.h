@@ -19,6 +19,11 @@ namespace CpuCompute
 
 		HRESULT setThreadsCount( int threads );
 
+		int threadsCount() const
+		{
+			return maxThreads;
+		}
+
 		HRESULT parallelFor( iComputeRange& compute, size_t length, size_t minBatch = 1 );
 
 		// Allocate a temporary buffer for the calling thread.
@@ -95,6 +95,18 @@ namespace CpuCompute
 			assert( nullptr != m_data );
 			return (uint16_t*)m_data;
 		}
+		uint16_t* bf16()
+		{
+			assert( m_type == eDataType::BF16 );
+			assert( nullptr != m_data );
+			return (uint16_t*)m_data;
+		}
+		const uint16_t* bf16() const
+		{
+			assert( m_type == eDataType::BF16 );
+			assert( nullptr != m_data );
+			return (uint16_t*)m_data;
+		}
 		float* fp32()
 		{
 			assert( m_type == eDataType::FP32 );
@@ -0,0 +1,50 @@
+#include "stdafx.h"
+#include "benchmarkUtils.h"
+#include "simdUtils.h"
+#include <intrin.h>
+
+void CpuCompute::fillRandom( float* rdi, size_t length, uint32_t seed )
+{
+	for( size_t i = 0; i < length; i++ )
+	{
+		seed = seed * 1664525u + 1013904223u;
+		rdi[ i ] = (float)(int)( seed >> 8 ) * ( 1.0f / (float)( 1 << 23 ) ) - 1.0f;
+	}
+}
+
+void CpuCompute::fillRandomHalfs( uint16_t* rdi, size_t length, uint32_t seed )
+{
+	constexpr size_t chunk = 1024;
+	std::array<float, chunk> temp;
+	for( size_t i = 0; i < length; i += chunk )
+	{
+		const size_t len = std::min( chunk, length - i );
+		fillRandom( temp.data(), len, seed + (uint32_t)i );
+		floatsDowncast( rdi + i, temp.data(), len );
+	}
+}
+
+CStringA CpuCompute::cpuBrand()
+{
+	char name[ 49 ] = {};
+	std::array<int, 4> info;
+	__cpuid( info.data(), 0x80000000 );
+	if( (uint32_t)info[ 0 ] >= 0x80000004 )
+	{
+		for( int i = 0; i < 3; i++ )
+		{
+			__cpuid( info.data(), 0x80000002 + i );
+			memcpy( name + i * 16, info.data(), 16 );
+		}
+	}
+	CStringA res = name;
+	res.Trim();
+	return res;
+}
+
+uint32_t CpuCompute::cpuSignature()
+{
+	std::array<int, 4> info;
+	__cpuid( info.data(), 1 );
+	return (uint32_t)info[ 0 ];
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <atlstr.h>
+
+// Utilities shared by the kernels benchmark and the tuner of the matrix multiplication
+namespace CpuCompute
+{
+	// The decoder streams weights of all layers, a single matrix repeated in a loop would stay in the last level cache.
+	// The benchmarks cycle through copies of the weights with at least this total size.
+	constexpr size_t weightsPoolBytes = 1 << 26;
+
+	// Count of copies of the FP16 weights matrix in the pool
+	inline size_t weightsPoolCopies( size_t weightElements )
+	{
+		return std::max( weightsPoolBytes / ( weightElements * 2 ), (size_t)1 );
+	}
+
+	// Pseudo-random values in [ -1 .. +1 ] interval, the exact distribution doesn't matter for the performance
+	void fillRandom( float* rdi, size_t length, uint32_t seed );
+
+	// Same values as fillRandom, downcasted to FP16
+	void fillRandomHalfs( uint16_t* rdi, size_t length, uint32_t seed );
+
+	// Brand string of the CPU, like "Intel(R) Core(TM) i7-xxx CPU @ 3.60GHz", or an empty string when the CPU doesn't report one
+	CStringA cpuBrand();
+
+	// Processor signature: family, model, and stepping; the brand strings are sometimes the same for different generations
+	uint32_t cpuSignature();
+}
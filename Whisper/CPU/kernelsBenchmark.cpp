@@ -0,0 +1,567 @@
+#include "stdafx.h"
+#include "../API/iContext.cl.h"
+#include "mulMat.h"
+#include "simdUtils.h"
+#include "LargeBuffer.h"
+#include "benchmarkUtils.h"
+#include "../Whisper/melSpectrogram.h"
+#include "../Utils/CpuProfiler.h"
+#include <atlfile.h>
+#include <atlstr.h>
+#include <intrin.h>
+#include <cmath>
+using namespace Whisper;
+using namespace CpuCompute;
+
+namespace
+{
+	struct ModelSize
+	{
+		const char* name;
+		uint32_t n_state;
+	};
+	static const std::array<ModelSize, 5> s_modelSizes =
+	{
+		ModelSize{ "tiny", 384 },
+		ModelSize{ "base", 512 },
+		ModelSize{ "small", 768 },
+		ModelSize{ "medium", 1024 },
+		ModelSize{ "large", 1280 },
+	};
+
+	// Count of columns in the activations: greedy decoder, beam search decoder with 5 beams, decoder prompt, and the encoder
+	static const std::array<uint32_t, 4> s_batchSizes = { 1, 5, 224, 1500 };
+
+	// Lengths of the softmax rows: decoder attention with the longest prompt, the complete text context, and the encoder attention
+	static const std::array<uint32_t, 3> s_softMaxLengths = { 224, 448, 1500 };
+
+	constexpr size_t minIterations = 5;
+	// Each timed sample repeats the kernel until it takes at least that long, otherwise the overhead of the timer itself is measurable for the small kernels
+	constexpr double minSampleSeconds = 20E-6;
+
+	// A dense FP32 or FP16 buffer with random values
+	class RandomBuffer
+	{
+		LargeBuffer buffer;
+
+	public:
+		HRESULT createFloats( size_t length, uint32_t seed )
+		{
+			CHECK( buffer.allocate( length * 4 ) );
+			fillRandom( floats(), length, seed );
+			return S_OK;
+		}
+
+		HRESULT createHalfs( size_t length, uint32_t seed )
+		{
+			CHECK( buffer.allocate( length * 2 ) );
+			fillRandomHalfs( halfs(), length, seed );
+			return S_OK;
+		}
+
+		float* floats() const { return (float*)buffer.pointer(); }
+		uint16_t* halfs() const { return (uint16_t*)buffer.pointer(); }
+	};
+
+	struct Result
+	{
+		CStringA name;
+		CStringA shape;
+		const char* model;
+		int threads;
+		// Nanoseconds per call, median and minimum of the samples
+		double ns, nsMin;
+		// Count of floating-point operations and bytes of memory traffic per call
+		double flops, bytes;
+		// Nanoseconds per call predicted by the roofline model, the minimum possible time
+		double nsRoofline;
+	};
+
+	// Throughput limits of this computer, measured with synthetic loads
+	struct Roofline
+	{
+		// FP32 FMA throughput, GFLOP/s
+		double gflops;
+		// Bandwidth of the system memory, GB/s
+		double bandwidth;
+
+		double minimumNanoseconds( double flops, double bytes ) const
+		{
+			// GFLOP/s and GB/s happen to be FLOPs and bytes per nanosecond
+			return std::max( flops / gflops, bytes / bandwidth );
+		}
+	};
+
+	// Multiply-add loop with 10 independent accumulators, enough to saturate 2 FMA units with 4 cycles latency
+	__declspec( noinline ) float fmaLoop( size_t iterations )
+	{
+		std::array<__m256, 10> acc;
+		for( size_t i = 0; i < acc.size(); i++ )
+			acc[ i ] = _mm256_set1_ps( (float)(int)i );
+		const __m256 a = _mm256_set1_ps( 0.999f );
+		const __m256 b = _mm256_set1_ps( 1E-3f );
+		for( size_t i = 0; i < iterations; i++ )
+		{
+			for( __m256& v : acc )
+				v = _mm256_fmadd_ps( v, a, b );
+		}
+		__m256 res = acc[ 0 ];
+		for( size_t i = 1; i < acc.size(); i++ )
+			res = _mm256_add_ps( res, acc[ i ] );
+		return _mm256_cvtss_f32( res );
+	}
+	constexpr double fmaLoopFlops = 10 * 8 * 2;
+
+	// Sum of FP32 numbers in the buffer, with 4 accumulators to hide the latency of the additions
+	__declspec( noinline ) float readLoop( const float* rsi, size_t length )
+	{
+		__m256 a0 = _mm256_setzero_ps(), a1 = a0, a2 = a0, a3 = a0;
+		const float* const rsiEnd = rsi + length;
+		for( ; rsi < rsiEnd; rsi += 32 )
+		{
+			a0 = _mm256_add_ps( a0, _mm256_load_ps( rsi ) );
+			a1 = _mm256_add_ps( a1, _mm256_load_ps( rsi + 8 ) );
+			a2 = _mm256_add_ps( a2, _mm256_load_ps( rsi + 16 ) );
+			a3 = _mm256_add_ps( a3, _mm256_load_ps( rsi + 24 ) );
+		}
+		a0 = _mm256_add_ps( _mm256_add_ps( a0, a1 ), _mm256_add_ps( a2, a3 ) );
+		return _mm256_cvtss_f32( a0 );
+	}
+
+	class Benchmark
+	{
+		const sCpuBenchmarkParams& params;
+		ParallelForRunner pfor;
+		// Roofline of a single core for the single-threaded kernels, and of all threads for the rest of them
+		Roofline rooflineSingle, rooflineMulti;
+		std::vector<Result> results;
+		std::vector<double> samples;
+		double nsPerTick;
+		// Prevents the compiler from optimizing away the synthetic loads
+		volatile float sink = 0;
+
+		bool enabled( const char* name ) const
+		{
+			if( nullptr == params.filter || 0 == *params.filter )
+				return true;
+			CStringA n = name, f = params.filter;
+			n.MakeLower();
+			f.MakeLower();
+			return n.Find( f ) >= 0;
+		}
+
+		// Run the function repeatedly, measure the median and minimum time per call
+		template<class Fn>
+		HRESULT measure( Result& r, Fn&& fn )
+		{
+			// Warmup: faults in the pages of the buffers, launches threads of the pool, and calibrates the count of calls per sample
+			int64_t t0 = tscNow();
+			CHECK( fn() );
+			const double nsFirst = (double)( tscNow() - t0 ) * nsPerTick;
+			const size_t repeats = std::max( (size_t)( minSampleSeconds * 1E9 / std::max( nsFirst, 1.0 ) ), (size_t)1 );
+
+			samples.clear();
+			const double nsBudget = (double)params.minMilliseconds * 1E6;
+			const int64_t started = tscNow();
+			while( samples.size() < minIterations || (double)( tscNow() - started ) * nsPerTick < nsBudget )
+			{
+				t0 = tscNow();
+				for( size_t i = 0; i < repeats; i++ )
+					CHECK( fn() );
+				samples.push_back( (double)( tscNow() - t0 ) * nsPerTick / (double)(int64_t)repeats );
+			}
+
+			std::sort( samples.begin(), samples.end() );
+			r.ns = samples[ samples.size() / 2 ];
+			r.nsMin = samples.front();
+			const Roofline& roofline = ( r.threads > 1 ) ? rooflineMulti : rooflineSingle;
+			r.nsRoofline = roofline.minimumNanoseconds( r.flops, r.bytes );
+			print( r );
+			results.push_back( std::move( r ) );
+			return S_OK;
+		}
+
+		void print( const Result& r ) const
+		{
+			const double gflops = r.flops / r.ns;
+			const double gbs = r.bytes / r.ns;
+			const double percent = r.nsRoofline * 100.0 / r.ns;
+			logInfo( u8"%s\t%s\t%s\t%.1f ns, %.1f GFLOP/s, %.1f GB/s, %.1f%% of roofline",
+				r.name.GetString(), r.model, r.shape.GetString(), r.ns, gflops, gbs, percent );
+		}
+
+		HRESULT measureRoofline( size_t threads, Roofline& rdi );
+		HRESULT benchMulMat();
+		HRESULT benchNorm();
+		HRESULT benchSoftMax();
+		HRESULT benchAddRepeatGelu();
+		HRESULT benchFloatsUpcast();
+		HRESULT benchFft();
+		HRESULT saveJson( LPCTSTR path ) const;
+
+	public:
+		Benchmark( const sCpuBenchmarkParams& bp ) :
+			params( bp ), pfor( bp.threads )
+		{
+			nsPerTick = 1E9 / (double)(int64_t)tscFrequency();
+		}
+
+		HRESULT run()
+		{
+			CHECK( measureRoofline( 1, rooflineSingle ) );
+			CHECK( measureRoofline( (size_t)params.threads, rooflineMulti ) );
+			CHECK( benchMulMat() );
+			CHECK( benchNorm() );
+			CHECK( benchSoftMax() );
+			CHECK( benchAddRepeatGelu() );
+			CHECK( benchFloatsUpcast() );
+			CHECK( benchFft() );
+			if( nullptr != params.jsonPath )
+				CHECK( saveJson( params.jsonPath ) );
+			return S_OK;
+		}
+	};
+
+	HRESULT Benchmark::measureRoofline( size_t threads, Roofline& rdi )
+	{
+		// Compute throughput: every thread of the pool runs the FMA loop
+		struct FmaJob : public iComputeRange
+		{
+			size_t iterations;
+			Benchmark* benchmark;
+			HRESULT __stdcall compute( size_t i, size_t end ) const override final
+			{
+				for( ; i < end; i++ )
+					benchmark->sink = fmaLoop( iterations );
+				return S_OK;
+			}
+		};
+		FmaJob fma;
+		fma.iterations = 1 << 22;
+		fma.benchmark = this;
+
+		double best = INFINITY;
+		for( int i = 0; i < 5; i++ )
+		{
+			const int64_t t0 = tscNow();
+			CHECK( pfor.parallelFor( fma, threads ) );
+			best = std::min( best, (double)( tscNow() - t0 ) * nsPerTick );
+		}
+		rdi.gflops = fmaLoopFlops * (double)fma.iterations * (double)threads / best;
+
+		// Memory bandwidth: the threads read slices of a buffer much larger than the caches
+		struct ReadJob : public iComputeRange
+		{
+			const float* buffer;
+			size_t sliceLength;
+			Benchmark* benchmark;
+			HRESULT __stdcall compute( size_t i, size_t end ) const override final
+			{
+				for( ; i < end; i++ )
+					benchmark->sink = readLoop( buffer + i * sliceLength, sliceLength );
+				return S_OK;
+			}
+		};
+		constexpr size_t readBytes = (size_t)1 << 28;
+		RandomBuffer memory;
+		CHECK( memory.createFloats( readBytes / 4, 1 ) );
+		ReadJob read;
+		read.buffer = memory.floats();
+		read.sliceLength = ( readBytes / 4 / threads ) & ~(size_t)31;
+		read.benchmark = this;
+
+		best = INFINITY;
+		for( int i = 0; i < 5; i++ )
+		{
+			const int64_t t0 = tscNow();
+			CHECK( pfor.parallelFor( read, threads ) );
+			best = std::min( best, (double)( tscNow() - t0 ) * nsPerTick );
+		}
+		rdi.bandwidth = (double)( read.sliceLength * threads * 4 ) / best;
+
+		logInfo( u8"Roofline estimate with %zu threads: %.1f GFLOP/s, %.1f GB/s", threads, rdi.gflops, rdi.bandwidth );
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchMulMat()
+	{
+		if( !enabled( "mulMat" ) )
+			return S_OK;
+
+		struct Weights
+		{
+			const char* name;
+			// Multipliers of n_state for the length of the dot products, and count of the output rows
+			uint32_t length, rows;
+		};
+		// Projections of the attention blocks, and both layers of the MLP blocks
+		static const std::array<Weights, 3> s_weights =
+		{
+			Weights{ "attn", 1, 1 },
+			Weights{ "mlp.0", 1, 4 },
+			Weights{ "mlp.2", 4, 1 },
+		};
+
+		for( const ModelSize& ms : s_modelSizes )
+		{
+			for( const Weights& w : s_weights )
+			{
+				const uint32_t length = ms.n_state * w.length;
+				const uint32_t rows = ms.n_state * w.rows;
+				const size_t weightElements = (size_t)length * rows;
+				const size_t countCopies = weightsPoolCopies( weightElements );
+				RandomBuffer weights;
+				CHECK( weights.createHalfs( weightElements * countCopies, 2 ) );
+
+				for( uint32_t n : s_batchSizes )
+				{
+					RandomBuffer activations, output;
+					CHECK( activations.createFloats( (size_t)length * n, 3 ) );
+					CHECK( output.createFloats( (size_t)rows * n, 4 ) );
+
+					Tensor b, res;
+					CHECK( b.attach( activations.floats(), eDataType::FP32, { length, n } ) );
+					CHECK( res.attach( output.floats(), eDataType::FP32, { rows, n } ) );
+					std::vector<Tensor> a( countCopies );
+					for( size_t i = 0; i < countCopies; i++ )
+						CHECK( a[ i ].attach( weights.halfs() + i * weightElements, eDataType::FP16, { length, rows } ) );
+
+					Result r;
+					r.name.Format( "mulMat.%s", w.name );
+					r.shape.Format( "[ %u, %u ] * [ %u, %u ]", length, rows, length, n );
+					r.model = ms.name;
+					r.threads = params.threads;
+					r.flops = 2.0 * (double)weightElements * n;
+					r.bytes = (double)( weightElements * 2 + (size_t)length * n * 4 + (size_t)rows * n * 4 );
+
+					size_t next = 0;
+					CHECK( measure( r, [ & ]()
+						{
+							const Tensor& src = a[ next ];
+							next = ( next + 1 ) % countCopies;
+							return mulMat( res, src, b, pfor );
+						} ) );
+				}
+			}
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchNorm()
+	{
+		if( !enabled( "norm" ) )
+			return S_OK;
+
+		for( const ModelSize& ms : s_modelSizes )
+		{
+			for( uint32_t n : s_batchSizes )
+			{
+				const size_t length = ms.n_state;
+				RandomBuffer src, dst;
+				CHECK( src.createFloats( length * n, 5 ) );
+				CHECK( dst.createFloats( length * n, 6 ) );
+				std::vector<float> tempBuffer( tempBufferForFloats( length ) / 4 );
+				AlignedSpan temp{ tempBuffer.data() };
+
+				Result r;
+				r.name = "norm";
+				r.shape.Format( "[ %zu, %u ]", length, n );
+				r.model = ms.name;
+				r.threads = 1;
+				// Sum, subtract the mean, sum of squares, scale
+				r.flops = 5.0 * (double)( length * n );
+				r.bytes = 8.0 * (double)( length * n );
+
+				CHECK( measure( r, [ & ]()
+					{
+						for( size_t i = 0; i < n; i++ )
+							::norm( dst.floats() + i * length, temp, src.floats() + i * length, length );
+						return S_OK;
+					} ) );
+			}
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchSoftMax()
+	{
+		if( !enabled( "softMax" ) )
+			return S_OK;
+
+		// Count of rows for every call, one row for each head of the attention in the large model
+		constexpr uint32_t rows = 20;
+		for( uint32_t length : s_softMaxLengths )
+		{
+			RandomBuffer buffer;
+			CHECK( buffer.createFloats( (size_t)length * rows, 7 ) );
+
+			Result r;
+			r.name = "softMax";
+			r.shape.Format( "[ %u, %u ]", length, rows );
+			r.model = "";
+			r.threads = 1;
+			// Maximum, scale and subtract, exponent, sum, normalize
+			r.flops = 5.0 * length * rows;
+			r.bytes = 8.0 * length * rows;
+
+			// The function works in-place; after the first call the rows contain probabilities, the performance doesn't depend on the values
+			CHECK( measure( r, [ & ]()
+				{
+					for( size_t i = 0; i < rows; i++ )
+						softMax( buffer.floats() + i * length, length, 0.125f );
+					return S_OK;
+				} ) );
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchAddRepeatGelu()
+	{
+		if( !enabled( "addRepeatGeluRow" ) )
+			return S_OK;
+
+		const DirectCompute::LookupTablesData& lookup = getLookupTables();
+		for( const ModelSize& ms : s_modelSizes )
+		{
+			for( uint32_t n : s_batchSizes )
+			{
+				// Bias and activation of the first layer of the MLP blocks
+				const size_t lenPattern = (size_t)ms.n_state * 4;
+				const size_t length = lenPattern * n;
+				RandomBuffer buffer, bias;
+				CHECK( buffer.createFloats( length, 8 ) );
+				CHECK( bias.createFloats( lenPattern, 9 ) );
+
+				Result r;
+				r.name = "addRepeatGeluRow";
+				r.shape.Format( "[ %zu, %u ]", lenPattern, n );
+				r.model = ms.name;
+				r.threads = 1;
+				r.flops = 2.0 * (double)length;
+				r.bytes = 8.0 * (double)length;
+
+				// The function is in-place, the values drift with every call but the lookup table makes the performance independent of them
+				CHECK( measure( r, [ & ]()
+					{
+						addRepeatGeluRow( buffer.floats(), length, bias.floats(), lenPattern, lookup );
+						return S_OK;
+					} ) );
+			}
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchFloatsUpcast()
+	{
+		if( !enabled( "floatsUpcast" ) )
+			return S_OK;
+
+		for( const ModelSize& ms : s_modelSizes )
+		{
+			for( uint32_t n : s_batchSizes )
+			{
+				const size_t length = (size_t)ms.n_state * n;
+				RandomBuffer src, dst;
+				CHECK( src.createHalfs( length, 10 ) );
+				CHECK( dst.createFloats( length, 11 ) );
+
+				Result r;
+				r.name = "floatsUpcast";
+				r.shape.Format( "[ %u, %u ]", ms.n_state, n );
+				r.model = ms.name;
+				r.threads = 1;
+				r.flops = 0;
+				r.bytes = 6.0 * (double)length;
+
+				CHECK( measure( r, [ & ]()
+					{
+						floatsUpcast( dst.floats(), src.halfs(), length );
+						return S_OK;
+					} ) );
+			}
+		}
+		return S_OK;
+	}
+
+	HRESULT Benchmark::benchFft()
+	{
+		if( !enabled( "fft" ) )
+			return S_OK;
+
+		constexpr uint32_t n_fft = 1 + FFT_SIZE / 2;
+		Filters filters;
+		filters.n_mel = N_MEL;
+		filters.n_fft = n_fft;
+		filters.data.resize( (size_t)N_MEL * n_fft );
+		fillRandom( filters.data.data(), filters.data.size(), 12 );
+		for( float& f : filters.data )
+			f = std::abs( f );
+
+		// One second of audio, the spectrogram computes 100 frames of it
+		constexpr size_t countFrames = 100;
+		constexpr size_t countSamples = countFrames * FFT_STEP + FFT_SIZE;
+		RandomBuffer pcm;
+		CHECK( pcm.createFloats( countSamples, 13 ) );
+
+		SpectrogramContext context{ filters };
+		std::array<float, N_MEL> mel;
+
+		Result r;
+		r.name = "fft";
+		r.shape.Format( "[ %u, %zu ]", FFT_SIZE, countFrames );
+		r.model = "";
+		r.threads = 1;
+		// 5 N log2( N ) for the radix-2 complex FFT, and the dot products with the mel filters
+		r.flops = (double)countFrames * ( 5.0 * FFT_SIZE * std::log2( (double)FFT_SIZE ) + 2.0 * N_MEL * n_fft );
+		r.bytes = (double)( countSamples * 4 + (size_t)N_MEL * n_fft * 4 );
+
+		return measure( r, [ & ]()
+			{
+				for( size_t i = 0; i < countFrames; i++ )
+					context.fft( mel, pcm.floats() + i * FFT_STEP, FFT_SIZE );
+				return S_OK;
+			} );
+	}
+
+	HRESULT Benchmark::saveJson( LPCTSTR path ) const
+	{
+		const CStringA name = cpuBrand();
+
+		CStringA json;
+		json.Preallocate( (int)( results.size() * 256 + 256 ) );
+		json.Format( "{\"cpu\":\"%s\",\"threads\":%i,\"roofline\":[{\"threads\":1,\"gflops\":%.2f,\"bandwidth\":%.2f},{\"threads\":%i,\"gflops\":%.2f,\"bandwidth\":%.2f}],\"results\":[\n",
+			name.GetString(), params.threads, rooflineSingle.gflops, rooflineSingle.bandwidth, params.threads, rooflineMulti.gflops, rooflineMulti.bandwidth );
+		for( size_t i = 0; i < results.size(); i++ )
+		{
+			const Result& r = results[ i ];
+			json.AppendFormat( "{\"name\":\"%s\",\"model\":\"%s\",\"shape\":\"%s\",\"threads\":%i,\"ns\":%.1f,\"nsMin\":%.1f,\"gflops\":%.3f,\"gbs\":%.3f,\"nsRoofline\":%.1f",
+				r.name.GetString(), r.model, r.shape.GetString(), r.threads, r.ns, r.nsMin, r.flops / r.ns, r.bytes / r.ns, r.nsRoofline );
+			json += ( i + 1 < results.size() ) ? "},\n" : "}\n";
+		}
+		json += "]}\n";
+
+		CAtlFile file;
+		CHECK( file.Create( path, GENERIC_WRITE, 0, CREATE_ALWAYS ) );
+		CHECK( file.Write( json.GetString(), (DWORD)json.GetLength() ) );
+		return S_OK;
+	}
+}
+
+HRESULT COMLIGHTCALL Whisper::benchmarkCpuKernels( const sCpuBenchmarkParams& params )
+{
+	if( params.threads < 1 )
+	{
+		logError( u8"%s parameter %i is out of range", "threads", params.threads );
+		return E_INVALIDARG;
+	}
+
+	try
+	{
+		Benchmark benchmark{ params };
+		return benchmark.run();
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+}
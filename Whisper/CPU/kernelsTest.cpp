@@ -0,0 +1,300 @@
+#include "stdafx.h"
+#include "../API/iContext.cl.h"
+#include "mulMat.h"
+#include "mulMatTuner.h"
+#include "mulMatJit.h"
+#include "simdUtils.h"
+#include "benchmarkUtils.h"
+#include <atlstr.h>
+#include <cmath>
+using namespace Whisper;
+using namespace CpuCompute;
+
+// Tests of the CPU kernels against scalar reference implementations, exported from the DLL as testCpuKernels function.
+// The shapes are small and deliberately odd, to exercise the remainders: incomplete blocks of rows, partial tiles, and the lengths which aren't multiples of the vectors.
+namespace
+{
+	// Enough threads to split the products into several ranges, the results must not depend on the count
+	constexpr int testThreads = 4;
+
+	// Shape of the product: length of the dot products, count of the output rows, and count of the columns in the second matrix
+	struct ProductShape
+	{
+		uint32_t length, rows, columns;
+	};
+
+	// Compare the product with the reference computed in FP64.
+	// The error of every element is relative to the sum of absolute values of the products in that dot product, the scale of the rounding errors.
+	struct ProductCheck
+	{
+		std::vector<double> reference;
+		std::vector<double> scale;
+
+		// The first matrix is row major [ length, rows ] FP32, the second one is [ length, columns ] FP32
+		void compute( const float* a, const float* b, const ProductShape& shape )
+		{
+			reference.resize( (size_t)shape.rows * shape.columns );
+			scale.resize( reference.size() );
+			for( uint32_t c = 0; c < shape.columns; c++ )
+			{
+				const float* const column = b + (size_t)c * shape.length;
+				for( uint32_t r = 0; r < shape.rows; r++ )
+				{
+					const float* const row = a + (size_t)r * shape.length;
+					double sum = 0, sumAbs = 0;
+					for( uint32_t i = 0; i < shape.length; i++ )
+					{
+						const double p = (double)row[ i ] * (double)column[ i ];
+						sum += p;
+						sumAbs += std::abs( p );
+					}
+					const size_t idx = (size_t)c * shape.rows + r;
+					reference[ idx ] = sum;
+					scale[ idx ] = std::max( sumAbs, 1E-6 );
+				}
+			}
+		}
+
+		// Maximum relative error of the dense [ rows, columns ] output
+		double maxError( const float* result ) const
+		{
+			double res = 0;
+			for( size_t i = 0; i < reference.size(); i++ )
+			{
+				const double e = std::abs( (double)result[ i ] - reference[ i ] ) / scale[ i ];
+				if( !( e <= res ) )
+					res = e;	// NaN propagates as the maximum
+			}
+			return res;
+		}
+	};
+
+	class KernelsTest
+	{
+		const char* const filter;
+		ParallelForRunner pfor;
+		size_t countPassed = 0, countFailed = 0;
+
+		bool enabled( const char* name ) const
+		{
+			if( nullptr == filter || 0 == *filter )
+				return true;
+			CStringA n = name, f = filter;
+			n.MakeLower();
+			f.MakeLower();
+			return n.Find( f ) >= 0;
+		}
+
+		void check( bool passed, const char* what )
+		{
+			if( passed )
+			{
+				countPassed++;
+				logDebug( u8"%s: passed", what );
+			}
+			else
+			{
+				countFailed++;
+				logError( u8"%s: FAILED", what );
+			}
+		}
+
+		void checkProduct( const char* name, const ProductShape& shape, double error, double maxError )
+		{
+			CStringA what;
+			what.Format( "%s [ %u, %u ] * [ %u, %u ], relative error %g, the limit is %g", name, shape.length, shape.rows, shape.length, shape.columns, error, maxError );
+			check( error <= maxError, what );
+		}
+
+		HRESULT testMulMatBf16();
+		HRESULT testMulMatVariants( const char* name, const ProductShape& shape );
+		HRESULT testMulMatJit();
+		HRESULT testTuningTable();
+
+	public:
+		KernelsTest( const char* f ) :
+			filter( f ), pfor( testThreads )
+		{ }
+
+		HRESULT run()
+		{
+			CHECK( testMulMatBf16() );
+			CHECK( testMulMatJit() );
+			CHECK( testTuningTable() );
+
+			if( 0 != countFailed )
+			{
+				logError( u8"CPU kernels: %zu tests failed, %zu passed", countFailed, countPassed );
+				return E_FAIL;
+			}
+			logInfo( u8"CPU kernels: all %zu tests passed", countPassed );
+			return S_OK;
+		}
+	};
+
+	static const std::array<ProductShape, 6> s_bf16Shapes =
+	{ {
+		// Single dot product, shorter than a vector
+		{ 5, 1, 1 },
+		// Incomplete blocks of rows, and the remainders of the AVX2 and AVX512 loops
+		{ 37, 7, 3 },
+		{ 100, 13, 2 },
+		// Decoder of the tiny model, a single token and a short prompt
+		{ 384, 64, 1 },
+		{ 384, 17, 5 },
+		// The second layer of the MLP
+		{ 1536, 9, 2 },
+	} };
+
+	HRESULT KernelsTest::testMulMatBf16()
+	{
+		if( !enabled( "mulMatBf16" ) )
+			return S_OK;
+
+		// With AVX512_BF16, the kernel rounds the second matrix to BF16, 8 bits of mantissa; otherwise it upcasts the first one, and the products are exact
+		const double maxError = hasNativeBf16() ? 1.0 / 256 : 1E-5;
+
+		for( const ProductShape& shape : s_bf16Shapes )
+		{
+			const size_t elementsA = (size_t)shape.length * shape.rows;
+			const size_t elementsB = (size_t)shape.length * shape.columns;
+			std::vector<float> a( elementsA ), b( elementsB ), result( (size_t)shape.rows * shape.columns );
+			std::vector<uint16_t> a16( elementsA );
+			fillRandom( a.data(), elementsA, 5 );
+			fillRandom( b.data(), elementsB, 6 );
+			// The reference uses the weights after the rounding, BF16 to FP32 upcast is exact
+			floatsToBf16( a16.data(), a.data(), elementsA );
+			for( size_t i = 0; i < elementsA; i++ )
+			{
+				const uint32_t bits = (uint32_t)a16[ i ] << 16;
+				memcpy( &a[ i ], &bits, 4 );
+			}
+
+			ProductCheck reference;
+			reference.compute( a.data(), b.data(), shape );
+
+			Tensor ta, tb, tr;
+			CHECK( ta.attach( a16.data(), eDataType::BF16, { shape.length, shape.rows } ) );
+			CHECK( tb.attach( b.data(), eDataType::FP32, { shape.length, shape.columns } ) );
+			CHECK( tr.attach( result.data(), eDataType::FP32, { shape.rows, shape.columns } ) );
+			std::fill( result.begin(), result.end(), NAN );
+			CHECK( mulMatBf16( tr, ta, tb, pfor ) );
+			checkProduct( "mulMatBf16", shape, reference.maxError( result.data() ), maxError );
+		}
+
+		// The shapes which don't match must be rejected before the kernel reads anything
+		std::array<uint16_t, 64> a16 = {};
+		std::array<float, 64> b = {}, result = {};
+		Tensor ta, tb, tr;
+		CHECK( ta.attach( a16.data(), eDataType::BF16, { 8, 4 } ) );
+		CHECK( tb.attach( b.data(), eDataType::FP32, { 8, 2 } ) );
+		CHECK( tr.attach( result.data(), eDataType::FP32, { 3, 2 } ) );
+		check( FAILED( mulMatBf16( tr, ta, tb, pfor ) ), "mulMatBf16 rejects the output of the wrong shape" );
+		return S_OK;
+	}
+
+	// Instantiations of MulMatImpl template in mulMatImpl.cpp, in the format of MulMatVariant: panelHeightRegs, tileWidthFloats, minBatch
+	static const std::array<MulMatVariant, 8> s_mulMatVariants =
+	{ {
+		{ 1, 1, 1 }, { 4, 1, 1 },
+		{ 1, 2, 1 }, { 4, 2, 1 },
+		{ 1, 3, 1 }, { 2, 3, 1 },
+		{ 1, 4, 1 }, { 2, 4, 1 },
+	} };
+
+	// Lengths of the dot products: shorter than a vector, the longest one which the generator unrolls completely, a remainder of the unrolled loop, and the decoder of the tiny model.
+	// 37 rows are incomplete panels of all heights, the column counts are partial tiles of all widths.
+	static const std::array<uint32_t, 4> s_jitLengths = { 7, 32, 100, 384 };
+	static const std::array<uint32_t, 4> s_jitColumns = { 1, 3, 5, 13 };
+	constexpr uint32_t jitRows = 37;
+
+	// Run the product with every instantiation of MulMatImpl, and compare with the reference
+	HRESULT KernelsTest::testMulMatVariants( const char* name, const ProductShape& shape )
+	{
+		const size_t elementsA = (size_t)shape.length * shape.rows;
+		const size_t elementsB = (size_t)shape.length * shape.columns;
+		std::vector<float> a( elementsA ), b( elementsB ), result( (size_t)shape.rows * shape.columns );
+		std::vector<uint16_t> a16( elementsA );
+		fillRandomHalfs( a16.data(), elementsA, 7 );
+		floatsUpcast( a.data(), a16.data(), elementsA );
+		fillRandom( b.data(), elementsB, 8 );
+
+		ProductCheck reference;
+		reference.compute( a.data(), b.data(), shape );
+
+		Tensor ta, tb, tr;
+		CHECK( ta.attach( a16.data(), eDataType::FP16, { shape.length, shape.rows } ) );
+		CHECK( tb.attach( b.data(), eDataType::FP32, { shape.length, shape.columns } ) );
+		CHECK( tr.attach( result.data(), eDataType::FP32, { shape.rows, shape.columns } ) );
+
+		// FP16 to FP32 upcast is exact, the only errors are from the FP32 accumulators
+		constexpr double maxError = 1E-4;
+		for( const MulMatVariant& v : s_mulMatVariants )
+		{
+			std::fill( result.begin(), result.end(), NAN );
+			CHECK( mulMatVariant( v, tr, ta, tb, pfor ) );
+			CStringA what;
+			what.Format( "%s, MulMatImpl<%i, %i>", name, (int)v.panelHeightRegs, (int)v.tileWidthFloats );
+			checkProduct( what, shape, reference.maxError( result.data() ), maxError );
+		}
+		return S_OK;
+	}
+
+	HRESULT KernelsTest::testMulMatJit()
+	{
+		if( !enabled( "mulMatJit" ) )
+			return S_OK;
+
+		for( uint32_t length : s_jitLengths )
+		{
+			// Same products with the kernels from mulMat.kernel.hpp, then with the generated ones.
+			// The generated code lives until the process exits, the built-in kernels are only tested for the lengths which weren't compiled yet.
+			if( 0 == jitFlavour( length ) )
+			{
+				for( uint32_t columns : s_jitColumns )
+					CHECK( testMulMatVariants( "mulMat", ProductShape{ length, jitRows, columns } ) );
+			}
+
+			CHECK( jitCompileMulMat( &length, 1 ) );
+			CStringA what;
+			what.Format( "mulMatJit generated the kernels for length %u", length );
+			check( 0 != jitFlavour( length ), what );
+
+			for( uint32_t columns : s_jitColumns )
+				CHECK( testMulMatVariants( "mulMatJit", ProductShape{ length, jitRows, columns } ) );
+		}
+		return S_OK;
+	}
+
+	HRESULT KernelsTest::testTuningTable()
+	{
+		if( !enabled( "tuningCache" ) )
+			return S_OK;
+
+		// A new directory in %TEMP%, the cache of the real tuning results stays untouched
+		wchar_t temp[ MAX_PATH ];
+		const DWORD len = GetTempPathW( MAX_PATH, temp );
+		if( 0 == len || len >= MAX_PATH )
+			return HRESULT_FROM_WIN32( ERROR_ENVVAR_NOT_FOUND );
+		CString dir;
+		dir.Format( L"%sWhisper-selfTest-%u", temp, GetCurrentProcessId() );
+
+		const HRESULT hr = CpuCompute::testTuningCache( dir );
+		CHECK( hr );
+		check( S_OK == hr, "tuningCache: save and load the table of the tuned variants" );
+		return S_OK;
+	}
+}
+
+HRESULT COMLIGHTCALL Whisper::testCpuKernels( const char* filter )
+{
+	try
+	{
+		KernelsTest test{ filter };
+		return test.run();
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+}
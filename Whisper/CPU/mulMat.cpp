@@ -1,54 +1,159 @@
 ﻿#include "stdafx.h"
 #include "mulMat.h"
 #include "mulMatImpl.h"
+#include "mulMatTuner.h"
+#include "simdUtils.h"
 using namespace CpuCompute;
 
 namespace
 {
 	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
-	static HRESULT mulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor )
+	static HRESULT mulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue, size_t minBatch )
 	{
-		MulMatImpl<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor };
-		return impl.run( pfor );
+		MulMatImpl<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor, epilogue };
+		return impl.run( pfor, minBatch );
+	}
+
+	HRESULT validateEpilogue( const Tensor& result, const MulMatEpilogue& ep )
+	{
+		if( !result.isContinuous() )
+			return E_NOTIMPL;
+		if( nullptr != ep.bias )
+		{
+			const Tensor& bias = *ep.bias;
+			if( bias.type() != eDataType::FP32 || bias.nb[ 0 ] != 1 || bias.ne[ 0 ] != result.ne[ 0 ] )
+				return E_INVALIDARG;
+		}
+		if( nullptr != ep.residual )
+		{
+			// Same shape and both continuous means same memory layout, the kernels use the same offsets for output and residual
+			const Tensor& residual = *ep.residual;
+			if( residual.type() != eDataType::FP32 || !residual.isContinuous() || !DirectCompute::isSameShape( residual, result ) )
+				return E_INVALIDARG;
+		}
+		return S_OK;
+	}
+
+	// Apply the epilogue in a separate pass over the output, for the implementations which don't support fused epilogues
+	HRESULT applyEpilogue( Tensor& result, const MulMatEpilogue& ep, ParallelForRunner& pfor )
+	{
+		struct EpilogueContext : public iComputeRange
+		{
+			float* result;
+			const float* bias;
+			const float* residual;
+			const DirectCompute::LookupTablesData* gelu;
+			float scale;
+			size_t length;
+
+			HRESULT __stdcall compute( size_t i, size_t end ) const override final
+			{
+				for( ; i < end; i++ )
+				{
+					const size_t off = i * length;
+					epilogueRow( result + off, length, bias, scale, gelu, ( nullptr != residual ) ? residual + off : nullptr );
+				}
+				return S_OK;
+			}
+		};
+
+		EpilogueContext context;
+		context.result = result.fp32();
+		context.bias = ( nullptr != ep.bias ) ? ep.bias->fp32() : nullptr;
+		context.residual = ( nullptr != ep.residual ) ? ep.residual->fp32() : nullptr;
+		context.gelu = ep.gelu ? &getLookupTables() : nullptr;
+		context.scale = ep.scale;
+		context.length = result.ne[ 0 ];
+		return pfor.parallelFor( context, result.countRows() );
 	}
 }
 
-HRESULT CpuCompute::mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor )
+HRESULT CpuCompute::mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue )
 {
+	if( nullptr != epilogue )
+	{
+		if( epilogue->empty() )
+			epilogue = nullptr;
+		else
+			CHECK( validateEpilogue( result, *epilogue ) );
+	}
+
+	if( a.type() == eDataType::BF16 )
+	{
+		CHECK( mulMatBf16( result, a, b, pfor ) );
+		if( nullptr != epilogue )
+			CHECK( applyEpilogue( result, *epilogue, pfor ) );
+		return S_OK;
+	}
 	if( a.type() != eDataType::FP16 )
 		return E_NOTIMPL;
 	if( b.type() != eDataType::FP32 )
 		return E_NOTIMPL;
 
-	// return mulMatImpl<1, 1>( result, a, b, pfor );
+	// The autotuner measures the products of weight matrices on this CPU, see mulMatTuner.cpp
+	MulMatVariant variant;
+	if( !findTunedMulMat( a, b, pfor.threadsCount(), variant ) )
+		variant = defaultMulMatVariant( a.ne[ 1 ], b.ne[ 1 ] );
+	return mulMatVariant( variant, result, a, b, pfor, epilogue );
+}
+
+MulMatVariant CpuCompute::defaultMulMatVariant( uint32_t rows, uint32_t columns )
+{
+	// return MulMatVariant{ 1, 1, 1 };
 
-	if( b.ne[ 1 ] == 1 )
+	if( columns == 1 )
 	{
 		// Multiplying by a single row
-		if( a.ne[ 1 ] >= 32 )
-			return mulMatImpl<4, 1>( result, a, b, pfor );
+		if( rows >= 32 )
+			return MulMatVariant{ 4, 1, 1 };
 		else
-			return mulMatImpl<1, 1>( result, a, b, pfor );
+			return MulMatVariant{ 1, 1, 1 };
 	}
-	else if( b.ne[ 1 ] == 2 )
+	else if( columns == 2 )
 	{
-		if( a.ne[ 1 ] >= 32 )
-			return mulMatImpl<4, 2>( result, a, b, pfor );
+		if( rows >= 32 )
+			return MulMatVariant{ 4, 2, 1 };
 		else
-			return mulMatImpl<1, 2>( result, a, b, pfor );
+			return MulMatVariant{ 1, 2, 1 };
 	}
-	else if( b.ne[ 1 ] == 3 )
+	else if( columns == 3 )
 	{
-		if( a.ne[ 1 ] >= 16 )
-			return mulMatImpl<2, 3>( result, a, b, pfor );
+		if( rows >= 16 )
+			return MulMatVariant{ 2, 3, 1 };
 		else
-			return mulMatImpl<1, 3>( result, a, b, pfor );
+			return MulMatVariant{ 1, 3, 1 };
 	}
 	else
 	{
-		if( a.ne[ 1 ] >= 16 )
-			return mulMatImpl<2, 4>( result, a, b, pfor );
+		if( rows >= 16 )
+			return MulMatVariant{ 2, 4, 1 };
 		else
-			return mulMatImpl<1, 4>( result, a, b, pfor );
+			return MulMatVariant{ 1, 4, 1 };
+	}
+}
+
+HRESULT CpuCompute::mulMatVariant( const MulMatVariant& v, Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue )
+{
+	const size_t minBatch = std::max( v.minBatch, (uint8_t)1 );
+	const uint16_t key = ( (uint16_t)v.panelHeightRegs << 8 ) | v.tileWidthFloats;
+	switch( key )
+	{
+	case 0x0101:
+		return mulMatImpl<1, 1>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0401:
+		return mulMatImpl<4, 1>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0102:
+		return mulMatImpl<1, 2>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0402:
+		return mulMatImpl<4, 2>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0103:
+		return mulMatImpl<1, 3>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0203:
+		return mulMatImpl<2, 3>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0104:
+		return mulMatImpl<1, 4>( result, a, b, pfor, epilogue, minBatch );
+	case 0x0204:
+		return mulMatImpl<2, 4>( result, a, b, pfor, epilogue, minBatch );
 	}
+	return E_INVALIDARG;
 }
\ No newline at end of file
@@ -4,7 +4,33 @@
 
 namespace CpuCompute
 {
-	HRESULT mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor );
+	// Optional element-wise operations fused into the matrix multiplication, applied to the output tiles while they're still in registers.
+	// The complete formula is result = gelu( ( a * b + bias ) * scale ) + residual
+	struct MulMatEpilogue
+	{
+		// FP32 vector of length result.ne[ 0 ], added to every column of the product
+		const Tensor* bias = nullptr;
+		// Multiplier applied after the bias
+		float scale = 1.0f;
+		// Apply GELU activation, after the bias and the scale
+		bool gelu = false;
+		// Continuous FP32 tensor of the same size as the output, added at the very end
+		const Tensor* residual = nullptr;
+
+		bool empty() const
+		{
+			return nullptr == bias && 1.0f == scale && !gelu && nullptr == residual;
+		}
+	};
+
+	HRESULT mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue = nullptr );
+
+	// Multiply BF16 matrix by FP32 matrix, the implementation is in mulMatBf16.cpp
+	HRESULT mulMatBf16( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor );
+
+	// True when the CPU supports AVX512_BF16 instructions, and the OS has enabled AVX512 state.
+	// With eGpuModelFlags.Bf16Weights flag, the model loader uses the value to decide whether to convert FP16 weights into BF16.
+	bool hasNativeBf16();
 }
 
 #if TENSOR_GGML_COMPAT
@@ -20,6 +20,28 @@ struct ResultTile
 		throw E_UNEXPECTED;
 	}
 	__forceinline void store( float* rdi, size_t w, size_t h, size_t stride ) const;
+
+	// Apply the fused epilogue to the first `columns` columns of the tile: arr = gelu( ( arr + bias ) * scale ) + residual
+	// The panel must be complete, i.e. all of the panelHeightRegs * 8 output rows must be within the output matrix.
+	__forceinline void applyEpilogue( const float* bias, __m256 scale, const DirectCompute::LookupTablesData* geluLookup, const float* residual, size_t residualStride, size_t columns )
+	{
+		std::array<__m256, panelHeightRegs> biasVec;
+		for( size_t r = 0; r < panelHeightRegs; r++ )
+			biasVec[ r ] = ( nullptr != bias ) ? _mm256_loadu_ps( bias + r * 8 ) : _mm256_setzero_ps();
+
+		for( size_t c = 0; c < tileWidthFloats; c++ )
+		{
+			if( c >= columns )
+				break;
+			for( size_t r = 0; r < panelHeightRegs; r++ )
+			{
+				__m256& v = arr[ c * panelHeightRegs + r ];
+				v = epilogue( v, biasVec[ r ], scale, geluLookup );
+				if( nullptr != residual )
+					v = _mm256_add_ps( v, _mm256_loadu_ps( residual + c * residualStride + r * 8 ) );
+			}
+		}
+	}
 };
 
 #pragma region setZero functions
@@ -0,0 +1,318 @@
+#include "stdafx.h"
+#include <intrin.h>
+#include "mulMat.h"
+#include "simdUtils.h"
+using namespace CpuCompute;
+
+// Matrix multiplication where the first argument is in BF16 format, and the second one is FP32.
+// On CPUs with AVX512_BF16 extension, the second matrix is converted to BF16 too, and the dot products are computed with vdpbf16ps instruction, 32 elements per instruction.
+// On other CPUs, the BF16 elements are upcast to FP32 with a shift, and multiplied with FMA. That's slower than the FP16 panels, only implemented for completeness.
+namespace
+{
+	bool checkAvx512Bf16Support()
+	{
+		int cpuInfo[ 4 ];
+		__cpuid( cpuInfo, 0 );
+		if( cpuInfo[ 0 ] < 7 )
+			return false;
+
+		// The OS needs to save and restore AVX512 state: XCR0 bits for SSE, AVX, opmask, and both halves of ZMM registers
+		__cpuid( cpuInfo, 1 );
+		constexpr int osxsave = 1 << 27;
+		if( 0 == ( cpuInfo[ 2 ] & osxsave ) )
+			return false;
+		constexpr uint64_t xcr0Mask = 0xE6;
+		if( ( _xgetbv( 0 ) & xcr0Mask ) != xcr0Mask )
+			return false;
+
+		__cpuidex( cpuInfo, 7, 0 );
+		constexpr int avx512f = 1 << 16;
+		constexpr int avx512bw = 1 << 30;
+		if( ( cpuInfo[ 1 ] & ( avx512f | avx512bw ) ) != ( avx512f | avx512bw ) )
+			return false;
+		// EAX of the leaf 7 sub-leaf 0 has the maximum sub-leaf index
+		if( cpuInfo[ 0 ] < 1 )
+			return false;
+
+		__cpuidex( cpuInfo, 7, 1 );
+		constexpr int avx512bf16 = 1 << 5;
+		return 0 != ( cpuInfo[ 0 ] & avx512bf16 );
+	}
+
+	bool checkAvx2Support()
+	{
+		int cpuInfo[ 4 ];
+		__cpuid( cpuInfo, 0 );
+		if( cpuInfo[ 0 ] < 7 )
+			return false;
+
+		// The fallback kernel uses FMA as well, and the OS needs to save and restore the YMM registers: XCR0 bits for SSE and AVX
+		__cpuid( cpuInfo, 1 );
+		constexpr int fma = 1 << 12;
+		constexpr int osxsave = 1 << 27;
+		constexpr int avx = 1 << 28;
+		if( ( cpuInfo[ 2 ] & ( fma | osxsave | avx ) ) != ( fma | osxsave | avx ) )
+			return false;
+		constexpr uint64_t xcr0Mask = 0x6;
+		if( ( _xgetbv( 0 ) & xcr0Mask ) != xcr0Mask )
+			return false;
+
+		__cpuidex( cpuInfo, 7, 0 );
+		constexpr int avx2 = 1 << 5;
+		return 0 != ( cpuInfo[ 1 ] & avx2 );
+	}
+
+	static const bool haveAvx512Bf16 = checkAvx512Bf16Support();
+	static const bool haveAvx2 = checkAvx2Support();
+
+	// Count of rows of the first matrix processed together, sharing the loads from the second matrix
+	constexpr uint32_t rowsPerBlock = 4;
+
+	// a / b, rounded up to the next integer
+	inline uint32_t divRoundUp( uint32_t a, uint32_t b )
+	{
+		assert( b != 0 );
+		return ( a + ( b - 1 ) ) / b;
+	}
+
+	__forceinline __m512bh asBf16( __m512i v )
+	{
+		// Bitwise reinterpret cast; the compiler optimizes away the memory
+		__m512bh res;
+		static_assert( sizeof( res ) == sizeof( v ) );
+		memcpy( &res, &v, sizeof( v ) );
+		return res;
+	}
+
+	// Compute dot products of `rows` rows of the BF16 matrix, with a single row of BF16 numbers
+	// The second vector is padded with zeros to the multiple of 32 elements
+	template<uint32_t rows>
+	__forceinline void dotAvx512( float* rdi, const uint16_t* rsiA, size_t strideA, const uint16_t* rsiB, size_t length )
+	{
+		std::array<__m512, rows> acc;
+		for( uint32_t r = 0; r < rows; r++ )
+			acc[ r ] = _mm512_setzero_ps();
+
+		const size_t lengthAligned = length & ~(size_t)31;
+		size_t i;
+		for( i = 0; i < lengthAligned; i += 32 )
+		{
+			const __m512bh b = asBf16( _mm512_loadu_si512( rsiB + i ) );
+			for( uint32_t r = 0; r < rows; r++ )
+			{
+				const __m512bh a = asBf16( _mm512_loadu_si512( rsiA + r * strideA + i ) );
+				acc[ r ] = _mm512_dpbf16_ps( acc[ r ], a, b );
+			}
+		}
+
+		const size_t rem = length - lengthAligned;
+		if( 0 != rem )
+		{
+			const __mmask32 mask = ( 1u << (uint32_t)rem ) - 1;
+			const __m512bh b = asBf16( _mm512_loadu_si512( rsiB + i ) );
+			for( uint32_t r = 0; r < rows; r++ )
+			{
+				const __m512bh a = asBf16( _mm512_maskz_loadu_epi16( mask, rsiA + r * strideA + i ) );
+				acc[ r ] = _mm512_dpbf16_ps( acc[ r ], a, b );
+			}
+		}
+
+		for( uint32_t r = 0; r < rows; r++ )
+			rdi[ r ] = _mm512_reduce_add_ps( acc[ r ] );
+	}
+
+	// Upcast 8 BF16 numbers into FP32
+	__forceinline __m256 upcastBf16( const uint16_t* rsi )
+	{
+		__m256i iv = _mm256_cvtepu16_epi32( _mm_loadu_si128( ( const __m128i* )rsi ) );
+		iv = _mm256_slli_epi32( iv, 16 );
+		return _mm256_castsi256_ps( iv );
+	}
+
+	__forceinline float bf16Scalar( uint16_t bf )
+	{
+		const uint32_t u = (uint32_t)bf << 16;
+		return _mm_cvtss_f32( _mm_castsi128_ps( _mm_cvtsi32_si128( (int)u ) ) );
+	}
+
+	__forceinline float horizontalSum( __m256 v )
+	{
+		__m128 r = _mm256_extractf128_ps( v, 1 );
+		r = _mm_add_ps( r, _mm256_castps256_ps128( v ) );
+		r = _mm_add_ps( r, _mm_movehl_ps( r, r ) );
+		r = _mm_add_ss( r, _mm_movehdup_ps( r ) );
+		return _mm_cvtss_f32( r );
+	}
+
+	// Compute dot products of `rows` rows of the BF16 matrix, with a single row of FP32 numbers
+	template<uint32_t rows>
+	__forceinline void dotAvx2( float* rdi, const uint16_t* rsiA, size_t strideA, const float* rsiB, size_t length )
+	{
+		std::array<__m256, rows> acc;
+		for( uint32_t r = 0; r < rows; r++ )
+			acc[ r ] = _mm256_setzero_ps();
+
+		const size_t lengthAligned = length & ~(size_t)7;
+		size_t i;
+		for( i = 0; i < lengthAligned; i += 8 )
+		{
+			const __m256 b = _mm256_loadu_ps( rsiB + i );
+			for( uint32_t r = 0; r < rows; r++ )
+				acc[ r ] = _mm256_fmadd_ps( upcastBf16( rsiA + r * strideA + i ), b, acc[ r ] );
+		}
+
+		for( uint32_t r = 0; r < rows; r++ )
+		{
+			float res = horizontalSum( acc[ r ] );
+			for( size_t j = i; j < length; j++ )
+				res += bf16Scalar( rsiA[ r * strideA + j ] ) * rsiB[ j ];
+			rdi[ r ] = res;
+		}
+	}
+
+	class MulMatBf16 : public iComputeRange
+	{
+		float* const resultPointer;
+		const uint16_t* const pa;
+		const float* const pb;
+		uint32_t length;
+		std::array<uint32_t, 3> resultStrides;
+		std::array<uint32_t, 4> resultSize;
+		std::array<uint32_t, 4> stridesA, stridesB;
+		uint32_t countBlocks;
+		ParallelForRunner& runner;
+
+		// Length of the second matrix rows after conversion to BF16, padded to the multiple of 32 elements
+		uint32_t paddedLength() const
+		{
+			return ( length + 31 ) & ~31u;
+		}
+
+		// Convert a layer of the second matrix into BF16, in the thread-local buffer
+		uint16_t* convertLayerB( const float* rsi ) const
+		{
+			const size_t padded = paddedLength();
+			const size_t rows = resultSize[ 1 ];
+			uint16_t* const buffer = (uint16_t*)runner.threadLocalBuffer( padded * rows * 2 );
+			uint16_t* rdi = buffer;
+			for( size_t i = 0; i < rows; i++, rsi += stridesB[ 1 ], rdi += padded )
+			{
+				floatsToBf16( rdi, rsi, length );
+				for( size_t j = length; j < padded; j++ )
+					rdi[ j ] = 0;
+			}
+			return buffer;
+		}
+
+		template<uint32_t rows>
+		void computeBlock( float* rdi, const uint16_t* rsiA, const float* rsiB, const uint16_t* convertedB ) const
+		{
+			const size_t columns = resultSize[ 1 ];
+			if( nullptr != convertedB )
+			{
+				const size_t padded = paddedLength();
+				for( size_t j = 0; j < columns; j++, rdi += resultStrides[ 0 ], convertedB += padded )
+					dotAvx512<rows>( rdi, rsiA, stridesA[ 1 ], convertedB, length );
+			}
+			else
+			{
+				for( size_t j = 0; j < columns; j++, rdi += resultStrides[ 0 ], rsiB += stridesB[ 1 ] )
+					dotAvx2<rows>( rdi, rsiA, stridesA[ 1 ], rsiB, length );
+			}
+		}
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final
+		{
+			size_t prevLayer = SIZE_MAX;
+			const uint16_t* convertedB = nullptr;
+
+			for( ; i < end; i++ )
+			{
+				const size_t iBlock = i % countBlocks;
+				const size_t layer = i / countBlocks;
+				const size_t m2 = layer % resultSize[ 2 ];
+				const size_t m3 = layer / resultSize[ 2 ];
+
+				const float* rsiB = pb + m2 * stridesB[ 2 ] + m3 * stridesB[ 3 ];
+				if( haveAvx512Bf16 && layer != prevLayer )
+				{
+					// The parallel for splits the work into continuous ranges, most threads only need to convert the second matrix once
+					convertedB = convertLayerB( rsiB );
+					prevLayer = layer;
+				}
+
+				const size_t row = iBlock * rowsPerBlock;
+				const uint16_t* rsiA = pa + m2 * stridesA[ 2 ] + m3 * stridesA[ 3 ] + row * stridesA[ 1 ];
+				float* rdi = resultPointer + m2 * resultStrides[ 1 ] + m3 * resultStrides[ 2 ] + row;
+
+				const size_t rowsRemaining = resultSize[ 0 ] - row;
+				switch( std::min( rowsRemaining, (size_t)rowsPerBlock ) )
+				{
+				case 4:
+					computeBlock<4>( rdi, rsiA, rsiB, convertedB );
+					break;
+				case 3:
+					computeBlock<3>( rdi, rsiA, rsiB, convertedB );
+					break;
+				case 2:
+					computeBlock<2>( rdi, rsiA, rsiB, convertedB );
+					break;
+				case 1:
+					computeBlock<1>( rdi, rsiA, rsiB, convertedB );
+					break;
+				default:
+					return E_UNEXPECTED;
+				}
+			}
+			return S_OK;
+		}
+
+	public:
+
+		MulMatBf16( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor ) :
+			resultPointer( result.fp32() ),
+			pa( a.bf16() ),
+			pb( b.fp32() ),
+			runner( pfor )
+		{
+			length = a.ne[ 0 ];
+			resultStrides[ 0 ] = result.nb[ 1 ];
+			resultStrides[ 1 ] = result.nb[ 2 ];
+			resultStrides[ 2 ] = result.nb[ 3 ];
+			store( resultSize, result.sizeVec() );
+			store( stridesA, a.stridesVec() );
+			store( stridesB, b.stridesVec() );
+			countBlocks = divRoundUp( resultSize[ 0 ], rowsPerBlock );
+		}
+
+		HRESULT run()
+		{
+			const size_t length = (size_t)countBlocks * resultSize[ 2 ] * resultSize[ 3 ];
+			return runner.parallelFor( *this, length );
+		}
+	};
+}
+
+bool CpuCompute::hasNativeBf16()
+{
+	return haveAvx512Bf16;
+}
+
+HRESULT CpuCompute::mulMatBf16( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor )
+{
+	if( a.type() != eDataType::BF16 || b.type() != eDataType::FP32 || result.type() != eDataType::FP32 )
+		return E_INVALIDARG;
+	// The kernels take the length of the dot products from the first matrix, and the bounds of the loops from the output
+	if( !DirectCompute::canMulMat( a, b ) )
+		return E_INVALIDARG;
+	if( result.ne[ 0 ] != a.ne[ 1 ] || result.ne[ 1 ] != b.ne[ 1 ] || result.ne[ 2 ] != a.ne[ 2 ] || result.ne[ 3 ] != a.ne[ 3 ] )
+		return E_INVALIDARG;
+	// Both kernels need the rows to be continuous in both source matrices, and in the output
+	if( a.nb[ 0 ] != 1 || b.nb[ 0 ] != 1 || result.nb[ 0 ] != 1 )
+		return E_NOTIMPL;
+	if( !( haveAvx512Bf16 || haveAvx2 ) )
+		return E_NOTIMPL;
+
+	MulMatBf16 impl{ result, a, b, pfor };
+	return impl.run();
+}
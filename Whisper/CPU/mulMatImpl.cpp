@@ -2,6 +2,7 @@
 #include <intrin.h>
 #include "mulMatImpl.h"
 #include "mulMat.kernel.hpp"
+#include "simdUtils.h"
 
 #define DBG_TRACK_TEMPLATE_INSTANTIATION 0
 
@@ -31,7 +32,7 @@ namespace
 
 const bool MulMatBase::haveAvx2 = checkAvx2Support();
 
-MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats ) :
+MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats, const MulMatEpilogue* epilogue ) :
 	resultPointer( result.fp32() ),
 	pa( a.data() ),
 	pb( b.data() ),
@@ -51,6 +52,23 @@ MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, Parall
 	this->panelHeightRegisters = panelHeightRegs;
 	this->tileWidth = tileWidthFloats;
 
+	// The generated kernels need continuous columns in the second matrix, see mulMatJit.cpp
+	if( stridesB[ 0 ] == 1 )
+		findJitTileKernels( length, panelHeightRegs, tileWidthFloats, jitKernels );
+
+	// The caller is expected to validate the epilogue, see validateEpilogue() function in mulMat.cpp
+	if( nullptr != epilogue && !epilogue->empty() )
+	{
+		hasEpilogue = true;
+		if( nullptr != epilogue->bias )
+			epilogueBias = epilogue->bias->fp32();
+		if( nullptr != epilogue->residual )
+			epilogueResidual = epilogue->residual->fp32();
+		if( epilogue->gelu )
+			epilogueGelu = &getLookupTables();
+		epilogueScale = epilogue->scale;
+	}
+
 	// Pick a method which reshapes a panel of the matrix A into the shape we need to compute the product
 	// Store the pointer to that method in the field of this class
 	if( a.nb[ 0 ] == 1 )
@@ -93,10 +111,10 @@ MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, Parall
 #endif
 }
 
-HRESULT MulMatBase::run( ParallelForRunner& pfor )
+HRESULT MulMatBase::run( ParallelForRunner& pfor, size_t minBatch )
 {
 	size_t length = (size_t)countPanels * resultSize[ 2 ] * resultSize[ 3 ];
-	return pfor.parallelFor( *this, length );
+	return pfor.parallelFor( *this, length, minBatch );
 }
 
 const float* MulMatBase::getLayerB( size_t m2, size_t m3 ) const
@@ -107,6 +125,78 @@ const float* MulMatBase::getLayerB( size_t m2, size_t m3 ) const
 	return rsi;
 }
 
+void MulMatBase::applyEpilogueStored( float* rdi, size_t width, size_t columns, size_t iPanel ) const
+{
+	const size_t stride = resultStrides[ 0 ];
+	const float* bias = epilogueBias;
+	if( nullptr != bias )
+		bias += iPanel * panelHeightRegisters * 8;
+	const float* residual = epilogueResidual;
+	if( nullptr != residual )
+		residual += ( rdi - resultPointer );
+
+	for( size_t i = 0; i < columns; i++, rdi += stride )
+	{
+		epilogueRow( rdi, width, bias, epilogueScale, epilogueGelu, residual );
+		if( nullptr != residual )
+			residual += stride;
+	}
+}
+
+template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+__forceinline void MulMatImpl<panelHeightRegs, tileWidthFloats>::storeWithEpilogue( ResultTile<panelHeightRegs, tileWidthFloats>& tile, float* rdi, size_t storeWidth, size_t columns, size_t iPanel ) const
+{
+	constexpr size_t panelHeightFloats = panelHeightRegs * 8;
+	if( storeWidth == panelHeightFloats )
+	{
+		// Complete panel, apply the epilogue in registers
+		const float* bias = ( nullptr != epilogueBias ) ? epilogueBias + iPanel * panelHeightFloats : nullptr;
+		const float* residual = ( nullptr != epilogueResidual ) ? epilogueResidual + ( rdi - resultPointer ) : nullptr;
+		tile.applyEpilogue( bias, _mm256_set1_ps( epilogueScale ), epilogueGelu, residual, resultStrides[ 0 ], columns );
+		tile.store( rdi, storeWidth, columns, resultStrides[ 0 ] );
+	}
+	else
+	{
+		// Incomplete panel at the bottom of the output, loading complete vectors of bias or residual would read outside of these tensors
+		// The tile was just written, it's in L1 cache
+		tile.store( rdi, storeWidth, columns, resultStrides[ 0 ] );
+		applyEpilogueStored( rdi, storeWidth, columns, iPanel );
+	}
+}
+
+template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+void MulMatImpl<panelHeightRegs, tileWidthFloats>::computePanelJit( const uint16_t* panel, const float* pb, float* rdi, size_t storeWidth, size_t iPanel ) const
+{
+	const size_t resultStride = resultStrides[ 0 ];
+	ResultTile<panelHeightRegs, tileWidthFloats> tile;
+	JitTileArgs args;
+	args.panel = panel;
+	args.strideB = (size_t)stridesB[ 1 ] * 4;
+	args.tile = (float*)tile.arr.data();
+
+	const pfnJitTileKernel kernel = jitKernels[ tileWidthFloats - 1 ];
+	for( size_t j = 0; j < completeTilesPerPanel; j++, pb += tileWidthFloats * stridesB[ 1 ], rdi += resultStride * tileWidthFloats )
+	{
+		args.b = pb;
+		kernel( &args );
+		if( !hasEpilogue )
+			tile.store( rdi, storeWidth, tileWidthFloats, resultStride );
+		else
+			storeWithEpilogue( tile, rdi, storeWidth, tileWidthFloats, iPanel );
+	}
+
+	if( 0 != lastColumnsInPanel )
+	{
+		// The generated kernels have no partial tiles, there's a separate kernel for every count of columns
+		args.b = pb;
+		jitKernels[ lastColumnsInPanel - 1 ]( &args );
+		if( !hasEpilogue )
+			tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
+		else
+			storeWithEpilogue( tile, rdi, storeWidth, lastColumnsInPanel, iPanel );
+	}
+}
+
 // This method is the main one, its called by the thread pool
 template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
 HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t i, size_t end ) const noexcept
@@ -138,6 +228,11 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 		float* rdi = getPanelDest( iPanel, m2, m3 );
 
 		const size_t storeWidth = std::min( panelHeightFloats, (size_t)resultSize[ 0 ] - iPanel * panelHeightFloats );
+		if( nullptr != jitKernels[ 0 ] )
+		{
+			computePanelJit( panel, pb, rdi, storeWidth, iPanel );
+			continue;
+		}
 		std::array<__m256, panelHeightRegs> vecPanel;
 #if 1
 		ResultTile<panelHeightRegs, tileWidthFloats> tile;
@@ -156,7 +251,10 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 				loadPanel( rsiA, vecPanel );
 				tile.kernel( vecPanel, rsiB, stridesB[ 1 ] );
 			}
-			tile.store( rdi, storeWidth, tileWidthFloats, resultStride );
+			if( !hasEpilogue )
+				tile.store( rdi, storeWidth, tileWidthFloats, resultStride );
+			else
+				storeWithEpilogue( tile, rdi, storeWidth, tileWidthFloats, iPanel );
 		}
 
 		if( 0 != lastColumnsInPanel )
@@ -170,7 +268,10 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 				loadPanel( rsiA, vecPanel );
 				tile.kernelPartial( vecPanel, rsiB, stridesB[ 1 ], lastColumnsInPanel );
 			}
-			tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
+			if( !hasEpilogue )
+				tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
+			else
+				storeWithEpilogue( tile, rdi, storeWidth, lastColumnsInPanel, iPanel );
 		}
 #else
 		// This version bypasses horizontal tiling, instead implements a brute force algorithm to multiply the current panel by the complete B matrix
@@ -196,6 +297,8 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 			for( size_t k = 0; k < panelHeightRegs; k++ )
 				_mm256_store_ps( &arr[ k * 8 ], tile[ k ] );
 			memcpy( rdi, arr.data(), storeWidth * 4 );
+			if( hasEpilogue )
+				applyEpilogueStored( rdi, storeWidth, 1, iPanel );
 		}
 #endif
 	}
@@ -6,6 +6,15 @@
 // https://link.springer.com/article/10.1007/s11227-022-05003-3
 #include "ParallelForRunner.h"
 #include "Tensor.h"
+#include "mulMat.h"
+#include "mulMatJit.h"
+
+namespace DirectCompute
+{
+	struct LookupTablesData;
+}
+template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+struct ResultTile;
 
 namespace CpuCompute
 {
@@ -55,6 +64,19 @@ namespace CpuCompute
 		// The object which implements multithreading for this job, and supplies memory for thread-local buffers
 		ParallelForRunner& runner;
 
+		// The fused epilogue, resolved into raw pointers. The pointers are nullptr when the corresponding step is not needed.
+		const float* epilogueBias = nullptr;
+		const float* epilogueResidual = nullptr;
+		const DirectCompute::LookupTablesData* epilogueGelu = nullptr;
+		float epilogueScale = 1.0f;
+		bool hasEpilogue = false;
+
+		// Runtime generated micro-kernels for this length of the dot products, when they were compiled at model load; all nullptr otherwise
+		JitTileKernels jitKernels = {};
+
+		// Apply the epilogue to the output in memory, used for incomplete panels at the bottom of the output matrix
+		void applyEpilogueStored( float* rdi, size_t width, size_t columns, size_t iPanel ) const;
+
 		// Count of FP16 values in the thread-local panel buffer
 		uint32_t floatsPerPanel() const
 		{
@@ -88,8 +110,9 @@ namespace CpuCompute
 
 		static const bool haveAvx2;
 	public:
-		MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats );
-		HRESULT run( ParallelForRunner& pfor );
+		MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats, const MulMatEpilogue* epilogue );
+		// minBatch is the minimum count of panels for every thread of the pool
+		HRESULT run( ParallelForRunner& pfor, size_t minBatch = 1 );
 	};
 
 	// This class actually contains the kernels implementations
@@ -98,9 +121,15 @@ namespace CpuCompute
 	{
 		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final;
 
+		// Compute the products of the panel with the generated micro-kernels, and store them into the output
+		void computePanelJit( const uint16_t* panel, const float* pb, float* rdi, size_t storeWidth, size_t iPanel ) const;
+
+		// Apply the fused epilogue to the output tile, and store the tile to the output matrix
+		void storeWithEpilogue( ResultTile<panelHeightRegs, tileWidthFloats>& tile, float* rdi, size_t storeWidth, size_t columns, size_t iPanel ) const;
+
 	public:
-		MulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor ) :
-			MulMatBase( result, a, b, pfor, panelHeightRegs, tileWidthFloats )
+		MulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue = nullptr ) :
+			MulMatBase( result, a, b, pfor, panelHeightRegs, tileWidthFloats, epilogue )
 		{ }
 	};
 }
\ No newline at end of file
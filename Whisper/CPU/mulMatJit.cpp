@@ -0,0 +1,597 @@
+#include "stdafx.h"
+#include "mulMatJit.h"
+#include <intrin.h>
+#include <atlcoll.h>
+#include <atomic>
+#include <memory>
+using namespace CpuCompute;
+
+// Runtime code generator for the micro-kernels of the FP16 * FP32 matrix multiplication.
+// The templates in mulMat.kernel.hpp loop over the length of the dot products, and only implement the tile shapes written by hand.
+// The generated kernels are specialized for the exact length: the loop has no remainder handling, and the short ones are completely unrolled.
+// On CPUs with AVX512F, the panels of 16 and 32 rows are computed with ZMM registers, with the broadcasts embedded into the FMA instructions.
+namespace
+{
+	bool checkAvx512Support()
+	{
+		int cpuInfo[ 4 ];
+		__cpuid( cpuInfo, 0 );
+		if( cpuInfo[ 0 ] < 7 )
+			return false;
+
+		// The OS needs to save and restore AVX512 state: XCR0 bits for SSE, AVX, opmask, and both halves of ZMM registers
+		__cpuid( cpuInfo, 1 );
+		constexpr int osxsave = 1 << 27;
+		if( 0 == ( cpuInfo[ 2 ] & osxsave ) )
+			return false;
+		constexpr uint64_t xcr0Mask = 0xE6;
+		if( ( _xgetbv( 0 ) & xcr0Mask ) != xcr0Mask )
+			return false;
+
+		__cpuidex( cpuInfo, 7, 0 );
+		constexpr int avx512f = 1 << 16;
+		return 0 != ( cpuInfo[ 1 ] & avx512f );
+	}
+	static const bool haveAvx512 = checkAvx512Support();
+
+	// Panel heights of MulMatImpl instantiations in mulMatImpl.cpp, in AVX vectors
+	static const std::array<uint8_t, 3> s_panelHeights = { 1, 2, 4 };
+	// The lengths up to this one are unrolled completely, longer ones are unrolled by `unrollSteps`
+	constexpr uint32_t maxFullUnroll = 32;
+	constexpr uint32_t unrollSteps = 8;
+	// Distance of the software prefetch ahead of the loads from the panel, in bytes
+	constexpr int32_t prefetchDistance = 1024;
+	// Entry points of the kernels are aligned by the size of the cache line
+	constexpr size_t codeAlignment = 64;
+
+	// The general purpose registers we need, in the encoding of x64 instructions
+	enum struct eReg : uint8_t
+	{
+		rax = 0, rcx = 1, rdx = 2,
+		r8 = 8, r9 = 9, r10 = 10, r11 = 11,
+		none = 0xFF
+	};
+
+	// Memory operand [ base + index * scale + disp ]
+	struct Mem
+	{
+		eReg base;
+		eReg index = eReg::none;
+		uint8_t scale = 1;
+		int32_t disp = 0;
+	};
+
+	inline Mem ptr( eReg base, int32_t disp )
+	{
+		return Mem{ base, eReg::none, 1, disp };
+	}
+
+	// A minimal x64 assembler, only implements the instructions used by the micro-kernels.
+	// Vector registers are limited to 0-15, the kernels don't need more.
+	class Assembler
+	{
+		std::vector<uint8_t> code;
+
+		void byte( uint32_t b )
+		{
+			code.push_back( (uint8_t)b );
+		}
+		void dword( uint32_t v )
+		{
+			for( int i = 0; i < 4; i++, v = v >> 8 )
+				byte( v & 0xFF );
+		}
+
+		static uint8_t lowBits( eReg r )
+		{
+			return (uint8_t)r & 7;
+		}
+		static bool isExtended( eReg r )
+		{
+			return r != eReg::none && 0 != ( (uint8_t)r & 8 );
+		}
+
+		// ModRM byte for the memory operand, SIB byte when needed, and the displacement.
+		// N is the compression factor of 8-bit displacements in EVEX instructions, 1 for legacy and VEX instructions.
+		void modrm( uint8_t reg, const Mem& m, int32_t n = 1 )
+		{
+			const uint8_t base = lowBits( m.base );
+			uint8_t mod;
+			if( 0 == m.disp && base != 5 )
+				mod = 0;
+			else if( 0 == m.disp % n && m.disp / n >= -128 && m.disp / n <= 127 )
+				mod = 1;
+			else
+				mod = 2;
+
+			reg &= 7;
+			if( m.index == eReg::none && base != 4 )
+				byte( ( mod << 6 ) | ( reg << 3 ) | base );
+			else
+			{
+				byte( ( mod << 6 ) | ( reg << 3 ) | 4 );
+				const uint8_t ss = ( m.scale == 8 ) ? 3 : ( m.scale == 4 ) ? 2 : ( m.scale == 2 ) ? 1 : 0;
+				const uint8_t index = ( m.index == eReg::none ) ? 4 : lowBits( m.index );
+				byte( ( ss << 6 ) | ( index << 3 ) | base );
+			}
+
+			if( 1 == mod )
+				byte( (uint8_t)(int8_t)( m.disp / n ) );
+			else if( 2 == mod )
+				dword( (uint32_t)m.disp );
+		}
+
+		// REX prefix with W bit, for 64-bit instructions
+		void rexW( eReg reg, const Mem& m )
+		{
+			byte( 0x48 | ( isExtended( reg ) ? 4 : 0 ) | ( isExtended( m.index ) ? 2 : 0 ) | ( isExtended( m.base ) ? 1 : 0 ) );
+		}
+		void rexW( eReg rm )
+		{
+			byte( 0x48 | ( isExtended( rm ) ? 1 : 0 ) );
+		}
+
+		// 3-byte VEX prefix. mm: 1 = 0F, 2 = 0F38 opcode map. pp: 0 = no prefix, 1 = 66. The W bit is always 0.
+		void vex( uint8_t mm, uint8_t pp, bool ymm, uint8_t reg, uint8_t vvvv, bool x, bool b )
+		{
+			byte( 0xC4 );
+			byte( ( ( reg & 8 ) ? 0 : 0x80 ) | ( x ? 0 : 0x40 ) | ( b ? 0 : 0x20 ) | mm );
+			byte( ( ( ~vvvv & 15 ) << 3 ) | ( ymm ? 4 : 0 ) | pp );
+		}
+		void vexRR( uint8_t mm, uint8_t pp, bool ymm, uint8_t op, uint8_t reg, uint8_t vvvv, uint8_t rm )
+		{
+			vex( mm, pp, ymm, reg, vvvv, false, 0 != ( rm & 8 ) );
+			byte( op );
+			byte( 0xC0 | ( ( reg & 7 ) << 3 ) | ( rm & 7 ) );
+		}
+		void vexRM( uint8_t mm, uint8_t pp, bool ymm, uint8_t op, uint8_t reg, uint8_t vvvv, const Mem& m )
+		{
+			vex( mm, pp, ymm, reg, vvvv, isExtended( m.index ), isExtended( m.base ) );
+			byte( op );
+			modrm( reg, m );
+		}
+
+		// EVEX prefix of a 512-bit instruction with a memory operand, without masking. The W bit is always 0.
+		void evexRM( uint8_t mm, uint8_t pp, uint8_t op, uint8_t reg, uint8_t vvvv, const Mem& m, bool broadcast, int32_t n )
+		{
+			byte( 0x62 );
+			// R, X, B, R' bits are inverted, R' = 1 for registers 0-15
+			byte( ( ( reg & 8 ) ? 0 : 0x80 ) | ( isExtended( m.index ) ? 0 : 0x40 ) | ( isExtended( m.base ) ? 0 : 0x20 ) | 0x10 | mm );
+			byte( ( ( ~vvvv & 15 ) << 3 ) | 4 | pp );
+			// L'L = 10 for 512 bits, V' = 1 for registers 0-15
+			byte( 0x40 | ( broadcast ? 0x10 : 0 ) | 0x08 );
+			byte( op );
+			modrm( reg, m, n );
+		}
+
+	public:
+		size_t position() const
+		{
+			return code.size();
+		}
+		const std::vector<uint8_t>& bytes() const
+		{
+			return code;
+		}
+
+		// Pad the code with int3 instructions
+		void align( size_t alignment )
+		{
+			while( 0 != code.size() % alignment )
+				byte( 0xCC );
+		}
+
+		// mov r64, qword ptr [ m ]
+		void mov( eReg dest, const Mem& m )
+		{
+			rexW( dest, m );
+			byte( 0x8B );
+			modrm( (uint8_t)dest, m );
+		}
+		// lea r64, [ m ]
+		void lea( eReg dest, const Mem& m )
+		{
+			rexW( dest, m );
+			byte( 0x8D );
+			modrm( (uint8_t)dest, m );
+		}
+		// mov eax, imm32
+		void movEax( uint32_t imm )
+		{
+			byte( 0xB8 );
+			dword( imm );
+		}
+		// add r64, imm32
+		void add( eReg dest, int32_t imm )
+		{
+			rexW( dest );
+			if( imm >= -128 && imm <= 127 )
+			{
+				byte( 0x83 );
+				byte( 0xC0 | lowBits( dest ) );
+				byte( (uint8_t)(int8_t)imm );
+			}
+			else
+			{
+				byte( 0x81 );
+				byte( 0xC0 | lowBits( dest ) );
+				dword( (uint32_t)imm );
+			}
+		}
+		// dec eax
+		void decEax()
+		{
+			byte( 0xFF );
+			byte( 0xC8 );
+		}
+		// jnz to the earlier position in the code
+		void jnz( size_t target )
+		{
+			const ptrdiff_t rel8 = (ptrdiff_t)target - (ptrdiff_t)( code.size() + 2 );
+			if( rel8 >= -128 )
+			{
+				byte( 0x75 );
+				byte( (uint8_t)(int8_t)rel8 );
+			}
+			else
+			{
+				byte( 0x0F );
+				byte( 0x85 );
+				dword( (uint32_t)(int32_t)( (ptrdiff_t)target - (ptrdiff_t)( code.size() + 4 ) ) );
+			}
+		}
+		void prefetcht0( const Mem& m )
+		{
+			if( isExtended( m.base ) || isExtended( m.index ) )
+				byte( 0x40 | ( isExtended( m.index ) ? 2 : 0 ) | ( isExtended( m.base ) ? 1 : 0 ) );
+			byte( 0x0F );
+			byte( 0x18 );
+			modrm( 1, m );
+		}
+		void vzeroupper()
+		{
+			byte( 0xC5 );
+			byte( 0xF8 );
+			byte( 0x77 );
+		}
+		void ret()
+		{
+			byte( 0xC3 );
+		}
+
+		// vxorps ymm, ymm, ymm; VEX encoded instructions also clear the upper half of ZMM registers
+		void zero( uint8_t r )
+		{
+			vexRR( 1, 0, true, 0x57, r, r, r );
+		}
+		// vmovups xmmword ptr [ m ], xmm
+		void storeXmm( const Mem& m, uint8_t r )
+		{
+			vexRM( 1, 0, false, 0x11, r, 0, m );
+		}
+		// vmovups xmm, xmmword ptr [ m ]
+		void loadXmm( uint8_t r, const Mem& m )
+		{
+			vexRM( 1, 0, false, 0x10, r, 0, m );
+		}
+		// vmovups ymmword ptr [ m ], ymm
+		void storeYmm( const Mem& m, uint8_t r )
+		{
+			vexRM( 1, 0, true, 0x11, r, 0, m );
+		}
+		// vcvtph2ps ymm, xmmword ptr [ m ]
+		void upcastYmm( uint8_t r, const Mem& m )
+		{
+			vexRM( 2, 1, true, 0x13, r, 0, m );
+		}
+		// vbroadcastss ymm, dword ptr [ m ]
+		void broadcastYmm( uint8_t r, const Mem& m )
+		{
+			vexRM( 2, 1, true, 0x18, r, 0, m );
+		}
+		// vfmadd231ps ymm, ymm, ymm
+		void fmaYmm( uint8_t acc, uint8_t a, uint8_t b )
+		{
+			vexRR( 2, 1, true, 0xB8, acc, a, b );
+		}
+		// vmovups zmmword ptr [ m ], zmm
+		void storeZmm( const Mem& m, uint8_t r )
+		{
+			evexRM( 1, 0, 0x11, r, 0, m, false, 64 );
+		}
+		// vcvtph2ps zmm, ymmword ptr [ m ]
+		void upcastZmm( uint8_t r, const Mem& m )
+		{
+			evexRM( 2, 1, 0x13, r, 0, m, false, 32 );
+		}
+		// vfmadd231ps zmm, zmm, dword ptr [ m ]{1to16}
+		void fmaBroadcastZmm( uint8_t acc, uint8_t a, const Mem& m )
+		{
+			evexRM( 2, 1, 0xB8, acc, a, m, true, 4 );
+		}
+	};
+
+	// Count of vector registers in a column of the tile: YMM for the AVX2 kernels, ZMM for the AVX512 ones
+	inline uint8_t columnRegs( uint8_t panelHeightRegs, bool zmm )
+	{
+		return zmm ? panelHeightRegs / 2 : panelHeightRegs;
+	}
+
+	// The AVX512 kernels need complete ZMM vectors in the panel
+	inline bool useZmm( uint8_t panelHeightRegs )
+	{
+		return haveAvx512 && 0 == ( panelHeightRegs % 2 );
+	}
+
+	// The widest tile which fits in 16 vector registers: the accumulators, the panel, and 2 registers for the broadcasts of AVX2 kernels
+	uint8_t maxColumns( uint8_t panelHeightRegs )
+	{
+		const bool zmm = useZmm( panelHeightRegs );
+		const uint8_t regs = columnRegs( panelHeightRegs, zmm );
+		const uint8_t available = 16 - regs - ( zmm ? 0 : 2 );
+		return (uint8_t)std::min( available / regs, 4 );
+	}
+
+	// Emit the micro-kernel for the length of the dot products, panel height, and count of columns in the tile.
+	// The only argument is the pointer to JitTileArgs structure, in RCX register per x64 calling convention.
+	void emitKernel( Assembler& as, uint32_t length, uint8_t panelHeightRegs, uint8_t columns )
+	{
+		const bool zmm = useZmm( panelHeightRegs );
+		const uint8_t regs = columnRegs( panelHeightRegs, zmm );
+		const uint8_t countAcc = regs * columns;
+		const uint8_t panelReg = countAcc;
+		const uint8_t broadcastReg = panelReg + regs;
+		const uint8_t usedRegs = zmm ? broadcastReg : broadcastReg + 2;
+		assert( usedRegs <= 16 && columns <= 4 );
+		const int32_t panelBytes = panelHeightRegs * 16;
+
+		// XMM6-XMM15 are non-volatile
+		constexpr uint8_t firstNonVolatile = 6;
+		const int32_t offsetSaved = (int32_t)offsetof( JitTileArgs, savedXmm );
+		for( uint8_t r = firstNonVolatile; r < usedRegs; r++ )
+			as.storeXmm( ptr( eReg::rcx, offsetSaved + ( r - firstNonVolatile ) * 16 ), r );
+
+		// r8 = panel, rdx = b, r9 = stride of b, r10 = 3 * stride
+		as.mov( eReg::r8, ptr( eReg::rcx, (int32_t)offsetof( JitTileArgs, panel ) ) );
+		as.mov( eReg::rdx, ptr( eReg::rcx, (int32_t)offsetof( JitTileArgs, b ) ) );
+		as.mov( eReg::r9, ptr( eReg::rcx, (int32_t)offsetof( JitTileArgs, strideB ) ) );
+		if( columns > 3 )
+			as.lea( eReg::r10, Mem{ eReg::r9, eReg::r9, 2, 0 } );
+
+		for( uint8_t i = 0; i < countAcc; i++ )
+			as.zero( i );
+
+		// Element `k` of the column `c` of the second matrix
+		const auto columnElement = [ & ]( uint8_t c, uint32_t k )
+		{
+			const int32_t disp = (int32_t)k * 4;
+			switch( c )
+			{
+			case 0: return Mem{ eReg::rdx, eReg::none, 1, disp };
+			case 1: return Mem{ eReg::rdx, eReg::r9, 1, disp };
+			case 2: return Mem{ eReg::rdx, eReg::r9, 2, disp };
+			}
+			return Mem{ eReg::rdx, eReg::r10, 1, disp };
+		};
+
+		// One step of the dot products, at the offset `k` from the current pointers
+		const auto step = [ & ]( uint32_t k )
+		{
+			const int32_t offsetPanel = (int32_t)k * panelBytes;
+			if( 0 == offsetPanel % 64 )
+				as.prefetcht0( ptr( eReg::r8, offsetPanel + prefetchDistance ) );
+
+			if( zmm )
+			{
+				for( uint8_t r = 0; r < regs; r++ )
+					as.upcastZmm( panelReg + r, ptr( eReg::r8, offsetPanel + r * 32 ) );
+				for( uint8_t c = 0; c < columns; c++ )
+				{
+					const Mem b = columnElement( c, k );
+					for( uint8_t r = 0; r < regs; r++ )
+						as.fmaBroadcastZmm( c * regs + r, panelReg + r, b );
+				}
+			}
+			else
+			{
+				for( uint8_t r = 0; r < regs; r++ )
+					as.upcastYmm( panelReg + r, ptr( eReg::r8, offsetPanel + r * 16 ) );
+				for( uint8_t c = 0; c < columns; c++ )
+				{
+					// Alternate the registers for the broadcasts, to break the dependency between columns
+					const uint8_t b = broadcastReg + ( c & 1 );
+					as.broadcastYmm( b, columnElement( c, k ) );
+					for( uint8_t r = 0; r < regs; r++ )
+						as.fmaYmm( c * regs + r, panelReg + r, b );
+				}
+			}
+		};
+
+		const uint32_t unroll = ( length <= maxFullUnroll ) ? length : unrollSteps;
+		const uint32_t loops = ( 0 != unroll ) ? length / unroll : 0;
+		const uint32_t remainder = length - loops * unroll;
+		uint32_t k0 = 0;
+		if( loops > 1 )
+		{
+			as.movEax( loops );
+			const size_t loopStart = as.position();
+			for( uint32_t k = 0; k < unroll; k++ )
+				step( k );
+			as.add( eReg::r8, (int32_t)unroll * panelBytes );
+			as.add( eReg::rdx, (int32_t)unroll * 4 );
+			as.decEax();
+			as.jnz( loopStart );
+		}
+		else if( 1 == loops )
+		{
+			for( uint32_t k = 0; k < unroll; k++ )
+				step( k );
+			k0 = unroll;
+		}
+		for( uint32_t k = 0; k < remainder; k++ )
+			step( k0 + k );
+
+		// Store the accumulators in the layout of ResultTile::arr, column major
+		as.mov( eReg::r11, ptr( eReg::rcx, (int32_t)offsetof( JitTileArgs, tile ) ) );
+		for( uint8_t c = 0; c < columns; c++ )
+		{
+			for( uint8_t r = 0; r < regs; r++ )
+			{
+				const uint8_t acc = c * regs + r;
+				if( zmm )
+					as.storeZmm( ptr( eReg::r11, ( c * panelHeightRegs + r * 2 ) * 32 ), acc );
+				else
+					as.storeYmm( ptr( eReg::r11, ( c * panelHeightRegs + r ) * 32 ), acc );
+			}
+		}
+
+		for( uint8_t r = firstNonVolatile; r < usedRegs; r++ )
+			as.loadXmm( r, ptr( eReg::rcx, offsetSaved + ( r - firstNonVolatile ) * 16 ) );
+		as.vzeroupper();
+		as.ret();
+	}
+
+	// Copy the code into new pages of memory, and make them executable
+	HRESULT makeExecutable( const std::vector<uint8_t>& code, const uint8_t*& rdi )
+	{
+		const size_t size = code.size();
+		void* const p = VirtualAlloc( nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+		if( nullptr == p )
+			return getLastHr();
+		memcpy( p, code.data(), size );
+
+		DWORD oldProtect;
+		if( !VirtualProtect( p, size, PAGE_EXECUTE_READ, &oldProtect ) )
+		{
+			const HRESULT hr = getLastHr();
+			VirtualFree( p, 0, MEM_RELEASE );
+			return hr;
+		}
+		FlushInstructionCache( GetCurrentProcess(), p, size );
+		rdi = (const uint8_t*)p;
+		return S_OK;
+	}
+
+	inline uint64_t tableKey( uint32_t length, uint8_t panelHeightRegs )
+	{
+		return ( (uint64_t)length << 8 ) | panelHeightRegs;
+	}
+
+	class KernelsTable
+	{
+		// The lookups happen in the constructor of every matrix product, they read an immutable sorted copy of the map without locking.
+		// The compiler publishes a new copy after every length; the replaced ones are kept until the process exits, like the generated code.
+		using Snapshot = std::vector<std::pair<uint64_t, JitTileKernels>>;
+
+		CComAutoCriticalSection critSec;
+		CAtlMap<uint64_t, JitTileKernels> map;
+		std::vector<std::unique_ptr<const Snapshot>> snapshots;
+		std::atomic<const Snapshot*> published{ nullptr };
+
+		void publish();
+
+	public:
+		bool find( uint32_t length, uint8_t panelHeightRegs, JitTileKernels& rdi ) const
+		{
+			const Snapshot* snapshot = published.load( std::memory_order_acquire );
+			if( nullptr == snapshot )
+				return false;
+			const uint64_t key = tableKey( length, panelHeightRegs );
+			auto it = std::lower_bound( snapshot->begin(), snapshot->end(), key,
+				[]( const std::pair<uint64_t, JitTileKernels>& e, uint64_t k ) { return e.first < k; } );
+			if( it == snapshot->end() || it->first != key )
+				return false;
+			rdi = it->second;
+			return true;
+		}
+
+		HRESULT compile( uint32_t length );
+	};
+
+	void KernelsTable::publish()
+	{
+		auto snapshot = std::make_unique<Snapshot>();
+		snapshot->reserve( map.GetCount() );
+		for( POSITION pos = map.GetStartPosition(); nullptr != pos; )
+		{
+			const auto* p = map.GetNext( pos );
+			snapshot->emplace_back( p->m_key, p->m_value );
+		}
+		std::sort( snapshot->begin(), snapshot->end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+		published.store( snapshot.get(), std::memory_order_release );
+		snapshots.emplace_back( std::move( snapshot ) );
+	}
+
+	HRESULT KernelsTable::compile( uint32_t length )
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+		if( nullptr != map.Lookup( tableKey( length, s_panelHeights[ 0 ] ) ) )
+			return S_FALSE;
+
+		// All kernels of the length in a single allocation, the offsets are patched into function pointers once the code is executable
+		Assembler as;
+		std::array<std::array<size_t, 4>, 3> offsets;
+		for( size_t i = 0; i < s_panelHeights.size(); i++ )
+		{
+			const uint8_t panelHeight = s_panelHeights[ i ];
+			offsets[ i ].fill( SIZE_MAX );
+			const uint8_t columns = maxColumns( panelHeight );
+			for( uint8_t c = 1; c <= columns; c++ )
+			{
+				as.align( codeAlignment );
+				offsets[ i ][ c - 1 ] = as.position();
+				emitKernel( as, length, panelHeight, c );
+			}
+		}
+
+		const uint8_t* code;
+		CHECK( makeExecutable( as.bytes(), code ) );
+
+		for( size_t i = 0; i < s_panelHeights.size(); i++ )
+		{
+			JitTileKernels kernels;
+			for( size_t c = 0; c < 4; c++ )
+				kernels[ c ] = ( offsets[ i ][ c ] != SIZE_MAX ) ? (pfnJitTileKernel)( code + offsets[ i ][ c ] ) : nullptr;
+			map.SetAt( tableKey( length, s_panelHeights[ i ] ), kernels );
+		}
+		publish();
+		logDebug( u8"Generated matrix multiplication kernels for length %i, %i bytes of %s code", (int)length, (int)as.position(), haveAvx512 ? "AVX512" : "AVX2" );
+		return S_OK;
+	}
+
+	KernelsTable s_table;
+}
+
+HRESULT CpuCompute::jitCompileMulMat( const uint32_t* lengths, size_t count )
+{
+	for( size_t i = 0; i < count; i++ )
+	{
+		if( 0 == lengths[ i ] || lengths[ i ] > 0x10000 )
+			return E_INVALIDARG;
+		CHECK( s_table.compile( lengths[ i ] ) );
+	}
+	return S_OK;
+}
+
+uint8_t CpuCompute::jitFlavour( uint32_t length )
+{
+	JitTileKernels kernels;
+	if( !s_table.find( length, s_panelHeights[ 0 ], kernels ) )
+		return 0;
+	return haveAvx512 ? 2 : 1;
+}
+
+bool CpuCompute::findJitTileKernels( uint32_t length, uint8_t panelHeightRegs, uint8_t tileWidthFloats, JitTileKernels& rdi )
+{
+	if( tileWidthFloats < 1 || tileWidthFloats > 4 )
+		return false;
+	JitTileKernels kernels;
+	if( !s_table.find( length, panelHeightRegs, kernels ) )
+		return false;
+	// The tile and all partial tiles of that panel height are needed
+	for( uint8_t c = 0; c < tileWidthFloats; c++ )
+		if( nullptr == kernels[ c ] )
+			return false;
+	rdi = kernels;
+	return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+#include <xmmintrin.h>
+
+namespace CpuCompute
+{
+	// Arguments of the runtime generated micro-kernels
+	struct JitTileArgs
+	{
+		// Column major panel of the first matrix, in the thread-local buffer made by MulMatBase::pfnMakePanel
+		const uint16_t* panel;
+		// First column of the tile in the second matrix, the elements of the columns must be continuous
+		const float* b;
+		// Distance between the columns of the second matrix, in bytes
+		size_t strideB;
+		// Output accumulators, in the layout of ResultTile::arr
+		float* tile;
+		// The generated code doesn't use the stack, it saves non-volatile XMM6-XMM15 registers here
+		std::array<__m128, 10> savedXmm;
+	};
+
+	// A micro-kernel computes the product of the complete panel by a few columns of the second matrix.
+	// It only writes the accumulators, the caller applies the epilogue and stores the output tile.
+	using pfnJitTileKernel = void( *)( JitTileArgs* args );
+
+	// Micro-kernels for a length of the dot products and a panel height; the element [ i ] computes i + 1 columns of the tile
+	using JitTileKernels = std::array<pfnJitTileKernel, 4>;
+
+	// Generate micro-kernels for these lengths of the dot products, for all panel heights and tile widths of MulMatImpl.
+	// The code lives until the process exits, the lengths which were already compiled are skipped.
+	HRESULT jitCompileMulMat( const uint32_t* lengths, size_t count );
+
+	// Find the micro-kernels for the tile of MulMatImpl<panelHeightRegs, tileWidthFloats>, and the partial tiles of that panel height.
+	// Returns false when that length wasn't compiled, the caller then uses the kernels from mulMat.kernel.hpp
+	bool findJitTileKernels( uint32_t length, uint8_t panelHeightRegs, uint8_t tileWidthFloats, JitTileKernels& rdi );
+
+	// Code which runs the products with that length of the dot products, the tuner keeps separate results for each one:
+	// 0 for the kernels from mulMat.kernel.hpp, 1 for the generated AVX2 code, 2 for the generated AVX512 code
+	uint8_t jitFlavour( uint32_t length );
+}
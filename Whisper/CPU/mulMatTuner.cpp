@@ -0,0 +1,500 @@
+#include "stdafx.h"
+#include "mulMatTuner.h"
+#include "../API/iContext.cl.h"
+#include "LargeBuffer.h"
+#include "benchmarkUtils.h"
+#include "mulMatJit.h"
+#include "../Utils/CpuProfiler.h"
+#include <atlcoll.h>
+#include <atlfile.h>
+#include <atlstr.h>
+#include <intrin.h>
+#include <atomic>
+#include <memory>
+using namespace CpuCompute;
+
+namespace
+{
+	struct Tile
+	{
+		uint8_t panelHeightRegs, tileWidthFloats;
+	};
+	// Instantiations of MulMatImpl template in mulMatImpl.cpp
+	static const std::array<Tile, 8> s_tiles =
+	{ {
+		{ 1, 1 }, { 4, 1 },
+		{ 1, 2 }, { 4, 2 },
+		{ 1, 3 }, { 2, 3 },
+		{ 1, 4 }, { 2, 4 },
+	} };
+	static const std::array<uint8_t, 3> s_minBatches = { 1, 2, 4 };
+
+	// Buckets of the count of columns in the activations.
+	// The first ones are the decoder with 1 to 4 beams, or 1 to 4 speculative tokens, the larger ones are the prompts.
+	static const std::array<uint32_t, 9> s_bucketLimits = { 1, 2, 3, 4, 8, 16, 64, 256, UINT_MAX };
+	// The count of columns measured for every bucket
+	static const std::array<uint32_t, 9> s_bucketColumns = { 1, 2, 3, 4, 6, 12, 40, 160, 448 };
+
+	uint8_t columnsBucket( uint32_t columns )
+	{
+		uint8_t i = 0;
+		while( columns > s_bucketLimits[ i ] )
+			i++;
+		return i;
+	}
+
+	// Every candidate is measured for at least that many calls and that long, the result is the fastest call
+	constexpr size_t minCalls = 3;
+	constexpr double minSeconds = 2E-3;
+	// Keep the fixed rules unless the tuned variant is faster by more than that; smaller differences are noise
+	constexpr double minGain = 0.02;
+	// Increment when the kernels or the candidates change, to invalidate the old cache files
+	constexpr int cacheVersion = 2;
+
+	// The flavour is the code which computes the tiles, see jitFlavour() function; the generated kernels are much faster, and change the best variants.
+	uint64_t tableKey( uint8_t flavour, uint32_t length, uint32_t rows, uint8_t bucket, int threads )
+	{
+		uint64_t key = flavour;
+		key = ( key << 24 ) | ( rows & 0xFFFFFF );
+		key = ( key << 16 ) | ( length & 0xFFFF );
+		key = ( key << 8 ) | bucket;
+		key = ( key << 8 ) | (uint8_t)std::min( threads, 0xFF );
+		return key;
+	}
+
+	// The tuning results depend on the CPU model, they are cached in a file per CPU:
+	// %LOCALAPPDATA%\Whisper\mulMat-<hash of the CPU brand string>.txt
+	// Only the paths are computed here, saveCache() creates the directory.
+	HRESULT cacheFilePath( const CStringA& cpu, CString& directory, CString& path )
+	{
+		wchar_t buffer[ MAX_PATH ];
+		const DWORD len = GetEnvironmentVariableW( L"LOCALAPPDATA", buffer, MAX_PATH );
+		if( 0 == len || len >= MAX_PATH )
+			return HRESULT_FROM_WIN32( ERROR_ENVVAR_NOT_FOUND );
+
+		// FNV-1a
+		uint32_t hash = 2166136261u;
+		for( int i = 0; i < cpu.GetLength(); i++ )
+			hash = ( hash ^ (uint8_t)cpu[ i ] ) * 16777619u;
+
+		directory = buffer;
+		directory += L"\\Whisper";
+		path = directory;
+		path.AppendFormat( L"\\mulMat-%08X.txt", hash );
+		return S_OK;
+	}
+
+	bool isCandidate( const MulMatVariant& v )
+	{
+		bool tile = false;
+		for( const Tile& t : s_tiles )
+			tile |= ( t.panelHeightRegs == v.panelHeightRegs && t.tileWidthFloats == v.tileWidthFloats );
+		return tile && v.minBatch >= 1 && v.minBatch <= s_minBatches.back();
+	}
+
+	class TuningTable
+	{
+		// Every matrix product looks up the table, these lookups read an immutable sorted copy of the map without locking.
+		// The copy is published when the model loads the cache, and after the tuner is done; the replaced ones are kept until the process exits.
+		using Snapshot = std::vector<std::pair<uint64_t, MulMatVariant>>;
+
+		CComAutoCriticalSection critSec;
+		CAtlMap<uint64_t, MulMatVariant> map;
+		CStringA cpu;
+		CString directory, path;
+		bool loaded = false;
+		std::vector<std::unique_ptr<const Snapshot>> snapshots;
+		std::atomic<const Snapshot*> published{ nullptr };
+
+		void loadCache();
+
+	public:
+		TuningTable() = default;
+		// Use that cache file instead of the one in %LOCALAPPDATA%, for testTuningCache() function
+		TuningTable( LPCWSTR dir, LPCWSTR file ) :
+			directory( dir ), path( file )
+		{ }
+
+		void load()
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+			if( loaded )
+				return;
+			loadCache();
+			publish();
+		}
+
+		// Lock-free lookup in the published copy of the table
+		bool find( uint64_t key, MulMatVariant& rdi ) const
+		{
+			const Snapshot* snapshot = published.load( std::memory_order_acquire );
+			if( nullptr == snapshot )
+				return false;
+			auto it = std::lower_bound( snapshot->begin(), snapshot->end(), key,
+				[]( const std::pair<uint64_t, MulMatVariant>& e, uint64_t k ) { return e.first < k; } );
+			if( it == snapshot->end() || it->first != key )
+				return false;
+			rdi = it->second;
+			return true;
+		}
+
+		// Lookup in the table being tuned, including the entries which are not published yet
+		bool contains( uint64_t key )
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+			return nullptr != map.Lookup( key );
+		}
+
+		void store( uint64_t key, const MulMatVariant& v )
+		{
+			CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+			map.SetAt( key, v );
+		}
+
+		void publish();
+
+		HRESULT saveCache();
+	};
+
+	void TuningTable::publish()
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+		auto snapshot = std::make_unique<Snapshot>();
+		snapshot->reserve( map.GetCount() );
+		for( POSITION pos = map.GetStartPosition(); nullptr != pos; )
+		{
+			const auto* p = map.GetNext( pos );
+			snapshot->emplace_back( p->m_key, p->m_value );
+		}
+		std::sort( snapshot->begin(), snapshot->end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+		published.store( snapshot.get(), std::memory_order_release );
+		snapshots.emplace_back( std::move( snapshot ) );
+	}
+
+	TuningTable s_table;
+
+	void TuningTable::loadCache()
+	{
+		loaded = true;
+		cpu = cpuBrand();
+		cpu.AppendFormat( " %08X", cpuSignature() );
+		HRESULT hr;
+		if( path.IsEmpty() )
+		{
+			hr = cacheFilePath( cpu, directory, path );
+			if( FAILED( hr ) )
+			{
+				logWarningHr( hr, u8"Unable to locate the cache of the tuned matrix multiplication kernels" );
+				return;
+			}
+		}
+
+		CAtlFile file;
+		hr = file.Create( path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING );
+		if( FAILED( hr ) )
+			return;
+		ULONGLONG cb;
+		if( FAILED( file.GetSize( cb ) ) || cb > 0x100000 )
+			return;
+		CStringA text;
+		char* pointer = text.GetBufferSetLength( (int)cb );
+		hr = file.Read( pointer, (DWORD)cb );
+		text.ReleaseBuffer( (int)cb );
+		if( FAILED( hr ) )
+			return;
+
+		// The first line is the version and the CPU, the rest of them are the table entries:
+		// flavour, length, rows, bucket, threads, panelHeightRegs, tileWidthFloats, minBatch
+		int pos = 0;
+		CStringA line = text.Tokenize( "\r\n", pos );
+		CStringA header;
+		header.Format( "%i %s", cacheVersion, cpu.GetString() );
+		if( line != header )
+		{
+			logDebug( u8"The cache of the tuned matrix multiplication kernels is for another CPU or version, ignoring" );
+			return;
+		}
+
+		size_t count = 0;
+		for( line = text.Tokenize( "\r\n", pos ); !line.IsEmpty(); line = text.Tokenize( "\r\n", pos ) )
+		{
+			uint32_t flavour, length, rows, bucket, threads, panel, tile, minBatch;
+			if( 8 != sscanf_s( line, "%u %u %u %u %u %u %u %u", &flavour, &length, &rows, &bucket, &threads, &panel, &tile, &minBatch ) )
+				continue;
+			const MulMatVariant v{ (uint8_t)panel, (uint8_t)tile, (uint8_t)minBatch };
+			if( flavour > 0xFF || bucket >= s_bucketLimits.size() || !isCandidate( v ) )
+				continue;
+			map.SetAt( tableKey( (uint8_t)flavour, length, rows, (uint8_t)bucket, (int)threads ), v );
+			count++;
+		}
+		logDebug16( L"Loaded %zu tuned matrix multiplication kernels from \"%s\"", count, path.GetString() );
+	}
+
+	HRESULT TuningTable::saveCache()
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+		if( path.IsEmpty() )
+			return S_FALSE;
+
+		CStringA text;
+		text.Format( "%i %s\n", cacheVersion, cpu.GetString() );
+		for( POSITION pos = map.GetStartPosition(); nullptr != pos; )
+		{
+			const auto* p = map.GetNext( pos );
+			const uint64_t key = p->m_key;
+			const MulMatVariant& v = p->m_value;
+			text.AppendFormat( "%u %u %u %u %u %u %u %u\n",
+				(uint32_t)( key >> 56 ), (uint32_t)( key >> 16 ) & 0xFFFF, (uint32_t)( key >> 32 ) & 0xFFFFFF, (uint32_t)( key >> 8 ) & 0xFF, (uint32_t)key & 0xFF,
+				v.panelHeightRegs, v.tileWidthFloats, v.minBatch );
+		}
+
+		if( !CreateDirectoryW( directory, nullptr ) )
+		{
+			const DWORD err = GetLastError();
+			if( err != ERROR_ALREADY_EXISTS )
+				return HRESULT_FROM_WIN32( err );
+		}
+
+		CAtlFile file;
+		CHECK( file.Create( path, GENERIC_WRITE, 0, CREATE_ALWAYS ) );
+		CHECK( file.Write( text.GetString(), (DWORD)text.GetLength() ) );
+		return S_OK;
+	}
+
+	class Tuner
+	{
+		ParallelForRunner pfor;
+		const int threads;
+		const double secondsPerTick;
+
+		// Seconds per call of the fastest call
+		template<class Fn>
+		HRESULT measure( Fn&& fn, double& rdi )
+		{
+			// The first call faults in the output buffer, and launches the threads of the pool
+			CHECK( fn() );
+			rdi = INFINITY;
+			const int64_t started = tscNow();
+			for( size_t i = 0; i < minCalls || (double)( tscNow() - started ) * secondsPerTick < minSeconds; i++ )
+			{
+				const int64_t t0 = tscNow();
+				CHECK( fn() );
+				rdi = std::min( rdi, (double)( tscNow() - t0 ) * secondsPerTick );
+			}
+			return S_OK;
+		}
+
+	public:
+		Tuner( int t ) :
+			pfor( t ), threads( t ),
+			secondsPerTick( 1.0 / (double)(int64_t)tscFrequency() )
+		{ }
+
+		HRESULT tune( const MulMatShape& shape, bool force );
+	};
+
+	HRESULT Tuner::tune( const MulMatShape& shape, bool force )
+	{
+		const uint32_t length = shape.length;
+		const uint32_t rows = shape.rows;
+		if( length > 0xFFFF || rows > 0xFFFFFF )
+			return E_INVALIDARG;
+		const size_t weightElements = (size_t)length * rows;
+		const size_t countCopies = weightsPoolCopies( weightElements );
+
+		LargeBuffer weights;
+		CHECK( weights.allocate( weightElements * countCopies * 2 ) );
+		fillRandomHalfs( (uint16_t*)weights.pointer(), weightElements * countCopies, 0 );
+		std::vector<Tensor> a( countCopies );
+		for( size_t i = 0; i < countCopies; i++ )
+			CHECK( a[ i ].attach( (uint16_t*)weights.pointer() + i * weightElements, eDataType::FP16, { length, rows } ) );
+
+		const uint8_t lastBucket = columnsBucket( std::max( shape.maxColumns, 1u ) );
+		for( uint8_t bucket = 0; bucket <= lastBucket; bucket++ )
+		{
+			const uint64_t key = tableKey( jitFlavour( length ), length, rows, bucket, threads );
+			if( !force && s_table.contains( key ) )
+				continue;
+
+			const uint32_t columns = std::min( s_bucketColumns[ bucket ], std::max( shape.maxColumns, 1u ) );
+			LargeBuffer activations, output;
+			CHECK( activations.allocate( (size_t)length * columns * 4 ) );
+			CHECK( output.allocate( (size_t)rows * columns * 4 ) );
+			fillRandom( (float*)activations.pointer(), (size_t)length * columns, bucket );
+			Tensor b, res;
+			CHECK( b.attach( activations.pointer(), eDataType::FP32, { length, columns } ) );
+			CHECK( res.attach( output.pointer(), eDataType::FP32, { rows, columns } ) );
+
+			const MulMatVariant defaultVariant = defaultMulMatVariant( rows, columns );
+			MulMatVariant best = defaultVariant;
+			double bestSeconds = INFINITY, defaultSeconds = INFINITY;
+			for( const Tile& tile : s_tiles )
+			{
+				const size_t panelHeight = (size_t)tile.panelHeightRegs * 8;
+				const size_t countPanels = ( rows + panelHeight - 1 ) / panelHeight;
+				size_t prevThreads = 0;
+				for( uint8_t minBatch : s_minBatches )
+				{
+					// The minimum batch only changes the count of threads which run the job, skip the values which result in the same count
+					const size_t nth = std::max( std::min( countPanels / minBatch, (size_t)threads ), (size_t)1 );
+					if( nth == prevThreads )
+						continue;
+					prevThreads = nth;
+					const MulMatVariant v{ tile.panelHeightRegs, tile.tileWidthFloats, minBatch };
+
+					size_t next = 0;
+					double seconds;
+					CHECK( measure( [ & ]()
+						{
+							const Tensor& src = a[ next ];
+							next = ( next + 1 ) % countCopies;
+							return mulMatVariant( v, res, src, b, pfor );
+						}, seconds ) );
+
+					if( v == defaultVariant )
+						defaultSeconds = seconds;
+					if( seconds < bestSeconds )
+					{
+						bestSeconds = seconds;
+						best = v;
+					}
+				}
+			}
+
+			if( bestSeconds * ( 1.0 + minGain ) > defaultSeconds )
+				best = defaultVariant;
+			s_table.store( key, best );
+
+			const double gain = ( best == defaultVariant ) ? 0.0 : ( defaultSeconds / bestSeconds - 1.0 ) * 100.0;
+			logDebug( u8"mulMat [ %u, %u ] * [ %u, %u ], %i threads: MulMatImpl<%i, %i>, minBatch %i, %.1f%% faster than the default",
+				length, rows, length, columns, threads, (int)best.panelHeightRegs, (int)best.tileWidthFloats, (int)best.minBatch, gain );
+		}
+		return S_OK;
+	}
+}
+
+bool CpuCompute::findTunedMulMat( const Tensor& a, const Tensor& b, int threads, MulMatVariant& rdi )
+{
+	// Only tuning the products of weight matrices by the activations: row major FP16 matrix on the left, and a single layer of both operands
+	if( a.nb[ 0 ] != 1 || a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 || b.ne[ 2 ] != 1 || b.ne[ 3 ] != 1 )
+		return false;
+	if( a.ne[ 0 ] > 0xFFFF || a.ne[ 1 ] > 0xFFFFFF )
+		return false;
+	const uint64_t key = tableKey( jitFlavour( a.ne[ 0 ] ), a.ne[ 0 ], a.ne[ 1 ], columnsBucket( b.ne[ 1 ] ), threads );
+	return s_table.find( key, rdi );
+}
+
+void CpuCompute::loadTunedMulMat()
+{
+	s_table.load();
+}
+
+HRESULT CpuCompute::tuneMulMat( const MulMatShape* shapes, size_t count, int threads, bool force )
+{
+	if( threads < 1 )
+		return E_INVALIDARG;
+	// Load the cache before tuning, otherwise saveCache() would drop the shapes tuned by the previous runs
+	s_table.load();
+	try
+	{
+		Tuner tuner{ threads };
+		for( size_t i = 0; i < count; i++ )
+			CHECK( tuner.tune( shapes[ i ], force ) );
+	}
+	catch( HRESULT hr )
+	{
+		s_table.publish();
+		return hr;
+	}
+
+	s_table.publish();
+	const HRESULT hr = s_table.saveCache();
+	if( FAILED( hr ) )
+		logWarningHr( hr, u8"Unable to save the cache of the tuned matrix multiplication kernels" );
+	return S_OK;
+}
+
+HRESULT CpuCompute::testTuningCache( const wchar_t* directory )
+{
+	struct Entry
+	{
+		uint8_t flavour;
+		uint32_t length, rows;
+		uint8_t bucket;
+		int threads;
+		MulMatVariant variant;
+	};
+	// Every flavour, and the maximum values of all fields of the key
+	static const std::array<Entry, 4> s_entries =
+	{ {
+		{ 0, 384, 384, 0, 1, { 4, 1, 1 } },
+		{ 1, 1536, 384, 4, 8, { 2, 3, 2 } },
+		{ 2, 384, 51865, 1, 16, { 4, 2, 1 } },
+		{ 2, 0xFFFF, 0xFFFFFF, (uint8_t)( s_bucketLimits.size() - 1 ), 0xFF, { 2, 4, 4 } },
+	} };
+
+	CString dir = directory;
+	CString path = dir;
+	path += L"\\mulMat-test.txt";
+
+	// The directory doesn't exist yet, saving the cache creates it
+	HRESULT hr;
+	{
+		TuningTable saved{ dir, path };
+		saved.load();
+		for( const Entry& e : s_entries )
+			saved.store( tableKey( e.flavour, e.length, e.rows, e.bucket, e.threads ), e.variant );
+		hr = saved.saveCache();
+	}
+
+	if( SUCCEEDED( hr ) )
+	{
+		TuningTable loaded{ dir, path };
+		loaded.load();
+		for( const Entry& e : s_entries )
+		{
+			MulMatVariant v;
+			if( loaded.find( tableKey( e.flavour, e.length, e.rows, e.bucket, e.threads ), v ) && v == e.variant )
+				continue;
+			logError( u8"The tuning cache lost the entry for flavour %i, [ %u, %u ], bucket %i, %i threads",
+				(int)e.flavour, e.length, e.rows, (int)e.bucket, e.threads );
+			hr = S_FALSE;
+		}
+
+		// Same shape with another flavour of the kernels, it wasn't saved
+		MulMatVariant v;
+		if( loaded.find( tableKey( 1, 384, 384, 0, 1 ), v ) )
+		{
+			logError( u8"The tuning cache has an entry which wasn't saved" );
+			hr = S_FALSE;
+		}
+	}
+
+	DeleteFileW( path );
+	RemoveDirectoryW( dir );
+	return hr;
+}
+
+HRESULT COMLIGHTCALL Whisper::tuneCpuMatMul( int threads )
+{
+	if( threads < 1 )
+	{
+		logError( u8"%s parameter %i is out of range", "threads", threads );
+		return E_INVALIDARG;
+	}
+
+	// Text state of the decoder in tiny, base, small, medium and large models
+	static const std::array<uint32_t, 5> modelSizes = { 384, 512, 768, 1024, 1280 };
+	constexpr uint32_t n_text_ctx = 448;
+	constexpr uint32_t n_vocab = 51865;
+
+	std::vector<MulMatShape> shapes;
+	for( uint32_t n : modelSizes )
+	{
+		shapes.push_back( MulMatShape{ n, n, n_text_ctx } );
+		shapes.push_back( MulMatShape{ n, n * 4, n_text_ctx } );
+		shapes.push_back( MulMatShape{ n * 4, n, n_text_ctx } );
+		shapes.push_back( MulMatShape{ n, n_vocab, 8 } );
+	}
+	return tuneMulMat( shapes.data(), shapes.size(), threads, true );
+}
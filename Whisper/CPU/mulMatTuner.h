@@ -0,0 +1,51 @@
+#pragma once
+#include "ParallelForRunner.h"
+#include "Tensor.h"
+#include "mulMat.h"
+
+namespace CpuCompute
+{
+	// Template arguments of MulMatImpl class, and the minimum count of panels for every thread of the pool
+	struct MulMatVariant
+	{
+		uint8_t panelHeightRegs;
+		uint8_t tileWidthFloats;
+		uint8_t minBatch;
+
+		bool operator==( const MulMatVariant& that ) const
+		{
+			return panelHeightRegs == that.panelHeightRegs && tileWidthFloats == that.tileWidthFloats && minBatch == that.minBatch;
+		}
+	};
+
+	// The variant selected by the fixed rules, for the output matrix with these counts of rows and columns
+	MulMatVariant defaultMulMatVariant( uint32_t rows, uint32_t columns );
+
+	// Run the specified instantiation of MulMatImpl; the implementation is in mulMat.cpp, where these templates are instantiated
+	HRESULT mulMatVariant( const MulMatVariant& variant, Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const MulMatEpilogue* epilogue = nullptr );
+
+	// Find the variant which was the fastest for the product of the weight matrix by these activations, with that count of threads.
+	// Returns false when the autotuner hasn't measured that shape, or the table wasn't loaded. Doesn't lock, safe to call on every product.
+	bool findTunedMulMat( const Tensor& a, const Tensor& b, int threads, MulMatVariant& rdi );
+
+	// Load the table from the disk cache, unless it was already loaded. The model calls this when it's created with TuneMulMat or JitMulMat flags.
+	void loadTunedMulMat();
+
+	// Shape of a weight matrix, and the maximum count of columns in the activations multiplied by that matrix
+	struct MulMatShape
+	{
+		// Length of the dot products, a.ne[ 0 ]
+		uint32_t length;
+		// Count of the output rows, a.ne[ 1 ]
+		uint32_t rows;
+		uint32_t maxColumns;
+	};
+
+	// Benchmark the candidate variants for these shapes and all buckets of column counts up to maxColumns, update the table, and save it into the disk cache.
+	// The shapes already in the table are skipped unless `force` is true.
+	HRESULT tuneMulMat( const MulMatShape* shapes, size_t count, int threads, bool force = false );
+
+	// Self-test of the disk cache, called by kernelsTest.cpp: save a table into a file in that new directory, load it into another table, and compare them.
+	// Returns S_FALSE when the loaded table is different, the files are deleted afterwards.
+	HRESULT testTuningCache( const wchar_t* directory );
+}
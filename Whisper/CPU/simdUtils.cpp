@@ -316,6 +316,58 @@ void norm( float* rdi, float* temp, const float* rsi, size_t length )
 	}
 }
 
+void normFma( float* rdi, const float* rsi, size_t length, const float* w, const float* b )
+{
+	const size_t lengthAligned = length & maskAlign8;
+	const size_t rem = length % 8;
+
+	// First pass: sum and sum of squares.
+	// The values are shifted by the first element of the row, to avoid catastrophic cancellation in the variance formula.
+	const __m256 shift = _mm256_broadcast_ss( rsi );
+	__m256 sum = _mm256_setzero_ps();
+	__m256 sumSquares = _mm256_setzero_ps();
+	size_t i;
+	for( i = 0; i < lengthAligned; i += 8 )
+	{
+		const __m256 v = _mm256_sub_ps( _mm256_loadu_ps( rsi + i ), shift );
+		sum = _mm256_add_ps( sum, v );
+		sumSquares = _mm256_fmadd_ps( v, v, sumSquares );
+	}
+	const float shiftScalar = rsi[ 0 ];
+	float sumScalar = horizontalSum( sum );
+	float sumSquaresScalar = horizontalSum( sumSquares );
+	for( ; i < length; i++ )
+	{
+		const float v = rsi[ i ] - shiftScalar;
+		sumScalar += v;
+		sumSquaresScalar += v * v;
+	}
+
+	const float lengthFloat = (float)(int)length;
+	const float shiftedMean = sumScalar / lengthFloat;
+	const float variance = std::max( sumSquaresScalar / lengthFloat - shiftedMean * shiftedMean, 0.0f );
+
+	constexpr float eps = 1e-5f;
+	const __m256 mean = _mm256_set1_ps( shiftedMean + shiftScalar );
+	const __m256 scale = _mm256_set1_ps( 1.0f / std::sqrtf( variance + eps ) );
+
+	// Second pass: normalize, apply the affine transform, and store
+	for( i = 0; i < lengthAligned; i += 8 )
+	{
+		__m256 v = _mm256_loadu_ps( rsi + i );
+		v = _mm256_mul_ps( _mm256_sub_ps( v, mean ), scale );
+		v = _mm256_fmadd_ps( v, _mm256_loadu_ps( w + i ), _mm256_loadu_ps( b + i ) );
+		_mm256_storeu_ps( rdi + i, v );
+	}
+	if( 0 != rem )
+	{
+		__m256 v = loadPartial( rsi + i, rem );
+		v = _mm256_mul_ps( _mm256_sub_ps( v, mean ), scale );
+		v = _mm256_fmadd_ps( v, loadPartial( w + i, rem ), loadPartial( b + i, rem ) );
+		storePartial( rdi + i, v, rem );
+	}
+}
+
 void fmaRepeatRow( float* rdi, size_t len, const float* w, const float* b, size_t lenPattern )
 {
 	float* rdiEndAligned = rdi + ( len & maskAlign8 );
@@ -468,20 +520,6 @@ void addRepeatRow( float* rdi, size_t len, const float* b, size_t lenPattern )
 	}
 }
 
-namespace
-{
-	__forceinline __m256 gelu( __m256 x, const DirectCompute::LookupTablesData& lookup )
-	{
-		__m128i iv = _mm256_cvtps_ph( x, 0 );
-		alignas( 16 ) std::array<uint16_t, 8> arr;
-		_mm_store_si128( ( __m128i* )arr.data(), iv );
-		for( uint16_t& a : arr )
-			a = lookup.gelu[ a ];
-		iv = _mm_load_si128( ( __m128i* )arr.data() );
-		return _mm256_cvtph_ps( iv );
-	}
-}
-
 void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern, const DirectCompute::LookupTablesData& lookup )
 {
 	float* rdiEndAligned = rdi + ( len & maskAlign8 );
@@ -535,6 +573,33 @@ void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern
 	}
 }
 
+void epilogueRow( float* rdi, size_t len, const float* bias, float scale, const DirectCompute::LookupTablesData* geluLookup, const float* residual )
+{
+	const size_t lenAligned = len & maskAlign8;
+	const size_t rem = len % 8;
+	const __m256 scaleVec = _mm256_set1_ps( scale );
+	const __m256 zero = _mm256_setzero_ps();
+
+	size_t i;
+	for( i = 0; i < lenAligned; i += 8 )
+	{
+		__m256 v = _mm256_loadu_ps( rdi + i );
+		v = epilogue( v, ( nullptr != bias ) ? _mm256_loadu_ps( bias + i ) : zero, scaleVec, geluLookup );
+		if( nullptr != residual )
+			v = _mm256_add_ps( v, _mm256_loadu_ps( residual + i ) );
+		_mm256_storeu_ps( rdi + i, v );
+	}
+	if( 0 != rem )
+	{
+		const __m256i mask = loadTailMaskInt( rem );
+		__m256 v = _mm256_maskload_ps( rdi + i, mask );
+		v = epilogue( v, ( nullptr != bias ) ? _mm256_maskload_ps( bias + i, mask ) : zero, scaleVec, geluLookup );
+		if( nullptr != residual )
+			v = _mm256_add_ps( v, _mm256_maskload_ps( residual + i, mask ) );
+		_mm256_maskstore_ps( rdi + i, mask, v );
+	}
+}
+
 void __vectorcall scaleRow( float* rdi, size_t len, const __m256 scale )
 {
 	float* rdiEndAligned = rdi + ( len & maskAlign8 );
@@ -652,6 +717,218 @@ void softMax( float* rdi, size_t length, const float inputScale )
 	}
 }
 
+namespace
+{
+	__forceinline float exponentLookup( float f, const LookupTablesData& lookup )
+	{
+		uint16_t f16 = _cvtss_sh( f, 0 );
+		f16 = lookup.exponent[ f16 ];
+		return _cvtsh_ss( f16 );
+	}
+
+	__forceinline void scaleAccumulator( float* rdi, size_t length, float mul )
+	{
+		const __m256 scale = _mm256_set1_ps( mul );
+		for( size_t i = 0; i < length; i += 8 )
+			_mm256_storeu_ps( rdi + i, _mm256_mul_ps( _mm256_loadu_ps( rdi + i ), scale ) );
+	}
+}
+
+namespace
+{
+	// Rows of FP16 keys or values
+	struct Fp16Rows
+	{
+		const uint16_t* rsi;
+		size_t stride;
+
+		__forceinline __m256 load( size_t row, size_t i ) const
+		{
+			return load8( rsi + row * stride + i );
+		}
+		__forceinline float scale( size_t row ) const
+		{
+			return 1.0f;
+		}
+	};
+
+	// Upcast 8 int8_t numbers into FP32
+	__forceinline __m256 load8( const int8_t* rsi )
+	{
+		const __m128i iv = _mm_loadl_epi64( ( const __m128i* )rsi );
+		return _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( iv ) );
+	}
+
+	// Rows of INT8 keys or values, each row has a scale
+	struct Int8Rows
+	{
+		const int8_t* rsi;
+		const float* scales;
+		size_t stride;
+
+		__forceinline __m256 load( size_t row, size_t i ) const
+		{
+			return load8( rsi + row * stride + i );
+		}
+		__forceinline float scale( size_t row ) const
+		{
+			return scales[ row ];
+		}
+	};
+
+	// Rows of INT8 keys or values of an attention head, all rows share the scale
+	struct Int8HeadRows
+	{
+		const int8_t* rsi;
+		float headScale;
+		size_t stride;
+
+		__forceinline __m256 load( size_t row, size_t i ) const
+		{
+			return load8( rsi + row * stride + i );
+		}
+		__forceinline float scale( size_t row ) const
+		{
+			return headScale;
+		}
+	};
+
+	template<class Rows>
+	__forceinline void attentionRowImpl( float* rdi, float* scores, const float* q, const Rows& keys, const Rows& values, size_t headDim, size_t count, const LookupTablesData& lookup )
+	{
+		assert( 0 == headDim % 8 );
+		assert( count > 0 );
+
+		for( size_t i = 0; i < headDim; i += 8 )
+			_mm256_storeu_ps( rdi + i, _mm256_setzero_ps() );
+
+		float maxScalar = -INFINITY;
+		double sum = 0;
+		for( size_t j0 = 0; j0 < count; j0 += attentionBlockLength )
+		{
+			const size_t blockLength = std::min( attentionBlockLength, count - j0 );
+
+			// Compute a block of dot( q, k ) scores
+			float blockMax = -INFINITY;
+			for( size_t j = 0; j < blockLength; j++ )
+			{
+				__m256 acc = _mm256_setzero_ps();
+				for( size_t i = 0; i < headDim; i += 8 )
+					acc = _mm256_fmadd_ps( _mm256_loadu_ps( q + i ), keys.load( j0 + j, i ), acc );
+				const float s = horizontalSum( acc ) * keys.scale( j0 + j );
+				scores[ j ] = s;
+				blockMax = std::max( blockMax, s );
+			}
+
+			// When the running maximum increases, rescale the accumulated values and the sum
+			if( blockMax > maxScalar )
+			{
+				if( maxScalar != -INFINITY )
+				{
+					// Not using the lookup table here: the error would accumulate over the blocks
+					const float mul = std::exp( maxScalar - blockMax );
+					scaleAccumulator( rdi, headDim, mul );
+					sum *= mul;
+				}
+				maxScalar = blockMax;
+			}
+
+			// Accumulate exp( score - max ) * value
+			for( size_t j = 0; j < blockLength; j++ )
+			{
+				const float p = exponentLookup( scores[ j ] - maxScalar, lookup );
+				sum += p;
+				const __m256 pv = _mm256_set1_ps( p * values.scale( j0 + j ) );
+				for( size_t i = 0; i < headDim; i += 8 )
+					_mm256_storeu_ps( rdi + i, _mm256_fmadd_ps( pv, values.load( j0 + j, i ), _mm256_loadu_ps( rdi + i ) ) );
+			}
+		}
+
+		scaleAccumulator( rdi, headDim, (float)( 1.0 / sum ) );
+	}
+}
+
+void attentionRow( float* rdi, float* scores, const float* q, const uint16_t* keys, const uint16_t* values, size_t stride, size_t headDim, size_t count, const LookupTablesData& lookup )
+{
+	attentionRowImpl( rdi, scores, q, Fp16Rows{ keys, stride }, Fp16Rows{ values, stride }, headDim, count, lookup );
+}
+
+void attentionRowInt8( float* rdi, float* scores, const float* q, const int8_t* keys, const float* keyScales, const int8_t* values, const float* valueScales, size_t stride, size_t headDim, size_t count, const LookupTablesData& lookup )
+{
+	attentionRowImpl( rdi, scores, q, Int8Rows{ keys, keyScales, stride }, Int8Rows{ values, valueScales, stride }, headDim, count, lookup );
+}
+
+void attentionHeadInt8( float* rdi, float* scores, const float* q, const int8_t* keys, float keyScale, const int8_t* values, float valueScale, size_t stride, size_t headDim, size_t count, const LookupTablesData& lookup )
+{
+	attentionRowImpl( rdi, scores, q, Int8HeadRows{ keys, keyScale, stride }, Int8HeadRows{ values, valueScale, stride }, headDim, count, lookup );
+}
+
+namespace
+{
+	__forceinline __m256 absolute( __m256 v )
+	{
+		return _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), v );
+	}
+
+	// Multiply 8 numbers by the scale, round to nearest, and store them as bytes
+	__forceinline void storeInt8( int8_t* rdi, __m256 v, __m256 mul )
+	{
+		const __m256i iv = _mm256_cvtps_epi32( _mm256_mul_ps( v, mul ) );
+		__m128i i16 = _mm_packs_epi32( _mm256_castsi256_si128( iv ), _mm256_extracti128_si256( iv, 1 ) );
+		i16 = _mm_packs_epi16( i16, i16 );
+		_mm_storel_epi64( ( __m128i* )rdi, i16 );
+	}
+}
+
+float quantizeRowInt8( int8_t* rdi, const float* rsi, size_t length )
+{
+	assert( 0 == length % 8 );
+
+	// Find maximum absolute value
+	__m256 ax = _mm256_setzero_ps();
+	for( size_t i = 0; i < length; i += 8 )
+		ax = _mm256_max_ps( ax, absolute( _mm256_loadu_ps( rsi + i ) ) );
+	const float maxAbs = horizontalMax( ax );
+
+	if( maxAbs == 0.0f )
+	{
+		memset( rdi, 0, length );
+		return 0.0f;
+	}
+
+	// Scale into [ -127 .. +127 ], round to nearest, and pack into bytes
+	const __m256 mul = _mm256_set1_ps( 127.0f / maxAbs );
+	for( size_t i = 0; i < length; i += 8 )
+		storeInt8( rdi + i, _mm256_loadu_ps( rsi + i ), mul );
+	return maxAbs / 127.0f;
+}
+
+float quantizeRowsInt8( int8_t* rdi, const uint16_t* rsi, size_t stride, size_t length, size_t rows )
+{
+	assert( 0 == length % 8 );
+
+	// Find maximum absolute value of the complete matrix
+	__m256 ax = _mm256_setzero_ps();
+	const uint16_t* rsiRow = rsi;
+	for( size_t r = 0; r < rows; r++, rsiRow += stride )
+		for( size_t i = 0; i < length; i += 8 )
+			ax = _mm256_max_ps( ax, absolute( load8( rsiRow + i ) ) );
+	const float maxAbs = horizontalMax( ax );
+
+	if( maxAbs == 0.0f )
+	{
+		memset( rdi, 0, length * rows );
+		return 0.0f;
+	}
+
+	// The second pass reads the source again, for the attention heads it's small enough to stay in L2 cache
+	const __m256 mul = _mm256_set1_ps( 127.0f / maxAbs );
+	for( size_t r = 0; r < rows; r++, rsi += stride, rdi += length )
+		for( size_t i = 0; i < length; i += 8 )
+			storeInt8( rdi + i, load8( rsi + i ), mul );
+	return maxAbs / 127.0f;
+}
+
 void floatsUpcast( float* rdi, const uint16_t* rsi, size_t length )
 {
 	const uint16_t* rsiEndAligned = rsi + ( length & maskAlign8 );
@@ -691,6 +968,64 @@ void floatsDowncast( uint16_t* rdi, const float* rsi, size_t length )
 	}
 }
 
+namespace
+{
+	// Round 8 FP32 numbers to BF16 with round-to-nearest-even, and pack the results into 16-bit lanes
+	// NaN inputs are not handled, the model weights don't have them
+	__forceinline __m128i downcastBf16( __m256 vf )
+	{
+		const __m128i bias = _mm_set1_epi32( 0x7FFF );
+		const __m128i one = _mm_set1_epi32( 1 );
+
+		__m128i low = _mm_castps_si128( _mm256_castps256_ps128( vf ) );
+		__m128i high = _mm_castps_si128( _mm256_extractf128_ps( vf, 1 ) );
+
+		// The lowest bit of the result is needed to round the ties to even
+		low = _mm_add_epi32( low, _mm_add_epi32( bias, _mm_and_si128( _mm_srli_epi32( low, 16 ), one ) ) );
+		high = _mm_add_epi32( high, _mm_add_epi32( bias, _mm_and_si128( _mm_srli_epi32( high, 16 ), one ) ) );
+
+		low = _mm_srli_epi32( low, 16 );
+		high = _mm_srli_epi32( high, 16 );
+		return _mm_packus_epi32( low, high );
+	}
+
+	__forceinline void storePartial16( uint16_t* rdi, __m128i vi, size_t count )
+	{
+		for( size_t i = 0; i < count; i++, rdi++ )
+		{
+			*rdi = (uint16_t)(uint32_t)_mm_cvtsi128_si32( vi );
+			vi = _mm_srli_si128( vi, 2 );
+		}
+	}
+}
+
+void floatsToBf16( uint16_t* rdi, const float* rsi, size_t length )
+{
+	const float* rsiEndAligned = rsi + ( length & maskAlign8 );
+	const size_t rem = length % 8;
+
+	for( ; rsi < rsiEndAligned; rsi += 8, rdi += 8 )
+		store16( rdi, downcastBf16( _mm256_loadu_ps( rsi ) ) );
+
+	if( 0 != rem )
+	{
+		__m256 vf = _mm256_maskload_ps( rsi, loadTailMaskInt( rem ) );
+		storePartial16( rdi, downcastBf16( vf ), rem );
+	}
+}
+
+void halfsToBf16( uint16_t* rdi, const uint16_t* rsi, size_t length )
+{
+	const uint16_t* rsiEndAligned = rsi + ( length & maskAlign8 );
+	const size_t rem = length % 8;
+
+	for( ; rsi < rsiEndAligned; rsi += 8, rdi += 8 )
+		store16( rdi, downcastBf16( load8( rsi ) ) );
+
+	if( 0 != rem )
+		storePartial16( rdi, downcastBf16( loadPartial( rsi, rem ) ), rem );
+}
+
 void addRowInPlace( float* rdi, const float* rsi, size_t length )
 {
 	const float* rdiEndAligned = rdi + ( length & maskAlign8 );
@@ -1,5 +1,6 @@
 #pragma once
 #include <immintrin.h>
+#include "../ML/LookupTablesData.h"
 
 void addF16to32( float* rdi, const uint16_t* a, const uint16_t* b, size_t length );
 void addF16to32( float* rdi, const uint16_t* a, const float* b, size_t length );
@@ -34,20 +35,66 @@ inline size_t tempBufferForFloats( size_t count )
 
 void norm( float* rdi, float* temp, const float* rsi, size_t length );
 
+// Fused layer normalization and affine transform, rdi = norm( rsi ) * w + b, where w and b are vectors of the same length as the row.
+// Makes two passes over the source: sum with sum of squares, then the output. Unlike norm(), doesn't need the temporary buffer.
+void normFma( float* rdi, const float* rsi, size_t length, const float* w, const float* b );
+
 void fmaRepeatRow( float* rdi, size_t len, const float* w, const float* b, size_t lenPattern );
 void __vectorcall addRepeatScaleRow( float* rdi, size_t len, const float* b, size_t lenPattern, const __m256 scale );
 void addRepeatRow( float* rdi, size_t len, const float* b, size_t lenPattern );
 void __vectorcall scaleRow( float* rdi, size_t len, const __m256 scale );
 
-namespace DirectCompute
-{
-	struct LookupTablesData;
-}
 const DirectCompute::LookupTablesData& getLookupTables();
 void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern, const DirectCompute::LookupTablesData& lookup );
 
+__forceinline __m256 gelu( __m256 x, const DirectCompute::LookupTablesData& lookup )
+{
+	__m128i iv = _mm256_cvtps_ph( x, 0 );
+	alignas( 16 ) std::array<uint16_t, 8> arr;
+	_mm_store_si128( ( __m128i* )arr.data(), iv );
+	for( uint16_t& a : arr )
+		a = lookup.gelu[ a ];
+	iv = _mm_load_si128( ( __m128i* )arr.data() );
+	return _mm256_cvtph_ps( iv );
+}
+
+// The first part of the matrix multiplication epilogue, gelu( ( x + bias ) * scale ). Pass nullptr lookup tables to skip the GELU.
+__forceinline __m256 __vectorcall epilogue( __m256 x, __m256 bias, __m256 scale, const DirectCompute::LookupTablesData* geluLookup )
+{
+	x = _mm256_add_ps( x, bias );
+	x = _mm256_mul_ps( x, scale );
+	if( nullptr != geluLookup )
+		x = gelu( x, *geluLookup );
+	return x;
+}
+
+// Apply the matrix multiplication epilogue to a row of the output, rdi = gelu( ( rdi + bias ) * scale ) + residual
+// Bias, lookup tables and residual are all optional, pass nullptr to skip these steps.
+void epilogueRow( float* rdi, size_t len, const float* bias, float scale, const DirectCompute::LookupTablesData* geluLookup, const float* residual );
+
 void softMax( float* rdi, size_t length, const float inputScale );
 
+// Count of attention scores computed at once by attentionRow(), it's the required size of the scores buffer
+constexpr size_t attentionBlockLength = 64;
+
+// Compute softmax( q * keys ) * values for a single query row and a single attention head, without materializing the complete row of attention weights.
+// Keys and values are FP16 matrices of size [ headDim, count ], with the specified row stride in elements. The head dimension must be a multiple of 8.
+// The scores buffer needs space for attentionBlockLength floats.
+void attentionRow( float* rdi, float* scores, const float* q, const uint16_t* keys, const uint16_t* values, size_t stride, size_t headDim, size_t count, const DirectCompute::LookupTablesData& lookup );
+
+// Same as attentionRow(), for INT8 keys and values. Each row of keys and values has a scale, these vectors are dense.
+void attentionRowInt8( float* rdi, float* scores, const float* q, const int8_t* keys, const float* keyScales, const int8_t* values, const float* valueScales, size_t stride, size_t headDim, size_t count, const DirectCompute::LookupTablesData& lookup );
+
+// Same as attentionRowInt8(), for INT8 keys and values with a single scale for the complete head
+void attentionHeadInt8( float* rdi, float* scores, const float* q, const int8_t* keys, float keyScale, const int8_t* values, float valueScale, size_t stride, size_t headDim, size_t count, const DirectCompute::LookupTablesData& lookup );
+
+// Quantize FP32 row into INT8 with symmetric range, return the scale. The length must be a multiple of 8.
+float quantizeRowInt8( int8_t* rdi, const float* rsi, size_t length );
+
+// Quantize FP16 matrix [ length, rows ] into a dense INT8 matrix with symmetric range and a single scale, return the scale.
+// The stride is the distance between rows of the source, in elements. The length must be a multiple of 8.
+float quantizeRowsInt8( int8_t* rdi, const uint16_t* rsi, size_t stride, size_t length, size_t rows );
+
 // A cache line-aligned array where first 8 elements have all bits set, last 8 elements are zeros
 extern const std::array<int, 16> s_zeroTailMask;
 
@@ -78,5 +125,10 @@ void floatsUpcast( float* rdi, const uint16_t* rsi, size_t length );
 
 void floatsDowncast( uint16_t* rdi, const float* rsi, size_t length );
 
+// Convert FP32 numbers into BF16, rounding to nearest even
+void floatsToBf16( uint16_t* rdi, const float* rsi, size_t length );
+// Convert FP16 numbers into BF16, rounding the 10-bit mantissa to 7 bits. It's safe to call in-place, with rdi == rsi
+void halfsToBf16( uint16_t* rdi, const uint16_t* rsi, size_t length );
+
 void addRowInPlace( float* rdi, const float* rsi, size_t length );
 void addRow( float* rdi, const float* a, const float* b, size_t length );
\ No newline at end of file
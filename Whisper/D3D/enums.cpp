@@ -1,9 +1,11 @@
 #include "stdafx.h"
 #include "enums.h"
 
-static const alignas( 16 ) std::array<DXGI_FORMAT, 3> s_tensorViewFormats = { DXGI_FORMAT_R16_FLOAT, DXGI_FORMAT_R32_FLOAT, DXGI_FORMAT_R32_UINT };
+static const alignas( 16 ) std::array<DXGI_FORMAT, 4> s_tensorViewFormats = { DXGI_FORMAT_R16_FLOAT, DXGI_FORMAT_R32_FLOAT, DXGI_FORMAT_R32_UINT, DXGI_FORMAT_R16_UINT };
 
 DXGI_FORMAT DirectCompute::viewFormat( eDataType dt )
 {
+	// BF16 tensors only live in system RAM, we don't have shaders for them
+	assert( dt != eDataType::BF16 );
 	return s_tensorViewFormats[ (uint8_t)dt ];
 }
\ No newline at end of file
@@ -9,13 +9,15 @@ namespace DirectCompute
 		FP16,
 		FP32,
 		U32,
+		// Brain floating point, upper 16 bits of FP32. Only supported by the CPU tensors, GPU has no native support for the format.
+		BF16,
 	};
 
 	inline size_t elementSize( eDataType dt )
 	{
-		assert( dt == eDataType::FP16 || dt == eDataType::FP32 || dt == eDataType::U32 );
+		assert( dt == eDataType::FP16 || dt == eDataType::FP32 || dt == eDataType::U32 || dt == eDataType::BF16 );
 
-		return ( dt == eDataType::FP16 ) ? 2 : 4;
+		return ( dt == eDataType::FP16 || dt == eDataType::BF16 ) ? 2 : 4;
 	}
 
 	DXGI_FORMAT viewFormat( eDataType dt );
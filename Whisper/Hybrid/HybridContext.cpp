@@ -3,6 +3,9 @@
 #include <optional>
 #include "HybridContext.h"
 #include "../Utils/Trace/tracing.h"
+#include "../Whisper/sEncodeParams.h"
+#include "../Whisper/WhisperContext.h"
+#include "../Whisper/DeviceLock.h"
 
 #if BUILD_HYBRID_VERSION
 namespace
@@ -27,92 +30,60 @@ namespace
 	constexpr size_t MB = 1u << 20;
 }
 
-HybridContext::HybridContext( const Whisper::WhisperModel& wm ) :
+HybridContext::HybridContext( const Whisper::WhisperModel& wm, Whisper::ProfileCollection& profiler ) :
 	ml( threadsCount( 0 ) ),
 	model( wm.hybridTensors ),
-	whisperModel( wm )
-{ }
+	whisperModel( wm ),
+	profiler( profiler )
+{
+	ml.setProfiler( &profiler );
+}
 
 namespace
 {
-	enum struct eModelType : uint8_t
+	// Capacity of the arenas, derived from the lifetimes of the tensors in HybridContext::decode() for the longest sequence of n_text_ctx tokens
+	// The arenas only reserve address space, the memory is committed on demand, so these are upper bounds rather than the expected RAM use
+	struct ArenaSizes
 	{
-		Tiny = 0,
-		Base = 1,
-		Small = 2,
-		Medium = 3,
-		Large = 4,
+		size_t compute, layer;
 	};
 
-	static HRESULT detectModelType( const Whisper::sModelParams& modelParams, eModelType& mt )
+	ArenaSizes decoderArenaSizes( const Whisper::sModelParams& mp )
 	{
-		switch( modelParams.n_audio_layer )
-		{
-		case 4:
-			mt = eModelType::Tiny;
-			return S_OK;
-		case 6:
-			mt = eModelType::Base;
-			return S_OK;
-		case 12:
-			mt = eModelType::Small;
-			return S_OK;
-		case 24:
-			mt = eModelType::Medium;
-			return S_OK;
-		case 32:
-			mt = eModelType::Large;
-			return S_OK;
-		}
-		logError( u8"Unrecognized model" );
-		return E_INVALIDARG;
+		const size_t tokens = mp.n_text_ctx;
+		const size_t row = sizeof( float ) * mp.n_text_state;
+		// Slack for the alignment of individual tensors
+		constexpr size_t alignSlack = 64 * 32;
+
+		ArenaSizes res;
+		// The embeddings, the output of the final norm, and the logits; they live until the end of decode()
+		res.compute = tokens * ( row * 2 + sizeof( float ) * mp.n_vocab ) + alignSlack;
+		// The per-layer arena is reset after every layer, it keeps all tensors of the layer:
+		// 11 tensors of [ n_state, N ] shape, and the [ 4 * n_state, N ] output of the first MLP layer
+		// The output of the layer is in the dedicated allocLayerOutput buffer
+		res.layer = tokens * row * ( 11 + 4 ) + alignSlack;
+		return res;
 	}
-
-	struct alignas( 2 ) RamMB
-	{
-		uint8_t dec, decLayer;
-		constexpr RamMB( uint8_t d, uint8_t dl ) : dec( d ), decLayer( dl ) { }
-
-		__m128i loadBytes() const
-		{
-			__m128i v = _mm_loadu_si16( this );
-			// Upcast bytes to int64_t. That instruction can load directly from memory, too bad VC++ optimized doesn't care
-			v = _mm_cvtepu8_epi64( v );
-			// Scale from megabytes into bytes, the multiplier is obviously 2^20
-			v = _mm_slli_epi64( v, 20 );
-			return v;
-		}
-	};
-
-	// The magic numbers are from MEM_REQ_DECODE and MEM_REQ_DECODE_LAYER red/black maps in the reference version,
-	// near the top of whisper.cpp source file
-	static const std::array<RamMB, 5> s_memRequirements =
-	{
-		RamMB{ 200, 32 },	// Tiny
-		RamMB{ 202, 44 },	// Base
-		RamMB{ 204, 64 },	// Small
-		RamMB{ 206, 84 },	// Medium
-		RamMB{ 208, 110 },	// Large
-	};
 }
 
 HRESULT HybridContext::create()
 {
 	// Allocate buffers for compute
 	// We know they're large, so bypassing the heap
-	eModelType modelType;
-	CHECK( detectModelType( whisperModel.parameters, modelType ) );
-
-	const __m128i bytes = s_memRequirements.at( (uint8_t)modelType ).loadBytes();
-	CHECK( allocCompute.create( _mm_cvtsi128_si64( bytes ) ) );
-	CHECK( allocComputeLayer.create( _mm_extract_epi64( bytes, 1 ) ) );
+	const ArenaSizes arenas = decoderArenaSizes( whisperModel.parameters );
+	CHECK( allocCompute.create( arenas.compute ) );
+	CHECK( allocComputeLayer.create( arenas.layer ) );
 
 	// Create staging buffers to download output from encoder stage,
 	// in the reference version they're named memory_cross_k / memory_cross_v
 	CHECK( kvCross.create( whisperModel.parameters ) );
 
 	// Create RAM buffers for memory_k / memory_v
-	CHECK( kv.create( whisperModel.parameters ) );
+	// The cross-attention cache is written at once for all tokens, with INT8 precision it uses a single scale per head
+	const auto& mp = whisperModel.parameters;
+	const bool int8 = whisperModel.hybridCacheInt8;
+	CHECK( kv.create( mp, int8 ) );
+	CHECK( kvCrossCache.create( mp.n_text_layer, mp.n_audio_ctx, mp.n_text_state, mp.n_text_head, int8, true ) );
 
 	return S_OK;
 }
@@ -137,6 +108,32 @@ public:
 	}
 };
 
+void HybridContext::repackCrossCache( uint32_t M )
+{
+	if( M == kvCrossLength )
+		return;
+
+	// The encoder produces these tensors in [ layer ][ token ][ n_state ] layout, transpose them into the head-major one
+	const auto& hparams = whisperModel.parameters;
+	const uint32_t n_state = hparams.n_text_state;
+	const uint32_t len = M * n_state * hparams.n_text_layer;
+	// The device is single-threaded, other contexts might be using it on their threads
+	Whisper::DeviceLockRaii lock{ &DirectCompute::WhisperContext::deviceLock(), profiler };
+	{
+		auto mapped = kvCross.map();
+		const CpuCompute::Tensor k = mapped.keysView( len, 0 ).reshape3d( n_state, M, hparams.n_text_layer );
+		const CpuCompute::Tensor v = mapped.valuesView( len, 0 ).reshape3d( n_state, M, hparams.n_text_layer );
+		ml.setNextTag( "crossAttn.repack" );
+		ml.storeHeads( kvCrossCache, k, v, M );
+	}
+	kvCrossLength = M;
+
+	// The cache has a complete copy of the staging buffers, without the pipelined encoder they're not needed until the next window.
+	// For the large model, these buffers take 245 MB of system RAM.
+	if( !downloadsAhead )
+		kvCross.release();
+}
+
 HRESULT HybridContext::decode( const int* tokens, const int n_tokens, const int n_past, const sDecParams& dp, std::vector<float>& probs )
 {
 	CHECK( ml.setThreadsCount( dp.n_threads ) );
@@ -145,7 +142,6 @@ HRESULT HybridContext::decode( const int* tokens, const int n_tokens, const int
 	const auto& hparams = whisperModel.parameters;
 	const uint32_t n_vocab = hparams.n_vocab;
 
-	const uint32_t n_ctx = hparams.n_text_ctx;
 	const uint32_t n_state = hparams.n_text_state;
 	const uint32_t n_head = hparams.n_text_head;
 	const uint32_t n_layer = hparams.n_text_layer;
@@ -159,7 +155,7 @@ HRESULT HybridContext::decode( const int* tokens, const int n_tokens, const int
 	Tracing::tensor( "dec-rows", cur );
 
 	Tensor inpL = cur;
-	auto kvCross = this->kvCross.map();
+	repackCrossCache( M );
 
 	for( uint32_t il = 0; il < n_layer; il++ )
 	{
@@ -168,148 +164,134 @@ HRESULT HybridContext::decode( const int* tokens, const int n_tokens, const int
 		SetAllocatorRaii acLayer{ this, allocComputeLayer };
 
 		// norm
-		Tensor cur = ml.norm( inpL );
-		ml.fmaRepeat( cur, layer.attnLn0 );
+		Tensor cur = ml.normFma( inpL, layer.attnLn0 );
 		if( 0 == il ) Tracing::tensor( "dec-norm", cur );
 
 		// self-attention
 		{
-			Tensor Qcur = ml.mulMat( layer.attnQuery.w, cur );
-			if( 0 == il ) Tracing::tensor( "dec-Qcur-0", Qcur );
 			const float scaling = computeScaling( (int)n_state, (int)n_head );
-			ml.addRepeatScale( Qcur, layer.attnQuery.b, scaling );
+			ml.setNextTag( "attn.query" );
+			Tensor Qcur = ml.mulMat( layer.attnQuery.w, cur, MulMatEpilogue{ .bias = &layer.attnQuery.b, .scale = scaling } );
 			if( 0 == il ) Tracing::tensor( "dec-Qcur-1", Qcur );
 
 			// note: no bias for Key
-			Tensor Kcur = ml.mulMat( layer.attnKey, cur );
-			ml.scale( Kcur, scaling );
+			ml.setNextTag( "attn.key" );
+			Tensor Kcur = ml.mulMat( layer.attnKey, cur, MulMatEpilogue{ .scale = scaling } );
 			if( 0 == il ) Tracing::tensor( "dec-Kcur", Kcur );
 
-			Tensor Vcur = ml.mulMat( layer.attnValue.w, cur );
-			ml.addRepeat( Vcur, layer.attnValue.b );
+			ml.setNextTag( "attn.value" );
+			Tensor Vcur = ml.mulMat( layer.attnValue.w, cur, MulMatEpilogue{ .bias = &layer.attnValue.b } );
 			if( 0 == il ) Tracing::tensor( "dec-Vcur", Vcur );
 
 			// store key and value to memory
-			{
-				const uint32_t len = N * n_state;
-				const uint32_t off = n_state * ( (uint32_t)il * n_ctx + n_past );
-				Tensor k = kv.keysView( len, off );
-				Tensor v = kv.valuesView( len, off );
-
-				CHECK( ml.copyImpl( k, Kcur ) );
-				CHECK( ml.copyImpl( v, Vcur ) );
-			}
+			kv.store( il, n_past, Kcur, Vcur );
 
 			// ------
-			Tensor Q = ml.permute( ml.copy( Qcur, eDataType::FP32, { n_state / n_head, n_head, N } ), 0, 2, 1, 3 );
-			Tensor K = ml.permute( kv.keysView( ( n_past + N ) * n_state, (uint32_t)il * n_ctx * n_state )
-				.reshape3d( n_state / n_head, n_head, n_past + N ),
-				0, 2, 1, 3 );
-			Tensor KQ = ml.mulMat( K, Q );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-0", KQ );
-			ml.diagMaskInf( KQ, n_past );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-1", KQ );
-			ml.softMax( KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-2", KQ );
-
-			Tensor V_trans = ml.permute(
-				kv.valuesView( ( n_past + N ) * n_state, (uint32_t)il * n_ctx * n_state )
-				.reshape3d( n_state / n_head, n_head, n_past + N ),
-				1, 2, 0, 3 );
-
-			Tensor KQV = ml.mulMat( V_trans, KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
-
-			Tensor KQV_merged = ml.permute( KQV, 0, 2, 1, 3 );
-			ml.copyInPlace( cur, KQV_merged, eDataType::FP32, { n_state, N } );
-		}
-
-		{
-			cur = ml.mulMat( layer.attnLn1.w, cur );
-			ml.addRepeat( cur, layer.attnLn1.b );
+			// Fused attention replaces mulMat( K, Q ), diagMaskInf, softMax, and mulMat( V_trans, KQ ): the KQ matrix is never materialized
+			ml.setNextTag( "attn" );
+			cur = ml.attention( Qcur, kv.view( il, n_past + N ), true, n_past );
+			// Same tag and layout as the KQV tensor of the unfused attention, the traces stay comparable with older ones and with the other engines
+			if( 0 == il ) Tracing::tensor( "dec-KQV", ml.permute( cur.reshape3d( n_state / n_head, n_head, N ), 0, 2, 1, 3 ) );
 		}
 
-		// add the input
-		Tensor inpCA = ml.add( cur, inpL );
+		// projection, and add the input
+		ml.setNextTag( "attn.out" );
+		Tensor inpCA = ml.mulMat( layer.attnLn1.w, cur, MulMatEpilogue{ .bias = &layer.attnLn1.b, .residual = &inpL } );
 
 		// norm
-		{
-			cur = ml.norm( inpCA );
-			ml.fmaRepeat( cur, layer.crossAttnLn0 );
-		}
+		cur = ml.normFma( inpCA, layer.crossAttnLn0 );
 
 		// cross-attention
 		{
-			Tensor Qcur = ml.mulMat( layer.crossAttnQuery.w, cur );
-			ml.addRepeatScale( Qcur, layer.crossAttnQuery.b, computeScaling( (int)n_state, (int)n_head ) );
+			const float scaling = computeScaling( (int)n_state, (int)n_head );
+			ml.setNextTag( "crossAttn.query" );
+			Tensor Qcur = ml.mulMat( layer.crossAttnQuery.w, cur, MulMatEpilogue{ .bias = &layer.crossAttnQuery.b, .scale = scaling } );
 
 			// Kcross is already scaled
-			const uint32_t len = M * n_state;
-			const uint32_t off = (uint32_t)il * len;
-			Tensor Kcross = kvCross.keysView( len, off ).reshape3d( n_state / n_head, n_head, M );
-			Tensor Vcross = kvCross.valuesView( len, off ).reshape3d( n_state / n_head, n_head, M );
-
 			// ------
-			Tensor Q = ml.permute( ml.copy( Qcur, eDataType::FP32, { n_state / n_head, n_head, N } ), 0, 2, 1, 3 );
-			Tensor K = ml.permute( Kcross, 0, 2, 1, 3 );
-			Tensor KQ = ml.mulMat( K, Q );
-			ml.softMax( KQ );
-			Tensor V_trans = ml.permute( Vcross, 1, 2, 0, 3 );
-			Tensor KQV = ml.mulMat( V_trans, KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
-			Tensor KQV_merged = ml.permute( KQV, 0, 2, 1, 3 );
-
-			ml.copyInPlace( cur, KQV_merged, eDataType::FP32, { n_state, N } );
+			ml.setNextTag( "crossAttn" );
+			cur = ml.attention( Qcur, kvCrossCache.view( il, M ), false );
+			if( 0 == il ) Tracing::tensor( "dec-KQV", ml.permute( cur.reshape3d( n_state / n_head, n_head, N ), 0, 2, 1, 3 ) );
 		}
 
-		// projection
-		{
-			cur = ml.mulMat( layer.crossAttnLn1.w, cur );
-			ml.addRepeat( cur, layer.crossAttnLn1.b );
-		}
-		// add the input
-		ml.addInPlace( cur, inpCA );
-		Tensor inpFF = cur;
+		// projection, and add the input
+		ml.setNextTag( "crossAttn.out" );
+		Tensor inpFF = ml.mulMat( layer.crossAttnLn1.w, cur, MulMatEpilogue{ .bias = &layer.crossAttnLn1.b, .residual = &inpCA } );
 
 		// feed-forward network
 		{
 			// norm
-			cur = ml.norm( inpFF );
-			ml.fmaRepeat( cur, layer.mlpLn );
+			cur = ml.normFma( inpFF, layer.mlpLn );
 
-			cur = ml.mulMat( layer.mlp0.w, cur );
-			ml.addRepeatGelu( cur, layer.mlp0.b );
+			ml.setNextTag( "mlp.0" );
+			cur = ml.mulMat( layer.mlp0.w, cur, MulMatEpilogue{ .bias = &layer.mlp0.b, .gelu = true } );
 
 			// The mulMat() below creates a tensor for the output of this layer.
 			// We have a special memory storage for these tensors, that's how they survive resets of per-layer arenas
 			allocLayerOutput.resetArena();
 			ml.setAllocator( &allocLayerOutput );
 
-			// projection
-			cur = ml.mulMat( layer.mlp1.w, cur );
-			ml.addRepeat( cur, layer.mlp1.b );
+			// projection, and add the input
+			ml.setNextTag( "mlp.1" );
+			cur = ml.mulMat( layer.mlp1.w, cur, MulMatEpilogue{ .bias = &layer.mlp1.b, .residual = &inpFF } );
 		}
 
 		// output from this layer
-		ml.addInPlace( cur, inpFF );
 		inpL = cur;
 	}
 
 	// norm
-	cur = ml.norm( inpL );
-	ml.fmaRepeat( cur, model.ln );
+	cur = ml.normFma( inpL, model.ln );
 
-	cur = ml.mulMat( model.tokenEmbedding, cur );
+	ml.setNextTag( "logits" );
+	if( nullptr == dp.allowedTokens )
+		cur = ml.mulMat( model.tokenEmbedding, cur );
+	else
+	{
+		CHECK( restrictedEmbedding( dp.allowedTokens, dp.countAllowed ) );
+		cur = ml.mulMat( restrictedRows, cur );
+	}
 
 	// logits -> probs
 	ml.softMax( cur );
 
 	const float* rsi = cur.fp32();
-	probs.assign( rsi, rsi + cur.countElements() );
+	if( nullptr == dp.allowedTokens )
+		probs.assign( rsi, rsi + cur.countElements() );
+	else
+		DirectCompute::expandRestrictedProbs( probs, rsi, N, n_vocab, dp.allowedTokens, dp.countAllowed );
 	Tracing::vector( "probs", probs );
 	return S_OK;
 }
 
+HRESULT HybridContext::restrictedEmbedding( const int* tokens, uint32_t count )
+{
+	if( restrictedTokens.size() == count && std::equal( tokens, tokens + count, restrictedTokens.begin() ) )
+		return S_OK;
+
+	const CpuCompute::Tensor& source = model.tokenEmbedding;
+	if( 0 == count || !source.isContinuous() )
+		return E_INVALIDARG;
+	const uint32_t rowLength = source.ne[ 0 ];
+	const size_t cbRow = DirectCompute::elementSize( source.type() ) * rowLength;
+
+	restrictedTokens.clear();
+	CHECK( restrictedBuffer.allocate( cbRow * count ) );
+	const uint8_t* rsi = (const uint8_t*)source.data();
+	uint8_t* rdi = restrictedBuffer.pointer();
+	for( uint32_t i = 0; i < count; i++, rdi += cbRow )
+	{
+		const int tok = tokens[ i ];
+		if( tok < 0 || (uint32_t)tok >= source.ne[ 1 ] )
+			return E_BOUNDS;
+		memcpy( rdi, rsi + cbRow * tok, cbRow );
+	}
+	CHECK( restrictedRows.attach( restrictedBuffer.pointer(), source.type(), { rowLength, count } ) );
+
+	restrictedTokens.assign( tokens, tokens + count );
+	return S_OK;
+}
+
 void* HybridContext::AllocSingle::allocate( size_t cb, size_t align )
 {
 	if( !allocated )
@@ -26,26 +26,58 @@ class HybridContext
 
 	const CpuCompute::DecoderTensors& model;
 	const Whisper::WhisperModel& whisperModel;
+	// Profiler of the context, measures the wait for the device lock in repackCrossCache()
+	Whisper::ProfileCollection& profiler;
 	KeyValueDownloader kvCross;
 	CpuCompute::KvTensors kv;
+	// Cross-attention cache, repacked from the staging buffers into the head-major layout
+	CpuCompute::KvTensors kvCrossCache;
+	// Count of tokens in kvCrossCache, zero after downloadKeyValues() until the cache is repacked
+	uint32_t kvCrossLength = 0;
+	// True when the last download was made ahead by the pipelined encoder; the staging buffers are kept for the next one
+	bool downloadsAhead = false;
+
+	// If needed, repack kvCross staging buffers into kvCrossCache, and release these buffers unless the encoder is pipelined.
+	// The staging buffers are resources of the shared D3D device, the method holds the device lock while it uses them.
+	void repackCrossCache( uint32_t M );
+
+	// Rows of the token embedding matrix for the restricted vocabulary, copied on the first decode() call with the new set of tokens
+	std::vector<int> restrictedTokens;
+	CpuCompute::LargeBuffer restrictedBuffer;
+	CpuCompute::Tensor restrictedRows;
+	HRESULT restrictedEmbedding( const int* tokens, uint32_t count );
 
 	class SetAllocatorRaii;
 
 public:
 
-	HybridContext( const Whisper::WhisperModel& wm );
+	// The CPU operations of the decoder are measured with the profiler of the context
+	HybridContext( const Whisper::WhisperModel& wm, Whisper::ProfileCollection& profiler );
 
 	HRESULT create();
 
-	HRESULT downloadKeyValues( const DirectCompute::KeyValueBuffers& source )
+	// Download cross-attention buffers to the staging ones. Unless `ahead` is true, the next decode() call repacks them into the cache.
+	// With `ahead` = true, the decoder continues to use the cache until useDownloadedKeyValues() method is called.
+	HRESULT downloadKeyValues( const DirectCompute::KeyValueBuffers& source, bool ahead = false )
 	{
+		if( !ahead )
+			kvCrossLength = 0;
+		downloadsAhead = ahead;
 		return kvCross.download( source );
 	}
 
+	void useDownloadedKeyValues()
+	{
+		kvCrossLength = 0;
+	}
+
 	struct sDecParams
 	{
 		int n_threads;
 		int M;
+		// Optional restricted vocabulary, see DirectCompute::sDecodeParams
+		const int* allowedTokens = nullptr;
+		uint32_t countAllowed = 0;
 	};
 
 	HRESULT decode( const int* tokens, const int n_tokens, const int n_past, const sDecParams& dp, std::vector<float>& probs_out );
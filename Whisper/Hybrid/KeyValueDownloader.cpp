@@ -3,21 +3,25 @@
 
 HRESULT KeyValueDownloader::create( const Whisper::sModelParams& mp )
 {
-	const uint32_t n_audio_ctx = mp.n_audio_ctx;
 	const uint32_t n_mem = mp.n_text_layer * mp.n_audio_ctx;
-	const uint32_t n_elements = mp.n_text_state * n_mem;
+	length = mp.n_text_state * n_mem;
+	return createBuffers();
+}
 
-	CD3D11_BUFFER_DESC desc{ n_elements * 2, 0, D3D11_USAGE_STAGING, D3D11_CPU_ACCESS_READ };
+HRESULT KeyValueDownloader::createBuffers()
+{
+	CD3D11_BUFFER_DESC desc{ length * 2, 0, D3D11_USAGE_STAGING, D3D11_CPU_ACCESS_READ };
 	ID3D11Device* dev = DirectCompute::device();
 	CHECK( dev->CreateBuffer( &desc, nullptr, &keys ) );
 	CHECK( dev->CreateBuffer( &desc, nullptr, &values ) );
-
-	length = n_elements;
 	return S_OK;
 }
 
 HRESULT KeyValueDownloader::download( const DirectCompute::KeyValueBuffers& source )
 {
+	if( !keys )
+		CHECK( createBuffers() );
+
 	ID3D11DeviceContext* ctx = DirectCompute::context();
 	ctx->CopyResource( keys, source.keys.getBuffer() );
 	ctx->CopyResource( values, source.values.getBuffer() );
@@ -27,6 +31,8 @@ HRESULT KeyValueDownloader::download( const DirectCompute::KeyValueBuffers& sour
 KeyValueDownloader::ReadMap::ReadMap( KeyValueDownloader& owner ) :
 	length( owner.length )
 {
+	if( !owner.keys )
+		throw OLE_E_BLANK;
 	check( mappedKeys.map( owner.keys, true ) );
 	check( mappedValues.map( owner.values, true ) );
 }
\ No newline at end of file
@@ -9,6 +9,8 @@ class KeyValueDownloader
 	CComPtr<ID3D11Buffer> keys, values;
 	uint32_t length = 0;
 
+	HRESULT createBuffers();
+
 	using E = uint16_t;
 	static constexpr DirectCompute::eDataType dataType = DirectCompute::eDataType::FP16;
 
@@ -16,9 +18,16 @@ public:
 	// Create the staging resources to download kvCross tensors produced by the GPGPU encoder
 	HRESULT create( const Whisper::sModelParams& mp );
 
-	// Download these two tensors from VRAM to the staging buffers in system RAM
+	// Download these two tensors from VRAM to the staging buffers in system RAM, re-creating the buffers if they were released
 	HRESULT download( const DirectCompute::KeyValueBuffers& source );
 
+	// Release the staging buffers, after their content was copied elsewhere
+	void release()
+	{
+		keys = nullptr;
+		values = nullptr;
+	}
+
 	class ReadMap
 	{
 		const uint32_t length;
@@ -337,4 +337,38 @@ Tensor Tensor::reshape3d( uint32_t ne0, uint32_t ne1, uint32_t ne2 ) const
 	res.ne = { ne0, ne1, ne2, 1 };
 	res.setDenseStrides();
 	return res;
-}
\ No newline at end of file
+}
+
+Tensor Tensor::columns( uint32_t first, uint32_t count ) const
+{
+	if( !isContinuous() || !isMatrix() )
+		throw E_NOTIMPL;
+	if( 0 == count || first + count > ne[ 1 ] )
+		throw E_BOUNDS;
+
+	CComPtr<ID3D11Buffer> buffer = getBuffer();
+	D3D11_SHADER_RESOURCE_VIEW_DESC desc;
+	srv->GetDesc( &desc );
+	const UINT offset = desc.Buffer.FirstElement + first * ne[ 0 ];
+	const UINT length = count * ne[ 0 ];
+
+	CComPtr<ID3D11ShaderResourceView> newSrv;
+	CD3D11_SHADER_RESOURCE_VIEW_DESC srvDesc{ D3D11_SRV_DIMENSION_BUFFER, desc.Format, offset, length };
+	check( device()->CreateShaderResourceView( buffer, &srvDesc, &newSrv ) );
+
+	CComPtr<ID3D11UnorderedAccessView> newUav;
+	if( nullptr != uav )
+	{
+		CD3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc{ D3D11_UAV_DIMENSION_BUFFER, desc.Format, offset, length };
+		check( device()->CreateUnorderedAccessView( buffer, &uavDesc, &newUav ) );
+	}
+
+	TensorShape shape;
+	shape.ne = { ne[ 0 ], count, 1, 1 };
+	shape.setDenseStrides();
+	Tensor res{ shape, newSrv, newUav };
+#ifdef _DEBUG
+	res.dbgType = dbgType;
+#endif
+	return res;
+}
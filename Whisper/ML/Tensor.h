@@ -61,6 +61,10 @@ namespace DirectCompute
 		// ggml_reshape_3d
 		Tensor reshape3d( uint32_t ne0, uint32_t ne1, uint32_t ne2 ) const;
 
+		// Columns [ first .. first + count ] of a dense matrix, as another dense matrix which shares VRAM with this tensor.
+		// Unlike other views, this one creates new GPU views of the buffer, with the offset; the decoder caches them, see WhisperContext::ColumnViews
+		Tensor columns( uint32_t first, uint32_t count ) const;
+
 		inline void dbgSetType( eDataType dt, bool hasData = false, eBufferUse use = eBufferUse::ReadWrite )
 		{
 #ifdef _DEBUG
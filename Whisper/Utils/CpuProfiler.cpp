@@ -35,6 +35,14 @@ namespace
 
 			return makeTime( tsc, freq );
 		}
+
+		inline uint64_t getFrequency()
+		{
+			uint64_t freq = frequency;
+			if( freq == 0 )
+				freq = computeTscFrequency();
+			return freq;
+		}
 	};
 
 	uint64_t __declspec( noinline ) CpuTimescale::computeTscFrequency()
@@ -62,4 +70,45 @@ namespace
 uint64_t Whisper::ticksFromTsc( uint64_t tscDiff )
 {
 	return timescale.computeTicks( tscDiff );
+}
+
+uint64_t Whisper::tscFrequency()
+{
+	return timescale.getFrequency();
+}
+
+namespace
+{
+	volatile long s_cyclesFailed = 0;
+
+	uint64_t __declspec( noinline ) cyclesFailed()
+	{
+		// Don't spam the log, and don't waste time on the failing calls
+		if( 0 == InterlockedExchange( &s_cyclesFailed, 1 ) )
+		{
+			const HRESULT hr = getLastHr();
+			logWarningHr( hr, u8"CPU cycle counters are unavailable" );
+		}
+		return 0;
+	}
+}
+
+uint64_t Whisper::processCycles()
+{
+	if( 0 != s_cyclesFailed )
+		return 0;
+	ULONG64 cycles;
+	if( QueryProcessCycleTime( GetCurrentProcess(), &cycles ) && 0 != cycles )
+		return cycles;
+	return cyclesFailed();
+}
+
+uint64_t Whisper::threadCycles()
+{
+	if( 0 != s_cyclesFailed )
+		return 0;
+	ULONG64 cycles;
+	if( QueryThreadCycleTime( GetCurrentThread(), &cycles ) && 0 != cycles )
+		return cycles;
+	return cyclesFailed();
 }
\ No newline at end of file
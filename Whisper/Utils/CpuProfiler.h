@@ -12,6 +12,16 @@ namespace Whisper
 	// Scale the time interval from CPU time stamp counter clock into 100-nanosecond ticks, rounding to nearest
 	uint64_t ticksFromTsc( uint64_t tscDiff );
 
+	// Frequency of the time stamp counter, in Hz
+	uint64_t tscFrequency();
+
+	// CPU cycles used by all threads of the process, in both user and kernel modes.
+	// Returns 0 when the counter is unavailable, the profiler then doesn't print the numbers derived from the cycles.
+	uint64_t processCycles();
+
+	// CPU cycles used by the calling thread, in both user and kernel modes; returns 0 when the counter is unavailable
+	uint64_t threadCycles();
+
 	class CpuProfiler
 	{
 		const int64_t started = tscNow();
@@ -0,0 +1,93 @@
+#include "stdafx.h"
+#include "EventRecorder.h"
+#include "CpuProfiler.h"
+#include <atlfile.h>
+#include <atlstr.h>
+using namespace Whisper;
+
+HRESULT EventRecorder::start( uint32_t countEvents )
+{
+	events.reset();
+	capacity = 0;
+	nextEvent = 0;
+	if( 0 == countEvents )
+		return S_OK;
+
+	events.reset( new ( std::nothrow ) Event[ countEvents ] );
+	if( !events )
+		return E_OUTOFMEMORY;
+	for( uint32_t i = 0; i < countEvents; i++ )
+		events[ i ].sequence = 0;
+	tscStarted = tscNow();
+	capacity = countEvents;
+	return S_OK;
+}
+
+namespace
+{
+	// Microseconds since the start of the recording
+	double microseconds( int64_t tsc, int64_t tscStarted )
+	{
+		if( tsc <= tscStarted )
+			return 0;
+		return (double)(int64_t)ticksFromTsc( (uint64_t)( tsc - tscStarted ) ) * 0.1;
+	}
+}
+
+HRESULT EventRecorder::save( LPCTSTR path ) const
+{
+	if( !enabled() )
+	{
+		logError( u8"The event recorder is not started" );
+		return OLE_E_BLANK;
+	}
+
+	// Copy the events which were completely written, the writers may still be adding new ones
+	std::vector<Event> list;
+	list.reserve( capacity );
+	for( size_t i = 0; i < capacity; i++ )
+	{
+		const Event& src = events[ i ];
+		const int64_t seq = src.sequence;
+		if( seq <= 0 )
+			continue;
+		Event& e = list.emplace_back();
+		e.category = src.category;
+		e.name = src.name;
+		e.tag = src.tag;
+		e.tscBegin = src.tscBegin;
+		e.tscEnd = src.tscEnd;
+		e.threadId = src.threadId;
+		_ReadWriteBarrier();
+		if( src.sequence != seq )
+		{
+			// Another thread has started writing the slot while we were copying
+			list.pop_back();
+			continue;
+		}
+		e.sequence = seq;
+	}
+	std::sort( list.begin(), list.end(), []( const Event& a, const Event& b ) { return a.sequence < b.sequence; } );
+
+	CStringA json;
+	json.Preallocate( (int)( list.size() * 128 + 64 ) );
+	json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	const DWORD pid = GetCurrentProcessId();
+	for( size_t i = 0; i < list.size(); i++ )
+	{
+		const Event& e = list[ i ];
+		const double ts = microseconds( e.tscBegin, tscStarted );
+		const double dur = microseconds( e.tscEnd, tscStarted ) - ts;
+		json.AppendFormat( "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%u,\"tid\":%u",
+			e.name, e.category, ts, dur, pid, e.threadId );
+		if( nullptr != e.tag )
+			json.AppendFormat( ",\"args\":{\"tag\":\"%s\"}", e.tag );
+		json += ( i + 1 < list.size() ) ? "},\n" : "}\n";
+	}
+	json += "]}\n";
+
+	CAtlFile file;
+	CHECK( file.Create( path, GENERIC_WRITE, 0, CREATE_ALWAYS ) );
+	CHECK( file.Write( json.GetString(), (DWORD)json.GetLength() ) );
+	return S_OK;
+}
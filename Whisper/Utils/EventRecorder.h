@@ -0,0 +1,59 @@
+#pragma once
+#include <memory>
+
+namespace Whisper
+{
+	// Opt-in timeline of the profiler events, saved in the Chrome trace event format.
+	// Open the JSON in chrome://tracing or https://ui.perfetto.dev to see how the threads overlap.
+	// Multiple threads record events concurrently without locks, the buffer is a ring: when full, the new events overwrite the oldest ones.
+	class EventRecorder
+	{
+		struct Event
+		{
+			// Index of the event plus 1, 0 for the empty slot, or -1 while a thread is writing the fields
+			volatile int64_t sequence;
+			// Readonly strings, the recorder only keeps the pointers
+			const char* category;
+			const char* name;
+			const char* tag;
+			int64_t tscBegin, tscEnd;
+			DWORD threadId;
+		};
+		std::unique_ptr<Event[]> events;
+		size_t capacity = 0;
+		volatile int64_t nextEvent = 0;
+		// Timestamp counter when the recording started, the timeline starts at 0
+		int64_t tscStarted = 0;
+
+	public:
+		// Allocate the buffer, and start recording. Pass 0 to stop recording and release the memory.
+		// Not thread safe, must be called while no other threads are recording events.
+		HRESULT start( uint32_t countEvents );
+
+		bool enabled() const
+		{
+			return 0 != capacity;
+		}
+
+		void record( const char* category, const char* name, const char* tag, int64_t tscBegin, int64_t tscEnd ) noexcept
+		{
+			const int64_t idx = InterlockedIncrement64( &nextEvent ) - 1;
+			Event& e = events[ (size_t)( (uint64_t)idx % capacity ) ];
+			// Mark the slot busy. After the ring wraps around, another writer may still be writing the same slot;
+			// then this event is dropped. That only happens when the ring is too small for the rate of the events.
+			const int64_t prev = e.sequence;
+			if( prev < 0 || prev != InterlockedCompareExchange64( &e.sequence, -1, prev ) )
+				return;
+			e.category = category;
+			e.name = name;
+			e.tag = tag;
+			e.tscBegin = tscBegin;
+			e.tscEnd = tscEnd;
+			e.threadId = GetCurrentThreadId();
+			InterlockedExchange64( &e.sequence, idx + 1 );
+		}
+
+		// Write the recorded events into JSON file
+		HRESULT save( LPCTSTR path ) const;
+	};
+}
@@ -3,6 +3,7 @@
 #include "GpuProfiler.h"
 #include "../Whisper/WhisperModel.h"
 #include "../D3D/shaderNames.h"
+#include <cmath>
 using namespace Whisper;
 
 ProfileCollection::Measure& ProfileCollection::measure( DirectCompute::eProfilerBlock which )
@@ -19,12 +20,189 @@ ProfileCollection::Measure& ProfileCollection::measure( DirectCompute::eComputeS
 	return measures[ key ];
 }
 
-ProfileCollection::Measure& ProfileCollection::measure( eCpuBlock which )
+namespace
 {
-	uint32_t key = (uint8_t)which;
-	key |= 0x10000;
+	volatile long s_instanceCounter = 0;
+
+	// Most threads only use one or two collections, of the context and sometimes of the draft context
+	struct ThreadCacheEntry
+	{
+		uint32_t instanceId;
+		void* measures;
+	};
+	constexpr size_t threadCacheSize = 4;
+	thread_local std::array<ThreadCacheEntry, threadCacheSize> ts_cache = {};
+	thread_local uint32_t ts_cacheNext = 0;
+}
+
+void ProfileCollection::ThreadMeasures::clear()
+{
+	for( CpuMeasure& m : measures )
+		m.reset();
+}
+
+void ProfileCollection::ThreadMeasures::add( eCpuBlock which, uint64_t ticks, uint64_t cycles )
+{
+	// Only this thread writes the sequence counter; the interlocked exchanges are full memory barriers around the update
+	const long seq = sequence;
+	InterlockedExchange( &sequence, seq + 1 );
+	const long gen = *resetCounter;
+	if( gen != generation )
+	{
+		clear();
+		generation = gen;
+	}
+	CpuMeasure& m = measures[ (uint8_t)which ];
+	m.add( ticks );
+#if PROFILER_CYCLE_COUNTERS
+	m.cycles += cycles;
+#endif
+	InterlockedExchange( &sequence, seq + 2 );
+}
+
+void ProfileCollection::ThreadMeasures::clearOps()
+{
+	for( OpMeasure& m : ops )
+		m.reset();
+}
+
+void ProfileCollection::ThreadMeasures::addOp( eCpuOp which, uint16_t tag, const std::array<uint32_t, 3>& shape, uint64_t ticks, uint64_t flops, uint64_t bytes, uint64_t cycles )
+{
+	// Same protocol as add() method, with another sequence counter
+	const long seq = opsSequence;
+	InterlockedExchange( &opsSequence, seq + 1 );
+	const long gen = *resetCounter;
+	if( gen != opsGeneration )
+	{
+		clearOps();
+		opsGeneration = gen;
+	}
+	OpMeasure& m = ops[ (size_t)tag * countCpuOps + (uint8_t)which ];
+	m.add( ticks, flops, bytes );
+	m.shape = shape;
+#if PROFILER_CYCLE_COUNTERS
+	m.cycles += cycles;
+#endif
+	InterlockedExchange( &opsSequence, seq + 2 );
+}
+
+bool ProfileCollection::ThreadMeasures::readOps( OpMeasures& rdi ) const
+{
+	while( true )
+	{
+		const long seq = opsSequence;
+		if( 0 == ( seq & 1 ) )
+		{
+			rdi = ops;
+			const long gen = opsGeneration;
+			_ReadWriteBarrier();
+			if( seq == opsSequence )
+				return gen == *resetCounter;
+		}
+		YieldProcessor();
+	}
+}
+
+bool ProfileCollection::ThreadMeasures::read( CpuMeasures& rdi ) const
+{
+	while( true )
+	{
+		const long seq = sequence;
+		if( 0 == ( seq & 1 ) )
+		{
+			rdi = measures;
+			const long gen = generation;
+			_ReadWriteBarrier();
+			if( seq == sequence )
+				return gen == *resetCounter;
+		}
+		YieldProcessor();
+	}
+}
+
+ProfileCollection::ThreadMeasures& ProfileCollection::threadMeasures()
+{
+	for( const ThreadCacheEntry& e : ts_cache )
+		if( e.instanceId == instanceId )
+			return *(ThreadMeasures*)e.measures;
+
+	// The first use of this collection on the calling thread, or the entry was evicted from the cache
+	ThreadMeasures* result = nullptr;
+	const DWORD tid = GetCurrentThreadId();
+	{
+		CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+		ThreadMeasures* exited = nullptr;
+		for( const auto& tm : threadMeasuresList )
+		{
+			if( tm->threadId == tid )
+			{
+				result = tm.get();
+				break;
+			}
+			if( nullptr == exited && WAIT_OBJECT_0 == WaitForSingleObject( tm->thread, 0 ) )
+				exited = tm.get();
+		}
+		if( nullptr == result )
+		{
+			if( nullptr != exited )
+			{
+				// Thread pools come and go, keep the measures of the exited thread, and reuse the array
+				if( exited->generation == resetCounter )
+				{
+					for( size_t i = 0; i < countCpuBlocks; i++ )
+						retiredMeasures[ i ].merge( exited->measures[ i ] );
+				}
+				if( exited->opsGeneration == resetCounter )
+				{
+					for( size_t i = 0; i < retiredOps.size(); i++ )
+						retiredOps[ i ].merge( exited->ops[ i ] );
+				}
+				exited->clear();
+				exited->clearOps();
+				exited->thread.Close();
+				result = exited;
+			}
+			else
+			{
+				result = threadMeasuresList.emplace_back( std::make_unique<ThreadMeasures>() ).get();
+				result->resetCounter = &resetCounter;
+			}
+			result->generation = resetCounter;
+			result->opsGeneration = resetCounter;
+			result->threadId = tid;
+			// When OpenThread fails, the array is never reused
+			result->thread.Attach( OpenThread( SYNCHRONIZE, FALSE, tid ) );
+		}
+	}
+
+	ThreadCacheEntry& e = ts_cache[ ts_cacheNext % threadCacheSize ];
+	ts_cacheNext++;
+	e.instanceId = instanceId;
+	e.measures = result;
+	return *result;
+}
+
+uint16_t ProfileCollection::cpuOpTagId( const char* tag )
+{
+	if( nullptr == tag )
+		return 0;
+	// The decoder only has a dozen of distinct tags, the linear search is faster than a hash map
+	long count = countOpTags;
+	for( long i = 1; i < count; i++ )
+		if( cpuOpTags[ i ] == tag )
+			return (uint16_t)i;
+
 	CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
-	return measures[ key ];
+	count = countOpTags;
+	for( long i = 1; i < count; i++ )
+		if( cpuOpTags[ i ] == tag )
+			return (uint16_t)i;
+	if( count >= (long)maxCpuOpTags )
+		return 0;
+	cpuOpTags[ count ] = tag;
+	// Publish the new element after it's written
+	InterlockedExchange( &countOpTags, count + 1 );
+	return (uint16_t)count;
 }
 
 #if PROFILER_COLLECT_TAGS
@@ -59,6 +237,37 @@ namespace
 			V( Decode );
 			V( DecodeStep );
 			V( DecodeLayer );
+			V( LanguageDetect );
+			V( Draft );
+			V( DeviceWait );
+			V( ReadAudio );
+#undef V
+		}
+		assert( false );
+		return nullptr;
+	}
+
+	static const char* printCpuOp( uint16_t id )
+	{
+		const eCpuOp which = (eCpuOp)id;
+		switch( which )
+		{
+#define V(x) case eCpuOp::x: return #x
+			V( addRows );
+			V( norm );
+			V( normFma );
+			V( fmaRepeat );
+			V( mulMat );
+			V( addRepeatScale );
+			V( addRepeat );
+			V( add );
+			V( addInPlace );
+			V( addRepeatGelu );
+			V( scale );
+			V( diagMaskInf );
+			V( softMax );
+			V( attention );
+			V( copy );
 #undef V
 		}
 		assert( false );
@@ -95,9 +304,6 @@ namespace
 	{
 		switch( type )
 		{
-		case 1:
-			logInfo( u8"    CPU Tasks" );
-			return &printCpuBlock;
 		case 2:
 			logInfo( u8"    GPU Tasks" );
 			return &printGpuBlock;
@@ -154,6 +360,94 @@ namespace
 	};
 }
 
+const char* Whisper::cpuBlockName( eCpuBlock which )
+{
+	return printCpuBlock( (uint16_t)which );
+}
+
+const char* Whisper::cpuOpName( eCpuOp which )
+{
+	return printCpuOp( (uint16_t)which );
+}
+
+#if PROFILER_CYCLE_COUNTERS
+namespace
+{
+	// Average count of CPU cores used while the block was running; for the blocks measured with the thread counter, the fraction of time the thread was running
+	double busyCores( uint64_t cycles, uint64_t ticks )
+	{
+		// The ticks are 100 nanoseconds
+		const double elapsedCycles = (double)(int64_t)ticks * (double)(int64_t)tscFrequency() * 1.0E-7;
+		return ( elapsedCycles > 0 ) ? (double)(int64_t)cycles / elapsedCycles : 0.0;
+	}
+}
+#endif
+
+void ProfileCollection::CpuMeasure::reset()
+{
+	Measure::reset();
+	minTicks = UINT64_MAX;
+	maxTicks = 0;
+	histogram.fill( 0 );
+#if PROFILER_CYCLE_COUNTERS
+	cycles = 0;
+#endif
+}
+
+void ProfileCollection::CpuMeasure::merge( const CpuMeasure& that )
+{
+	count += that.count;
+	totalTicks += that.totalTicks;
+	minTicks = std::min( minTicks, that.minTicks );
+	maxTicks = std::max( maxTicks, that.maxTicks );
+	for( size_t i = 0; i < histogram.size(); i++ )
+		histogram[ i ] += that.histogram[ i ];
+#if PROFILER_CYCLE_COUNTERS
+	cycles += that.cycles;
+#endif
+}
+
+uint64_t ProfileCollection::CpuMeasure::percentile( double p ) const
+{
+	if( 0 == count )
+		return 0;
+	const size_t rank = std::max( (size_t)std::ceil( p * (double)(int64_t)count ), (size_t)1 );
+	size_t i = 0;
+	for( size_t sum = 0; i < histogram.size(); i++ )
+	{
+		sum += histogram[ i ];
+		if( sum >= rank )
+			break;
+	}
+	assert( i < histogram.size() );
+
+	// Middle of the bucket, inverse of the bucket() function
+	uint64_t val;
+	if( i < 4 )
+		val = i;
+	else
+	{
+		const uint32_t msb = (uint32_t)( i / 4 + 1 );
+		const uint64_t lower = ( 4 + i % 4 ) << ( msb - 2 );
+		val = lower + ( ( 1ull << ( msb - 2 ) ) >> 1 );
+	}
+	return std::clamp( val, minTicks, maxTicks );
+}
+
+void ProfileCollection::CpuMeasure::print( const char* name ) const
+{
+	Measure::print( name );
+	if( count < 2 )
+		return;
+	PrintedTime pMin{ minTicks }, p50{ percentile( 0.5 ) }, p90{ percentile( 0.9 ) }, p99{ percentile( 0.99 ) }, pMax{ maxTicks };
+	logInfo( u8"\tmin %g %s, median %g %s, 90%% %g %s, 99%% %g %s, max %g %s",
+		pMin.value, pMin.unit, p50.value, p50.unit, p90.value, p90.unit, p99.value, p99.unit, pMax.value, pMax.unit );
+#if PROFILER_CYCLE_COUNTERS
+	if( 0 != cycles )
+		logInfo( u8"\t%.0f%% of the thread busy, %g cycles average", busyCores( cycles, totalTicks ) * 100.0, (double)(int64_t)cycles / (double)(int64_t)count );
+#endif
+}
+
 void ProfileCollection::Measure::print( const char* name ) const
 {
 	PrintedTime total{ totalTicks };
@@ -166,6 +460,118 @@ void ProfileCollection::Measure::print( const char* name ) const
 	}
 }
 
+void ProfileCollection::OpMeasure::print( const char* name, bool printShape ) const
+{
+	char shapeText[ 48 ] = "";
+	if( printShape )
+		snprintf( shapeText, sizeof( shapeText ), " [ %u, %u, %u ]", shape[ 0 ], shape[ 1 ], shape[ 2 ] );
+
+	PrintedTime total{ totalTicks };
+	PrintedTime avg = (double)totalTicks / (double)(int64_t)count;
+	// The ticks are 100 nanoseconds, this expression computes count of GB/s or GFLOP/s from count of bytes or FLOPs
+	const double mul = 1.0E-2 / (double)(int64_t)std::max( totalTicks, (uint64_t)1 );
+	const double gbs = (double)(int64_t)bytes * mul;
+	if( 0 != flops )
+	{
+		const double gflops = (double)(int64_t)flops * mul;
+		logInfo( u8"%s%s\t%g %s, %zu calls, %g %s average, %.1f GFLOP/s, %.1f GB/s", name, shapeText,
+			total.value, total.unit, count, avg.value, avg.unit, gflops, gbs );
+	}
+	else
+	{
+		logInfo( u8"%s%s\t%g %s, %zu calls, %g %s average, %.1f GB/s", name, shapeText,
+			total.value, total.unit, count, avg.value, avg.unit, gbs );
+	}
+#if PROFILER_CYCLE_COUNTERS
+	if( 0 != cycles )
+	{
+		const double cores = busyCores( cycles, totalTicks );
+		if( 0 != flops )
+			logInfo( u8"\t%.2f cores busy, %.2f FLOP/cycle", cores, (double)(int64_t)flops / (double)(int64_t)cycles );
+		else
+			logInfo( u8"\t%.2f cores busy, %.2f bytes/cycle", cores, (double)(int64_t)bytes / (double)(int64_t)cycles );
+	}
+#endif
+}
+
+void ProfileCollection::OpMeasure::merge( const OpMeasure& that )
+{
+	if( 0 == that.count )
+		return;
+	count += that.count;
+	totalTicks += that.totalTicks;
+	flops += that.flops;
+	bytes += that.bytes;
+#if PROFILER_CYCLE_COUNTERS
+	cycles += that.cycles;
+#endif
+	shape = that.shape;
+}
+
+void ProfileCollection::printCpuOps()
+{
+	CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+	// Merge the measures of all threads; the arrays are too large for the stack
+	std::unique_ptr<OpMeasures> merged = std::make_unique<OpMeasures>( retiredOps );
+	std::unique_ptr<OpMeasures> copy = std::make_unique<OpMeasures>();
+	for( const auto& tm : threadMeasuresList )
+	{
+		if( !tm->readOps( *copy ) )
+			continue;
+		for( size_t i = 0; i < copy->size(); i++ )
+			( *merged )[ i ].merge( ( *copy )[ i ] );
+	}
+
+	// Totals of the operations, for all tags
+	std::array<OpMeasure, countCpuOps> totals;
+	std::array<bool, countCpuOps> haveTags = {};
+	cpuOpsTemp.clear();
+	for( size_t i = 0; i < merged->size(); i++ )
+	{
+		const OpMeasure& m = ( *merged )[ i ];
+		if( m.count == 0 )
+			continue;
+		const size_t op = i % countCpuOps;
+		totals[ op ].merge( m );
+		if( i >= countCpuOps )
+			haveTags[ op ] = true;
+		cpuOpsTemp.push_back( OpTemp{ m.totalTicks, (uint32_t)i } );
+	}
+	if( cpuOpsTemp.empty() )
+		return;
+	std::stable_sort( cpuOpsTemp.begin(), cpuOpsTemp.end() );
+
+	std::array<uint8_t, countCpuOps> order;
+	for( size_t i = 0; i < countCpuOps; i++ )
+		order[ i ] = (uint8_t)i;
+	std::stable_sort( order.begin(), order.end(), [ &totals ]( uint8_t a, uint8_t b )
+		{
+			return totals[ a ].totalTicks > totals[ b ].totalTicks;
+		} );
+
+	logInfo( u8"    CPU Operations" );
+	for( uint8_t op : order )
+	{
+		const OpMeasure& t = totals[ op ];
+		if( t.count == 0 )
+			continue;
+		// The shapes are only meaningful for the individual call sites
+		t.print( printCpuOp( op ), !haveTags[ op ] );
+		if( !haveTags[ op ] )
+			continue;
+
+		for( const OpTemp& e : cpuOpsTemp )
+		{
+			if( e.key % countCpuOps != op )
+				continue;
+			const size_t tag = e.key / countCpuOps;
+			char name[ 64 ];
+			snprintf( name, sizeof( name ), "  %s", ( 0 != tag ) ? cpuOpTags[ tag ] : "<untagged>" );
+			( *merged )[ e.key ].print( name, true );
+		}
+	}
+}
+
 #if PROFILER_COLLECT_TAGS
 struct TaggedShaderCmp
 {
@@ -192,8 +598,41 @@ void ProfileCollection::TaggedTemp::print() const
 }
 #endif
 
+void ProfileCollection::mergeCpuMeasures( CpuMeasures& rdi )
+{
+	CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+	rdi = retiredMeasures;
+	CpuMeasures copy;
+	for( const auto& tm : threadMeasuresList )
+	{
+		if( !tm->read( copy ) )
+			continue;
+		for( size_t i = 0; i < countCpuBlocks; i++ )
+			rdi[ i ].merge( copy[ i ] );
+	}
+}
+
 void ProfileCollection::print()
 {
+	{
+		CpuMeasures merged;
+		mergeCpuMeasures( merged );
+
+		bool header = false;
+		for( size_t i = 0; i < countCpuBlocks; i++ )
+		{
+			if( merged[ i ].count == 0 )
+				continue;
+			if( !header )
+			{
+				logInfo( u8"    CPU Tasks" );
+				header = true;
+			}
+			merged[ i ].print( printCpuBlock( (uint16_t)i ) );
+		}
+	}
+	printCpuOps();
+
 	keysTemp.clear();
 	for( POSITION pos = measures.GetStartPosition(); nullptr != pos; )
 	{
@@ -294,14 +733,23 @@ void ProfileCollection::reset()
 {
 	for( POSITION pos = measures.GetStartPosition(); nullptr != pos; )
 		measures.GetNextValue( pos ).reset();
+
+	CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+	for( CpuMeasure& m : retiredMeasures )
+		m.reset();
+	for( OpMeasure& m : retiredOps )
+		m.reset();
+	// The threads clear their arrays on the next write, the merge skips them until then
+	InterlockedIncrement( &resetCounter );
 }
 
-ProfileCollection::ProfileCollection( const WhisperModel& model )
+ProfileCollection::ProfileCollection( const WhisperModel& model ) :
+	instanceId( (uint32_t)InterlockedIncrement( &s_instanceCounter ) )
 {
 	const __m128i vals = model.getLoadTimes();
 
 	uint64_t s = (uint64_t)_mm_cvtsi128_si64( vals );
-	measure( eCpuBlock::LoadModel ).add( s );
+	threadMeasures().add( eCpuBlock::LoadModel, s, 0 );
 
 	s = (uint64_t)_mm_extract_epi64( vals, 1 );
 	measure( DirectCompute::eProfilerBlock::LoadModel ).add( s );
@@ -1,6 +1,9 @@
 #pragma once
 #include <atlcoll.h>
+#include <array>
+#include <memory>
 #include "CpuProfiler.h"
+#include "EventRecorder.h"
 
 namespace DirectCompute
 {
@@ -25,7 +28,37 @@ namespace Whisper
 		Decode,
 		DecodeStep,
 		DecodeLayer,
+		LanguageDetect,
+		Draft,
+		DeviceWait,
+		ReadAudio,
 	};
+	constexpr size_t countCpuBlocks = (size_t)eCpuBlock::ReadAudio + 1;
+	const char* cpuBlockName( eCpuBlock which );
+
+	// Operations of CpuCompute::MlContext, used by the decoder of the hybrid model
+	enum struct eCpuOp : uint8_t
+	{
+		addRows,
+		norm,
+		normFma,
+		fmaRepeat,
+		mulMat,
+		addRepeatScale,
+		addRepeat,
+		add,
+		addInPlace,
+		addRepeatGelu,
+		scale,
+		diagMaskInf,
+		softMax,
+		attention,
+		copy,
+	};
+	constexpr size_t countCpuOps = (size_t)eCpuOp::copy + 1;
+	const char* cpuOpName( eCpuOp which );
+	// Capacity of the table with the tags of the CPU operations, including the element 0 for the untagged ones
+	constexpr size_t maxCpuOpTags = 32;
 
 	class ProfileCollection
 	{
@@ -53,9 +86,96 @@ namespace Whisper
 			}
 		};
 
+		// CPU measures also keep the extreme values, and a histogram of the durations to estimate percentiles
+		struct CpuMeasure : Measure
+		{
+			uint64_t minTicks = UINT64_MAX;
+			uint64_t maxTicks = 0;
+			// Logarithmic buckets, 4 of them per octave; the estimated percentiles are within 12.5% from the exact ones
+			std::array<uint32_t, 256> histogram = {};
+#if PROFILER_CYCLE_COUNTERS
+			// CPU cycles used by the thread which ran the block, see threadCycles() function.
+			// Thread pools launched by the block are not included.
+			uint64_t cycles = 0;
+#endif
+
+			void reset();
+
+			void print( const char* name ) const;
+
+			void add( uint64_t val )
+			{
+				Measure::add( val );
+				minTicks = std::min( minTicks, val );
+				maxTicks = std::max( maxTicks, val );
+				histogram[ bucket( val ) ]++;
+			}
+
+			void merge( const CpuMeasure& that );
+
+			// Estimate the value for the percentile, the argument is in [ 0 .. 1 ] interval
+			uint64_t percentile( double p ) const;
+
+		private:
+			static size_t bucket( uint64_t val )
+			{
+				if( val < 4 )
+					return (size_t)val;
+				unsigned long msb;
+				_BitScanReverse64( &msb, val );
+				return ( msb - 1 ) * 4 + (size_t)( ( val >> ( msb - 2 ) ) & 3 );
+			}
+		};
+		using CpuMeasures = std::array<CpuMeasure, countCpuBlocks>;
+
+		// CPU operations also count floating point operations and bytes of memory touched, to print GFLOP/s and GB/s numbers
+		struct OpMeasure : Measure
+		{
+			uint64_t flops = 0;
+			uint64_t bytes = 0;
+			// Shape of the last call: [ M, N, K ] for matrix multiplication, size of the output tensor for the rest of them
+			std::array<uint32_t, 3> shape = {};
+#if PROFILER_CYCLE_COUNTERS
+			// CPU cycles used by all threads of the process, see processCycles() function.
+			// The operations run on the thread pool, which the thread counter doesn't see. The process counter also includes unrelated threads, like other contexts.
+			uint64_t cycles = 0;
+#endif
+
+			void reset()
+			{
+				Measure::reset();
+				flops = 0;
+				bytes = 0;
+#if PROFILER_CYCLE_COUNTERS
+				cycles = 0;
+#endif
+			}
+
+			void add( uint64_t ticks, uint64_t fl, uint64_t cb )
+			{
+				Measure::add( ticks );
+				flops += fl;
+				bytes += cb;
+			}
+
+			void merge( const OpMeasure& that );
+
+			void print( const char* name, bool printShape ) const;
+		};
+		// CPU operations for all tags, the index is tag * countCpuOps + op
+		using OpMeasures = std::array<OpMeasure, countCpuOps * maxCpuOpTags>;
+
 		Measure& measure( DirectCompute::eProfilerBlock which );
 		Measure& measure( DirectCompute::eComputeShader which );
-		Measure& measure( eCpuBlock which );
+
+		// True when the CPU operations are measured: always with PROFILER_CPU_OPERATIONS build flag, otherwise while the timeline is recorded
+		bool profileCpuOps() const
+		{
+			return PROFILER_CPU_OPERATIONS || recorder.enabled();
+		}
+		// ID of the tag of CPU operations. The tag is a readonly string like in GpuProfiler::setNextTag, or nullptr for ID 0.
+		// Doesn't lock unless the collection sees the tag for the first time; when the table is full, the new tags are reported as untagged.
+		uint16_t cpuOpTagId( const char* tag );
 #if PROFILER_COLLECT_TAGS
 		Measure& measure( DirectCompute::eComputeShader which, uint16_t tag );
 #endif
@@ -63,19 +183,37 @@ namespace Whisper
 
 		void reset();
 
+		// Merge CPU measures of all threads which used this collection
+		void mergeCpuMeasures( CpuMeasures& rdi );
+
+	private:
+		struct ThreadMeasures;
+	public:
+
 		class CpuRaii
 		{
-			Measure* dest;
+			ThreadMeasures* dest;
 			const int64_t tsc;
+			// nullptr unless the event recorder is started
+			EventRecorder* recorder;
+			const eCpuBlock block;
+#if PROFILER_CYCLE_COUNTERS
+			const uint64_t cycles = threadCycles();
+#endif
 
 		public:
-			CpuRaii( Measure& m ) : dest( &m ), tsc( tscNow() )
+			CpuRaii( ThreadMeasures& m, EventRecorder* rec, eCpuBlock which ) :
+				dest( &m ), tsc( tscNow() ), recorder( rec ), block( which )
 			{ }
 			CpuRaii( const CpuRaii& ) = delete;
 			CpuRaii( CpuRaii&& that ) noexcept :
-				tsc( that.tsc )
+				tsc( that.tsc ), block( that.block )
+#if PROFILER_CYCLE_COUNTERS
+				, cycles( that.cycles )
+#endif
 			{
 				dest = that.dest;
+				recorder = that.recorder;
 				that.dest = nullptr;
 			}
 
@@ -83,22 +221,147 @@ namespace Whisper
 			{
 				if( nullptr != dest )
 				{
-					const int64_t elapsed = tscNow() - tsc;
-					dest->add( ticksFromTsc( elapsed ) );
+#if PROFILER_CYCLE_COUNTERS
+					const uint64_t cyclesUsed = ( 0 != cycles ) ? threadCycles() - cycles : 0;
+#else
+					const uint64_t cyclesUsed = 0;
+#endif
+					const int64_t now = tscNow();
+					dest->add( block, ticksFromTsc( now - tsc ), cyclesUsed );
+					if( nullptr != recorder )
+						recorder->record( "cpu", cpuBlockName( block ), nullptr, tsc, now );
 				}
 			}
 		};
 
 		decltype( auto ) cpuBlock( eCpuBlock which )
 		{
-			return CpuRaii{ measure( which ) };
+			return CpuRaii{ threadMeasures(), eventRecorder(), which };
+		}
+
+		class OpRaii
+		{
+			ProfileCollection* owner;
+			const int64_t tsc;
+			const uint64_t flops, bytes;
+			const std::array<uint32_t, 3> shape;
+			const eCpuOp op;
+			const uint16_t tag;
+#if PROFILER_CYCLE_COUNTERS
+			const uint64_t cycles;
+#endif
+
+		public:
+			// With nullptr collection, the object doesn't measure anything. The tag is from cpuOpTagId() method.
+			OpRaii( ProfileCollection* pc, eCpuOp which, uint16_t opTag, const std::array<uint32_t, 3>& opShape, uint64_t fl, uint64_t cb ) :
+				owner( pc ), tsc( ( nullptr != pc ) ? tscNow() : 0 ), flops( fl ), bytes( cb ), shape( opShape ), op( which ), tag( opTag )
+#if PROFILER_CYCLE_COUNTERS
+				, cycles( ( nullptr != pc ) ? processCycles() : 0 )
+#endif
+			{ }
+			OpRaii( const OpRaii& ) = delete;
+
+			~OpRaii()
+			{
+				if( nullptr != owner )
+				{
+#if PROFILER_CYCLE_COUNTERS
+					const uint64_t cyclesUsed = ( 0 != cycles ) ? processCycles() - cycles : 0;
+#else
+					const uint64_t cyclesUsed = 0;
+#endif
+					const int64_t now = tscNow();
+					owner->threadMeasures().addOp( op, tag, shape, ticksFromTsc( now - tsc ), flops, bytes, cyclesUsed );
+					EventRecorder* const recorder = owner->eventRecorder();
+					if( nullptr != recorder )
+						recorder->record( "op", cpuOpName( op ), owner->cpuOpTags[ tag ], tsc, now );
+				}
+			}
+		};
+
+		// The recorder of the timeline, or nullptr when it's not started
+		EventRecorder* eventRecorder()
+		{
+			return recorder.enabled() ? &recorder : nullptr;
+		}
+		// Start recording the timeline of CPU blocks and operations, or stop with 0 events.
+		// Should be called while the context is idle.
+		HRESULT startRecorder( uint32_t countEvents )
+		{
+			return recorder.start( countEvents );
+		}
+		HRESULT saveRecording( LPCTSTR path ) const
+		{
+			return recorder.save( path );
 		}
 
 		uint16_t makeTagId( const char* tag );
 
 	private:
+		// GPU measures, only used by the thread which owns the device
 		CAtlMap<uint32_t, Measure> measures;
 		CComAutoCriticalSection critSec;
+
+		EventRecorder recorder;
+
+		// Distinct tags of the CPU operations, the element 0 is nullptr for untagged ones.
+		// Append-only: cpuOpTagId() scans the first countOpTags elements without the lock, and adds new tags under critSec.
+		std::array<const char*, maxCpuOpTags> cpuOpTags = {};
+		volatile long countOpTags = 1;
+		struct OpTemp
+		{
+			uint64_t ticks;
+			// Index in OpMeasures array
+			uint32_t key;
+
+			bool operator<( const OpTemp& that ) const
+			{
+				// Flipping the comparison to sort in descending order
+				return ticks > that.ticks;
+			}
+		};
+		std::vector<OpTemp> cpuOpsTemp;
+		void printCpuOps();
+
+		// CPU measures are written by multiple threads, contexts use thread pools for some of the work.
+		// Each thread has its own array; print() method merges them.
+		struct ThreadMeasures
+		{
+			// Opened with SYNCHRONIZE access right, to detect the thread has exited
+			CHandle thread;
+			DWORD threadId = 0;
+			// The owner thread is the only writer of the array, and it doesn't take any locks.
+			// The counter is odd while the owner updates the array; the readers copy the array, and retry when the counter has changed during the copy.
+			volatile long sequence = 0;
+			// Value of ProfileCollection.resetCounter when the array was cleared. The owner clears the array on the first write after reset(), the readers skip the stale arrays.
+			long generation = 0;
+			CpuMeasures measures;
+			const volatile long* resetCounter = nullptr;
+			// Same for the CPU operations, they're measured on the threads which run the decoder of the hybrid model
+			volatile long opsSequence = 0;
+			long opsGeneration = 0;
+			OpMeasures ops;
+
+			void add( eCpuBlock which, uint64_t ticks, uint64_t cycles );
+			// Copy the measures while the owner thread may be updating them, returns false when the array was written before the last reset
+			bool read( CpuMeasures& rdi ) const;
+			void clear();
+
+			void addOp( eCpuOp which, uint16_t tag, const std::array<uint32_t, 3>& shape, uint64_t ticks, uint64_t flops, uint64_t bytes, uint64_t cycles );
+			bool readOps( OpMeasures& rdi ) const;
+			void clearOps();
+		};
+		// Guarded by critSec, only modified when a thread uses this collection for the first time.
+		// The array of an exited thread is merged into retiredMeasures, and reused by the next new thread.
+		std::vector<std::unique_ptr<ThreadMeasures>> threadMeasuresList;
+		CpuMeasures retiredMeasures;
+		OpMeasures retiredOps;
+		// Incremented by reset(), the per-thread arrays are only written by their threads
+		volatile long resetCounter = 0;
+		// Unique ID of this collection, the key in the thread-local cache of the arrays
+		const uint32_t instanceId;
+		// Find or create the array of CPU measures for the calling thread
+		ThreadMeasures& threadMeasures();
 #if PROFILER_COLLECT_TAGS
 		CAtlMap<const char*, uint16_t> tagIDs;
 		std::vector<const char*> tagNames;
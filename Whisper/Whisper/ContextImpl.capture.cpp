@@ -92,7 +92,7 @@ namespace
 		VAD vad;
 		sFullParams fullParams;
 		ProfileCollection& profiler;
-		iContext* const whisperContext;
+		ContextImpl* const whisperContext;
 
 		// Set the state bit, and if needed notify user with the callback.
 		HRESULT setStateFlag( eCaptureStatus newBit ) noexcept
@@ -165,7 +165,7 @@ namespace
 		}
 
 	public:
-		Capture( const sCaptureCallbacks& cb, const iAudioCapture* ac, const sFullParams& sfp, iContext* wc, ProfileCollection& pc ) :
+		Capture( const sCaptureCallbacks& cb, const iAudioCapture* ac, const sFullParams& sfp, ContextImpl* wc, ProfileCollection& pc ) :
 			callbacks( cb ),
 			captureParams( ac->getParams() ),
 			fullParams( sfp ), whisperContext( wc ), profiler( pc )
@@ -383,6 +383,13 @@ namespace
 	HRESULT Capture::workCallback()
 	{
 		CHECK( whisperContext->runFull( fullParams, &buffer ) );
+		if( fullParams.autoLanguage() )
+		{
+			// The language of the capture session is detected once, from the first piece of audio long enough to transcribe
+			const uint32_t key = whisperContext->detectedLanguageKey();
+			if( 0 != key )
+				fullParams.language = key;
+		}
 		CHECK( clearStateFlag( eCaptureStatus::Transcribing ) );
 		return S_OK;
 	}
@@ -438,6 +445,7 @@ HRESULT COMLIGHTCALL ContextImpl::runCapture( const sFullParams& params, const s
 		}
 	}
 
+	updateSharedDevice();
 	auto profCompleteCpu = profiler.cpuBlock( eCpuBlock::RunComplete );
 	Capture capture{ callbacks, reader, params, this, profiler };
 	CHECK( capture.startup( reader ) );
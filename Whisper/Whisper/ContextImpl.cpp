@@ -8,14 +8,116 @@ ContextImpl::ContextImpl( const WhisperModel& modelData, iModel* modelPointer )
 	model( modelData ),
 	modelPtr( modelPointer ),
 	context( modelData, profiler ),
-	profiler( modelData )
+	profiler( modelData ),
+	deviceLock( &DirectCompute::WhisperContext::deviceLock() )
 { }
 
+namespace
+{
+	// Count of contexts created by iModel.createContext method, for all models in the process
+	volatile long s_userContexts = 0;
+}
+
+ContextImpl::~ContextImpl()
+{
+	if( userContext )
+		InterlockedDecrement( &s_userContexts );
+	destroyLock.lock( deviceLock );
+}
+
+void ContextImpl::setUserContext()
+{
+	assert( !userContext );
+	userContext = true;
+	InterlockedIncrement( &s_userContexts );
+}
+
+void ContextImpl::updateSharedDevice()
+{
+	context.sharedDevice = s_userContexts > 1;
+	if( draftContext )
+		draft()->context.sharedDevice = context.sharedDevice;
+}
+
 #define WHISPER_CHUNK_SIZE  30
 
-HRESULT ContextImpl::encode( iSpectrogram& mel, int seek )
+// While alive, decode() calls of the context go through the decode scheduler of the model, batched with the decode steps of other contexts.
+// The batch computes logits of the complete vocabulary, the runs with a restricted one don't join the scheduler: the other contexts would wait for their steps forever.
+class ContextImpl::BatchedDecodeRaii
+{
+	ContextImpl& owner;
+	DecodeScheduler* const scheduler;
+public:
+	BatchedDecodeRaii( ContextImpl& ctx ) :
+		owner( ctx ), scheduler( ctx.allowedTokens.empty() ? ctx.model.decodeScheduler.get() : nullptr )
+	{
+		if( nullptr == scheduler )
+			return;
+		scheduler->join();
+		owner.batchedDecode = true;
+	}
+	~BatchedDecodeRaii()
+	{
+		if( nullptr == scheduler )
+			return;
+		owner.batchedDecode = false;
+		scheduler->leave();
+	}
+};
+
+// While alive, the restricted vocabulary of the run is set on the context, and on the context of the draft model
+class ContextImpl::AllowedTokensRaii
+{
+	ContextImpl& owner;
+public:
+	AllowedTokensRaii( ContextImpl& ctx, std::vector<int>& tokens ) : owner( ctx )
+	{
+		if( owner.draftContext )
+			owner.draft()->allowedTokens = tokens;
+		owner.allowedTokens.swap( tokens );
+	}
+	~AllowedTokensRaii()
+	{
+		owner.allowedTokens.clear();
+		if( owner.draftContext )
+			owner.draft()->allowedTokens.clear();
+	}
+};
+
+HRESULT ContextImpl::restrictedVocabulary( const sFullParams& params, std::vector<int>& rdi ) const
+{
+	rdi.clear();
+	if( nullptr == params.allowed_tokens || params.allowed_n_tokens <= 0 )
+		return S_OK;
+
+	const Vocabulary& vocab = model.vocab;
+	const int n_vocab = model.parameters.n_vocab;
+	rdi.reserve( (size_t)params.allowed_n_tokens + ( n_vocab - vocab.token_beg ) + 1 );
+	for( int i = 0; i < params.allowed_n_tokens; i++ )
+	{
+		const whisper_token t = params.allowed_tokens[ i ];
+		if( t < 0 || t >= n_vocab )
+		{
+			logError( u8"Allowed token %i is outside of the vocabulary, n_vocab = %i", t, n_vocab );
+			return E_INVALIDARG;
+		}
+		rdi.push_back( t );
+	}
+
+	// The sampling needs the end of text and timestamp tokens to finish the segments
+	rdi.push_back( vocab.token_eot );
+	for( int i = vocab.token_beg; i < n_vocab; i++ )
+		rdi.push_back( i );
+
+	std::sort( rdi.begin(), rdi.end() );
+	rdi.erase( std::unique( rdi.begin(), rdi.end() ), rdi.end() );
+	return S_OK;
+}
+
+HRESULT ContextImpl::encode( iSpectrogram& mel, int seek, bool ahead )
 {
 	auto prof = profiler.cpuBlock( eCpuBlock::Encode );
+	DeviceLockRaii lock{ deviceLock, profiler };
 	// whisper_encode
 	using namespace DirectCompute;
 
@@ -32,7 +134,7 @@ HRESULT ContextImpl::encode( iSpectrogram& mel, int seek )
 	ep.n_text_ctx = model.parameters.n_text_ctx;
 	try
 	{
-		auto cur = context.encode( mel, ep );
+		auto cur = context.encode( mel, ep, ahead );
 		Tracing::tensor( "encode-out", cur );
 		return S_OK;
 	}
@@ -54,7 +156,22 @@ HRESULT ContextImpl::decode( const int* tokens, size_t length, int n_past, int t
 	dp.M = exp_n_audio_ctx > 0 ? exp_n_audio_ctx : model.parameters.n_audio_ctx;
 	dp.n_text_layer = model.parameters.n_text_layer;
 	dp.n_vocab = model.parameters.n_vocab;
+	if( !allowedTokens.empty() )
+	{
+		dp.allowedTokens = allowedTokens.data();
+		dp.countAllowed = (uint32_t)allowedTokens.size();
+	}
 
+	// The scheduler locks the device while it runs the batch.
+	// The contexts with a restricted vocabulary, including the language detection, never join it, see BatchedDecodeRaii class.
+	if( batchedDecode )
+	{
+		assert( allowedTokens.empty() );
+		return model.decodeScheduler->decode( context, profiler, tokens, (int)length, dp, ctx_[ nth ].probs );
+	}
+
+	// The hybrid model decodes on the CPU, HybridContext only locks the device while it reads the cross-attention keys and values from the staging buffers
+	DeviceLockRaii lock{ context.isHybrid() ? nullptr : deviceLock, profiler };
 	try
 	{
 		context.decode( tokens, (int)length, dp, ctx_[nth].probs, threads);
@@ -66,6 +183,66 @@ HRESULT ContextImpl::decode( const int* tokens, size_t length, int n_past, int t
 	}
 }
 
+HRESULT ContextImpl::detectLanguage( iSpectrogram& mel, int seek, int threads )
+{
+	// Ported from whisper_lang_auto_detect() function
+	auto p = profiler.cpuBlock( eCpuBlock::LanguageDetect );
+	detectedLanguage = -1;
+	if( ctx_.empty() )
+		ctx_.resize( 1 );
+
+	CHECK( encode( mel, seek ) );
+
+	// Restrict the vocabulary to the language tokens, the logits projection only computes about 100 rows instead of the complete vocabulary
+	sLanguageList list;
+	CHECK( getSupportedLanguages( list ) );
+	const whisper_token sot = model.vocab.token_sot;
+	std::vector<int> languages;
+	for( uint32_t i = 0; i < list.length; i++ )
+		languages.push_back( sot + 1 + list.pointer[ i ].id );
+	allowedTokens.swap( languages );
+	std::sort( allowedTokens.begin(), allowedTokens.end() );
+	const HRESULT hr = decode( &sot, 1, 0, threads, 0 );
+	// Restore the vocabulary of the transcription
+	allowedTokens.swap( languages );
+	CHECK( hr );
+
+	// The softmax is already restricted to the language tokens, normalizing again is for the tokens missing from smaller vocabularies
+	const std::vector<float>& probs = ctx_[ 0 ].probs;
+	double sum = 0;
+	float maxProb = -1;
+	const sLanguageEntry* best = nullptr;
+	for( uint32_t i = 0; i < list.length; i++ )
+	{
+		const sLanguageEntry& e = list.pointer[ i ];
+		const size_t token = (size_t)sot + 1 + e.id;
+		if( token >= probs.size() )
+			continue;
+		const float p = probs[ token ];
+		sum += p;
+		if( p > maxProb )
+		{
+			maxProb = p;
+			best = &e;
+		}
+	}
+	if( nullptr == best || !( sum > 0 ) )
+	{
+		logError( u8"%s: unable to detect the language", __func__ );
+		return E_FAIL;
+	}
+
+	detectedLanguage = best->id;
+	logInfo( u8"Detected language: %s, probability %.3f", best->name, maxProb / sum );
+	return S_OK;
+}
+
+uint32_t ContextImpl::detectedLanguageKey() const
+{
+	const sLanguageEntry* e = lookupLanguageById( detectedLanguage );
+	return ( nullptr != e ) ? e->key : 0;
+}
+
 std::pair<int, int> ContextImpl::beamGetMinJointProb() const
 {
 	float min_p = INFINITY;
@@ -109,38 +286,46 @@ std::vector<sTokenData> ContextImpl::sampleBestN( const float* probs,
 
 	size_t n_logits = vocab.size();
 
-	ctx_[nth].probs_id.clear();
-	ctx_[nth].probs_id.reserve(n_logits);
-
-	for( size_t i = 0; i < n_logits; i++ )
-		ctx_[nth].probs_id.emplace_back(probs[i], (int)i);
+	// With the restricted vocabulary, probabilities of other tokens are zeros, only the allowed tokens are candidates.
+	// Either way the vector is sorted by token ID, the loops below rely on that.
+	auto& probs_id = ctx_[ nth ].probs_id;
+	probs_id.clear();
+	if( allowedTokens.empty() )
+	{
+		probs_id.reserve( n_logits );
+		for( size_t i = 0; i < n_logits; i++ )
+			probs_id.emplace_back( probs[ i ], (int)i );
+	}
+	else
+	{
+		probs_id.reserve( allowedTokens.size() );
+		for( int i : allowedTokens )
+			probs_id.emplace_back( probs[ i ], i );
+	}
 	{
 		double sum_ts = 0.0;
 		double max_ts = -1.0;
 		double max_tx = -1.0;
 
-		for( int i = 0; i < vocab.token_beg; i++ )
-			max_tx = std::max( max_tx, ctx_[ nth ].probs_id[ i ].first );
-
-		const int i0 = is_initial ? vocab.token_beg + 101 : vocab.token_beg;
-		const int i1 = is_initial ? vocab.token_beg + 101 : (int)n_logits;
-
 		// the initial timestamp cannot be larger than 100
 		// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-		if( is_initial )
-		{
-			for( int i = i0; i < n_logits; i++ )
-				ctx_[nth].probs_id[i].first = -INFINITY;
-		}
+		const int i1 = is_initial ? vocab.token_beg + 101 : (int)n_logits;
 
-		for( int i = vocab.token_beg; i < i1; i++ )
+		for( auto& e : probs_id )
 		{
-			sum_ts += ctx_[nth].probs_id[i].first;
-			if (ctx_[nth].probs_id[i].first > max_ts)
+			const int i = e.second;
+			if( i < vocab.token_beg )
+				max_tx = std::max( max_tx, e.first );
+			else if( i >= i1 )
+				e.first = -INFINITY;
+			else
 			{
-				max_ts = ctx_[nth].probs_id[i].first;
-				for (auto& result : result_vec) {
-					result.tid = ctx_[nth].probs_id[i].second;
+				sum_ts += e.first;
+				if( e.first > max_ts )
+				{
+					max_ts = e.first;
+					for( auto& result : result_vec )
+						result.tid = i;
 				}
 			}
 		}
@@ -150,8 +335,12 @@ std::vector<sTokenData> ContextImpl::sampleBestN( const float* probs,
 		if( sum_ts > max_tx || force_timestamp )
 		{
 			// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L430-L438
-			for( int i = 0; i < vocab.token_beg; i++ )
-				ctx_[nth].probs_id[ i ].first = -INFINITY;
+			for( auto& e : probs_id )
+			{
+				if( e.second >= vocab.token_beg )
+					break;
+				e.first = -INFINITY;
+			}
 		}
 
 		for (auto& result : result_vec) {
@@ -161,7 +350,7 @@ std::vector<sTokenData> ContextImpl::sampleBestN( const float* probs,
 	}
 
 	// find the top K tokens
-	const int top_k = 4 + n_best - 1;
+	const int top_k = std::min( 4 + n_best - 1, (int)probs_id.size() );
 
 	std::partial_sort(
 		ctx_[nth].probs_id.begin(),
@@ -555,11 +744,16 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 	// overwrite audio_ctx
 	exp_n_audio_ctx = params.audio_ctx;
 
-	// these tokens determine the task that will be performed
-	std::vector<whisper_token> prompt_init = { model.vocab.token_sot };
-	if( model.vocab.is_multilingual() )
+	std::vector<int> restricted;
+	CHECK( restrictedVocabulary( params, restricted ) );
+	AllowedTokensRaii _at( *this, restricted );
+
+	const bool multilingual = model.vocab.is_multilingual();
+	const bool autoLanguage = multilingual && params.autoLanguage();
+	int langId = -1;
+	if( multilingual && !autoLanguage )
 	{
-		int langId = lookupLanguageId( params.language );
+		langId = lookupLanguageId( params.language );
 		if( langId < 0 )
 		{
 			char lang[ 5 ];
@@ -568,12 +762,6 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 			logError( u8"%s: unknown language '%s'", __func__, lang );
 			return E_INVALIDARG;
 		}
-
-		prompt_init.push_back( model.vocab.token_sot + 1 + langId );
-		if( params.flag( eFullParamsFlags::Translate ) )
-			prompt_init.push_back( model.vocab.token_translate );
-		else
-			prompt_init.push_back( model.vocab.token_transcribe );
 	}
 
 	// int progress_prev = 0;
@@ -587,9 +775,43 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 
 	if( params.flag( eFullParamsFlags::NoContext ) )
 	{
+		DeviceLockRaii lock{ deviceLock, profiler };
 		CHECK( context.clearState() );
 	}
 
+	// Seek position of the encoder output in the cross-attention buffers, when the language detection left it there.
+	// The first iteration of the main loop reuses that output, the detection only costs a single step of the decoder.
+	int encodedSeek = -1;
+	if( autoLanguage )
+	{
+		if( detectedLanguage < 0 )
+		{
+			CHECK( detectLanguage( mel, seek_start, params.cpuThreads ) );
+			encodedSeek = seek_start;
+		}
+		langId = detectedLanguage;
+	}
+
+	// these tokens determine the task that will be performed
+	std::vector<whisper_token> prompt_init = { model.vocab.token_sot };
+	if( multilingual )
+	{
+		prompt_init.push_back( model.vocab.token_sot + 1 + langId );
+		if( params.flag( eFullParamsFlags::Translate ) )
+			prompt_init.push_back( model.vocab.token_translate );
+		else
+			prompt_init.push_back( model.vocab.token_transcribe );
+	}
+
+	// Pipelined mode: the hybrid model decodes on the CPU, and the GPU is idle in the meantime. Encode the next window while decoding the current one.
+	// SingleSegment flag always advances by 30 seconds, the only case when the next window is known in advance.
+	const bool pipeline = params.flag( eFullParamsFlags::PipelineEncode ) && params.flag( eFullParamsFlags::SingleSegment ) && context.isHybrid();
+	int encodedAheadSeek = -1;
+
+	// Speculative decoding is only implemented for the greedy sampling
+	const bool speculative = draftContext && params.strategy == Whisper::eSamplingStrategy::Greedy;
+	speculativeState.countDrafted = speculativeState.countAccepted = 0;
+
 	while( true )
 	{
 		if( nullptr != progress.pfn )
@@ -618,7 +840,12 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 		}
 
 		// encode audio features starting at offset seek
-		CHECK( encode( mel, seek ) );
+		if( seek == encodedAheadSeek )
+			context.useEncodedAhead();
+		else if( seek != encodedSeek )
+			CHECK( encode( mel, seek ) );
+		encodedSeek = -1;
+		encodedAheadSeek = -1;
 
 		for (auto& ctx : ctx_) {
 			// if we have already generated some text, use it as a prompt to condition the next generation
@@ -650,6 +877,9 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 			ctx.has_ts = false;
 		}
 
+		if( speculative )
+			CHECK( speculativeBegin( mel, seek ) );
+
 		// print the prompt
 		//printf("\n\n");
 		//for (int i = 0; i < prompt.size(); i++) {
@@ -662,8 +892,20 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 		{
 			// Measure "Decode" profiler value, both CPU and GPU times
 			auto prof = context.decodeProfiler();
+			BatchedDecodeRaii batched{ *this };
 			for( int i = 0, n_max = model.parameters.n_text_ctx / 2 - 4; i < n_max; i++ )
 			{
+				// The first decode() call has consumed the cross-attention buffers of this window, they're available for the next one
+				if( pipeline && i > 0 && encodedAheadSeek < 0 )
+				{
+					const int nextSeek = seek + 100 * WHISPER_CHUNK_SIZE;
+					if( nextSeek + 100 < seek_end )
+					{
+						CHECK( encode( mel, nextSeek, true ) );
+						encodedAheadSeek = nextSeek;
+					}
+				}
+
 				if (params.strategy == Whisper::eSamplingStrategy::Greedy) {
 					auto& has_ts = ctx_[0].has_ts;
 					auto& n_past = ctx_[0].n_past;
@@ -672,80 +914,130 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 					auto& seek_delta = ctx_[0].seek_delta;
 					auto& tokens_cur = ctx_[0].loop_ctx.tokens_cur;
 
-					CHECK(decode(prompt.data(), prompt.size(), n_past, params.cpuThreads, /*nth=*/0));
-
-					n_past += (int)prompt.size();
-					prompt.clear();
-
-					// very basic greedy sampling strategy:
-					//
-					//   - always take the most probable token
-					//
-					// more sophisticated sampling strategies could be implemented here, but we keep it simple
-					// feel free to experiment!
-					//
-
-					auto p = profiler.cpuBlock( eCpuBlock::Sample );
-					const sTokenData token = ( i == 0 )
-						? sampleTimestampN( true, /*nth=*/0, /*n_best=*/1)[0]
-						: sampleBestN(/*nth=*/0, /*n_best=*/1)[0];
-
-					// timestamp token - update sliding window
-					if( token.id > model.vocab.token_beg )
+					// Append the sampled token at position pos; returns true when the segment is complete, or the decoding has failed
+					auto greedyToken = [ & ]( const sTokenData& token, int pos ) -> bool
 					{
-						const int seek_delta_new = 2 * ( token.id - model.vocab.token_beg );
+						// timestamp token - update sliding window
+						if( token.id > model.vocab.token_beg )
+						{
+							const int seek_delta_new = 2 * ( token.id - model.vocab.token_beg );
 
-						// do not allow to go back in time
-						if( has_ts && seek_delta > seek_delta_new && result_len < i )
-							break;
+							// do not allow to go back in time
+							if( has_ts && seek_delta > seek_delta_new && result_len < pos )
+								return true;
 
-						seek_delta = seek_delta_new;
-						result_len = i + 1;
-						has_ts = true;
-					}
+							seek_delta = seek_delta_new;
+							result_len = pos + 1;
+							has_ts = true;
+						}
 
-					// add it to the context
-					prompt.push_back( token.id );
-					tokens_cur.push_back( token );
+						// add it to the context
+						prompt.push_back( token.id );
+						tokens_cur.push_back( token );
 
-					//{
-					//    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token[token.tid] : "[?]";
-					//    printf("%s: %10s %6d %6.3f '%s'\n", __func__, tt.c_str(), token.id, token.pt, ctx->vocab.id_to_token[token.id].c_str());
-					//}
+						//{
+						//    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token[token.tid] : "[?]";
+						//    printf("%s: %10s %6d %6.3f '%s'\n", __func__, tt.c_str(), token.id, token.pt, ctx->vocab.id_to_token[token.id].c_str());
+						//}
 
-					// end of segment
-					if( token.id == model.vocab.token_eot ||                  // end of text token
-						( params.max_tokens > 0 && i >= params.max_tokens ) || // max tokens per segment reached
-						( has_ts && seek + seek_delta + 100 >= seek_end )     // end of audio reached
-						)
-					{
-						if( result_len == 0 )
+						// end of segment
+						if( token.id == model.vocab.token_eot ||                  // end of text token
+							( params.max_tokens > 0 && pos >= params.max_tokens ) || // max tokens per segment reached
+							( has_ts && seek + seek_delta + 100 >= seek_end )     // end of audio reached
+							)
 						{
-							if( seek + seek_delta + 100 >= seek_end )
-								result_len = i + 1;
-							else
+							if( result_len == 0 )
 							{
-								failed = true;
-								break;
+								if( seek + seek_delta + 100 >= seek_end )
+									result_len = pos + 1;
+								else
+								{
+									failed = true;
+									return true;
+								}
+							}
+
+							if( params.flag( eFullParamsFlags::SingleSegment ) )
+							{
+								result_len = pos + 1;
+								seek_delta = 100 * WHISPER_CHUNK_SIZE;
 							}
+
+							return true;
 						}
 
-						if( params.flag( eFullParamsFlags::SingleSegment ) )
+						// sometimes, the decoding can get stuck in a repetition loop
+						// this is a simple strategy to avoid such cases - we simply flag the decoding as failed and advance
+						// the sliding window by 1 second
+						if (pos == n_max - 1 && (result_len == 0 || seek_delta < 100 * WHISPER_CHUNK_SIZE / 2))
 						{
-							result_len = i + 1;
-							seek_delta = 100 * WHISPER_CHUNK_SIZE;
+							failed = true;
+							return true;
 						}
+						return false;
+					};
 
-						break;
-					}
+					if( !speculative )
+					{
+						CHECK(decode(prompt.data(), prompt.size(), n_past, params.cpuThreads, /*nth=*/0));
 
-					// sometimes, the decoding can get stuck in a repetition loop
-					// this is a simple strategy to avoid such cases - we simply flag the decoding as failed and advance
-					// the sliding window by 1 second
-					if (i == n_max - 1 && (result_len == 0 || seek_delta < 100 * WHISPER_CHUNK_SIZE / 2))
+						n_past += (int)prompt.size();
+						prompt.clear();
+
+						// very basic greedy sampling strategy:
+						//
+						//   - always take the most probable token
+						//
+						// more sophisticated sampling strategies could be implemented here, but we keep it simple
+						// feel free to experiment!
+						//
+
+						auto p = profiler.cpuBlock( eCpuBlock::Sample );
+						const sTokenData token = ( i == 0 )
+							? sampleTimestampN( true, /*nth=*/0, /*n_best=*/1)[0]
+							: sampleBestN(/*nth=*/0, /*n_best=*/1)[0];
+
+						if( greedyToken( token, i ) )
+							break;
+					}
+					else
 					{
-						failed = true;
-						break;
+						// The draft model proposes a few tokens, this model decodes the pending and the drafted tokens in a single batch
+						uint32_t drafted;
+						CHECK( speculativeDecode( n_past, i, n_max, params.cpuThreads, drafted ) );
+						const size_t pending = prompt.size();
+						prompt.clear();
+
+						// Row [ pending - 1 + j ] of the output has the probabilities of the token which follows j-th drafted token.
+						// Sample these rows in order, and accept the drafted tokens while they match the tokens of this model.
+						// The first mismatch, or the row after all drafted tokens, yields one more token for free.
+						auto p = profiler.cpuBlock( eCpuBlock::Sample );
+						const size_t n_vocab = model.vocab.n_vocab;
+						bool complete = false;
+						uint32_t accepted = 0;
+						while( true )
+						{
+							const float* rsi = ctx_[ 0 ].probs.data() + ( pending - 1 + accepted ) * n_vocab;
+							const sTokenData token = ( i == 0 )
+								? sampleBestN( rsi, true, true, /*nth=*/0, /*n_best=*/1 )[ 0 ]
+								: sampleBestN( rsi, false, false, /*nth=*/0, /*n_best=*/1 )[ 0 ];
+							if( greedyToken( token, i ) )
+							{
+								complete = true;
+								break;
+							}
+							if( accepted == drafted || i + 1 >= n_max || token.id != speculativeDraftedToken( accepted ) )
+								break;
+							accepted++;
+							i++;
+						}
+						if( complete )
+							break;
+
+						// The KV cache has the pending and the accepted tokens; the last sampled token is the only one pending for the next step
+						n_past += (int)( pending + accepted );
+						prompt.erase( prompt.begin(), prompt.end() - 1 );
+						speculativeAccept( accepted, prompt.back() );
 					}
 				} else if (params.strategy == Whisper::eSamplingStrategy::BeamSearch) {
 					// Get the most likely `beam_wd` tokens for each beam.
@@ -1031,6 +1323,12 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 		seek += seek_delta;
 	}
 
+	if( speculative && 0 != speculativeState.countDrafted )
+	{
+		logDebug( u8"Speculative decoding: accepted %zu of %zu drafted tokens, %.1f%%", speculativeState.countAccepted, speculativeState.countDrafted,
+			100.0 * (double)speculativeState.countAccepted / (double)speculativeState.countDrafted );
+	}
+
 	if( nullptr != progress.pfn && !stoppedPrematurely )
 	{
 		auto cb = profiler.cpuBlock( eCpuBlock::Callbacks );
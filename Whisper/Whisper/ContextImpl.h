@@ -2,6 +2,8 @@
 #include "../API/iContext.cl.h"
 #include "../ComLightLib/comLightServer.h"
 #include "WhisperContext.h"
+#include "DecodeScheduler.h"
+#include "DeviceLock.h"
 #include "Spectrogram.h"
 #include "TranscribeResult.h"
 #include "sTokenData.h"
@@ -10,6 +12,25 @@ namespace Whisper
 {
 	class ContextImpl : public ComLight::ObjectRoot<iContext>
 	{
+		// The members below release GPU resources when destroyed. The destructor takes the device lock,
+		// this member is destroyed last and releases the lock after them.
+		class DestroyLock
+		{
+			CComAutoCriticalSection* cs = nullptr;
+		public:
+			void lock( CComAutoCriticalSection* p )
+			{
+				p->Lock();
+				cs = p;
+			}
+			~DestroyLock()
+			{
+				if( nullptr != cs )
+					cs->Unlock();
+			}
+		};
+		DestroyLock destroyLock;
+
 		const WhisperModel& model;
 		ComLight::CComPtr<iModel> modelPtr;
 		DirectCompute::WhisperContext context;
@@ -27,6 +48,11 @@ namespace Whisper
 		HRESULT COMLIGHTCALL runFull( const sFullParams& params, const iAudioBuffer* buffer ) override final;
 		HRESULT COMLIGHTCALL runStreamed( const sFullParams& params, const sProgressSink& progress, const iAudioReader* reader ) override final;
 		HRESULT COMLIGHTCALL runCapture( const sFullParams& params, const sCaptureCallbacks& callbacks, const iAudioCapture* reader ) override final;
+		HRESULT COMLIGHTCALL runFullParallel( const sFullParams& params, const iAudioBuffer* buffer, uint32_t countContexts ) override final;
+		HRESULT COMLIGHTCALL setDraftModel( iModel* draft, uint32_t countTokens ) override final;
+		HRESULT COMLIGHTCALL timelineStart( uint32_t countEvents ) override final;
+		HRESULT COMLIGHTCALL timelineSave( const wchar_t* path ) override final;
+		HRESULT COMLIGHTCALL timingsGet( sStageTimings& rdi ) override final;
 
 		struct Segment
 		{
@@ -78,7 +104,68 @@ namespace Whisper
 		// [EXPERIMENTAL] speed-up techniques
 		int32_t exp_n_audio_ctx = 0; // 0 - use default
 
-		HRESULT encode( iSpectrogram& mel, int seek );
+		// ID of the language detected by detectLanguage() method, or -1.
+		// The runFull / runStreamed / runFullParallel methods reset the cache; capture sessions detect once, and reuse the result for the rest of the audio.
+		int detectedLanguage = -1;
+		// Run the encoder at the specified seek position, and a single step of the decoder over the SOT token.
+		// Pick the most likely language token, and save the result in detectedLanguage field.
+		HRESULT detectLanguage( iSpectrogram& mel, int seek, int threads );
+
+		// All contexts share the D3D device, which was created single-threaded.
+		// The process-wide lock serializes the GPU work of the contexts which run on concurrent threads; their CPU work, including the hybrid decoder, runs in parallel.
+		// The contexts and the decode scheduler of the model take it with DeviceLockRaii.
+		CComAutoCriticalSection* const deviceLock;
+		// True when the context was created by iModel.createContext method
+		bool userContext = false;
+		// With more than one such context in the process, assume they run on concurrent threads, and don't measure GPU time of the blocks which span multiple calls.
+		// Called when a run starts; runFullParallel sets the flag on its contexts regardless.
+		void updateSharedDevice();
+		// True while the decode() calls go through the decode scheduler of the model
+		bool batchedDecode = false;
+		class BatchedDecodeRaii;
+		// Additional contexts for runFullParallel, created on the first call and reused afterwards
+		std::vector<ComLight::CComPtr<iContext>> parallelContexts;
+		HRESULT runParallelChunk( const sFullParams& params, iSpectrogram& mel, size_t begin, size_t end );
+
+		// Context of the draft model for the speculative decoding, and count of tokens to draft on each step
+		ComLight::CComPtr<iContext> draftContext;
+		uint32_t draftTokens = 0;
+		ContextImpl* draft() const
+		{
+			return static_cast<ContextImpl*>( (iContext*)draftContext );
+		}
+		struct SpeculativeState
+		{
+			// Decoder input of the current window of audio: the prompt, the tokens sampled so far, then the drafted tokens
+			std::vector<whisper_token> sequence;
+			// Length of the sequence without the drafted tokens
+			size_t length = 0;
+			// Count of leading tokens of the sequence in the KV cache of the draft model
+			int draftPast = 0;
+			// Statistics for the log
+			size_t countDrafted = 0, countAccepted = 0;
+		};
+		SpeculativeState speculativeState;
+		// Start decoding a new window of audio: run the encoder of the draft model, and reset the sequence to the prompt in ctx_[ 0 ]
+		HRESULT speculativeBegin( iSpectrogram& mel, int seek );
+		// Draft up to draftTokens tokens with the draft model, then decode the pending and the drafted tokens with this model in a single batch
+		HRESULT speculativeDecode( int n_past, int i, int n_max, int threads, uint32_t& drafted );
+		whisper_token speculativeDraftedToken( uint32_t idx ) const
+		{
+			return speculativeState.sequence[ speculativeState.length + idx ];
+		}
+		// Keep the first `accepted` drafted tokens, followed by the token sampled from this model
+		void speculativeAccept( uint32_t accepted, whisper_token last );
+
+		// Optional restricted vocabulary, sorted list of token IDs; empty for the complete vocabulary.
+		// When set, decode() only projects the decoder output on these rows of the token embedding matrix, and sampleBestN() only considers these tokens.
+		// The language detection sets it temporarily, the transcription runs set it from sFullParams.allowed_tokens
+		std::vector<int> allowedTokens;
+		class AllowedTokensRaii;
+		// Validate sFullParams.allowed_tokens, and make the sorted list with the end of text and timestamp tokens; the output is empty when the field is not set
+		HRESULT restrictedVocabulary( const sFullParams& params, std::vector<int>& rdi ) const;
+
+		HRESULT encode( iSpectrogram& mel, int seek, bool ahead = false );
 		HRESULT decode( const int* tokens, size_t length, int n_past, int threads, int nth );
 		std::vector<sTokenData> sampleBestN( const float* probs, bool force_timestamp, bool is_initial, int nth, int n_best );
 		std::vector<sTokenData> sampleBestN(int nth, int n_best);
@@ -98,13 +185,20 @@ namespace Whisper
 		HRESULT COMLIGHTCALL getResults( eResultFlags flags, iTranscribeResult** pp ) const noexcept override final;
 		HRESULT COMLIGHTCALL detectSpeaker( const sTimeInterval& time, eSpeakerChannel& result ) const noexcept override final;
 
-		int defaultThreadsCount() const;
-
 		__m128i getMemoryUse() const;
 		mutable std::vector<StereoSample> diarizeBuffer;
 
 	public:
 
 		ContextImpl( const WhisperModel& modelData, iModel* modelPointer );
+		~ContextImpl();
+		// Count this context as created by iModel.createContext method
+		void setUserContext();
+
+		// Key of the language detected by the last run, or 0 when the language was not detected
+		uint32_t detectedLanguageKey() const;
+
+		// Default value of sFullParams.cpuThreads for the contexts of that model
+		static int defaultThreadsCount( const WhisperModel& model );
 	};
 }
\ No newline at end of file
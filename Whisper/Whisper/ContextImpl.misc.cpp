@@ -35,7 +35,7 @@ static int getCpuCoresCount()
 	return physicalCores;
 }
 
-int ContextImpl::defaultThreadsCount() const
+int ContextImpl::defaultThreadsCount( const WhisperModel& model )
 {
 #if BUILD_HYBRID_VERSION
 	const bool isHybrid = !model.hybridTensors.layers.empty();
@@ -66,7 +66,7 @@ HRESULT COMLIGHTCALL ContextImpl::fullDefaultParams( eSamplingStrategy strategy,
 	memset( rdi, 0, sizeof( sFullParams ) );
 
 	rdi->strategy = strategy;
-	rdi->cpuThreads = defaultThreadsCount();
+	rdi->cpuThreads = defaultThreadsCount( model );
 	rdi->n_max_text_ctx = 16384;
 	rdi->flags = eFullParamsFlags::PrintProgress | eFullParamsFlags::PrintTimestamps;
 	rdi->thold_pt = 0.01f;
@@ -123,6 +123,12 @@ __m128i ContextImpl::getMemoryUse() const
 	__m128i res = setLow_size( cb );
 	// Add all the VRAM in the temporary buffers
 	res = _mm_add_epi64( res, context.getMemoryUse() );
+	// Additional contexts created by runFullParallel
+	for( const auto& c : parallelContexts )
+		res = _mm_add_epi64( res, static_cast<const ContextImpl*>( (iContext*)c )->getMemoryUse() );
+	// Context of the draft model
+	if( draftContext )
+		res = _mm_add_epi64( res, draft()->getMemoryUse() );
 	return res;
 }
 
@@ -184,6 +190,37 @@ HRESULT COMLIGHTCALL ContextImpl::timingsReset()
 	return S_OK;
 }
 
+HRESULT COMLIGHTCALL ContextImpl::timelineStart( uint32_t countEvents )
+{
+	return profiler.startRecorder( countEvents );
+}
+
+HRESULT COMLIGHTCALL ContextImpl::timelineSave( const wchar_t* path )
+{
+	if( nullptr == path )
+		return E_POINTER;
+	return profiler.saveRecording( path );
+}
+
+HRESULT COMLIGHTCALL ContextImpl::timingsGet( sStageTimings& rdi )
+{
+	ProfileCollection::CpuMeasures measures;
+	profiler.mergeCpuMeasures( measures );
+	auto ticks = [ &measures ]( eCpuBlock block )
+	{
+		return measures[ (uint8_t)block ].totalTicks;
+	};
+
+	rdi.run = ticks( eCpuBlock::RunComplete );
+	rdi.spectrogram = ticks( eCpuBlock::Spectrogram );
+	rdi.encode = ticks( eCpuBlock::Encode );
+	rdi.decode = ticks( eCpuBlock::Decode );
+	rdi.sample = ticks( eCpuBlock::Sample );
+	rdi.countRuns = (uint32_t)measures[ (uint8_t)eCpuBlock::RunComplete ].count;
+	rdi.countDecodes = (uint32_t)measures[ (uint8_t)eCpuBlock::Decode ].count;
+	return S_OK;
+}
+
 HRESULT COMLIGHTCALL ContextImpl::getResults( eResultFlags flags, iTranscribeResult** pp ) const noexcept
 {
 	if( nullptr == pp )
@@ -345,6 +382,8 @@ HRESULT COMLIGHTCALL ContextImpl::runFull( const sFullParams& params, const iAud
 	Tracing::vector( "runFull.pcm.in", buffer->getPcmMono(), buffer->countSamples() );
 #endif
 	CHECK( buffer->getTime( mediaTimeOffset ) );
+	detectedLanguage = -1;
+	updateSharedDevice();
 
 	auto profCompleteCpu = profiler.cpuBlock( eCpuBlock::RunComplete );
 	{
@@ -380,6 +419,8 @@ HRESULT COMLIGHTCALL ContextImpl::runStreamed( const sFullParams& params, const
 	}
 
 	mediaTimeOffset = 0;
+	detectedLanguage = -1;
+	updateSharedDevice();
 	auto profCompleteCpu = profiler.cpuBlock( eCpuBlock::RunComplete );
 
 	try
@@ -0,0 +1,282 @@
+#include "stdafx.h"
+#include "ContextImpl.h"
+#include "../Utils/parallelFor.h"
+using namespace Whisper;
+
+namespace
+{
+	// Each context transcribes at least 30 seconds of audio; shorter pieces waste most of the encoder's window
+	constexpr size_t minChunkFrames = 3000;
+	// Look for a pause within 5 seconds from the evenly spaced split points
+	constexpr size_t pauseSearchRadius = 500;
+	// Half-width of the moving average applied to the energy of the frames, 0.25 seconds.
+	// Without the smoothing, the search finds short gaps between syllables instead of pauses between phrases.
+	constexpr size_t energyHalfWindow = 25;
+	// Chunks after the first one start 5 seconds before their split point.
+	// The decoder transcribes that audio again, the text becomes the context of the chunk's own text; the merge drops these segments.
+	constexpr size_t overlapFrames = 500;
+
+	// The initial portion of another spectrogram, which ends at the specified frame.
+	// The encoder pads the mel beyond the end with zeros, same as it does at the end of the complete audio,
+	// so the context which transcribes a chunk doesn't see the speech from the next one.
+	class SpectrogramPrefix : public iSpectrogram
+	{
+		iSpectrogram& source;
+		const size_t length;
+
+		HRESULT makeBuffer( size_t offset, size_t len, const float** buffer, size_t& stride ) noexcept override final
+		{
+			if( offset + len > length )
+				return E_BOUNDS;
+			return source.makeBuffer( offset, len, buffer, stride );
+		}
+
+		size_t getLength() const noexcept override final
+		{
+			return length;
+		}
+
+		HRESULT copyStereoPcm( size_t offset, size_t len, std::vector<StereoSample>& buffer ) const override final
+		{
+			return source.copyStereoPcm( offset, len, buffer );
+		}
+
+	public:
+		SpectrogramPrefix( iSpectrogram& mel, size_t end ) :
+			source( mel ), length( end ) { }
+	};
+
+	// Find the quietest frame of the spectrogram within the [ begin, end ) interval.
+	// This is a simple energy-based voice activity detector: the energy of a frame is the sum of the log-mel values, averaged over the moving window.
+	HRESULT findPause( iSpectrogram& mel, size_t begin, size_t end, size_t& result )
+	{
+		const size_t i0 = ( begin > energyHalfWindow ) ? begin - energyHalfWindow : 0;
+		const size_t i1 = std::min( end + energyHalfWindow, mel.getLength() );
+		const size_t length = i1 - i0;
+
+		MelBufferRaii buffer;
+		CHECK( buffer.make( mel, i0, length ) );
+
+		// Prefix sums of the frame energies; prefix[ i ] is the sum of frames [ i0 .. i0 + i )
+		std::vector<double> prefix( length + 1, 0.0 );
+		for( size_t j = 0; j < N_MEL; j++ )
+		{
+			const float* rsi = buffer[ j ];
+			for( size_t i = 0; i < length; i++ )
+				prefix[ i + 1 ] += rsi[ i ];
+		}
+		for( size_t i = 0; i < length; i++ )
+			prefix[ i + 1 ] += prefix[ i ];
+
+		double minEnergy = INFINITY;
+		result = begin;
+		for( size_t i = begin; i < end; i++ )
+		{
+			const size_t w0 = ( i > i0 + energyHalfWindow ) ? i - energyHalfWindow : i0;
+			const size_t w1 = std::min( i + energyHalfWindow + 1, i1 );
+			const double e = ( prefix[ w1 - i0 ] - prefix[ w0 - i0 ] ) / (double)( w1 - w0 );
+			if( e < minEnergy )
+			{
+				minEnergy = e;
+				result = i;
+			}
+		}
+		return S_OK;
+	}
+}
+
+HRESULT ContextImpl::runParallelChunk( const sFullParams& params, iSpectrogram& mel, size_t begin, size_t end )
+{
+	sFullParams chunkParams = params;
+	chunkParams.offset_ms = (int)( begin * 10 );
+	chunkParams.duration_ms = (int)( ( end - begin ) * 10 );
+
+	t_beg = 0;
+	t_last = 0;
+	tid_last = 0;
+
+	SpectrogramPrefix prefix{ mel, end };
+	try
+	{
+		sProgressSink progressSink{ nullptr, nullptr };
+		return runFullImpl( chunkParams, progressSink, prefix );
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+}
+
+HRESULT COMLIGHTCALL ContextImpl::runFullParallel( const sFullParams& params, const iAudioBuffer* buffer, uint32_t countContexts )
+{
+	if( nullptr == buffer )
+		return E_POINTER;
+
+	// Count of mel frames to transcribe, same math as in Spectrogram::pcmToMel and runFullImpl
+	const size_t melLength = buffer->countSamples() / FFT_STEP;
+	const size_t seekStart = (size_t)params.offset_ms / 10;
+	const size_t seekEnd = ( params.duration_ms == 0 ) ? melLength : std::min( seekStart + params.duration_ms / 10, melLength );
+	const size_t totalFrames = ( seekEnd > seekStart ) ? seekEnd - seekStart : 0;
+	const size_t countChunks = std::min( (size_t)countContexts, totalFrames / minChunkFrames );
+	if( countChunks < 2 )
+		return runFull( params, buffer );
+
+	CHECK( buffer->getTime( mediaTimeOffset ) );
+	detectedLanguage = -1;
+	updateSharedDevice();
+	auto profCompleteCpu = profiler.cpuBlock( eCpuBlock::RunComplete );
+	{
+		auto p = profiler.cpuBlock( eCpuBlock::Spectrogram );
+		CHECK( spectrogram.pcmToMel( buffer, model.filters, params.cpuThreads ) );
+	}
+
+	if( params.flag( eFullParamsFlags::TokenTimestamps ) )
+		computeSignalEnergy( energy, buffer, 32 );
+
+	// Split the audio at pauses near the evenly spaced points
+	std::vector<size_t> boundaries( countChunks + 1 );
+	boundaries[ 0 ] = seekStart;
+	boundaries[ countChunks ] = seekEnd;
+	{
+		auto p = profiler.cpuBlock( eCpuBlock::VAD );
+		for( size_t i = 1; i < countChunks; i++ )
+		{
+			const size_t split = seekStart + totalFrames * i / countChunks;
+			CHECK( findPause( spectrogram, split - pauseSearchRadius, split + pauseSearchRadius, boundaries[ i ] ) );
+		}
+	}
+
+	if( nullptr != params.encoder_begin_callback )
+	{
+		auto cb = profiler.cpuBlock( eCpuBlock::Callbacks );
+		HRESULT hr = params.encoder_begin_callback( this, params.encoder_begin_callback_user_data );
+		if( hr != S_OK )
+		{
+			result_all.clear();
+			return SUCCEEDED( hr ) ? S_OK : hr;
+		}
+	}
+
+	// Detect the language once for the complete audio, the chunks are transcribed with the same language
+	uint32_t languageKey = params.language;
+	if( model.vocab.is_multilingual() && params.autoLanguage() )
+	{
+		exp_n_audio_ctx = params.audio_ctx;
+		CHECK( detectLanguage( spectrogram, (int)seekStart, params.cpuThreads ) );
+		languageKey = detectedLanguageKey();
+	}
+
+	// Create the additional contexts; they share the immutable WhisperModel with this one
+	iModel* const m = modelPtr;
+	while( parallelContexts.size() < countChunks - 1 )
+	{
+		ComLight::CComPtr<ComLight::Object<ContextImpl>> obj;
+		{
+			DeviceLockRaii lock{ deviceLock, profiler };
+			CHECK( ComLight::Object<ContextImpl>::create( obj, model, m ) );
+		}
+		obj.detach( &parallelContexts.emplace_back() );
+	}
+
+	// This context transcribes the first chunk, continuing the text context of the previous calls.
+	// The rest of them start with an empty context, and decode the overlap with the previous chunk first, to have the text before their split point.
+	std::vector<ContextImpl*> contexts( countChunks );
+	contexts[ 0 ] = this;
+	std::vector<size_t> starts( countChunks );
+	starts[ 0 ] = seekStart;
+	for( size_t i = 1; i < countChunks; i++ )
+	{
+		ContextImpl* c = static_cast<ContextImpl*>( (iContext*)parallelContexts[ i - 1 ] );
+		c->ctx_.clear();
+		if( params.flag( eFullParamsFlags::TokenTimestamps ) )
+			c->energy = energy;
+		contexts[ i ] = c;
+		starts[ i ] = std::max( boundaries[ i ] - overlapFrames, boundaries[ i - 1 ] );
+	}
+
+	// The callbacks are called on this thread after all chunks are complete; the threads share the CPU cores
+	struct Jobs
+	{
+		sFullParams params;
+		iSpectrogram* mel;
+		const std::vector<size_t>* starts;
+		const std::vector<size_t>* boundaries;
+		const std::vector<ContextImpl*>* contexts;
+	};
+	Jobs jobs;
+	jobs.params = params;
+	jobs.params.language = languageKey;
+	jobs.params.new_segment_callback = nullptr;
+	jobs.params.new_segment_callback_user_data = nullptr;
+	jobs.params.encoder_begin_callback = nullptr;
+	jobs.params.encoder_begin_callback_user_data = nullptr;
+	jobs.params.resetFlag( eFullParamsFlags::PrintProgress );
+	jobs.params.resetFlag( eFullParamsFlags::PrintRealtime );
+	jobs.params.cpuThreads = std::max( params.cpuThreads / (int)countChunks, 1 );
+	jobs.mel = &spectrogram;
+	jobs.starts = &starts;
+	jobs.boundaries = &boundaries;
+	jobs.contexts = &contexts;
+
+	pfnParallelForCallback pfn = []( int ith, void* pv ) noexcept -> HRESULT
+	{
+		const Jobs& jobs = *(const Jobs*)pv;
+		const size_t begin = ( *jobs.starts )[ ith ];
+		const size_t end = ( *jobs.boundaries )[ ith + 1 ];
+		return ( *jobs.contexts )[ ith ]->runParallelChunk( jobs.params, *jobs.mel, begin, end );
+	};
+
+	// The first chunk may use the draft model of this context for the speculative decoding, it shares the device too.
+	// The GPU work of all these contexts is serialized by the process-wide device lock.
+	std::vector<ContextImpl*> sharingContexts = contexts;
+	if( draftContext )
+		sharingContexts.push_back( draft() );
+	for( ContextImpl* c : sharingContexts )
+		c->context.sharedDevice = true;
+	const HRESULT hr = parallelFor( pfn, (int)countChunks, &jobs );
+	updateSharedDevice();
+	CHECK( hr );
+
+	// Merge the segments. The timestamps are already relative to the start of the audio, because the chunks were transcribed with offset_ms parameter.
+	// The segments in the overlap were transcribed by the previous chunk, they're dropped; the split points are at pauses, few segments cross them.
+	// The last segment of a chunk may extend past the split point, where the encoder saw the zero padding.
+	for( size_t i = 0; i < countChunks; i++ )
+	{
+		ContextImpl& c = *contexts[ i ];
+		const size_t first = ( i == 0 ) ? 0 : result_all.size();
+		const int64_t t0 = (int64_t)boundaries[ i ];
+		if( i != 0 )
+		{
+			for( Segment& seg : c.result_all )
+			{
+				// Keep the segment when its middle is after the split point
+				if( seg.t0 + seg.t1 >= t0 * 2 )
+					result_all.push_back( std::move( seg ) );
+			}
+		}
+
+		const int64_t t1 = (int64_t)boundaries[ i + 1 ];
+		for( size_t j = first; j < result_all.size(); j++ )
+		{
+			Segment& seg = result_all[ j ];
+			seg.t1 = std::min( seg.t1, t1 );
+			seg.t0 = std::min( std::max( seg.t0, t0 ), seg.t1 );
+		}
+		if( i != 0 )
+			c.result_all.clear();
+	}
+
+	// Stitch the text context: the next call to this context continues after the text of the last chunk
+	{
+		const ContextImpl& last = *contexts.back();
+		for( size_t i = 0; i < ctx_.size() && i < last.ctx_.size(); i++ )
+			ctx_[ i ].prompt_past = last.ctx_[ i ].prompt_past;
+	}
+
+	if( nullptr != params.new_segment_callback && !result_all.empty() )
+	{
+		auto cb = profiler.cpuBlock( eCpuBlock::Callbacks );
+		CHECK( params.new_segment_callback( this, (uint32_t)result_all.size(), params.new_segment_callback_user_data ) );
+	}
+	return S_OK;
+}
@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "ContextImpl.h"
+using namespace Whisper;
+
+// Speculative greedy decoding. A smaller model of the same family, like tiny or base, drafts a few tokens against its own encoder output.
+// This model then verifies all of them with a single decode() call, and keeps the longest prefix which matches its own greedy choices.
+// Decoding several tokens at once costs about the same as decoding one, because the weights of the decoder are loaded once for the complete batch.
+// The self-attention caches don't need explicit rollbacks: decode() writes keys and values at n_past position, overwriting the rejected tokens.
+
+HRESULT COMLIGHTCALL ContextImpl::setDraftModel( iModel* draftModel, uint32_t countTokens )
+{
+	draftContext = nullptr;
+	draftTokens = 0;
+	if( nullptr == draftModel )
+		return S_OK;
+	if( countTokens < 1 || countTokens > 16 )
+	{
+		logError( u8"%s parameter %u is out of range", "countTokens", countTokens );
+		return E_INVALIDARG;
+	}
+
+	ComLight::CComPtr<iContext> ctx;
+	CHECK( draftModel->createContext( &ctx ) );
+	// The reference CPU model implements iContext with another class
+	ContextImpl* impl = dynamic_cast<ContextImpl*>( (iContext*)ctx );
+	if( nullptr == impl )
+	{
+		logError( u8"The draft model must use the GPU or Hybrid implementation" );
+		return E_NOINTERFACE;
+	}
+
+	const sModelParams& mp = model.parameters;
+	const sModelParams& dp = impl->model.parameters;
+	if( mp.n_vocab != dp.n_vocab || mp.n_mels != dp.n_mels || mp.n_text_ctx != dp.n_text_ctx ||
+		model.vocab.is_multilingual() != impl->model.vocab.is_multilingual() )
+	{
+		logError( u8"The draft model is incompatible, it needs the same vocabulary and mel spectrogram as the main one" );
+		return E_INVALIDARG;
+	}
+
+	draftContext = ctx;
+	draftTokens = countTokens;
+	return S_OK;
+}
+
+HRESULT ContextImpl::speculativeBegin( iSpectrogram& mel, int seek )
+{
+	ContextImpl& d = *draft();
+	if( d.ctx_.empty() )
+		d.ctx_.resize( 1 );
+	{
+		auto p = profiler.cpuBlock( eCpuBlock::Draft );
+		d.exp_n_audio_ctx = exp_n_audio_ctx;
+		CHECK( d.encode( mel, seek ) );
+	}
+
+	SpeculativeState& s = speculativeState;
+	s.sequence = ctx_[ 0 ].loop_ctx.prompt;
+	s.length = s.sequence.size();
+	s.draftPast = 0;
+	return S_OK;
+}
+
+HRESULT ContextImpl::speculativeDecode( int n_past, int i, int n_max, int threads, uint32_t& drafted )
+{
+	SpeculativeState& s = speculativeState;
+	std::vector<whisper_token>& seq = s.sequence;
+	assert( seq.size() == s.length && (size_t)n_past < s.length );
+
+	// The tokens drafted past n_max position would be discarded anyway
+	const int count = std::min( (int)draftTokens, n_max - 1 - i );
+	if( count > 0 )
+	{
+		auto p = profiler.cpuBlock( eCpuBlock::Draft );
+		ContextImpl& d = *draft();
+		for( int j = 0; j < count; j++ )
+		{
+			CHECK( d.decode( seq.data() + s.draftPast, seq.size() - s.draftPast, s.draftPast, threads, 0 ) );
+			s.draftPast = (int)seq.size();
+
+			const sTokenData token = ( i + j == 0 )
+				? d.sampleTimestampN( true, 0, 1 )[ 0 ]
+				: d.sampleBestN( 0, 1 )[ 0 ];
+			seq.push_back( token.id );
+			if( token.id == model.vocab.token_eot )
+				break;
+		}
+	}
+	drafted = (uint32_t)( seq.size() - s.length );
+	s.countDrafted += drafted;
+
+	// Verify the drafted tokens with a single call to the decoder of this model
+	return decode( seq.data() + n_past, seq.size() - n_past, n_past, threads, 0 );
+}
+
+void ContextImpl::speculativeAccept( uint32_t accepted, whisper_token last )
+{
+	SpeculativeState& s = speculativeState;
+	s.countAccepted += accepted;
+	s.sequence.resize( s.length + accepted );
+	s.sequence.push_back( last );
+	s.length = s.sequence.size();
+	// The KV cache of the draft model remains valid up to the first rejected token
+	s.draftPast = std::min( s.draftPast, (int)s.length - 1 );
+}
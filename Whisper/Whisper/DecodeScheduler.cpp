@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "DecodeScheduler.h"
+using namespace Whisper;
+
+DecodeScheduler::DecodeScheduler()
+{
+	InitializeConditionVariable( &wakeWaiting );
+}
+
+void DecodeScheduler::join()
+{
+	EnterCriticalSection( &m_cs.m_sec );
+	countDecoding++;
+	LeaveCriticalSection( &m_cs.m_sec );
+}
+
+void DecodeScheduler::leave()
+{
+	EnterCriticalSection( &m_cs.m_sec );
+	assert( countDecoding > 0 );
+	countDecoding--;
+	// Other contexts might be waiting for the step of this one
+	runReady();
+	LeaveCriticalSection( &m_cs.m_sec );
+}
+
+void DecodeScheduler::runReady()
+{
+	while( !running && !pending.empty() && pending.size() >= countDecoding )
+	{
+		running = true;
+		batch.swap( pending );
+		pending.clear();
+
+		batchItems.clear();
+		for( const Step* s : batch )
+			batchItems.push_back( s->item );
+
+		LeaveCriticalSection( &m_cs.m_sec );
+		HRESULT hr = S_OK;
+		{
+			// The batch uses arenas and staging buffers of the first context, and attention buffers of all of them
+			DeviceLockRaii lock{ &DirectCompute::WhisperContext::deviceLock(), *batch[ 0 ]->profiler };
+			try
+			{
+				batchItems[ 0 ].context->decodeBatch( batchItems.data(), batchItems.size() );
+			}
+			catch( HRESULT code )
+			{
+				hr = code;
+			}
+		}
+		EnterCriticalSection( &m_cs.m_sec );
+
+		for( Step* s : batch )
+		{
+			s->status = hr;
+			s->completed = true;
+		}
+		batch.clear();
+		running = false;
+		WakeAllConditionVariable( &wakeWaiting );
+	}
+}
+
+HRESULT DecodeScheduler::decode( DirectCompute::WhisperContext& context, ProfileCollection& profiler, const int* tokens, int n_tokens, const DirectCompute::sDecodeParams& decParams, std::vector<float>& probs )
+{
+	Step step;
+	step.item = DirectCompute::WhisperContext::DecodeBatchItem{ &context, tokens, n_tokens, &decParams, &probs };
+	step.profiler = &profiler;
+	step.status = E_PENDING;
+	step.completed = false;
+
+	EnterCriticalSection( &m_cs.m_sec );
+	pending.push_back( &step );
+	runReady();
+	while( !step.completed )
+		SleepConditionVariableCS( &wakeWaiting, &m_cs.m_sec, INFINITE );
+	LeaveCriticalSection( &m_cs.m_sec );
+	return step.status;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "WhisperContext.h"
+#include "DeviceLock.h"
+
+namespace Whisper
+{
+	// Batches decode steps of concurrent contexts which share the same GPU model.
+	// Without it, every context runs its own N=1 pass over the decoder weights; with it, a single pass computes the next tokens of all contexts.
+	// Contexts join while they're decoding a window of audio, and leave when the window is complete.
+	// The batch runs when every context which has joined has submitted a step; the last one to submit runs the batch on its thread, the others wait for the results.
+	class DecodeScheduler
+	{
+		struct Step
+		{
+			DirectCompute::WhisperContext::DecodeBatchItem item;
+			// Profiler of the submitting context, measures the wait for the device lock when this step runs the batch
+			ProfileCollection* profiler;
+			HRESULT status;
+			bool completed;
+		};
+
+		CComAutoCriticalSection m_cs;
+		CONDITION_VARIABLE wakeWaiting;
+		// Count of contexts between join() and leave() calls
+		size_t countDecoding = 0;
+		// Steps submitted by these contexts, waiting for the next batch
+		std::vector<Step*> pending;
+		// True while a thread is running the batch without the lock
+		bool running = false;
+		std::vector<Step*> batch;
+		std::vector<DirectCompute::WhisperContext::DecodeBatchItem> batchItems;
+
+		// Run the pending steps when they're ready, must be called with the lock held
+		void runReady();
+
+	public:
+		DecodeScheduler();
+		DecodeScheduler( const DecodeScheduler& ) = delete;
+
+		void join();
+		void leave();
+
+		// Submit a decode step of the context, and wait for the results
+		HRESULT decode( DirectCompute::WhisperContext& context, ProfileCollection& profiler, const int* tokens, int n_tokens, const DirectCompute::sDecodeParams& decParams, std::vector<float>& probs );
+	};
+}
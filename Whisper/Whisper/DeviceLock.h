@@ -0,0 +1,30 @@
+#pragma once
+#include "../Utils/ProfileCollection.h"
+
+namespace Whisper
+{
+	// Holds the process-wide lock which serializes the GPU work of the contexts, see DirectCompute::WhisperContext::deviceLock()
+	// When the lock is busy, the wait is measured in the eCpuBlock::DeviceWait block of the profiler. With nullptr lock, does nothing.
+	class DeviceLockRaii
+	{
+		CComAutoCriticalSection* const cs;
+	public:
+		DeviceLockRaii( CComAutoCriticalSection* lock, ProfileCollection& profiler ) : cs( lock )
+		{
+			if( nullptr == cs )
+				return;
+			// Only measure the time when the device is busy with the work of other contexts
+			if( TryEnterCriticalSection( &cs->m_sec ) )
+				return;
+			auto p = profiler.cpuBlock( eCpuBlock::DeviceWait );
+			cs->Lock();
+		}
+		~DeviceLockRaii()
+		{
+			if( nullptr != cs )
+				cs->Unlock();
+		}
+		DeviceLockRaii( const DeviceLockRaii& ) = delete;
+		void operator=( const DeviceLockRaii& ) = delete;
+	};
+}
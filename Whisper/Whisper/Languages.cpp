@@ -80,6 +80,13 @@ namespace Whisper
 	{
 		return g_table.lookupName( code );
 	}
+	const sLanguageEntry* lookupLanguageById( int id )
+	{
+		for( const Lang& e : s_languageData )
+			if( e.id == id )
+				return &e;
+		return nullptr;
+	}
 	int COMLIGHTCALL getLanguageId( const char* lang )
 	{
 		return lookupLanguageId( lang );
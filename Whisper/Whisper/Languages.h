@@ -1,5 +1,6 @@
 #pragma once
 #include "../../ComLightLib/comLightCommon.h"
+#include "../API/sLanguageList.h"
 
 namespace Whisper
 {
@@ -8,5 +9,8 @@ namespace Whisper
 
 	const char* lookupLanguageName( const char* code );
 
+	// Find the language by ID, which is the offset of the language token from the SOT token; returns nullptr when not found
+	const sLanguageEntry* lookupLanguageById( int id );
+
 	int COMLIGHTCALL getLanguageId( const char* lang );
 }
\ No newline at end of file
@@ -30,6 +30,10 @@ HRESULT MelStreamer::ensurePcmChunks( size_t len )
 	const bool loadStereo = reader.outputsStereo();
 
 	const size_t neededChunks = len + FFT_SIZE / FFT_STEP;
+	if( queuePcmMono.size() >= neededChunks )
+		return S_OK;
+
+	auto profilerBlock = profiler.cpuBlock( eCpuBlock::ReadAudio );
 	while( true )
 	{
 		if( queuePcmMono.size() >= neededChunks )
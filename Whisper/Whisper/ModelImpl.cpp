@@ -5,23 +5,35 @@
 #include <intrin.h>
 #include "../Utils/ReadStream.h"
 #include "../modelFactory.h"
+#include "DecodeScheduler.h"
+#if BUILD_HYBRID_VERSION
+#include "../CPU/mulMatTuner.h"
+#include "../CPU/mulMatJit.h"
+#endif
 using namespace Whisper;
 
 namespace
 {
-	volatile long s_refCounter = 0;
+	// Models may be loaded on concurrent threads.
+	// Counting alone is not enough: without the lock, the second thread could use the device while the first one is still creating it.
+	CComAutoCriticalSection s_startupLock;
+	long s_refCounter = 0;
+	HRESULT s_startupStatus = S_OK;
 }
 
 HRESULT ModelImpl::FinalConstruct()
 {
-	if( 1 != InterlockedIncrement( &s_refCounter ) )
-		return S_FALSE;
-	return DirectCompute::mlStartup( gpuFlags );
+	CComCritSecLock<CComAutoCriticalSection> lock{ s_startupLock };
+	if( 1 != ++s_refCounter )
+		return FAILED( s_startupStatus ) ? s_startupStatus : S_FALSE;
+	s_startupStatus = DirectCompute::mlStartup( gpuFlags );
+	return s_startupStatus;
 }
 
 void ModelImpl::FinalRelease()
 {
-	if( 0 == InterlockedDecrement( &s_refCounter ) )
+	CComCritSecLock<CComAutoCriticalSection> lock{ s_startupLock };
+	if( 0 == --s_refCounter )
 		DirectCompute::mlShutdown();
 }
 
@@ -30,15 +42,115 @@ HRESULT COMLIGHTCALL ModelImpl::createContext( iContext** pp )
 	ComLight::CComPtr<ComLight::Object<ContextImpl>> obj;
 
 	iModel* m = this;
-	CHECK( ComLight::Object<ContextImpl>::create( obj, model, m ) );
+	{
+		// The new context allocates VRAM, other contexts might be using the device on other threads
+		CComCritSecLock<CComAutoCriticalSection> lock{ DirectCompute::WhisperContext::deviceLock() };
+		CHECK( ComLight::Object<ContextImpl>::create( obj, model, m ) );
+	}
+	obj->setUserContext();
 
 	obj.detach( pp );
 	return S_OK;
 }
 
+HRESULT COMLIGHTCALL ModelImpl::tokenize( const char* text, pfnDecodedTokens pfn, void* pv )
+{
+	if( nullptr == pfn )
+		return E_POINTER;
+
+	std::vector<int> tokens;
+	CHECK( model.vocab.tokenize( text, tokens ) );
+	return pfn( (int)tokens.size(), tokens.data(), pv );
+}
+
 HRESULT ModelImpl::load( iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks )
 {
-	return model.load( stm, hybrid, callbacks );
+	const bool bf16Weights = 0 != ( gpuFlags & (uint32_t)eGpuModelFlags::Bf16Weights );
+#if BUILD_HYBRID_VERSION
+	// The loader converts the decoder weights while reading the file
+	model.hybridBf16 = hybrid && bf16Weights && CpuCompute::hasNativeBf16();
+	if( hybrid && bf16Weights && !model.hybridBf16 )
+		logWarning( u8"eGpuModelFlags.Bf16Weights is ignored, the CPU doesn't support AVX512_BF16 instructions" );
+#endif
+	{
+		// The loader uploads tensors to VRAM, contexts of other models might be using the device on other threads
+		CComCritSecLock<CComAutoCriticalSection> lock{ DirectCompute::WhisperContext::deviceLock() };
+		CHECK( model.load( stm, hybrid, callbacks ) );
+	}
+
+	if( 0 != ( gpuFlags & (uint32_t)eGpuModelFlags::BatchedDecoder ) )
+	{
+		// The hybrid model decodes on the CPU, in separate threads of the contexts
+		if( hybrid )
+			logWarning( u8"eGpuModelFlags.BatchedDecoder is ignored by the Hybrid model" );
+		else
+			model.decodeScheduler = std::make_unique<DecodeScheduler>();
+	}
+
+	const bool jitMulMat = 0 != ( gpuFlags & (uint32_t)eGpuModelFlags::JitMulMat );
+	const bool tuneMulMat = 0 != ( gpuFlags & (uint32_t)eGpuModelFlags::TuneMulMat );
+	const bool cacheInt8 = 0 != ( gpuFlags & (uint32_t)eGpuModelFlags::KvCacheInt8 );
+#if BUILD_HYBRID_VERSION
+	model.hybridCacheInt8 = hybrid && cacheInt8;
+#endif
+	if( !hybrid )
+	{
+		if( jitMulMat )
+			logWarning( u8"eGpuModelFlags.JitMulMat is ignored by the GPU model" );
+		if( tuneMulMat )
+			logWarning( u8"eGpuModelFlags.TuneMulMat is ignored by the GPU model" );
+		if( cacheInt8 )
+			logWarning( u8"eGpuModelFlags.KvCacheInt8 is ignored by the GPU model" );
+		if( bf16Weights )
+			logWarning( u8"eGpuModelFlags.Bf16Weights is ignored by the GPU model" );
+	}
+#if BUILD_HYBRID_VERSION
+	else if( ( jitMulMat || tuneMulMat ) && !model.hybridBf16 )
+	{
+		const sModelParams& mp = model.parameters;
+		const uint32_t n = (uint32_t)mp.n_text_state;
+
+		// Generate the kernels first, so the tuner measures the code which will run in the decoder
+		if( jitMulMat )
+		{
+			// Lengths of the dot products in the decoder weights: n_text_state, and the second layer of the MLP
+			const uint32_t lengths[ 2 ] = { n, n * 4 };
+			HRESULT hr = CpuCompute::jitCompileMulMat( lengths, 2 );
+			if( FAILED( hr ) )
+				logWarningHr( hr, u8"Unable to generate the matrix multiplication kernels, using the built-in ones" );
+		}
+
+		if( tuneMulMat )
+		{
+			// Products of the decoder weights by up to n_text_ctx tokens, and the vocabulary projection of the beams
+			const uint32_t ctx = (uint32_t)mp.n_text_ctx;
+			const CpuCompute::MulMatShape shapes[ 4 ] =
+			{
+				{ n, n, ctx },
+				{ n, n * 4, ctx },
+				{ n * 4, n, ctx },
+				{ n, (uint32_t)mp.n_vocab, 8 },
+			};
+			HRESULT hr = CpuCompute::tuneMulMat( shapes, 4, ContextImpl::defaultThreadsCount( model ) );
+			if( FAILED( hr ) )
+				logWarningHr( hr, u8"Unable to tune the matrix multiplications, using the default kernels" );
+		}
+		else
+		{
+			// The products only use the variants tuned by the previous runs on this CPU, the tuner loads them as well
+			CpuCompute::loadTunedMulMat();
+		}
+	}
+	else if( jitMulMat || tuneMulMat )
+	{
+		// The BF16 weights are multiplied by the BF16 kernels, they don't go through MulMatImpl
+		if( jitMulMat )
+			logWarning( u8"eGpuModelFlags.JitMulMat is ignored with BF16 weights" );
+		if( tuneMulMat )
+			logWarning( u8"eGpuModelFlags.TuneMulMat is ignored with BF16 weights" );
+	}
+#endif
+	return S_OK;
 }
 
 inline bool hasSse41()
@@ -31,6 +31,8 @@ namespace Whisper
 			return model.vocab.string( token );
 		}
 
+		HRESULT COMLIGHTCALL tokenize( const char* text, pfnDecodedTokens pfn, void* pv ) override final;
+
 	public:
 		ModelImpl( uint32_t flags ) : gpuFlags( flags ) { }
 		HRESULT FinalConstruct();
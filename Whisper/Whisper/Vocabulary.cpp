@@ -29,6 +29,8 @@ void Vocabulary::completeBuild()
 			s = stringData.data() + ri;
 	}
 
+	buildEncoder();
+
 	int64_t cb = stringData.size();
 	cb += tokens.size() * sizeof( void* );
 	constexpr double mulKb = 1.0 / ( 1 << 10 );
@@ -0,0 +1,313 @@
+#include "stdafx.h"
+#include "Vocabulary.h"
+using namespace Whisper;
+
+// Byte-level BPE encoder, compatible with the tiktoken library used by OpenAI's Python version of Whisper.
+// The GGML model files don't include the merges table, but they don't need to: in that vocabulary, ID of a token is the rank of the merge which produced it.
+namespace
+{
+	enum struct eCharClass : uint8_t
+	{
+		Letter,
+		Number,
+		Space,
+		Other,
+	};
+
+	eCharClass classifyAscii( char c )
+	{
+		if( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) )
+			return eCharClass::Letter;
+		if( c >= '0' && c <= '9' )
+			return eCharClass::Number;
+		if( c == ' ' || ( c >= '\t' && c <= '\r' ) )
+			return eCharClass::Space;
+		return eCharClass::Other;
+	}
+
+	eCharClass classifyUnicode( uint32_t cp )
+	{
+		if( cp > 0xFFFF )
+		{
+			// Supplementary planes: CJK ideographs extensions are in planes 2 and 3, the rest is mostly emoji and symbols
+			return ( cp >= 0x20000 && cp < 0x40000 ) ? eCharClass::Letter : eCharClass::Other;
+		}
+		const wchar_t wc = (wchar_t)cp;
+		WORD type = 0;
+		if( !GetStringTypeW( CT_CTYPE1, &wc, 1, &type ) )
+			return eCharClass::Other;
+		if( 0 != ( type & C1_ALPHA ) )
+			return eCharClass::Letter;
+		if( 0 != ( type & C1_DIGIT ) )
+			return eCharClass::Number;
+		if( 0 != ( type & C1_SPACE ) )
+			return eCharClass::Space;
+		return eCharClass::Other;
+	}
+
+	// A code point of the input text
+	struct Char
+	{
+		uint32_t offset;
+		eCharClass cls;
+		bool isBlank;	// U+0020 SPACE, the only one which the GPT-2 pattern allows in front of words
+	};
+
+	// Decode UTF-8 into the vector of code points; the last element is a sentinel with the length of the string
+	// Invalid bytes are passed through as individual characters, the byte-level BPE can encode anything.
+	void decodeText( const char* text, size_t length, std::vector<Char>& result )
+	{
+		result.clear();
+		result.reserve( length + 1 );
+		const uint8_t* const s = (const uint8_t*)text;
+		size_t i = 0;
+		while( i < length )
+		{
+			const uint8_t c = s[ i ];
+			if( c < 0x80 )
+			{
+				result.push_back( Char{ (uint32_t)i, classifyAscii( (char)c ), c == ' ' } );
+				i++;
+				continue;
+			}
+
+			size_t len;
+			uint32_t cp;
+			if( ( c & 0xE0 ) == 0xC0 )
+			{
+				len = 2;
+				cp = c & 0x1F;
+			}
+			else if( ( c & 0xF0 ) == 0xE0 )
+			{
+				len = 3;
+				cp = c & 0x0F;
+			}
+			else if( ( c & 0xF8 ) == 0xF0 )
+			{
+				len = 4;
+				cp = c & 0x07;
+			}
+			else
+				len = 0;
+
+			if( 0 != len && i + len <= length )
+			{
+				for( size_t j = 1; j < len; j++ )
+				{
+					const uint8_t cont = s[ i + j ];
+					if( ( cont & 0xC0 ) != 0x80 )
+					{
+						len = 0;
+						break;
+					}
+					cp = ( cp << 6 ) | ( cont & 0x3F );
+				}
+			}
+			else
+				len = 0;
+
+			if( 0 == len )
+			{
+				result.push_back( Char{ (uint32_t)i, eCharClass::Other, false } );
+				i++;
+				continue;
+			}
+			result.push_back( Char{ (uint32_t)i, classifyUnicode( cp ), false } );
+			i += len;
+		}
+		result.push_back( Char{ (uint32_t)length, eCharClass::Other, false } );
+	}
+
+	inline bool isContraction( const char* s, size_t length, size_t& matched )
+	{
+		// 's|'t|'re|'ve|'m|'ll|'d
+		if( length < 2 || s[ 0 ] != '\'' )
+			return false;
+		const char c1 = s[ 1 ];
+		if( c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd' )
+		{
+			matched = 2;
+			return true;
+		}
+		if( length < 3 )
+			return false;
+		const char c2 = s[ 2 ];
+		if( ( c1 == 'r' && c2 == 'e' ) || ( c1 == 'v' && c2 == 'e' ) || ( c1 == 'l' && c2 == 'l' ) )
+		{
+			matched = 3;
+			return true;
+		}
+		return false;
+	}
+
+	// Split the text into words with the GPT-2 pattern, calling the callback with [ begin, end ) byte offsets of each word:
+	// 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+	template<class Callback>
+	void splitWords( const char* text, const std::vector<Char>& chars, Callback&& callback )
+	{
+		const size_t n = chars.size() - 1;
+		const size_t textLength = chars[ n ].offset;
+		size_t i = 0;
+		while( i < n )
+		{
+			const size_t begin = chars[ i ].offset;
+			size_t matched;
+			if( isContraction( text + begin, textLength - begin, matched ) )
+			{
+				// All characters of the contractions are ASCII, one byte each
+				i += matched;
+				callback( begin, chars[ i ].offset );
+				continue;
+			}
+
+			// Optional space in front of the word
+			size_t j = i;
+			if( chars[ j ].isBlank && j + 1 < n && chars[ j + 1 ].cls != eCharClass::Space )
+				j++;
+
+			const eCharClass cls = chars[ j ].cls;
+			if( cls != eCharClass::Space )
+			{
+				j++;
+				while( j < n && chars[ j ].cls == cls )
+					j++;
+				callback( begin, chars[ j ].offset );
+				i = j;
+				continue;
+			}
+
+			// A run of whitespace. Unless that's the end of the text, the last whitespace character stays for the next word.
+			while( j < n && chars[ j ].cls == eCharClass::Space )
+				j++;
+			if( j < n && j - i > 1 )
+				j--;
+			callback( begin, chars[ j ].offset );
+			i = j;
+		}
+	}
+}
+
+void Vocabulary::buildEncoder()
+{
+	tokenIds.clear();
+	const int count = std::min( (int)tokens.size(), token_eot );
+	tokenIds.reserve( count );
+	for( int i = 0; i < count; i++ )
+	{
+		const char* s = tokens[ i ];
+		const size_t len = strlen( s );
+		if( 0 == len )
+			continue;
+		// Keep the first occurrence, the lowest rank
+		tokenIds.try_emplace( std::string_view{ s, len }, i );
+	}
+}
+
+int Vocabulary::findToken( const char* rsi, size_t length ) const
+{
+	auto it = tokenIds.find( std::string_view{ rsi, length } );
+	if( it != tokenIds.end() )
+		return it->second;
+	return -1;
+}
+
+void Vocabulary::encodeWord( const char* rsi, size_t length, std::vector<int>& result ) const
+{
+	// Most words of a typical text are tokens on their own
+	const int whole = findToken( rsi, length );
+	if( whole >= 0 )
+	{
+		result.push_back( whole );
+		return;
+	}
+
+	// Ported from byte_pair_merge() function in tiktoken.
+	// The parts vector has start offsets of the current tokens, and ranks of merging every part with the next one.
+	constexpr int noRank = INT_MAX;
+	struct Part
+	{
+		uint32_t start;
+		int rank;
+	};
+	std::array<Part, 64> localBuffer;
+	std::vector<Part> heapBuffer;
+	Part* parts;
+	if( length + 1 <= localBuffer.size() )
+		parts = localBuffer.data();
+	else
+	{
+		heapBuffer.resize( length + 1 );
+		parts = heapBuffer.data();
+	}
+	size_t countParts = length + 1;
+
+	// Rank of merging parts[ i ] and parts[ i + 1 ], when they're followed by at least one more part
+	auto getRank = [ & ]( size_t i ) -> int
+	{
+		if( i + 2 >= countParts )
+			return noRank;
+		const uint32_t start = parts[ i ].start;
+		const int id = findToken( rsi + start, parts[ i + 2 ].start - start );
+		return ( id >= 0 ) ? id : noRank;
+	};
+
+	for( size_t i = 0; i < countParts; i++ )
+		parts[ i ] = Part{ (uint32_t)i, noRank };
+	for( size_t i = 0; i + 2 < countParts; i++ )
+		parts[ i ].rank = getRank( i );
+
+	while( countParts > 2 )
+	{
+		int minRank = noRank;
+		size_t minIndex = 0;
+		for( size_t i = 0; i + 1 < countParts; i++ )
+		{
+			if( parts[ i ].rank < minRank )
+			{
+				minRank = parts[ i ].rank;
+				minIndex = i;
+			}
+		}
+		if( minRank == noRank )
+			break;
+
+		// Merge parts[ minIndex ] with the next one, then update the ranks of the neighbors
+		std::copy( parts + minIndex + 2, parts + countParts, parts + minIndex + 1 );
+		countParts--;
+		parts[ minIndex ].rank = getRank( minIndex );
+		if( minIndex > 0 )
+			parts[ minIndex - 1 ].rank = getRank( minIndex - 1 );
+	}
+
+	for( size_t i = 0; i + 1 < countParts; i++ )
+	{
+		const uint32_t start = parts[ i ].start;
+		const uint32_t len = parts[ i + 1 ].start - start;
+		const int id = findToken( rsi + start, len );
+		if( id >= 0 )
+			result.push_back( id );
+		else
+			logWarning( u8"Vocabulary.tokenize: no token for the %u bytes at offset %u", len, start );
+	}
+}
+
+HRESULT Vocabulary::tokenize( const char* text, std::vector<id>& result ) const
+{
+	if( nullptr == text )
+		return E_POINTER;
+	if( tokenIds.empty() )
+		return OLE_E_BLANK;
+
+	const size_t length = strlen( text );
+	if( length >= UINT_MAX )
+		return DISP_E_OVERFLOW;
+
+	std::vector<Char> chars;
+	decodeText( text, length, chars );
+	splitWords( text, chars, [ & ]( size_t begin, size_t end )
+	{
+		encodeWord( text + begin, end - begin, result );
+	} );
+	return S_OK;
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include "../../ComLightLib/streams.h"
 #include "../API/SpecialTokens.h"
+#include <unordered_map>
+#include <string_view>
 
 namespace Whisper
 {
@@ -11,6 +13,13 @@ namespace Whisper
 
 		void addExtra( int index, const char* format, int i );
 
+		// String -> ID of the text tokens, for the BPE encoder. The keys point to the strings in the tokens vector.
+		// The token IDs double as merge ranks: the byte-level BPE vocabulary was built by appending merged tokens in the order of these merges.
+		std::unordered_map<std::string_view, int> tokenIds;
+		void buildEncoder();
+		int findToken( const char* rsi, size_t length ) const;
+		void encodeWord( const char* rsi, size_t length, std::vector<int>& result ) const;
+
 		void completeBuild();
 	public:
 
@@ -50,9 +59,15 @@ namespace Whisper
 
 		void getSpecialTokens( SpecialTokens& rdi ) const;
 
+		// Encode UTF-8 text into text tokens: split into words with the GPT-2 pattern, then byte-level BPE within each word
+		// The output never contains special tokens, the tokens are appended to the vector
+		HRESULT tokenize( const char* text, std::vector<id>& result ) const;
+
 		size_t getMemoryUse() const
 		{
-			return vectorMemoryUse( tokens ) + vectorMemoryUse( stringData );
+			// Approximate, the standard library doesn't expose the size of the hash map nodes
+			const size_t hashMap = tokenIds.bucket_count() * sizeof( void* ) + tokenIds.size() * ( sizeof( std::string_view ) + sizeof( int ) + sizeof( void* ) * 2 );
+			return vectorMemoryUse( tokens ) + vectorMemoryUse( stringData ) + hashMap;
 		}
 	};
 }
\ No newline at end of file
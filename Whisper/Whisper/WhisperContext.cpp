@@ -62,7 +62,7 @@ WhisperContext::WhisperContext( const Whisper::WhisperModel& wm, Whisper::Profil
 #if BUILD_HYBRID_VERSION
 	if( !wm.hybridTensors.layers.empty() )
 	{
-		hybridContext = std::make_unique<HybridContext>( wm );
+		hybridContext = std::make_unique<HybridContext>( wm, pc );
 		check( hybridContext->create() );
 #if SAVE_DEBUG_TRACE
 		Tracing::traceCreate( traceFileHybrid );
@@ -119,6 +119,12 @@ WhisperContext& WhisperContext::current()
 }
 #endif
 
+CComAutoCriticalSection& WhisperContext::deviceLock()
+{
+	static CComAutoCriticalSection cs;
+	return cs;
+}
+
 Tensor WhisperContext::createTensor( eDataType type, const std::array<uint32_t, 4>& ne )
 {
 	// return MlContext::createTensor( type, ne );
@@ -307,7 +313,7 @@ void WhisperContext::createKeyValueBuffers( const sEncodeParams& encParams )
 	}
 }
 
-Tensor WhisperContext::encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams )
+Tensor WhisperContext::encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams, bool ahead )
 {
 	auto prof = profiler.block( eProfilerBlock::Encode );
 	CaptureRaii renderdocCapture;
@@ -392,16 +398,76 @@ Tensor WhisperContext::encode( Whisper::iSpectrogram& spectrogram, const sEncode
 	if( hybridContext )
 	{
 		// When running hybrid model, download cross-attention buffers from VRAM to system RAM
-		check( hybridContext->downloadKeyValues( kvCross ) );
+		check( hybridContext->downloadKeyValues( kvCross, ahead ) );
+		// The decoder won't wait for the results until the next window. Submit the work now, instead of the next blocking call.
+		if( ahead )
+			context()->Flush();
 	}
 #endif
 	return cur;
 }
 
+void WhisperContext::useEncodedAhead()
+{
+#if BUILD_HYBRID_VERSION
+	if( hybridContext )
+		hybridContext->useDownloadedKeyValues();
+#endif
+}
+
+void WhisperContext::ColumnViews::setLayout( const sDecodeSession* sessions, size_t count )
+{
+	bool same = layout.size() == count * 2;
+	for( size_t i = 0; same && i < count; i++ )
+		same = layout[ i * 2 ] == sessions[ i ].first && layout[ i * 2 + 1 ] == sessions[ i ].N;
+	if( same )
+		return;
+
+	entries.clear();
+	layout.resize( count * 2 );
+	for( size_t i = 0; i < count; i++ )
+	{
+		layout[ i * 2 ] = sessions[ i ].first;
+		layout[ i * 2 + 1 ] = sessions[ i ].N;
+	}
+}
+
+Tensor WhisperContext::ColumnViews::columns( const Tensor& t, uint32_t first, uint32_t count )
+{
+	ID3D11ShaderResourceView* const srv = t;
+	const uint32_t ne0 = t.ne[ 0 ];
+	for( const Entry& e : entries )
+		if( e.source == srv && e.ne0 == ne0 && e.first == first && e.count == count )
+			return e.view;
+
+	// The arenas grow their buffers occasionally, the old views are never requested again
+	constexpr size_t maxEntries = 256;
+	if( entries.size() >= maxEntries )
+		entries.clear();
+
+	Entry& e = entries.emplace_back();
+	e.source = srv;
+	e.ne0 = ne0;
+	e.first = first;
+	e.count = count;
+	e.view = t.columns( first, count );
+	return e.view;
+}
+
 struct WhisperContext::sLayerDecParams
 {
 	uint32_t n_state, n_head, N;
-	uint32_t n_ctx, n_past, M;
+	const sDecodeSession* sessions;
+	size_t countSessions;
+	ColumnViews* views;
+
+	// Columns of the [ n_state, N ] matrix which belong to the session; when decoding a single context, the complete matrix
+	Tensor columns( const Tensor& t, const sDecodeSession& s ) const
+	{
+		if( s.N == N )
+			return t;
+		return views->columns( t, s.first, s.N );
+	}
 };
 
 Tensor WhisperContext::decodeLayer( const Tensor& inpL, size_t il, const sLayerDecParams& ldp )
@@ -436,42 +502,50 @@ Tensor WhisperContext::decodeLayer( const Tensor& inpL, size_t il, const sLayerD
 		addRepeat( Vcur, layer.attnValue.b );
 		if( 0 == il ) Tracing::tensor( "dec-Vcur", Vcur );
 
-		// store key and value to memory
+		// The projections above are shared by all sessions of the batch, the attention uses the caches of individual sessions
+		for( size_t i = 0; i < ldp.countSessions; i++ )
 		{
-			const uint32_t len = ldp.N * ldp.n_state;
-			const uint32_t off = ldp.n_state * ( (uint32_t)il * ldp.n_ctx + ldp.n_past );
-			Tensor k = kv.keys.view( len, off );
-			Tensor v = kv.values.view( len, off );
-			copyImpl( Kcur, k, true );
-			copyImpl( Vcur, v, true );
-		}
-
-		// ------
-		Tensor Q = permute( copy( Qcur, eDataType::FP32, { ldp.n_state / ldp.n_head, ldp.n_head, ldp.N } ), 0, 2, 1, 3 );
-		Tensor K = permute( kv.keys.view( ( ldp.n_past + ldp.N ) * ldp.n_state, (uint32_t)il * ldp.n_ctx * ldp.n_state )
-			.reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, ldp.n_past + ldp.N ),
-			0, 2, 1, 3 );
-		profiler.setNextTag( "dec.layer.4" );
-		Tensor KQ = mulMat( K, Q );
-		if( 0 == il ) Tracing::tensor( "dec-KQ-0", KQ );
-		diagMaskInf( KQ, ldp.n_past );
-		if( 0 == il ) Tracing::tensor( "dec-KQ-1", KQ );
-		profiler.setNextTag( "decLayer.1" );
-		softMax( KQ );
-		if( 0 == il ) Tracing::tensor( "dec-KQ-2", KQ );
+			const sDecodeSession& s = ldp.sessions[ i ];
+			const KeyValueBuffers& selfKv = *s.kv;
 
-		Tensor V_trans = permute(
-			kv.values
-			.view( ( ldp.n_past + ldp.N ) * ldp.n_state, (uint32_t)il * ldp.n_ctx * ldp.n_state )
-			.reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, ldp.n_past + ldp.N ),
-			1, 2, 0, 3 );
-
-		profiler.setNextTag( "dec.layer.5" );
-		Tensor KQV = mulMat( V_trans, KQ );
-		if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
+			// store key and value to memory
+			{
+				const uint32_t len = s.N * ldp.n_state;
+				const uint32_t off = ldp.n_state * ( (uint32_t)il * s.n_ctx + s.n_past );
+				Tensor k = selfKv.keys.view( len, off );
+				Tensor v = selfKv.values.view( len, off );
+				copyImpl( ldp.columns( Kcur, s ), k, true );
+				copyImpl( ldp.columns( Vcur, s ), v, true );
+			}
 
-		Tensor KQV_merged = permute( KQV, 0, 2, 1, 3 );
-		copyInPlace( cur, KQV_merged, eDataType::FP32, { ldp.n_state, ldp.N } );
+			// ------
+			Tensor Q = permute( copy( ldp.columns( Qcur, s ), eDataType::FP32, { ldp.n_state / ldp.n_head, ldp.n_head, s.N } ), 0, 2, 1, 3 );
+			Tensor K = permute( selfKv.keys.view( ( s.n_past + s.N ) * ldp.n_state, (uint32_t)il * s.n_ctx * ldp.n_state )
+				.reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, s.n_past + s.N ),
+				0, 2, 1, 3 );
+			profiler.setNextTag( "dec.layer.4" );
+			Tensor KQ = mulMat( K, Q );
+			if( 0 == il ) Tracing::tensor( "dec-KQ-0", KQ );
+			diagMaskInf( KQ, s.n_past );
+			if( 0 == il ) Tracing::tensor( "dec-KQ-1", KQ );
+			profiler.setNextTag( "decLayer.1" );
+			softMax( KQ );
+			if( 0 == il ) Tracing::tensor( "dec-KQ-2", KQ );
+
+			Tensor V_trans = permute(
+				selfKv.values
+				.view( ( s.n_past + s.N ) * ldp.n_state, (uint32_t)il * s.n_ctx * ldp.n_state )
+				.reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, s.n_past + s.N ),
+				1, 2, 0, 3 );
+
+			profiler.setNextTag( "dec.layer.5" );
+			Tensor KQV = mulMat( V_trans, KQ );
+			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
+
+			Tensor KQV_merged = permute( KQV, 0, 2, 1, 3 );
+			Tensor dest = ldp.columns( cur, s );
+			copyInPlace( dest, KQV_merged, eDataType::FP32, { ldp.n_state, s.N } );
+		}
 	}
 
 	{
@@ -494,26 +568,33 @@ Tensor WhisperContext::decodeLayer( const Tensor& inpL, size_t il, const sLayerD
 		Tensor Qcur = mulMat( layer.crossAttnQuery.w, cur );
 		addRepeatScale( Qcur, layer.crossAttnQuery.b, computeScaling( (int)ldp.n_state, (int)ldp.n_head ) );
 
-		// Kcross is already scaled
-		const uint32_t len = ldp.M * ldp.n_state;
-		const uint32_t off = (uint32_t)il * len;
-		Tensor Kcross = kvCross.keys.view( len, off ).reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, ldp.M );
-		Tensor Vcross = kvCross.values.view( len, off ).reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, ldp.M );
-
-		// ------
-		Tensor Q = permute( copy( Qcur, eDataType::FP32, { ldp.n_state / ldp.n_head, ldp.n_head, ldp.N } ), 0, 2, 1, 3 );
-		Tensor K = permute( Kcross, 0, 2, 1, 3 );
-		profiler.setNextTag( "dec.layer.8" );
-		Tensor KQ = mulMat( K, Q );
-		profiler.setNextTag( "decLayer.2" );
-		softMax( KQ );
-		Tensor V_trans = permute( Vcross, 1, 2, 0, 3 );
-		profiler.setNextTag( "dec.layer.9" );
-		Tensor KQV = mulMat( V_trans, KQ );
-		if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
-		Tensor KQV_merged = permute( KQV, 0, 2, 1, 3 );
-
-		copyInPlace( cur, KQV_merged, eDataType::FP32, { ldp.n_state, ldp.N } );
+		for( size_t i = 0; i < ldp.countSessions; i++ )
+		{
+			const sDecodeSession& s = ldp.sessions[ i ];
+			const KeyValueBuffers& crossKv = *s.kvCross;
+
+			// Kcross is already scaled
+			const uint32_t len = s.M * ldp.n_state;
+			const uint32_t off = (uint32_t)il * len;
+			Tensor Kcross = crossKv.keys.view( len, off ).reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, s.M );
+			Tensor Vcross = crossKv.values.view( len, off ).reshape3d( ldp.n_state / ldp.n_head, ldp.n_head, s.M );
+
+			// ------
+			Tensor Q = permute( copy( ldp.columns( Qcur, s ), eDataType::FP32, { ldp.n_state / ldp.n_head, ldp.n_head, s.N } ), 0, 2, 1, 3 );
+			Tensor K = permute( Kcross, 0, 2, 1, 3 );
+			profiler.setNextTag( "dec.layer.8" );
+			Tensor KQ = mulMat( K, Q );
+			profiler.setNextTag( "decLayer.2" );
+			softMax( KQ );
+			Tensor V_trans = permute( Vcross, 1, 2, 0, 3 );
+			profiler.setNextTag( "dec.layer.9" );
+			Tensor KQV = mulMat( V_trans, KQ );
+			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
+			Tensor KQV_merged = permute( KQV, 0, 2, 1, 3 );
+
+			Tensor dest = ldp.columns( cur, s );
+			copyInPlace( dest, KQV_merged, eDataType::FP32, { ldp.n_state, s.N } );
+		}
 	}
 
 	// projection
@@ -585,22 +666,70 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 		HybridContext::sDecParams sdp;
 		sdp.n_threads = threads;
 		sdp.M = decParams.M;
+		sdp.allowedTokens = decParams.allowedTokens;
+		sdp.countAllowed = decParams.countAllowed;
 		check( hybridContext->decode( tokens, n_tokens, decParams.n_past, sdp, probs ) );
 		return;
 	}
 #endif
 
+	const DecodeBatchItem item{ this, tokens, n_tokens, &decParams, &probs };
+	decodeBatch( &item, 1 );
+}
+
+void WhisperContext::decodeBatch( const DecodeBatchItem* items, size_t count )
+{
+	// These parameters only depend on the model, they're the same for all items of the batch
+	const sDecodeParams& decParams = *items[ 0 ].params;
+	const bool isRestricted = nullptr != decParams.allowedTokens;
+	if( 0 == count || ( isRestricted && count != 1 ) )
+		throw E_INVALIDARG;
+
 	auto prof = profiler.block( eProfilerBlock::DecodeStep );
 	CaptureRaii renderdocCapture;
 	profiler.profileShaders = profileDecodeShaders;
 	ArenaRaii arenaRaii{ *this, arenas.outer };
 
-	assert( n_tokens > 0 );
-	const uint32_t N = (uint32_t)n_tokens;
-	decoderInput.resize( N );
+	batchSessions.resize( count );
+	uint32_t N = 0;
+	for( size_t i = 0; i < count; i++ )
+	{
+		const DecodeBatchItem& item = items[ i ];
+		assert( item.n_tokens > 0 );
+		sDecodeSession& s = batchSessions[ i ];
+		s.kv = &item.context->kv;
+		s.kvCross = &item.context->kvCross;
+		s.first = N;
+		s.N = (uint32_t)item.n_tokens;
+		s.n_ctx = item.params->n_ctx;
+		s.n_past = item.params->n_past;
+		s.M = item.params->M;
+		N += s.N;
+	}
+	if( count > 1 )
+		columnViews.setLayout( batchSessions.data(), count );
 
-	Tensor embd = decoderInput.embedding( tokens );
-	Tensor cur = addRows( gpuModel.dec.tokenEmbedding, gpuModel.dec.positionalEmbedding, embd, decParams.n_past );
+	Tensor cur;
+	if( 1 == count )
+	{
+		decoderInput.resize( N );
+		Tensor embd = decoderInput.embedding( items[ 0 ].tokens );
+		cur = addRows( gpuModel.dec.tokenEmbedding, gpuModel.dec.positionalEmbedding, embd, decParams.n_past );
+	}
+	else
+	{
+		// Positional embeddings depend on n_past of the individual sessions, gather the rows one session at a time
+		cur = createTensor( eDataType::FP32, { decParams.n_state, N } );
+		for( size_t i = 0; i < count; i++ )
+		{
+			const sDecodeSession& s = batchSessions[ i ];
+			decoderInput.resize( s.N );
+			Tensor embd = decoderInput.embedding( items[ i ].tokens );
+			Tensor rows = addRows( gpuModel.dec.tokenEmbedding, gpuModel.dec.positionalEmbedding, embd, s.n_past );
+			Tensor dest = columnViews.columns( cur, s.first, s.N );
+			copyInPlace( dest, rows, eDataType::FP32, { decParams.n_state, s.N } );
+		}
+	}
 	Tracing::tensor( "dec-rows", cur );
 
 	{
@@ -608,9 +737,9 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 		ldp.n_state = decParams.n_state;
 		ldp.n_head = decParams.n_head;
 		ldp.N = N;
-		ldp.n_ctx = decParams.n_ctx;
-		ldp.n_past = decParams.n_past;
-		ldp.M = decParams.M;
+		ldp.sessions = batchSessions.data();
+		ldp.countSessions = count;
+		ldp.views = &columnViews;
 #if 1
 		for( size_t i = 0; i < decParams.n_text_layer; i++ )
 			cur = decodeLayer( cur, i, ldp );
@@ -625,17 +754,86 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 	fmaRepeat( cur, gpuModel.dec.ln );
 
 	profiler.setNextTag( "dec.logits" );
-	cur = mulMat( gpuModel.dec.tokenEmbedding, cur );
+	if( !isRestricted )
+		cur = mulMat( gpuModel.dec.tokenEmbedding, cur );
+	else
+		cur = mulMat( restrictedEmbedding( decParams.allowedTokens, decParams.countAllowed ), cur );
 
 	// logits -> probs
 	profiler.setNextTag( "dec.probs" );
 	softMax( cur );
 
 	decoderOutput.copyFromVram( cur );
-	assert( decoderOutput.size() == N * decParams.n_vocab );
+	if( isRestricted )
+	{
+		assert( decoderOutput.size() == N * decParams.countAllowed );
+		decoderOutput.copyToVector( restricted.probs );
+		std::vector<float>& probs = *items[ 0 ].probs;
+		expandRestrictedProbs( probs, restricted.probs.data(), N, decParams.n_vocab, decParams.allowedTokens, decParams.countAllowed );
+		Tracing::vector( "probs", probs );
+	}
+	else if( 1 == count )
+	{
+		assert( decoderOutput.size() == N * decParams.n_vocab );
+		std::vector<float>& probs = *items[ 0 ].probs;
+		decoderOutput.copyToVector( probs );
+		Tracing::vector( "probs", probs );
+	}
+	else
+	{
+		// Split the rows of the batch between the sessions
+		assert( decoderOutput.size() == N * decParams.n_vocab );
+		decoderOutput.copyToVector( batchProbs );
+		for( size_t i = 0; i < count; i++ )
+		{
+			const sDecodeSession& s = batchSessions[ i ];
+			const float* rsi = batchProbs.data() + (size_t)s.first * decParams.n_vocab;
+			items[ i ].probs->assign( rsi, rsi + (size_t)s.N * decParams.n_vocab );
+		}
+	}
+}
 
-	decoderOutput.copyToVector( probs );
-	Tracing::vector( "probs", probs );
+const Tensor& WhisperContext::restrictedEmbedding( const int* tokens, uint32_t count )
+{
+	if( restricted.tokens.size() == count && std::equal( tokens, tokens + count, restricted.tokens.begin() ) )
+		return restricted.rows;
+
+	const Tensor& source = gpuModel.dec.tokenEmbedding;
+	if( 0 == count || !source.isContinuous() )
+		throw E_INVALIDARG;
+	const uint32_t rowLength = source.ne[ 0 ];
+	const eDataType type = source.getType();
+	const size_t cbRow = elementSize( type ) * rowLength;
+
+	restricted.tokens.clear();
+	restricted.rows = Tensor{};
+	Tensor rows;
+	check( rows.create( type, { rowLength, count } ) );
+
+	CComPtr<ID3D11Resource> src, dst;
+	( (ID3D11ShaderResourceView*)source )->GetResource( &src );
+	( (ID3D11ShaderResourceView*)rows )->GetResource( &dst );
+
+	// Coordinates of a box are in bytes for buffers. Consecutive tokens, like the language or timestamp tokens, are copied with a single call.
+	D3D11_BOX box;
+	box.top = box.front = 0;
+	box.bottom = box.back = 1;
+	for( uint32_t i = 0; i < count; )
+	{
+		uint32_t j = i + 1;
+		while( j < count && tokens[ j ] == tokens[ j - 1 ] + 1 )
+			j++;
+		if( tokens[ i ] < 0 || (uint32_t)tokens[ j - 1 ] >= source.ne[ 1 ] )
+			throw E_BOUNDS;
+		box.left = (UINT)( cbRow * tokens[ i ] );
+		box.right = (UINT)( cbRow * ( tokens[ j - 1 ] + 1 ) );
+		context()->CopySubresourceRegion( dst, 0, (UINT)( cbRow * i ), 0, 0, src, 0, &box );
+		i = j;
+	}
+
+	restricted.tokens.assign( tokens, tokens + count );
+	restricted.rows = rows;
+	return restricted.rows;
 }
 
 __m128i WhisperContext::Arenas::getMemoryUse() const
@@ -662,6 +860,7 @@ __m128i WhisperContext::getMemoryUse() const
 	res = _mm_add_epi64( res, kvCross.getMemoryUse() );
 	res = _mm_add_epi64( res, decoderInput.getMemoryUse() );
 	res = _mm_add_epi64( res, decoderOutput.getMemoryUse() );
+	res = _mm_add_epi64( res, restricted.rows.getMemoryUse() );
 	return res;
 }
 
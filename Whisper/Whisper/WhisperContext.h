@@ -58,6 +58,16 @@ namespace DirectCompute
 		DecoderInputBuffers decoderInput;
 		DecoderResultBuffer decoderOutput;
 		const ModelBuffers& gpuModel;
+
+		// Rows of the token embedding matrix for the restricted vocabulary, copied on the first decode() call with the new set of tokens
+		struct RestrictedEmbedding
+		{
+			std::vector<int> tokens;
+			Tensor rows;
+			std::vector<float> probs;
+		};
+		RestrictedEmbedding restricted;
+		const Tensor& restrictedEmbedding( const int* tokens, uint32_t count );
 #if BUILD_HYBRID_VERSION
 		std::unique_ptr<HybridContext> hybridContext;
 #endif
@@ -73,7 +83,38 @@ namespace DirectCompute
 		Tensor convolutionAndGelu( const Tensor& mel, uint32_t n_ctx );
 		Tensor encodeLayer( const Tensor& source, size_t index, uint32_t n_state, uint32_t n_head, uint32_t n_ctx );
 
+		// Columns of the decoder input which belong to a single context, and the attention buffers of that context
+		struct sDecodeSession
+		{
+			const KeyValueBuffers* kv;
+			const KeyValueBuffers* kvCross;
+			uint32_t first, N;
+			uint32_t n_ctx, n_past, M;
+		};
 		struct sLayerDecParams;
+		// Sessions of the current decodeBatch() call, and the probabilities of all rows of the batch
+		std::vector<sDecodeSession> batchSessions;
+		std::vector<float> batchProbs;
+
+		// Views of the columns of the batch matrices which belong to individual sessions.
+		// The arenas return the same GPU views on every step, the cache keeps the column views while the layout of the batch stays the same.
+		class ColumnViews
+		{
+			struct Entry
+			{
+				CComPtr<ID3D11ShaderResourceView> source;
+				uint32_t ne0, first, count;
+				Tensor view;
+			};
+			std::vector<Entry> entries;
+			// Pairs of [ first, N ] of the sessions
+			std::vector<uint32_t> layout;
+		public:
+			// Drop the cached views when the layout of the batch has changed
+			void setLayout( const sDecodeSession* sessions, size_t count );
+			Tensor columns( const Tensor& t, uint32_t first, uint32_t count );
+		};
+		ColumnViews columnViews;
 
 		// Decoder methods
 		Tensor decodeLayer( const Tensor& source, size_t index, const sLayerDecParams& ldp );
@@ -93,36 +134,104 @@ namespace DirectCompute
 		WhisperContext( const Whisper::WhisperModel& wm, Whisper::ProfileCollection& pc );
 		WhisperContext( const WhisperContext& ) = delete;
 
-		Tensor encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams );
+		// With `ahead` = true, the hybrid model keeps decoding with the cross-attention cache of the previous encode() call, until useEncodedAhead() is called.
+		// This allows to run the encoder for the next window on the GPU, while the CPU decodes the current one.
+		Tensor encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams, bool ahead = false );
+		void useEncodedAhead();
 
 		void decode( const int* tokens, const int n_tokens, const sDecodeParams& decParams, std::vector<float>& probs, int threads );
 
+		// A decode step of a context which uses the same model
+		struct DecodeBatchItem
+		{
+			WhisperContext* context;
+			const int* tokens;
+			int n_tokens;
+			const sDecodeParams* params;
+			std::vector<float>* probs;
+		};
+
+		// Run a single pass of the decoder over the tokens of several contexts, with the GPU model.
+		// The weights are shared by all rows of the batch, the attention uses the KV buffers of the individual contexts.
+		// The method uses arenas and staging buffers of this context, the other contexts must not run anything on the GPU while it's running.
+		// Restricted vocabulary is only supported for a batch of a single item.
+		void decodeBatch( const DecodeBatchItem* items, size_t count );
+
 		static WhisperContext& current();
 
-		// Create a RAII object which measures both CPU and GPU time for the complete runFull() method
+		// The D3D device is created single-threaded and shared by all contexts.
+		// The contexts serialize their GPU work with this process-wide lock, so they can run on concurrent threads.
+		static CComAutoCriticalSection& deviceLock();
+
+		// True when other contexts use the same D3D device on other threads, see ContextImpl::updateSharedDevice
+		// These contexts only touch the device inside encode() and decode() calls, they can't measure GPU time of the blocks which span these calls
+		bool sharedDevice = false;
+
+		// GPU profiler block which spans several encode() and decode() calls.
+		// The flag above is sampled when a run starts, another context may start using the device later; the block takes the device lock to issue its queries.
+		class LockedBlockRaii
+		{
+			std::optional<GpuProfiler::BlockRaii> block;
+		public:
+			LockedBlockRaii( GpuProfiler& profiler, eProfilerBlock which )
+			{
+				CComCritSecLock<CComAutoCriticalSection> lock{ deviceLock() };
+				block.emplace( profiler.block( which ) );
+			}
+			~LockedBlockRaii()
+			{
+				if( !block )
+					return;
+				CComCritSecLock<CComAutoCriticalSection> lock{ deviceLock() };
+				block.reset();
+			}
+			LockedBlockRaii( LockedBlockRaii&& that ) noexcept :
+				block( std::move( that.block ) )
+			{
+				that.block.reset();
+			}
+			LockedBlockRaii( const LockedBlockRaii& ) = delete;
+			void operator=( const LockedBlockRaii& ) = delete;
+			void operator=( LockedBlockRaii&& ) = delete;
+		};
+
+		// Create a RAII object which measures CPU and optionally GPU time for the complete runFull() method
 		decltype( auto ) completeProfiler()
 		{
-			return std::make_tuple(
-				profiler.cpuBlock( Whisper::eCpuBlock::Run ),
-				profiler.block( eProfilerBlock::Run ) );
+			if( sharedDevice )
+				return std::make_tuple(
+					profiler.cpuBlock( Whisper::eCpuBlock::Run ),
+					std::optional<LockedBlockRaii>{} );
+			else
+				return std::make_tuple(
+					profiler.cpuBlock( Whisper::eCpuBlock::Run ),
+					std::optional<LockedBlockRaii>{ std::in_place, profiler, eProfilerBlock::Run } );
 		}
 
 		// Create a RAII object which measures CPU and optionally GPU time for the loop which calls decode() method
 		decltype( auto ) decodeProfiler()
 		{
 #if BUILD_HYBRID_VERSION
-			if( hybridContext )
+			const bool gpuTime = !hybridContext && !sharedDevice;
+#else
+			const bool gpuTime = !sharedDevice;
+#endif
+			if( !gpuTime )
 				return std::make_tuple(
 					profiler.cpuBlock( Whisper::eCpuBlock::Decode ),
-					std::optional<GpuProfiler::BlockRaii>{} );
+					std::optional<LockedBlockRaii>{} );
 			else
 				return std::make_tuple(
 					profiler.cpuBlock( Whisper::eCpuBlock::Decode ),
-					std::optional<GpuProfiler::BlockRaii>{ std::in_place, profiler.block( eProfilerBlock::Decode ) } );
+					std::optional<LockedBlockRaii>{ std::in_place, profiler, eProfilerBlock::Decode } );
+		}
+
+		bool isHybrid() const
+		{
+#if BUILD_HYBRID_VERSION
+			return (bool)hybridContext;
 #else
-			return std::make_tuple(
-				profiler.cpuBlock( Whisper::eCpuBlock::Decode ),
-				profiler.block( eProfilerBlock::Decode ) );
+			return false;
 #endif
 		}
 
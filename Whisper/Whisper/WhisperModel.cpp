@@ -7,8 +7,12 @@
 #include "../Utils/GpuProfilerSimple.h"
 #include "../Utils/CpuProfiler.h"
 #include "../CPU/HybridLoader.h"
+#include "../CPU/mulMat.h"
 #include "../ML/Reshaper.h"
+#include "DecodeScheduler.h"
 using namespace Whisper;
+
+WhisperModel::~WhisperModel() = default;
 using namespace DirectCompute;
 
 namespace
@@ -345,7 +349,7 @@ HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& cal
 	CAtlMap<CStringA, PendingTensor> map;
 	populateTensorsMap( map, parameters.n_audio_layer, parameters.n_text_layer, tensors, true );
 	DirectCompute::Reshaper reshape;
-	CpuCompute::HybridLoader loader( hybridTensors, parameters.n_text_layer );
+	CpuCompute::HybridLoader loader( hybridTensors, parameters.n_text_layer, hybridBf16 );
 
 	std::vector<uint8_t> bytesVector;
 	size_t countLoaded = 0;
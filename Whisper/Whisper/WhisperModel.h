@@ -5,9 +5,12 @@
 #include "../CPU/DecoderTensors.h"
 #include "../API/sLoadModelCallbacks.h"
 #include "sModelParams.h"
+#include <memory>
 
 namespace Whisper
 {
+	class DecodeScheduler;
+
 	struct Filters
 	{
 		uint32_t n_mel;
@@ -27,8 +30,18 @@ namespace Whisper
 
 #if BUILD_HYBRID_VERSION
 		CpuCompute::DecoderTensors hybridTensors;
+		// Store the attention caches of the hybrid decoder in INT8 precision, set by eGpuModelFlags.KvCacheInt8
+		bool hybridCacheInt8 = false;
+		// Convert the FP16 weights of the hybrid decoder into BF16, set by eGpuModelFlags.Bf16Weights on CPUs with AVX512_BF16 support
+		bool hybridBf16 = false;
 #endif
 
+		// Batches decode steps of the contexts created from this model, created when the model is loaded with eGpuModelFlags.BatchedDecoder flag.
+		// The scheduler is internally synchronized, the contexts use it from multiple threads.
+		std::unique_ptr<DecodeScheduler> decodeScheduler;
+
+		~WhisperModel();
+
 		HRESULT load( ComLight::iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks );
 
 		// A vector of 2 uint64_t values, both numbers are 100 nanosecond ticks:
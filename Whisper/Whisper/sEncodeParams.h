@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <vector>
 
 namespace DirectCompute
 {
@@ -16,5 +17,19 @@ namespace DirectCompute
 		uint32_t n_ctx, n_past, M;
 		uint32_t n_text_layer;
 		uint32_t n_vocab;
+		// Optional restricted vocabulary, sorted list of token IDs.
+		// When set, the decoder only computes logits of these tokens, the softmax is restricted to them, and the probabilities of other tokens are zeros.
+		const int* allowedTokens = nullptr;
+		uint32_t countAllowed = 0;
 	};
+
+	// Expand probabilities of the restricted vocabulary, [ countAllowed, N ] matrix, into the [ n_vocab, N ] output vector
+	inline void expandRestrictedProbs( std::vector<float>& probs, const float* rsi, uint32_t N, uint32_t n_vocab, const int* allowedTokens, uint32_t countAllowed )
+	{
+		probs.assign( (size_t)N * n_vocab, 0.0f );
+		float* rdi = probs.data();
+		for( uint32_t i = 0; i < N; i++, rdi += n_vocab, rsi += countAllowed )
+			for( uint32_t j = 0; j < countAllowed; j++ )
+				rdi[ allowedTokens[ j ] ] = rsi[ j ];
+	}
 }
\ No newline at end of file
@@ -68,11 +68,38 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(x)      InitializeSRWLock(x)
+#define ggml_mutex_destroy(x)   UNUSED(x)
+#define ggml_mutex_lock(x)      AcquireSRWLockExclusive(x)
+#define ggml_mutex_unlock(x)    ReleaseSRWLockExclusive(x)
+#define ggml_cond_init(x)       InitializeConditionVariable(x)
+#define ggml_cond_destroy(x)    UNUSED(x)
+#define ggml_cond_wait(c, m)    SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_cond_broadcast(x)  WakeAllConditionVariable(x)
+#define ggml_cpu_relax()        YieldProcessor()
 #else
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 
 typedef void* thread_ret_t;
+
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t ggml_cond_t;
+
+#define ggml_mutex_init(x)      pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy(x)   pthread_mutex_destroy(x)
+#define ggml_mutex_lock(x)      pthread_mutex_lock(x)
+#define ggml_mutex_unlock(x)    pthread_mutex_unlock(x)
+#define ggml_cond_init(x)       pthread_cond_init(x, NULL)
+#define ggml_cond_destroy(x)    pthread_cond_destroy(x)
+#define ggml_cond_wait(c, m)    pthread_cond_wait(c, m)
+#define ggml_cond_broadcast(x)  pthread_cond_broadcast(x)
+#define ggml_cpu_relax()        sched_yield()
 #endif
 
 #ifdef __HAIKU__
@@ -237,6 +264,31 @@ ggml_fp16_t ggml_fp32_to_fp16(float f) {
 
 #endif // __ARM_NEON
 
+// convert rows of FP16 <-> FP32 numbers, 8 at a time with F16C
+static void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, int n) {
+    int i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i))));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = GGML_FP16_TO_FP32(x[i]);
+    }
+}
+
+static void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, int n) {
+    int i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), 0));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = GGML_FP32_TO_FP16(x[i]);
+    }
+}
+
 //
 // global data
 //
@@ -1172,6 +1224,7 @@ struct ggml_context {
     size_t mem_size;
     void * mem_buffer;
     bool   mem_buffer_owned;
+    bool   no_alloc;
 
     int n_objects;
 
@@ -1432,6 +1485,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         .mem_size         = params.mem_size,
         .mem_buffer       = params.mem_buffer ? params.mem_buffer : malloc(params.mem_size),
         .mem_buffer_owned = params.mem_buffer ? false : true,
+        .no_alloc         = false,
         .n_objects        = 0,
         .objects_begin    = NULL,
         .objects_end      = NULL,
@@ -1479,6 +1533,14 @@ size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end->offset + ctx->objects_end->size;
 }
 
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc) {
+    ctx->no_alloc = no_alloc;
+}
+
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct ggml_tensor * ggml_new_tensor_impl(
@@ -1496,7 +1558,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL) {
+    const bool alloc = data == NULL && !ctx->no_alloc;
+
+    if (alloc) {
         size_needed += GGML_TYPE_SIZE[type];
         for (int i = 0; i < n_dims; i++) {
             size_needed *= ne[i];
@@ -1553,7 +1617,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ data == NULL ? (void *)(result + 1) : data,
+        /*.data         =*/ alloc ? (void *)(result + 1) : data,
+        /*.view_src     =*/ NULL,
+        /*.view_offs    =*/ 0,
         /*.pad          =*/ { 0 },
     };
 
@@ -1618,8 +1684,42 @@ struct ggml_tensor * ggml_new_tensor_4d(
     return ggml_new_tensor(ctx, type, 4, ne);
 }
 
+// scalars and op parameters are written while building the graph, they are allocated in the pool even in no_alloc contexts
+static struct ggml_tensor * ggml_new_tensor_1d_alloc(
+        struct ggml_context * ctx,
+        enum   ggml_type type,
+        int    ne0) {
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = false;
+    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, type, ne0);
+    ctx->no_alloc = no_alloc;
+    return result;
+}
+
+// views share the memory of the tensor which owns it; when that tensor has no data yet,
+// ggml_graph_plan_memory() sets the data pointer of the view once the owner is placed
+static struct ggml_tensor * ggml_new_view_impl(
+        struct ggml_context * ctx,
+        const struct ggml_tensor * a,
+        int    n_dims,
+        const int * ne,
+        size_t offset) {
+    struct ggml_tensor * const src = a->view_src != NULL ? a->view_src : (struct ggml_tensor *) a;
+    const size_t offs = a->view_offs + offset;
+
+    const bool no_alloc = ctx->no_alloc;
+    ctx->no_alloc = true;
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, n_dims, ne, src->data != NULL ? (char *) src->data + offs : NULL);
+    ctx->no_alloc = no_alloc;
+
+    result->view_src  = src;
+    result->view_offs = offs;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * result = ggml_new_tensor_1d_alloc(ctx, GGML_TYPE_I32, 1);
 
     ggml_set_i32(result, value);
 
@@ -1627,7 +1727,7 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    struct ggml_tensor * result = ggml_new_tensor_1d_alloc(ctx, GGML_TYPE_F32, 1);
 
     ggml_set_f32(result, value);
 
@@ -1899,7 +1999,7 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    return ggml_new_view_impl(ctx, src, src->n_dims, src->ne, 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2609,7 +2709,7 @@ struct ggml_tensor * ggml_reshape(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, b->n_dims, b->ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2635,7 +2735,7 @@ struct ggml_tensor * ggml_reshape_2d(
     }
 
     const int ne[2] = { ne0, ne1 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 2, ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2662,7 +2762,7 @@ struct ggml_tensor * ggml_reshape_3d(
     }
 
     const int ne[3] = { ne0, ne1, ne2 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 3, ne, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2683,7 +2783,7 @@ struct ggml_tensor * ggml_view_1d(
         assert(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 1, &ne0, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -2708,7 +2808,7 @@ struct ggml_tensor * ggml_view_2d(
 
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_view_impl(ctx, a, 2, ne, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -2855,7 +2955,7 @@ struct ggml_tensor * ggml_diag_mask_inf(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * b = ggml_new_tensor_1d_alloc(ctx, GGML_TYPE_I32, 1);
     ((int32_t *) b->data)[0] = n_past;
 
     result->op   = GGML_OP_DIAG_MASK_INF;
@@ -2910,7 +3010,7 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    struct ggml_tensor * b = ggml_new_tensor_1d_alloc(ctx, GGML_TYPE_I32, 3);
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -3054,18 +3154,39 @@ void ggml_set_param(
 
 // ggml_compute_forward_dup
 
+// copy of contiguous tensors of the same type, the threads copy equal slices of cache lines
+static void ggml_compute_forward_dup_bytes(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    const size_t nb = ggml_nbytes(dst);
+
+    // bytes per thread
+    const size_t db = ((nb + CACHE_LINE_SIZE - 1)/CACHE_LINE_SIZE + params->nth - 1)/params->nth*CACHE_LINE_SIZE;
+
+    // byte range for this thread
+    const size_t ib0 = MIN(db*params->ith, nb);
+    const size_t ib1 = MIN(ib0 + db, nb);
+
+    if (ib1 > ib0) {
+        memcpy((char *) dst->data + ib0, (const char *) src0->data + ib0, ib1 - ib0);
+    }
+}
+
 static void ggml_compute_forward_dup_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_is_contiguous(dst));
-    assert(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
@@ -3077,83 +3198,50 @@ static void ggml_compute_forward_dup_f16(
     const size_t nb03 = src0->nb[3];
 
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+        ggml_compute_forward_dup_bytes(params, src0, dst);
         return;
     }
 
-    if (src0->nb[0] == sizeof(ggml_fp16_t)) {
-        if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            const size_t rs = ne00*nb00;
+    // the rows of the source are written one after another into the destination
+    const int nr = ne01*ne02*ne03;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
-                        char * dst_ptr = (char *) dst->data + id*rs;
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-                        memcpy(dst_ptr, src0_ptr, rs);
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-                        id++;
-                    }
-                }
-            }
-        } else if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i01 = ir%ne01;
+        const int i02 = (ir/ne01)%ne02;
+        const int i03 = ir/(ne01*ne02);
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+        const char * src0_ptr = (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+        const size_t id = (size_t) ir*ne00;
 
-                            dst_ptr[id] = GGML_FP16_TO_FP32(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
+        if (nb00 == sizeof(ggml_fp16_t)) {
+            if (dst->type == GGML_TYPE_F16) {
+                memcpy((ggml_fp16_t *) dst->data + id, src0_ptr, ne00*sizeof(ggml_fp16_t));
+            } else if (dst->type == GGML_TYPE_F32) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) src0_ptr, (float *) dst->data + id, ne00);
+            } else {
+                GGML_ASSERT(false); // TODO: implement
             }
         } else {
-            GGML_ASSERT(false); // TODO: implement
-        }
-    } else {
-        //printf("%s: this is not optimal - fix me\n", __func__);
-
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
-
-                            dst_ptr[id] = GGML_FP16_TO_FP32(*src0_ptr);
-                            id++;
-                        }
-                    }
+            if (dst->type == GGML_TYPE_F16) {
+                ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data + id;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    dst_ptr[i00] = *(const ggml_fp16_t *) (src0_ptr + i00*nb00);
                 }
-            }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
-
-                            dst_ptr[id] = *src0_ptr;
-                            id++;
-                        }
-                    }
+            } else if (dst->type == GGML_TYPE_F32) {
+                float * dst_ptr = (float *) dst->data + id;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    dst_ptr[i00] = GGML_FP16_TO_FP32(*(const ggml_fp16_t *) (src0_ptr + i00*nb00));
                 }
+            } else {
+                GGML_ASSERT(false); // TODO: implement
             }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
         }
     }
 }
@@ -3162,7 +3250,6 @@ static void ggml_compute_forward_dup_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(params->ith == 0);
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
@@ -3170,6 +3257,9 @@ static void ggml_compute_forward_dup_f32(
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
@@ -3181,83 +3271,50 @@ static void ggml_compute_forward_dup_f32(
     const size_t nb03 = src0->nb[3];
 
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+        ggml_compute_forward_dup_bytes(params, src0, dst);
         return;
     }
 
-    if (src0->nb[0] == sizeof(float)) {
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            const size_t rs = ne00*nb00;
+    // the rows of the source are written one after another into the destination
+    const int nr = ne01*ne02*ne03;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
-                        char * dst_ptr = (char *) dst->data + id*rs;
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-                        memcpy(dst_ptr, src0_ptr, rs);
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-                        id++;
-                    }
-                }
-            }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i01 = ir%ne01;
+        const int i02 = (ir/ne01)%ne02;
+        const int i03 = ir/(ne01*ne02);
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+        const char * src0_ptr = (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+        const size_t id = (size_t) ir*ne00;
 
-                            dst_ptr[id] = GGML_FP32_TO_FP16(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
+        if (nb00 == sizeof(float)) {
+            if (dst->type == GGML_TYPE_F32) {
+                memcpy((float *) dst->data + id, src0_ptr, ne00*sizeof(float));
+            } else if (dst->type == GGML_TYPE_F16) {
+                ggml_fp32_to_fp16_row((const float *) src0_ptr, (ggml_fp16_t *) dst->data + id, ne00);
+            } else {
+                GGML_ASSERT(false); // TODO: implement
             }
         } else {
-            GGML_ASSERT(false); // TODO: implement
-        }
-    } else {
-        //printf("%s: this is not optimal - fix me\n", __func__);
-
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
-
-                            dst_ptr[id] = *src0_ptr;
-                            id++;
-                        }
-                    }
+            if (dst->type == GGML_TYPE_F32) {
+                float * dst_ptr = (float *) dst->data + id;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    dst_ptr[i00] = *(const float *) (src0_ptr + i00*nb00);
                 }
-            }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
-
-                            dst_ptr[id] = GGML_FP32_TO_FP16(*src0_ptr);
-                            id++;
-                        }
-                    }
+            } else if (dst->type == GGML_TYPE_F16) {
+                ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data + id;
+                for (int i00 = 0; i00 < ne00; i00++) {
+                    dst_ptr[i00] = GGML_FP32_TO_FP16(*(const float *) (src0_ptr + i00*nb00));
                 }
+            } else {
+                GGML_ASSERT(false); // TODO: implement
             }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
         }
     }
 }
@@ -3368,21 +3425,30 @@ static void ggml_compute_forward_sub_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sub_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])),
@@ -3418,21 +3484,30 @@ static void ggml_compute_forward_mul_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_mul_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])),
@@ -3468,21 +3543,30 @@ static void ggml_compute_forward_div_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_div_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])),
@@ -3517,20 +3601,29 @@ static void ggml_compute_forward_sqr_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n     = ggml_nrows(src0);
-    const int nc    = src0->ne[0];
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int n  = ggml_nrows(src0);
+    const int nc = src0->ne[0];
+
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sqr_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3563,20 +3656,29 @@ static void ggml_compute_forward_sqrt_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sqrt_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3744,7 +3846,6 @@ static void ggml_compute_forward_repeat_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_can_repeat(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -3762,20 +3863,27 @@ static void ggml_compute_forward_repeat_f32(
     const int nc0 = src0->ne[0];
     const int nr0 = src0->ne[1];
     const int ncr = nc/nc0; // guaranteed to be an integer due to the check in ggml_can_repeat
-    const int nrr = nr/nr0; // guaranteed to be an integer due to the check in ggml_can_repeat
 
     // TODO: support for transposed / permuted tensors
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    // TODO: maybe this is not optimal?
-    for (int i = 0; i < nrr; i++) {
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows of the destination per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int k = ir%nr0;
         for (int j = 0; j < ncr; j++) {
-            for (int k = 0; k < nr0; k++) {
-                ggml_vec_cpy_f32(nc0,
-                        (float *) ((char *)  dst->data + (i*nr0 + k)*( dst->nb[1]) + j*nc0*( dst->nb[0])),
-                        (float *) ((char *) src0->data + (        k)*(src0->nb[1])));
-            }
+            ggml_vec_cpy_f32(nc0,
+                    (float *) ((char *)  dst->data + ir*( dst->nb[1]) + j*nc0*( dst->nb[0])),
+                    (float *) ((char *) src0->data +  k*(src0->nb[1])));
         }
     }
 }
@@ -3806,20 +3914,29 @@ static void ggml_compute_forward_abs_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_abs_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3852,20 +3969,29 @@ static void ggml_compute_forward_sgn_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sgn_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3898,20 +4024,29 @@ static void ggml_compute_forward_neg_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_neg_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3944,20 +4079,29 @@ static void ggml_compute_forward_step_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_step_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3990,20 +4134,29 @@ static void ggml_compute_forward_relu_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
 
+    // rows per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_relu_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -4888,12 +5041,13 @@ static void ggml_compute_forward_get_rows_f16(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
               struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
     const int nr = ggml_nelements(src1);
 
@@ -4901,13 +5055,19 @@ static void ggml_compute_forward_get_rows_f16(
     assert( dst->ne[1] == nr);
     assert(src0->nb[0] == sizeof(ggml_fp16_t));
 
-    for (int i = 0; i < nr; ++i) {
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i = ir0; i < ir1; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
-        for (int j = 0; j < nc; ++j) {
-            ggml_fp16_t v = ((ggml_fp16_t *) ((char *) src0->data + r*src0->nb[1]))[j];
-            ((float *) ((char *)  dst->data + i*dst->nb[1]))[j] = GGML_FP16_TO_FP32(v);
-        }
+        ggml_fp16_to_fp32_row(
+                (ggml_fp16_t *) ((char *) src0->data + r*src0->nb[1]),
+                (float *)       ((char *)  dst->data + i*dst->nb[1]), nc);
     }
 }
 
@@ -4916,12 +5076,13 @@ static void ggml_compute_forward_get_rows_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
               struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
     const int nr = ggml_nelements(src1);
 
@@ -4929,7 +5090,14 @@ static void ggml_compute_forward_get_rows_f32(
     assert( dst->ne[1] == nr);
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < nr; ++i) {
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i = ir0; i < ir1; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
         ggml_vec_cpy_f32(nc,
@@ -4969,7 +5137,6 @@ static void ggml_compute_forward_diag_mask_inf_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(src1->type == GGML_TYPE_I32);
     assert(ggml_nelements(src1) == 1);
 
@@ -4984,18 +5151,26 @@ static void ggml_compute_forward_diag_mask_inf_f32(
     const int n  = ggml_nrows(src0);
     const int nc = src0->ne[0];
     const int nr = src0->ne[1];
-    const int nz = n/nr;
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int k = 0; k < nz; k++) {
-        for (int j = 0; j < nr; j++) {
-            for (int i = n_past; i < nc; i++) {
-                if (i > n_past + j) {
-                    *(float *)((char *) dst->data + k*dst->nb[2] + j*dst->nb[1] + i*dst->nb[0]) = -INFINITY;
-                }
-            }
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows of all matrices per thread
+    const int dr = (n + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, n);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int k = ir/nr;
+        const int j = ir%nr;
+        float * dst_ptr = (float *)((char *) dst->data + k*dst->nb[2] + j*dst->nb[1]);
+        for (int i = n_past + j + 1; i < nc; i++) {
+            dst_ptr[i] = -INFINITY;
         }
     }
 }
@@ -6917,112 +7092,214 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+//
+// persistent thread pool
+//
+// the workers are created once, and reused for all nodes of all graphs computed with the pool
+// every parallel task is published by incrementing the generation counter; idle workers spin for a short while, then sleep
+// on the condition variable. the calling thread runs the task with ith = 0, then waits until the workers have completed theirs
+//
 
-    int n_threads;
+// count of polling iterations before a waiting thread goes to sleep
+#define GGML_POOL_SPIN_COUNT 1024
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
+struct ggml_threadpool_worker {
+    ggml_thread_t thrd;
+    int ith;
+    struct ggml_threadpool * pool;
 };
 
-struct ggml_compute_state {
-    ggml_thread_t thrd;
+struct ggml_threadpool {
+    int n_threads; // including the calling thread
+
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond_work; // workers wait here for the next task
+    ggml_cond_t  cond_done; // the calling thread waits here for the workers
 
+    atomic_int  generation;    // incremented for every published task
+    atomic_int  n_pending;     // count of workers which have not yet completed the current task
+    atomic_int  n_sleeping;    // count of workers waiting on cond_work
+    atomic_bool main_sleeping; // true when the calling thread is waiting on cond_done
+    atomic_bool stop;
+
+    // the current task
     struct ggml_compute_params params;
     struct ggml_tensor * node;
 
-    struct ggml_compute_state_shared * shared;
+    // optional external implementation of GGML_OP_MUL_MAT
+    ggml_mul_mat_callback mul_mat;
+    void * mul_mat_user_data;
+
+    // work buffer of the graphs built in no_alloc contexts
+    void * work_data;
+    size_t work_size;
+
+    struct ggml_threadpool_worker * workers;
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_threadpool_worker * worker = (struct ggml_threadpool_worker *) data;
+    struct ggml_threadpool * pool = worker->pool;
 
-    const int n_threads = state->shared->n_threads;
+    int seen = 0;
 
     while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
+        // wait for the next task
+        for (int i = 0; atomic_load(&pool->generation) == seen && !atomic_load(&pool->stop); i++) {
+            if (i < GGML_POOL_SPIN_COUNT) {
+                ggml_cpu_relax();
+                continue;
             }
-        }
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
-
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
+            ggml_mutex_lock(&pool->mutex);
+            atomic_fetch_add(&pool->n_sleeping, 1);
+            while (atomic_load(&pool->generation) == seen && !atomic_load(&pool->stop)) {
+                ggml_cond_wait(&pool->cond_work, &pool->mutex);
             }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
+            atomic_fetch_sub(&pool->n_sleeping, 1);
+            ggml_mutex_unlock(&pool->mutex);
+            break;
         }
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
+        if (atomic_load(&pool->stop)) {
             break;
         }
 
-        if (state->node) {
-            ggml_compute_forward(&state->params, state->node);
-            state->node = NULL;
-        } else {
-            break;
+        seen = atomic_load(&pool->generation);
+
+        // the nodes with fewer tasks than threads don't need all the workers
+        if (worker->ith < pool->params.nth) {
+            struct ggml_compute_params params = pool->params;
+            params.ith = worker->ith;
+            ggml_compute_forward(&params, pool->node);
+        }
+
+        if (atomic_fetch_sub(&pool->n_pending, 1) == 1 && atomic_load(&pool->main_sleeping)) {
+            ggml_mutex_lock(&pool->mutex);
+            ggml_cond_broadcast(&pool->cond_done);
+            ggml_mutex_unlock(&pool->mutex);
         }
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    if (cgraph->n_threads <= 0) {
-        cgraph->n_threads = 8;
+struct ggml_threadpool * ggml_threadpool_create(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = 8;
     }
 
-    const int n_threads = cgraph->n_threads;
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool != NULL);
+    memset(pool, 0, sizeof(struct ggml_threadpool));
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+    pool->n_threads = n_threads;
+    ggml_mutex_init(&pool->mutex);
+    ggml_cond_init(&pool->cond_work);
+    ggml_cond_init(&pool->cond_done);
 
-    // create thread pool
     if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
-
-        atomic_store(&state_shared.has_work, true);
+        pool->workers = malloc(sizeof(struct ggml_threadpool_worker)*(n_threads - 1));
+        GGML_ASSERT(pool->workers != NULL);
 
         for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
+            pool->workers[j] = (struct ggml_threadpool_worker) {
+                .thrd = 0,
+                .ith  = j + 1,
+                .pool = pool,
             };
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+            int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
             assert(rc == 0);
             UNUSED(rc);
         }
     }
 
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->n_threads > 1) {
+        ggml_mutex_lock(&pool->mutex);
+        atomic_store(&pool->stop, true);
+        ggml_cond_broadcast(&pool->cond_work);
+        ggml_mutex_unlock(&pool->mutex);
+
+        for (int j = 0; j < pool->n_threads - 1; j++) {
+            int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+            assert(rc == 0);
+            UNUSED(rc);
+        }
+
+        free(pool->workers);
+    }
+
+    ggml_cond_destroy(&pool->cond_done);
+    ggml_cond_destroy(&pool->cond_work);
+    ggml_mutex_destroy(&pool->mutex);
+    free(pool->work_data);
+    free(pool);
+}
+
+int ggml_threadpool_size(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+void ggml_threadpool_set_mul_mat(struct ggml_threadpool * pool, ggml_mul_mat_callback callback, void * user_data) {
+    pool->mul_mat           = callback;
+    pool->mul_mat_user_data = user_data;
+}
+
+// run the task on all threads of the pool, the calling thread computes the task with ith = 0
+static void ggml_threadpool_run(struct ggml_threadpool * pool, struct ggml_compute_params * params, struct ggml_tensor * node) {
+    // publish the task
+    pool->params = *params;
+    pool->node   = node;
+    atomic_store(&pool->n_pending, pool->n_threads - 1);
+    atomic_fetch_add(&pool->generation, 1);
+
+    if (atomic_load(&pool->n_sleeping) > 0) {
+        ggml_mutex_lock(&pool->mutex);
+        ggml_cond_broadcast(&pool->cond_work);
+        ggml_mutex_unlock(&pool->mutex);
+    }
+
+    ggml_compute_forward(params, node);
+
+    // wait for the workers
+    for (int i = 0; atomic_load(&pool->n_pending) > 0; i++) {
+        if (i < GGML_POOL_SPIN_COUNT) {
+            ggml_cpu_relax();
+            continue;
+        }
+
+        ggml_mutex_lock(&pool->mutex);
+        atomic_store(&pool->main_sleeping, true);
+        while (atomic_load(&pool->n_pending) > 0) {
+            ggml_cond_wait(&pool->cond_done, &pool->mutex);
+        }
+        atomic_store(&pool->main_sleeping, false);
+        ggml_mutex_unlock(&pool->mutex);
+        break;
+    }
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = ggml_threadpool_create(cgraph->n_threads);
+    ggml_graph_compute_pool(ctx, cgraph, pool);
+    ggml_threadpool_free(pool);
+}
+
+void ggml_graph_compute_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool) {
+    if (cgraph->n_threads <= 0 || cgraph->n_threads > pool->n_threads) {
+        cgraph->n_threads = pool->n_threads;
+    }
+
+    const int n_threads = cgraph->n_threads;
+
     // initialize tasks + work buffer
     {
         size_t work_size = 0;
@@ -7033,26 +7310,24 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
             switch (node->op) {
                 case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
                 case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
                 case GGML_OP_SUB:
                 case GGML_OP_MUL:
                 case GGML_OP_DIV:
                 case GGML_OP_SQR:
                 case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
                 case GGML_OP_REPEAT:
                 case GGML_OP_ABS:
                 case GGML_OP_SGN:
                 case GGML_OP_NEG:
                 case GGML_OP_STEP:
                 case GGML_OP_RELU:
+                    {
+                        // the rows are split between the threads
+                        node->n_tasks = n_threads;
+                    } break;
+                case GGML_OP_SUM:
+                case GGML_OP_MEAN:
                     {
                         node->n_tasks = 1;
                     } break;
@@ -7101,12 +7376,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                         node->n_tasks = n_threads;
                     } break;
                 case GGML_OP_CPY:
+                case GGML_OP_GET_ROWS:
+                case GGML_OP_DIAG_MASK_INF:
+                    {
+                        node->n_tasks = n_threads;
+                    } break;
                 case GGML_OP_RESHAPE:
                 case GGML_OP_VIEW:
                 case GGML_OP_PERMUTE:
                 case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
                     {
                         node->n_tasks = 1;
                     } break;
@@ -7203,7 +7481,19 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
 
             GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            if (ctx->no_alloc) {
+                // the memory pool of the context only has room for the headers, the work buffer is kept in the thread pool and reused by the following graphs
+                if (cgraph->work_size > pool->work_size) {
+                    free(pool->work_data);
+                    pool->work_data = malloc(cgraph->work_size);
+                    GGML_ASSERT(pool->work_data != NULL);
+                    pool->work_size = cgraph->work_size;
+                }
+                const int ne = (int) cgraph->work_size;
+                cgraph->work = ggml_new_tensor_impl(ctx, GGML_TYPE_I8, 1, &ne, pool->work_data);
+            } else {
+                cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            }
         }
     }
 
@@ -7223,178 +7513,350 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         const int64_t perf_node_start_cycles  = ggml_perf_cycles();
         const int64_t perf_node_start_time_us = ggml_perf_time_us();
 
-        // INIT
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_INIT,
-            /*.ith   =*/ 0,
-            /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-        };
+        // the external implementation computes the complete product on the calling thread, or returns false for unsupported tensors
+        const bool computed_externally = node->op == GGML_OP_MUL_MAT && pool->mul_mat != NULL &&
+            pool->mul_mat(pool->mul_mat_user_data, node, node->src0, node->src1);
+
+        if (!computed_externally) {
+            // INIT
+            struct ggml_compute_params params = {
+                /*.type  =*/ GGML_TASK_INIT,
+                /*.ith   =*/ 0,
+                /*.nth   =*/ node->n_tasks,
+                /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+            };
 
-        ggml_compute_forward(&params, node);
+            ggml_compute_forward(&params, node);
 
-        // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+            // COMPUTE
+            params.type = GGML_TASK_COMPUTE;
+            if (node->n_tasks > 1) {
+                ggml_threadpool_run(pool, &params, node);
+            } else {
+                ggml_compute_forward(&params, node);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+            // FINALIZE
+            params.type = GGML_TASK_FINALIZE;
+            if (node->n_tasks > 1) {
+                ggml_threadpool_run(pool, &params, node);
+            } else {
+                ggml_compute_forward(&params, node);
             }
+        }
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
+        // performance stats (node)
+        {
+            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
+            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+            node->perf_runs++;
+            node->perf_cycles  += perf_cycles_cur;
+            node->perf_time_us += perf_time_us_cur;
+        }
+    }
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    // performance stats (graph)
+    {
+        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
+        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
+
+        cgraph->perf_runs++;
+        cgraph->perf_cycles  += perf_cycles_cur;
+        cgraph->perf_time_us += perf_time_us_cur;
 
-            atomic_store(&state_shared.has_work, true);
+        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
+                __func__, cgraph->perf_runs,
+                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
+                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
+                (double) perf_time_us_cur     / 1000.0,
+                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
+    }
+}
+
+void ggml_graph_reset(struct ggml_cgraph * cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * grad = cgraph->grads[i];
+
+        if (grad) {
+            ggml_set_zero(grad);
         }
+    }
+}
 
-        params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
+////////////////////////////////////////////////////////////////////////////////
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+// memory planner
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+struct ggml_plan_tensor {
+    const struct ggml_tensor * tensor; // key of the hash table, NULL for empty slots
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    int  n_uses;      // count of the nodes which reference this very tensor
+    int  n_consumers; // for tensors which own memory, count of the nodes which didn't yet consume it, directly or through views
+    bool owns_block;  // the block at offset is released when n_consumers drops to zero
+    bool placed;
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-        }
+    size_t offset;
+};
 
-        // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+struct ggml_plan_block {
+    size_t offset;
+    size_t size;
+};
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+#define GGML_PLAN_MAX_FREE_BLOCKS 256
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
+struct ggml_plan {
+    struct ggml_plan_tensor * table;
+    size_t table_size;
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    // free blocks, sorted by offset
+    struct ggml_plan_block free_blocks[GGML_PLAN_MAX_FREE_BLOCKS];
+    int n_free;
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    // the high watermark of the buffer
+    size_t size;
+};
+
+static struct ggml_plan_tensor * ggml_plan_get(struct ggml_plan * plan, const struct ggml_tensor * tensor) {
+    size_t i = ((size_t)(uintptr_t) tensor / sizeof(struct ggml_tensor)) % plan->table_size;
+    while (plan->table[i].tensor != NULL && plan->table[i].tensor != tensor) {
+        i = (i + 1) % plan->table_size;
+    }
+    plan->table[i].tensor = tensor;
+    return &plan->table[i];
+}
+
+static inline struct ggml_tensor * ggml_plan_root(struct ggml_tensor * tensor) {
+    return tensor->view_src != NULL ? tensor->view_src : tensor;
+}
+
+static inline size_t ggml_plan_size(const struct ggml_tensor * tensor) {
+    return ((ggml_nbytes(tensor) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+}
 
-            atomic_store(&state_shared.has_work, true);
+static int ggml_plan_sources(struct ggml_tensor * node, struct ggml_tensor ** srcs) {
+    int n = 0;
+    if (node->src0) {
+        srcs[n++] = node->src0;
+    }
+    if (node->src1) {
+        srcs[n++] = node->src1;
+    }
+    for (int i = 0; i < GGML_MAX_OPT; i++) {
+        if (node->opt[i]) {
+            srcs[n++] = node->opt[i];
         }
+    }
+    return n;
+}
 
-        params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
+// element-wise ops, which can write the result over their source
+static bool ggml_plan_can_inplace(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_ABS:
+        case GGML_OP_SGN:
+        case GGML_OP_NEG:
+        case GGML_OP_STEP:
+        case GGML_OP_RELU:
+        case GGML_OP_GELU:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+static size_t ggml_plan_alloc(struct ggml_plan * plan, size_t size) {
+    // best fit
+    int best = -1;
+    for (int i = 0; i < plan->n_free; i++) {
+        const struct ggml_plan_block * block = &plan->free_blocks[i];
+        if (block->size >= size && (best < 0 || block->size < plan->free_blocks[best].size)) {
+            best = i;
+        }
+    }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    if (best >= 0) {
+        struct ggml_plan_block * block = &plan->free_blocks[best];
+        const size_t offset = block->offset;
+        block->offset += size;
+        block->size   -= size;
+        if (block->size == 0) {
+            memmove(block, block + 1, sizeof(struct ggml_plan_block)*(plan->n_free - best - 1));
+            plan->n_free--;
+        }
+        return offset;
+    }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    // grow the buffer, extending the free block at the end of the buffer if there's one
+    size_t offset = plan->size;
+    if (plan->n_free > 0) {
+        const struct ggml_plan_block * last = &plan->free_blocks[plan->n_free - 1];
+        if (last->offset + last->size == plan->size) {
+            offset = last->offset;
+            plan->n_free--;
+        }
+    }
+    plan->size = offset + size;
+    return offset;
+}
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+static void ggml_plan_free(struct ggml_plan * plan, size_t offset, size_t size) {
+    int i = 0;
+    while (i < plan->n_free && plan->free_blocks[i].offset < offset) {
+        i++;
+    }
+
+    // merge with the previous and the next blocks
+    if (i > 0) {
+        struct ggml_plan_block * prev = &plan->free_blocks[i - 1];
+        if (prev->offset + prev->size == offset) {
+            prev->size += size;
+            if (i < plan->n_free && prev->offset + prev->size == plan->free_blocks[i].offset) {
+                prev->size += plan->free_blocks[i].size;
+                memmove(&plan->free_blocks[i], &plan->free_blocks[i + 1], sizeof(struct ggml_plan_block)*(plan->n_free - i - 1));
+                plan->n_free--;
             }
+            return;
         }
+    }
+    if (i < plan->n_free && offset + size == plan->free_blocks[i].offset) {
+        plan->free_blocks[i].offset  = offset;
+        plan->free_blocks[i].size   += size;
+        return;
+    }
 
-        // performance stats (node)
-        {
-            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+    if (plan->n_free == GGML_PLAN_MAX_FREE_BLOCKS) {
+        // too fragmented, the block is never reused; that only wastes some memory
+        return;
+    }
 
-            node->perf_runs++;
-            node->perf_cycles  += perf_cycles_cur;
-            node->perf_time_us += perf_time_us_cur;
+    memmove(&plan->free_blocks[i + 1], &plan->free_blocks[i], sizeof(struct ggml_plan_block)*(plan->n_free - i));
+    plan->free_blocks[i] = (struct ggml_plan_block) { offset, size };
+    plan->n_free++;
+}
+
+static void ggml_plan_place(struct ggml_plan * plan, struct ggml_plan_tensor * entry, size_t size) {
+    entry->offset     = ggml_plan_alloc(plan, size);
+    entry->placed     = true;
+    entry->owns_block = true;
+}
+
+size_t ggml_graph_plan_memory(struct ggml_cgraph * cgraph, void * buffer, size_t buffer_size, bool reuse) {
+    struct ggml_plan * plan = malloc(sizeof(struct ggml_plan));
+    GGML_ASSERT(plan != NULL);
+    memset(plan, 0, sizeof(struct ggml_plan));
+
+    plan->table_size = 2*(size_t)(cgraph->n_nodes + cgraph->n_leafs) + 1;
+    plan->table = calloc(plan->table_size, sizeof(struct ggml_plan_tensor));
+    GGML_ASSERT(plan->table != NULL);
+
+    struct ggml_tensor * srcs[2 + GGML_MAX_OPT];
+
+    // count the consumers
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const int n_srcs = ggml_plan_sources(cgraph->nodes[i], srcs);
+        for (int j = 0; j < n_srcs; j++) {
+            ggml_plan_get(plan, srcs[j])->n_uses++;
+            ggml_plan_get(plan, ggml_plan_root(srcs[j]))->n_consumers++;
         }
     }
 
-    // join thread pool
-    if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            assert(rc == 0);
-            UNUSED(rc);
+    // the outputs keep their memory until the end of the graph, including the memory of the output views
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        if (node->view_src != NULL && ggml_plan_get(plan, node)->n_uses == 0) {
+            ggml_plan_get(plan, node->view_src)->n_consumers++;
         }
+    }
 
-        ggml_lock_destroy(&state_shared.spin);
+    // leafs without data are the inputs of the graph, they are never released either
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        struct ggml_tensor * leaf = cgraph->leafs[i];
+        if (leaf->data == NULL && leaf->view_src == NULL) {
+            struct ggml_plan_tensor * entry = ggml_plan_get(plan, leaf);
+            ggml_plan_place(plan, entry, ggml_plan_size(leaf));
+            entry->n_consumers++;
+        }
     }
 
-    // performance stats (graph)
-    {
-        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
-        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        const int n_srcs = ggml_plan_sources(node, srcs);
+
+        if (node->data == NULL && node->view_src == NULL) {
+            struct ggml_plan_tensor * entry = ggml_plan_get(plan, node);
+            const size_t size = ggml_plan_size(node);
+
+            if (reuse && ggml_plan_can_inplace(node->op)) {
+                // take over the block of a source which is not needed after this node
+                for (int j = 0; j < n_srcs; j++) {
+                    struct ggml_tensor * src = srcs[j];
+                    struct ggml_plan_tensor * src_entry = ggml_plan_get(plan, src);
+                    if (src->view_src == NULL && src_entry->owns_block && src_entry->n_consumers == 1 &&
+                        src->type == node->type && ggml_plan_size(src) == size) {
+                        entry->offset     = src_entry->offset;
+                        entry->placed     = true;
+                        entry->owns_block = true;
+                        src_entry->owns_block = false;
+                        break;
+                    }
+                }
+            }
 
-        cgraph->perf_runs++;
-        cgraph->perf_cycles  += perf_cycles_cur;
-        cgraph->perf_time_us += perf_time_us_cur;
+            if (!entry->placed) {
+                ggml_plan_place(plan, entry, size);
+            }
+        }
 
-        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
-                __func__, cgraph->perf_runs,
-                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
-                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
-                (double) perf_time_us_cur     / 1000.0,
-                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
+        // release the sources after their last consumer
+        for (int j = 0; j < n_srcs; j++) {
+            struct ggml_tensor * root = ggml_plan_root(srcs[j]);
+            struct ggml_plan_tensor * entry = ggml_plan_get(plan, root);
+            entry->n_consumers--;
+            if (reuse && entry->n_consumers == 0 && entry->owns_block) {
+                ggml_plan_free(plan, entry->offset, ggml_plan_size(root));
+                entry->owns_block = false;
+            }
+        }
     }
-}
 
-void ggml_graph_reset(struct ggml_cgraph * cgraph) {
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        struct ggml_tensor * grad = cgraph->grads[i];
+    const size_t size = plan->size;
 
-        if (grad) {
-            ggml_set_zero(grad);
+    if (buffer != NULL && size <= buffer_size) {
+        for (int i = 0; i < cgraph->n_leafs; i++) {
+            struct ggml_plan_tensor * entry = ggml_plan_get(plan, cgraph->leafs[i]);
+            if (entry->placed) {
+                cgraph->leafs[i]->data = (char *) buffer + entry->offset;
+            }
+        }
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            struct ggml_plan_tensor * entry = ggml_plan_get(plan, cgraph->nodes[i]);
+            if (entry->placed) {
+                cgraph->nodes[i]->data = (char *) buffer + entry->offset;
+            }
+        }
+        // the owners are placed, resolve the views
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            struct ggml_tensor * node = cgraph->nodes[i];
+            if (node->data == NULL && node->view_src != NULL) {
+                GGML_ASSERT(node->view_src->data != NULL);
+                node->data = (char *) node->view_src->data + node->view_offs;
+            }
         }
     }
+
+    free(plan->table);
+    free(plan);
+
+    return size;
 }
 
 void ggml_graph_print(const struct ggml_cgraph * cgraph) {
@@ -279,6 +279,11 @@ struct ggml_tensor {
     int64_t perf_time_us;
 
     void * data;
+
+    // for views, the tensor which owns the memory and the offset in bytes from the start of that tensor
+    struct ggml_tensor * view_src;
+    size_t view_offs;
+
     char padding[8];
 };
 
@@ -327,6 +332,14 @@ void ggml_free(struct ggml_context * ctx);
 
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// when no_alloc is set, new tensors only get the header in the context's memory pool, and data == NULL
+// ggml_graph_plan_memory() then places the data of these tensors into an external buffer
+// scalars created with ggml_new_i32() / ggml_new_f32() are always allocated in the pool
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc);
+
+// size of the memory pool consumed by the header of a single tensor
+size_t ggml_tensor_overhead(void);
+
 struct ggml_tensor * ggml_new_tensor(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -610,6 +623,31 @@ struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+// persistent pool of worker threads, reused by all graphs computed with ggml_graph_compute_pool()
+// ggml_graph_compute() creates a temporary pool for every call
+struct ggml_threadpool;
+
+struct ggml_threadpool * ggml_threadpool_create(int n_threads);
+void ggml_threadpool_free(struct ggml_threadpool * pool);
+int  ggml_threadpool_size(const struct ggml_threadpool * pool);
+
+// external implementation of GGML_OP_MUL_MAT, called on the thread which computes the graph
+// returns false when it doesn't support the tensors, then the built-in implementation computes the product
+typedef bool (*ggml_mul_mat_callback)(void * user_data, struct ggml_tensor * dst, const struct ggml_tensor * src0, const struct ggml_tensor * src1);
+
+void ggml_threadpool_set_mul_mat(struct ggml_threadpool * pool, ggml_mul_mat_callback callback, void * user_data);
+
+// uses min(cgraph->n_threads, pool size) threads, or all threads of the pool when cgraph->n_threads is zero
+void ggml_graph_compute_pool(struct ggml_context * ctx, struct ggml_cgraph * cgraph, struct ggml_threadpool * pool);
+
+// place the tensors of the graph which have no data into a single buffer, based on their lifetimes:
+// the memory of a tensor is released after the last node which consumes it, and reused by the following nodes
+// element-wise ops overwrite their source when they are its last consumer
+// tensors which aren't consumed by any node of the graph are the outputs, they are never released
+// returns the required size of the buffer; the data pointers are only assigned when buffer_size is large enough
+// with reuse = false every tensor gets a dedicated block, intermediate results stay readable after the compute
+size_t ggml_graph_plan_memory(struct ggml_cgraph * cgraph, void * buffer, size_t buffer_size, bool reuse);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
 // print info and performance information for the graph
@@ -16,6 +16,7 @@
 #include <vector>
 #include <regex>
 #include "Utils/Logger.h"
+#include "CPU/mulMat.h"
 
 #define USE_FLASH_ATTN
 //#define USE_FLASH_FF
@@ -150,38 +151,6 @@ static const std::map<e_model, size_t> MEM_REQ_MEMORY = {
     { MODEL_LARGE,   306ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     80ull*MB },
-    { MODEL_BASE,    128ull*MB },
-    { MODEL_SMALL,   300ull*MB },
-    { MODEL_MEDIUM,  680ull*MB },
-    { MODEL_LARGE,  1100ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_ENCODE_LAYER = {
-    { MODEL_TINY,    104ull*MB },
-    { MODEL_BASE,    138ull*MB },
-    { MODEL_SMALL,   208ull*MB },
-    { MODEL_MEDIUM,  280ull*MB },
-    { MODEL_LARGE,   354ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,    200ull*MB },
-    { MODEL_BASE,    202ull*MB },
-    { MODEL_SMALL,   204ull*MB },
-    { MODEL_MEDIUM,  206ull*MB },
-    { MODEL_LARGE,   208ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE_LAYER = {
-    { MODEL_TINY,     32ull*MB },
-    { MODEL_BASE,     44ull*MB },
-    { MODEL_SMALL,    64ull*MB },
-    { MODEL_MEDIUM,   84ull*MB },
-    { MODEL_LARGE,   110ull*MB },
-};
-
 struct whisper_mel {
     int n_len;
     int n_mel;
@@ -396,6 +365,24 @@ struct whisper_model {
     std::map<std::string, struct ggml_tensor *> tensors;
 };
 
+// worker threads of a context, created on first use
+// copies of the context made by whisper_full_parallel() run concurrently, they get their own threads
+struct whisper_threads {
+    // worker threads for ggml_graph_compute_pool, reused by all graphs of encode and decode
+    struct ggml_threadpool * threadpool = nullptr;
+
+    // threads for the matrix products computed by CpuCompute::mulMat
+    std::unique_ptr<CpuCompute::ParallelForRunner> mul_mat_runner;
+
+    whisper_threads() = default;
+    whisper_threads(const whisper_threads &) {}
+    whisper_threads & operator=(const whisper_threads &) { return *this; }
+
+    ~whisper_threads() {
+        ggml_threadpool_free(threadpool);
+    }
+};
+
 struct whisper_context {
     int64_t t_load_us   = 0;
     int64_t t_mel_us    = 0;
@@ -406,8 +393,9 @@ struct whisper_context {
 
     std::vector<uint8_t> * buf_model; // the model buffer is read-only and can be shared between processors
     std::vector<uint8_t>   buf_memory;
-    std::vector<uint8_t>   buf_compute;
-    std::vector<uint8_t>   buf_compute_layer;
+    std::vector<uint8_t>   buf_compute;       // memory pool of ctx0: tensor headers, inputs and persistent results
+    std::vector<uint8_t>   buf_compute_layer; // memory pool of the per-layer contexts, only tensor headers and scalars
+    std::vector<uint8_t>   buf_graph;         // data of the other tensors, placed by ggml_graph_plan_memory()
 
     whisper_model model;
     whisper_vocab vocab;
@@ -429,8 +417,104 @@ struct whisper_context {
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx; // 0 - use default
+
+    whisper_threads threads;
 };
 
+// wrap ggml tensor into CpuCompute::Tensor; returns false when the type is not supported, or the strides are misaligned
+static bool whisper_wrap_tensor(const ggml_tensor * src, CpuCompute::Tensor & dst) {
+    using DirectCompute::eDataType;
+
+    eDataType type;
+    size_t cbElement;
+    switch (src->type) {
+        case GGML_TYPE_F16: type = eDataType::FP16; cbElement = 2; break;
+        case GGML_TYPE_F32: type = eDataType::FP32; cbElement = 4; break;
+        default: return false;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (src->ne[i] <= 0 || 0 != src->nb[i] % cbElement) {
+            return false;
+        }
+    }
+
+    if (FAILED(dst.attach(src->data, type, { (uint32_t)src->ne[0], (uint32_t)src->ne[1], (uint32_t)src->ne[2], (uint32_t)src->ne[3] }))) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        dst.nb[i] = (uint32_t)(src->nb[i] / cbElement);
+    }
+    return true;
+}
+
+// implementation of ggml_mul_mat_callback, computes F16 x F32 products with the panel-based kernels of the hybrid model
+static bool whisper_mul_mat(void * user_data, ggml_tensor * dst, const ggml_tensor * src0, const ggml_tensor * src1) {
+    if (src0->type != GGML_TYPE_F16 || src1->type != GGML_TYPE_F32 || dst->type != GGML_TYPE_F32) {
+        return false;
+    }
+    // rows of the output must be dense, the kernels write complete panels of them
+    if (dst->nb[0] != sizeof(float)) {
+        return false;
+    }
+    if (src0->ne[0] != src1->ne[0] || dst->ne[0] != src0->ne[1] || dst->ne[1] != src1->ne[1] ||
+        dst->ne[2] != src0->ne[2] || dst->ne[3] != src0->ne[3] || src1->ne[2] != src0->ne[2] || src1->ne[3] != src0->ne[3]) {
+        return false;
+    }
+
+    CpuCompute::Tensor result, a, b;
+    if (!whisper_wrap_tensor(dst, result) || !whisper_wrap_tensor(src0, a) || !whisper_wrap_tensor(src1, b)) {
+        return false;
+    }
+
+    auto & runner = *(CpuCompute::ParallelForRunner *) user_data;
+    try {
+        return SUCCEEDED(CpuCompute::mulMat(result, a, b, runner));
+    } catch (HRESULT) {
+        // unsupported layout of the source matrices, the exception is thrown before any output is written
+        return false;
+    }
+}
+
+// get the thread pool of the context, re-creating it when the count of threads changes
+static struct ggml_threadpool * whisper_threadpool(whisper_context & wctx, int n_threads) {
+    auto & threads = wctx.threads;
+    if (threads.threadpool && ggml_threadpool_size(threads.threadpool) != n_threads) {
+        ggml_threadpool_free(threads.threadpool);
+        threads.threadpool = nullptr;
+    }
+    if (!threads.threadpool) {
+        threads.threadpool = ggml_threadpool_create(n_threads);
+
+        if (!threads.mul_mat_runner) {
+            threads.mul_mat_runner = std::make_unique<CpuCompute::ParallelForRunner>(n_threads);
+        } else if (FAILED(threads.mul_mat_runner->setThreadsCount(n_threads))) {
+            return threads.threadpool;
+        }
+        ggml_threadpool_set_mul_mat(threads.threadpool, whisper_mul_mat, threads.mul_mat_runner.get());
+    }
+    return threads.threadpool;
+}
+
+// size of the memory pool of a no_alloc context: headers of the tensors, scalars, and bytes_allocated for the tensors created with allocation enabled
+static size_t whisper_pool_size(size_t bytes_allocated) {
+    return ggml_tensor_overhead()*GGML_MAX_NODES + bytes_allocated;
+}
+
+// place the tensors of the graph which have no data into wctx.buf_graph, and compute the graph
+static void whisper_graph_compute(whisper_context & wctx, struct ggml_context * ctx, struct ggml_cgraph & gf, int n_threads) {
+    // the tracing reads intermediate tensors after the compute, they need dedicated memory
+    const bool reuse = !SAVE_DEBUG_TRACE;
+
+    const size_t size = ggml_graph_plan_memory(&gf, wctx.buf_graph.data(), wctx.buf_graph.size(), reuse);
+    if (size > wctx.buf_graph.size()) {
+        wctx.buf_graph.resize(size);
+        ggml_graph_plan_memory(&gf, wctx.buf_graph.data(), wctx.buf_graph.size(), reuse);
+    }
+
+    ggml_graph_compute_pool(ctx, &gf, whisper_threadpool(wctx, n_threads));
+}
+
 template<typename T>
 static void read_safe(std::ifstream& fin, T& dest)
 {
@@ -524,8 +608,6 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         wctx.buf_model = new std::vector<uint8_t>();
         wctx.buf_model->resize(MEM_REQ_MODEL.at(model.type));
         wctx.buf_memory.resize(MEM_REQ_MEMORY.at(model.type));
-        wctx.buf_compute.resize(std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type)));
-        wctx.buf_compute_layer.resize(std::max(MEM_REQ_ENCODE_LAYER.at(model.type), MEM_REQ_DECODE_LAYER.at(model.type)));
     }
 
     // load mel filters
@@ -607,12 +689,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     }
 
     {
-        // this is the total memory required to run the inference
+        // this is the memory required to load the model; the buffers of the graphs are sized by the memory planner when they are computed
         const size_t mem_required =
                    wctx.buf_model->size() +
-                   wctx.buf_memory.size() +
-                   wctx.buf_compute.size() +
-                   wctx.buf_compute_layer.size();
+                   wctx.buf_memory.size();
 
 		logDebug( u8"%s: mem_required  = %7.2f MB", __func__, mem_required / 1024.0 / 1024.0 );
     }
@@ -1097,6 +1177,10 @@ static bool whisper_encode(
     const int n_mels = hparams.n_mels;
     assert(mel_inp.n_mel == n_mels);
 
+    // the pool has the mel input, the input of the layers, and the encoded features
+    wctx.buf_compute.resize(whisper_pool_size(sizeof(float)*(2*n_ctx*n_mels + 2*n_state*n_ctx)));
+    wctx.buf_compute_layer.resize(whisper_pool_size(0));
+
     struct ggml_init_params params;
     params.mem_size   = wctx.buf_compute.size();
     params.mem_buffer = wctx.buf_compute.data();
@@ -1120,6 +1204,8 @@ static bool whisper_encode(
     }
 	Tracing::delayTensor( "enc.input", mel );
 
+    ggml_set_no_alloc(ctx0, true);
+
     struct ggml_tensor * cur;
 
     // convolution + gelu
@@ -1164,7 +1250,10 @@ static bool whisper_encode(
 
     struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
 
+    // the input of the layers lives in the pool, it's overwritten by the output of every layer
+    ggml_set_no_alloc(ctx0, false);
     cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+    ggml_set_no_alloc(ctx0, true);
     // ===================================================================
 
     // original:
@@ -1172,6 +1261,20 @@ static bool whisper_encode(
 
     struct ggml_tensor * inpL = cur;
 
+    {
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+
+        ggml_build_forward_expand(&gf, inpL);
+        whisper_graph_compute(wctx, ctx0, gf, n_threads);
+		Tracing::writeDelayedTensors();
+    }
+
+    // disconnect the input from the convolutions, the graphs of the layers only consume the data
+    inpL->op = GGML_OP_NONE;
+    inpL->src0 = nullptr;
+    inpL->src1 = nullptr;
+
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_encoder[il];
 
@@ -1182,6 +1285,7 @@ static bool whisper_encode(
         paramsL.mem_buffer = wctx.buf_compute_layer.data();
 
         struct ggml_context * ctxL = ggml_init(paramsL);
+        ggml_set_no_alloc(ctxL, true);
 
 		Tracing::delayTensor( { "enc.layer[ %i ].in", il }, inpL );
 
@@ -1387,7 +1491,7 @@ static bool whisper_encode(
             gf.n_threads = n_threads;
 
             ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
+            whisper_graph_compute(wctx, ctxL, gf, n_threads);
 			Tracing::writeDelayedTensors();
             //ggml_graph_print(&gf);
         }
@@ -1395,9 +1499,6 @@ static bool whisper_encode(
         // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
         // input for next layer (inpO -> inpL)
         memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = nullptr;
-        inpL->src1 = nullptr;
 
         //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
 
@@ -1406,31 +1507,25 @@ static bool whisper_encode(
 	Tracing::tensor( "enc.layers", inpL );
 	cur = inpL;
 
+    // the final norm and the cross-attention memory are computed with a single graph
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
+
     // norm
     {
         cur = ggml_norm(ctx0, cur);
 
         // cur = ln_f_g*cur + ln_f_b
+        // the encoded features are consumed by all decoder layers, they live in the pool
+        ggml_set_no_alloc(ctx0, false);
         cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
                     ggml_repeat(ctx0, model.e_ln_w, cur),
                     cur),
                 ggml_repeat(ctx0, model.e_ln_b, cur));
+        ggml_set_no_alloc(ctx0, true);
     }
 
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
-
-        //ggml_graph_print(&gf);
-    }
-
-	Tracing::tensor( "encode-out", cur );
-
     // cur
     //{
     //    printf("ne0 = %d\n", cur->ne[0]);
@@ -1447,14 +1542,6 @@ static bool whisper_encode(
 
     // pre-compute cross-attention memory
     {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = GGML_OP_NONE;
-        cur->src0 = nullptr;
-        cur->src1 = nullptr;
-
         for (int il = 0; il < model.hparams.n_text_layer; ++il) {
             auto & layer = model.layers_decoder[il];
 
@@ -1483,9 +1570,12 @@ static bool whisper_encode(
             ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
         }
 
-        ggml_graph_compute(ctx0, &gf);
+        whisper_graph_compute(wctx, ctx0, gf, n_threads);
+        //ggml_graph_print(&gf);
     }
 
+	Tracing::tensor( "encode-out", cur );
+
     ////////////////////////////////////////////////////////////////////////////
 
     //printf("%s: used_mem = %f MB\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0);
@@ -1527,6 +1617,10 @@ static bool whisper_decode(
     const int N = n_tokens;
     const int M = wctx.exp_n_audio_ctx > 0 ? wctx.exp_n_audio_ctx : hparams.n_audio_ctx;
 
+    // the pool has the tokens and positions, the input of the layers, and the logits
+    wctx.buf_compute.resize(whisper_pool_size(2*sizeof(int32_t)*N + sizeof(float)*(n_state + n_vocab)*N));
+    wctx.buf_compute_layer.resize(whisper_pool_size(0));
+
     struct ggml_init_params params;
     params.mem_size   = wctx.buf_compute.size();
     params.mem_buffer = wctx.buf_compute.data();
@@ -1541,15 +1635,34 @@ static bool whisper_decode(
         ((int32_t *) position->data)[i] = n_past + i;
     }
 
+    ggml_set_no_alloc(ctx0, true);
+
     // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.d_te, embd),
-                ggml_get_rows(ctx0, model.d_pe, position));
+    struct ggml_tensor * te = ggml_get_rows(ctx0, model.d_te, embd);
+    struct ggml_tensor * pe = ggml_get_rows(ctx0, model.d_pe, position);
+
+    // the input of the layers lives in the pool, it's overwritten by the output of every layer
+    ggml_set_no_alloc(ctx0, false);
+    struct ggml_tensor * cur = ggml_add(ctx0, te, pe);
+    ggml_set_no_alloc(ctx0, true);
 	Tracing::delayTensor( "dec-rows", cur );
 
     struct ggml_tensor * inpL = cur;
 
+    {
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+
+        ggml_build_forward_expand(&gf, inpL);
+        whisper_graph_compute(wctx, ctx0, gf, n_threads);
+		Tracing::writeDelayedTensors();
+    }
+
+    // disconnect the input from the embeddings, the graphs of the layers only consume the data
+    inpL->op = GGML_OP_NONE;
+    inpL->src0 = nullptr;
+    inpL->src1 = nullptr;
+
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
@@ -1558,6 +1671,8 @@ static bool whisper_decode(
         paramsL.mem_buffer = wctx.buf_compute_layer.data();
 
         struct ggml_context * ctxL = ggml_init(paramsL);
+        ggml_set_no_alloc(ctxL, true);
+
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
 
@@ -1805,7 +1920,7 @@ static bool whisper_decode(
 
         {
             ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
+            whisper_graph_compute(wctx, ctxL, gf, n_threads);
 			Tracing::writeDelayedTensors();
             //ggml_graph_print(&gf);
         }
@@ -1813,9 +1928,6 @@ static bool whisper_decode(
         // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
         // input for next layer (inpO -> inpL)
         memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = nullptr;
-        inpL->src1 = nullptr;
 
         if (N > 1) {
             //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
@@ -1837,7 +1949,10 @@ static bool whisper_decode(
                 ggml_repeat(ctx0, model.d_ln_b, cur));
     }
 
+    // the logits are copied out after the graph, they live in the pool
+    ggml_set_no_alloc(ctx0, false);
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    ggml_set_no_alloc(ctx0, true);
 
     // logits -> probs
     cur = ggml_dup(ctx0, logits);
@@ -1849,7 +1964,7 @@ static bool whisper_decode(
         gf.n_threads = n_threads;
 
         ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
+        whisper_graph_compute(wctx, ctx0, gf, n_threads);
     }
 
     logits_out.resize(N*n_vocab);
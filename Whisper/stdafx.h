@@ -40,4 +40,16 @@
 
 // In addition to collecting total GPU times per compute shader, also collect and print performance data about individual invocations of some of the most expensive shaders
 // The feature is relatively cheap in terms of performance overhead, but pretty much useless in production, and clutters debug console with all these numbers
-#define PROFILER_COLLECT_TAGS 0
\ No newline at end of file
+#define PROFILER_COLLECT_TAGS 0
+
+// Measure the individual operations of the hybrid decoder, and print their times with GFLOP/s and GB/s numbers.
+// The overhead is a couple of timestamps per operation; the timeline recorder measures the operations regardless of the flag while it's recording.
+#define PROFILER_CPU_OPERATIONS 0
+
+// Also measure CPU cycles within the CPU profiler blocks and operations, and print the share of busy time, the count of busy cores and FLOPs per cycle.
+// The blocks count the cycles of the calling thread with QueryThreadCycleTime, work offloaded to thread pools is not included.
+// The operations of the hybrid decoder run on the thread pool, they count the cycles of all threads of the process with QueryProcessCycleTime,
+// which also includes other threads of the process like concurrent contexts; the numbers are only accurate when a single context is running.
+// Windows doesn't expose hardware counters like retired instructions or cache misses to user mode, the cycle counters work everywhere including containers and VMs.
+// The overhead is a few microseconds per block or operation.
+#define PROFILER_CYCLE_COUNTERS 0
\ No newline at end of file
@@ -73,6 +73,17 @@ namespace Whisper
 		{
 			return whisper_token_to_str( &ctx, token );
 		}
+		virtual HRESULT COMLIGHTCALL tokenize( const char* text, pfnDecodedTokens pfn, void* pv ) override final
+		{
+			if( nullptr == text || nullptr == pfn )
+				return E_POINTER;
+			// Each token has at least 1 byte
+			std::vector<whisper_token> tokens( strlen( text ) + 1 );
+			const int n = whisper_tokenize( &ctx, text, tokens.data(), (int)tokens.size() );
+			if( n < 0 )
+				return E_FAIL;
+			return pfn( n, tokens.data(), pv );
+		}
 		virtual HRESULT COMLIGHTCALL getSpecialTokens( SpecialTokens& rdi )
 		{
 			rdi.TranscriptionEnd = whisper_token_eot( &ctx );
@@ -117,6 +128,14 @@ namespace Whisper
 			return isZero( whisper_full( &ctx, wfp, samples, (int)n_samples ) );
 		}
 
+		HRESULT COMLIGHTCALL runFullParallel( const sFullParams& params, const iAudioBuffer* buffer, uint32_t countContexts ) override final
+		{
+			whisper_full_params wfp = makeOldParams( params, this );
+			const float* const samples = buffer->getPcmMono();
+			const uint32_t n_samples = buffer->countSamples();
+			return isZero( whisper_full_parallel( &ctx, wfp, samples, (int)n_samples, (int)std::max( countContexts, 1u ) ) );
+		}
+
 		HRESULT COMLIGHTCALL runStreamed( const sFullParams& params, const sProgressSink& progress, const iAudioReader* reader ) override final
 		{
 			logError( u8"The CPU reference implementation doesn’t support streaming" );
@@ -127,6 +146,30 @@ namespace Whisper
 			logError( u8"The CPU reference implementation doesn’t support audio capture" );
 			return E_NOTIMPL;
 		}
+		HRESULT COMLIGHTCALL setDraftModel( iModel* draft, uint32_t countTokens ) override final
+		{
+			if( nullptr == draft )
+				return S_OK;
+			logError( u8"The CPU reference implementation doesn’t support speculative decoding" );
+			return E_NOTIMPL;
+		}
+		HRESULT COMLIGHTCALL timelineStart( uint32_t countEvents ) override final
+		{
+			if( 0 == countEvents )
+				return S_OK;
+			logError( u8"The CPU reference implementation doesn’t support the timeline recorder" );
+			return E_NOTIMPL;
+		}
+		HRESULT COMLIGHTCALL timelineSave( const wchar_t* path ) override final
+		{
+			logError( u8"The CPU reference implementation doesn’t support the timeline recorder" );
+			return E_NOTIMPL;
+		}
+		HRESULT COMLIGHTCALL timingsGet( sStageTimings& rdi ) override final
+		{
+			logError( u8"The CPU reference implementation doesn’t support per-stage timings, use timingsPrint method" );
+			return E_NOTIMPL;
+		}
 
 		HRESULT COMLIGHTCALL getResults( eResultFlags flags, iTranscribeResult** pp ) const override final
 		{
@@ -296,8 +339,6 @@ namespace Whisper
 			ctx.buf_model = new std::vector<uint8_t>();
 			ctx.buf_model->resize( MEM_REQ_MODEL.at( model.type ) );
 			ctx.buf_memory.resize( MEM_REQ_MEMORY.at( model.type ) );
-			ctx.buf_compute.resize( std::max( MEM_REQ_ENCODE.at( model.type ), MEM_REQ_DECODE.at( model.type ) ) );
-			ctx.buf_compute_layer.resize( std::max( MEM_REQ_ENCODE_LAYER.at( model.type ), MEM_REQ_DECODE_LAYER.at( model.type ) ) );
 		}
 
 		// load mel filters
@@ -366,12 +407,10 @@ namespace Whisper
 		}
 
 		{
-			// this is the total memory required to run the inference
+			// this is the memory required to load the model; the buffers of the graphs are sized by the memory planner when they are computed
 			const size_t mem_required =
 				ctx.buf_model->size() +
-				ctx.buf_memory.size() +
-				ctx.buf_compute.size() +
-				ctx.buf_compute_layer.size();
+				ctx.buf_memory.size();
 			logDebug( u8"%s: mem_required  = %7.2f MB", __func__, mem_required / 1024.0 / 1024.0 );
 		}
 
@@ -24,6 +24,9 @@ namespace Whisper
 		PrintProgress = 0x10,
 		PrintRealtime = 0x20,
 		PrintTimestamps = 0x40,
+		/// <summary>Hybrid model only: encode the next window of audio on the GPU, while the CPU decodes the current one.</summary>
+		/// <remarks>The next window is only known in advance with <see cref="SingleSegment" /> flag, the flag is ignored without it.</remarks>
+		PipelineEncode = 0x80,
 
 		// Experimental
 		TokenTimestamps = 0x100,
@@ -24,5 +24,30 @@
 		/// <summary>Use reshaped matrix multiplication shaders even on nVidia and Intel GPUs</summary>
 		/// <remarks>Incompatible with <see cref="NoReshapedMatMul" /></remarks>
 		UseReshapedMatMul = 8,
+
+		/// <summary>Batch decode steps of the contexts which run concurrently on different threads</summary>
+		/// <remarks>Contexts created from the model compute the next tokens of all concurrent transcriptions with a single pass of the decoder.<br/>
+		/// Only supported by the GPU model, ignored by the Hybrid one.</remarks>
+		BatchedDecoder = 0x10,
+
+		/// <summary>Benchmark the tile shapes of the CPU matrix multiplications for the shapes of the model</summary>
+		/// <remarks>The first load of a model on a computer takes a few seconds longer, the results are cached in <c>%LOCALAPPDATA%\Whisper</c> directory.<br/>
+		/// Only supported by the Hybrid model, ignored by the GPU one.</remarks>
+		TuneMulMat = 0x20,
+
+		/// <summary>Generate the micro-kernels of the CPU matrix multiplications when loading the model</summary>
+		/// <remarks>The kernels are specialized for the exact lengths of the dot products in the decoder weights, and use AVX512 when the CPU supports it.<br/>
+		/// Only supported by the Hybrid model, ignored by the GPU one.</remarks>
+		JitMulMat = 0x40,
+
+		/// <summary>Store the attention caches of the decoder in INT8 precision instead of FP16</summary>
+		/// <remarks>Halves the system RAM used by these caches, at the cost of some precision.<br/>
+		/// Only supported by the Hybrid model, ignored by the GPU one.</remarks>
+		KvCacheInt8 = 0x80,
+
+		/// <summary>Convert the weights of the decoder from FP16 to BF16, on CPUs with AVX512_BF16 instructions</summary>
+		/// <remarks>The decoder is faster, but BF16 numbers only keep 8 bits of the mantissa, the results may change slightly.<br/>
+		/// Ignored on the CPUs without AVX512_BF16 support. Only supported by the Hybrid model, ignored by the GPU one.</remarks>
+		Bf16Weights = 0x100,
 	}
 }
\ No newline at end of file
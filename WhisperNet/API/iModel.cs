@@ -1,5 +1,6 @@
 ﻿using ComLight;
 using System.ComponentModel;
+using System.Runtime.InteropServices;
 
 namespace Whisper
 {
@@ -24,5 +25,10 @@ namespace Whisper
 		/// <remarks>Don't call this method, use <see cref="ExtensionMethods.stringFromToken(iModel, int)" /> instead.</remarks>
 		[EditorBrowsable( EditorBrowsableState.Never )]
 		IntPtr stringFromTokenInternal( int id );
+
+		/// <summary>Encode text into tokens with the byte-level BPE</summary>
+		/// <remarks>Don't call this method, use <see cref="ExtensionMethods.tokenize(iModel, string)" /> instead.</remarks>
+		[EditorBrowsable( EditorBrowsableState.Never )]
+		void tokenizeInternal( [MarshalAs( UnmanagedType.LPUTF8Str )] string text, [MarshalAs( UnmanagedType.FunctionPtr )] Internal.pfnDecodedTokens pfn, IntPtr pv );
 	}
 }
\ No newline at end of file
@@ -0,0 +1,23 @@
+﻿namespace Whisper
+{
+	/// <summary>Time spent in the stages of the transcription since the last timingsReset call</summary>
+	/// <remarks>The times are in 100-nanosecond ticks, same as TimeSpan.Ticks.<br />
+	/// When a stage runs on several threads at once, the times of these threads are added together.</remarks>
+	public readonly struct sStageTimings
+	{
+		/// <summary>Complete runFull, runStreamed, runCapture or runFullParallel calls</summary>
+		public readonly long run;
+		/// <summary>Mel spectrogram of the audio</summary>
+		public readonly long spectrogram;
+		/// <summary>Encoder, including the wait for the GPU</summary>
+		public readonly long encode;
+		/// <summary>Decoder, including the wait for the GPU</summary>
+		public readonly long decode;
+		/// <summary>Sampling of the tokens from the output of the decoder</summary>
+		public readonly long sample;
+		/// <summary>Count of the runs</summary>
+		public readonly int countRuns;
+		/// <summary>Count of decoder invocations</summary>
+		public readonly int countDecodes;
+	}
+}
@@ -1,4 +1,5 @@
 ﻿using System.Diagnostics;
+using System.Runtime.InteropServices;
 using Whisper.Internal;
 using Whisper.Internals;
 
@@ -13,7 +14,9 @@ namespace Whisper
 		sFullParams fullParams;
 		sProgressSink progressSink;
 		bool disposed = false;
-		readonly Action<object> pfnBuffer, pfnStream;
+		readonly Action<object> pfnBuffer, pfnStream, pfnParallel;
+		int parallelContexts;
+		int[]? allowedTokens;
 
 		internal Context( Internal.iContext context )
 		{
@@ -22,6 +25,7 @@ namespace Whisper
 			fullParams = context.fullDefaultParams( eSamplingStrategy.Greedy );
 			pfnBuffer = processBuffer;
 			pfnStream = processStream;
+			pfnParallel = processParallel;
 			progressSink = default;
 		}
 
@@ -45,6 +49,34 @@ namespace Whisper
 		{
 			context.runStreamed( ref fullParams, ref progressSink, (iAudioReader)reader );
 		}
+		void processParallel( object buffer )
+		{
+			context.runFullParallel( ref fullParams, (iAudioBuffer)buffer, parallelContexts );
+		}
+
+		/// <summary>Restrict the vocabulary of the decoder to these tokens; pass an empty span for the complete vocabulary.</summary>
+		/// <remarks>The list applies to all subsequent runs of this context. The end of text and timestamp tokens are always allowed.<br/>
+		/// Use <see cref="ExtensionMethods.tokenize(iModel, string)" /> to get the tokens of the expected words or phrases.</remarks>
+		public void setAllowedTokens( ReadOnlySpan<int> tokens ) =>
+			allowedTokens = tokens.IsEmpty ? null : tokens.ToArray();
+
+		GCHandle pinAllowedTokens()
+		{
+			if( null == allowedTokens )
+				return default;
+			GCHandle handle = GCHandle.Alloc( allowedTokens, GCHandleType.Pinned );
+			fullParams.allowed_tokens = handle.AddrOfPinnedObject();
+			fullParams.allowed_n_tokens = allowedTokens.Length;
+			return handle;
+		}
+
+		void unpinAllowedTokens( GCHandle handle )
+		{
+			fullParams.allowed_tokens = IntPtr.Zero;
+			fullParams.allowed_n_tokens = 0;
+			if( handle.IsAllocated )
+				handle.Free();
+		}
 
 		void runImpl( object source, Callbacks? callbacks, ReadOnlySpan<int> promptTokens, Action<object> pfn )
 		{
@@ -63,6 +95,7 @@ namespace Whisper
 				};
 			}
 
+			GCHandle allowed = pinAllowedTokens();
 			try
 			{
 				if( promptTokens.IsEmpty )
@@ -89,6 +122,7 @@ namespace Whisper
 
 				fullParams.prompt_tokens = IntPtr.Zero;
 				fullParams.prompt_n_tokens = 0;
+				unpinAllowedTokens( allowed );
 			}
 		}
 
@@ -140,6 +174,24 @@ namespace Whisper
 		public void runFull( iAudioReader reader, Callbacks? callbacks, Action<double>? pfnProgress, int[]? promptTokens ) =>
 			runFull( reader, callbacks, pfnProgress, promptTokens ?? ReadOnlySpan<int>.Empty );
 
+		/// <summary>Split the audio at pauses in the speech, and transcribe the chunks concurrently on up to <paramref name="countContexts" /> contexts which share the model</summary>
+		/// <remarks>The new segment callback is called once, after all chunks are transcribed.<br/>
+		/// Every chunk except the first one starts 5 seconds before its split point, the decoder transcribes that overlap again to have the preceding text.
+		/// The merge drops these duplicate segments. The text of the last chunk becomes the prompt of the next run.<br/>
+		/// The GPU work of the contexts is serialized on the shared device, only the CPU work runs concurrently.
+		/// This makes the method useful with the Hybrid model which decodes on the CPU, the GPU model gains little from it.</remarks>
+		public void runFullParallel( iAudioBuffer buffer, int countContexts, Callbacks? callbacks = null )
+		{
+			parallelContexts = countContexts;
+			runImpl( buffer, callbacks, ReadOnlySpan<int>.Empty, pfnParallel );
+		}
+
+		/// <summary>Use a smaller model of the same family, like tiny or base, to speed up the greedy decoding; pass null to disable.</summary>
+		/// <remarks>The draft model proposes <paramref name="countTokens" /> tokens, this context verifies all of them with a single call to the decoder.<br />
+		/// The draft model must use the same vocabulary, and the GPU or Hybrid implementation.</remarks>
+		public void setDraftModel( iModel? draft, int countTokens = 4 ) =>
+			context.setDraftModel( draft, countTokens );
+
 		/// <summary>Get text results out of the context</summary>
 		public TranscribeResult results( eResultFlags flags = eResultFlags.None )
 		{
@@ -157,6 +209,19 @@ namespace Whisper
 		/// <summary>Reset timing data</summary>
 		public void timingsReset() => context.timingsReset();
 
+		/// <summary>Start recording the timeline of the profiler events: CPU blocks, operations of the hybrid decoder, callbacks, and audio I/O</summary>
+		/// <remarks>The recorder keeps up to <paramref name="countEvents" /> of the most recent events; pass 0 to stop recording.<br />
+		/// Call this method while the context is idle.</remarks>
+		public void timelineStart( int countEvents = 0x10000 ) => context.timelineStart( countEvents );
+
+		/// <summary>Save the recorded timeline into JSON file in Chrome trace event format</summary>
+		/// <remarks>Open the file in chrome://tracing or https://ui.perfetto.dev</remarks>
+		public void timelineSave( string path ) => context.timelineSave( path );
+
+		/// <summary>Get the time spent in the stages of the transcription since the last <see cref="timingsReset" /> call</summary>
+		/// <remarks>Unlike <see cref="timingsPrint" />, this method doesn’t log anything, it’s for the benchmarks which compare the numbers across builds.</remarks>
+		public sStageTimings timingsGet() => context.timingsGet();
+
 		/// <summary>Continuously process audio from microphone or a similar capture device</summary>
 		/// <remarks>It’s recommended to call this method on a background thread.</remarks>
 		public void runCapture( iAudioCapture capture, Callbacks? callbacks, CaptureCallbacks? captureCallbacks )
@@ -176,6 +241,7 @@ namespace Whisper
 				};
 			}
 
+			GCHandle allowed = pinAllowedTokens();
 			try
 			{
 				sCaptureCallbacks cc = default;
@@ -195,6 +261,7 @@ namespace Whisper
 
 				fullParams.prompt_tokens = IntPtr.Zero;
 				fullParams.prompt_n_tokens = 0;
+				unpinAllowedTokens( allowed );
 			}
 		}
 
@@ -33,6 +33,22 @@ namespace Whisper
 		public static string? stringFromToken( this iModel model, int idToken ) =>
 			Marshal.PtrToStringUTF8( model.stringFromTokenInternal( idToken ) );
 
+		/// <summary>Encode text into tokens, for example to use as the prompt</summary>
+		public static int[] tokenize( this iModel model, string text )
+		{
+			int[] result = Array.Empty<int>();
+
+			pfnDecodedTokens pfn = delegate ( int len, int[]? arr, IntPtr pv )
+			{
+				if( len > 0 && arr != null )
+					result = arr;
+				return 0;
+			};
+
+			model.tokenizeInternal( text, pfn, IntPtr.Zero );
+			return result;
+		}
+
 		/// <summary>List capture devices</summary>
 		public static CaptureDeviceId[]? listCaptureDevices( this iMediaFoundation mf )
 		{
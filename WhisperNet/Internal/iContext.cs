@@ -37,5 +37,20 @@ namespace Whisper.Internal
 		void timingsPrint();
 		/// <summary>Reset timing data</summary>
 		void timingsReset();
+
+		/// <summary>Split the audio at pauses in the speech, and transcribe the chunks concurrently on separate contexts which share the model</summary>
+		void runFullParallel( [In] ref sFullParams @params, iAudioBuffer buffer, int countContexts );
+
+		/// <summary>Use a smaller model of the same family to speed up the greedy decoding, or pass null to disable</summary>
+		void setDraftModel( iModel? draft, int countTokens );
+
+		/// <summary>Start recording the timeline of the profiler events, or stop with 0 events</summary>
+		void timelineStart( int countEvents );
+		/// <summary>Save the recorded timeline in Chrome trace event format</summary>
+		void timelineSave( [MarshalAs( UnmanagedType.LPWStr )] string path );
+
+		/// <summary>Get the time spent in the stages of the transcription since the last timingsReset call</summary>
+		[RetValIndex]
+		sStageTimings timingsGet();
 	}
 }
\ No newline at end of file
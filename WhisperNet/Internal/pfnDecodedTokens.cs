@@ -0,0 +1,8 @@
+﻿using System.Runtime.InteropServices;
+
+namespace Whisper.Internal
+{
+	/// <summary>Function pointer to consume the tokens produced by <see cref="iModel.tokenizeInternal" /></summary>
+	[UnmanagedFunctionPointer( CallingConvention.StdCall )]
+	public delegate int pfnDecodedTokens( int len, [In, MarshalAs( UnmanagedType.LPArray, SizeParamIndex = 0 )] int[]? arr, IntPtr pv );
+}
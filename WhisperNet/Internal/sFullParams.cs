@@ -36,5 +36,8 @@ namespace Whisper.Internals
 		internal pfnEncoderBegin? encoderBeginCallback;
 		/// <summary>Parameter for the above, not needed in C#</summary>
 		internal IntPtr encoderBeginCallbackData;
+
+		internal IntPtr allowed_tokens;
+		internal int allowed_n_tokens;
 	}
 }
\ No newline at end of file